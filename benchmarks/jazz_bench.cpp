@@ -0,0 +1,353 @@
+#include "compiler.hpp"
+#include "core.hpp"
+#include "jit.hpp"
+#include "parser.hpp"
+#include "profile.hpp"
+#include "sema.hpp"
+#include "tokenizer.hpp"
+#include "vm.hpp"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Throughput of every stage, from the tokenizer to the VM. The results are
+// printed as JSON unless another `--benchmark_format` is given, see `main`.
+
+// A source with `function_count` functions, each calling the previous one,
+// with loops, branches and arithmetic in them
+static std::string generate_source(isize function_count) {
+    std::string source;
+    for (isize i = 0; i < function_count; i++) {
+        std::string index = std::to_string(i);
+        source += "f" + index + " :: fn(n: int) -> int {\n";
+        source += "    total := " + index + "\n";
+        source += "    for j := 0; j < n; j = j + 1 {\n";
+        source += "        if j < " + index + " {\n";
+        source += "            total = total + j * 3\n";
+        source += "        } else {\n";
+        source += "            total = total - (j + 1) / 2\n";
+        source += "        }\n";
+        source += "    }\n";
+        if (i > 0) {
+            source += "    return total + f" + std::to_string(i - 1) + "(n)\n";
+        } else {
+            source += "    return total\n";
+        }
+        source += "}\n\n";
+    }
+    source += "main :: fn() {\n";
+    source += "    std_println_int(f" + std::to_string(function_count - 1) +
+              "(3))\n";
+    source += "}\n";
+    return source;
+}
+
+// The tree points into `source`, it has to outlive it
+static AstFile* parse(const std::string& source, Arena* arena) {
+    Tokenizer tokenizer;
+    tokenizer_init(&tokenizer,
+                   String{.data = source.data(), .size = (isize)source.size()});
+    AstFile* file = ast_file_make(tokenizer, 16, arena);
+    ast_file_parse(file, arena);
+    core_assert(file->errors.size == 0);
+    return file;
+}
+
+static isize count_nodes(AstNode* node) {
+    if (!node) {
+        return 0;
+    }
+    isize count = 1;
+    switch (node->kind) {
+    case AstNodeKind::Literal:
+    case AstNodeKind::Identifier:
+    case AstNodeKind::Continue:
+        break;
+    case AstNodeKind::Binary:
+        count += count_nodes(node->as_binary()->left);
+        count += count_nodes(node->as_binary()->right);
+        break;
+    case AstNodeKind::Unary:
+        count += count_nodes(node->as_unary()->operand);
+        break;
+    case AstNodeKind::Call: {
+        AstNodeCall* call = node->as_call();
+        count += count_nodes(call->callee);
+        for (isize i = 0; i < call->arguments.size; i++) {
+            count += count_nodes(call->arguments[i]);
+        }
+        break;
+    }
+    case AstNodeKind::If:
+        count += count_nodes(node->as_if()->condition);
+        count += count_nodes(node->as_if()->then_branch);
+        count += count_nodes(node->as_if()->else_branch);
+        break;
+    case AstNodeKind::For: {
+        AstNodeFor* node_for = node->as_for();
+        count += count_nodes(node_for->init);
+        count += count_nodes(node_for->condition);
+        count += count_nodes(node_for->update);
+        count += count_nodes(node_for->then_branch);
+        count += count_nodes(node_for->else_branch);
+        break;
+    }
+    case AstNodeKind::Break:
+        count += count_nodes(node->as_break()->value);
+        break;
+    case AstNodeKind::Return:
+        count += count_nodes(node->as_return()->value);
+        break;
+    case AstNodeKind::Block: {
+        AstNodeBlock* block = node->as_block();
+        for (isize i = 0; i < block->statements.size; i++) {
+            count += count_nodes(block->statements[i]);
+        }
+        break;
+    }
+    case AstNodeKind::Parameter:
+        count += count_nodes(node->as_parameter()->name);
+        count += count_nodes(node->as_parameter()->type);
+        break;
+    case AstNodeKind::Function: {
+        AstNodeFunction* function = node->as_function();
+        for (isize i = 0; i < function->parameters.size; i++) {
+            count += count_nodes(function->parameters[i]);
+        }
+        count += count_nodes(function->return_type);
+        count += count_nodes(function->body);
+        break;
+    }
+    case AstNodeKind::Declaration:
+        count += count_nodes(node->as_declaration()->name);
+        count += count_nodes(node->as_declaration()->type);
+        count += count_nodes(node->as_declaration()->value);
+        break;
+    case AstNodeKind::Assignment:
+        count += count_nodes(node->as_assignment()->name);
+        count += count_nodes(node->as_assignment()->value);
+        break;
+    }
+    return count;
+}
+
+static isize count_nodes(Ast* ast) {
+    isize count = 0;
+    for (isize i = 0; i < ast->declarations.size; i++) {
+        count += count_nodes(ast->declarations[i]);
+    }
+    return count;
+}
+
+static void set_rate(benchmark::State& state, const char* name, isize count) {
+    state.counters[name] = benchmark::Counter(
+        (double)count * state.iterations(), benchmark::Counter::kIsRate);
+}
+
+static void BM_Tokenizer(benchmark::State& state) {
+    std::string source = generate_source(state.range(0));
+    isize tokens = 0;
+    for (auto _ : state) {
+        Tokenizer tokenizer;
+        tokenizer_init(&tokenizer, String{.data = source.data(),
+                                          .size = (isize)source.size()});
+        tokens = 0;
+        while (true) {
+            TokenizerResult result = tokenizer_next_token(&tokenizer);
+            core_assert(result.error == TokenizerErrorKind::None);
+            if (result.token.kind == TokenKind::Eof) {
+                break;
+            }
+            tokens++;
+        }
+        benchmark::DoNotOptimize(tokens);
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+    set_rate(state, "tokens", tokens);
+}
+BENCHMARK(BM_Tokenizer)->Arg(100)->Arg(1000);
+
+static void BM_Parser(benchmark::State& state) {
+    std::string source = generate_source(state.range(0));
+    isize nodes = 0;
+    for (auto _ : state) {
+        Arena arena = {};
+        arena_init(&arena, 1024 * 1024);
+        AstFile* file = parse(source, &arena);
+        nodes = count_nodes(&file->ast);
+        arena_free(&arena);
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+    set_rate(state, "nodes", nodes);
+}
+BENCHMARK(BM_Parser)->Arg(100)->Arg(1000);
+
+// Sema and the compiler change the tree, every iteration parses anew
+static void BM_Sema(benchmark::State& state) {
+    std::string source = generate_source(state.range(0));
+    isize nodes = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        Arena arena = {};
+        arena_init(&arena, 1024 * 1024);
+        AstFile* file = parse(source, &arena);
+        nodes = count_nodes(&file->ast);
+        state.ResumeTiming();
+        semantic_analysis(file, &arena);
+        state.PauseTiming();
+        arena_free(&arena);
+        state.ResumeTiming();
+    }
+    set_rate(state, "nodes", nodes);
+}
+BENCHMARK(BM_Sema)->Arg(100)->Arg(1000);
+
+static void BM_Compile(benchmark::State& state) {
+    std::string source = generate_source(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        Arena arena = {};
+        arena_init(&arena, 1024 * 1024);
+        AstFile* file = parse(source, &arena);
+        semantic_analysis(file, &arena);
+        state.ResumeTiming();
+        CodeUnit code = ast_compile_to_bytecode(&file->ast, true, &arena,
+                                                CompilerBackend::Register);
+        benchmark::DoNotOptimize(code.functions.data);
+        state.PauseTiming();
+        arena_free(&arena);
+        state.ResumeTiming();
+    }
+    // `main` and the entry function
+    set_rate(state, "functions", state.range(0) + 2);
+}
+BENCHMARK(BM_Compile)->Arg(100)->Arg(1000);
+
+// The canonical programs for the VM
+static const char* fib_source = R"SOURCE(
+    fib :: fn(n: int) -> int {
+        if n < 2 {
+            return n
+        }
+        return fib(n - 1) + fib(n - 2)
+    }
+
+    main :: fn() {
+        std_println_int(fib(25))
+    }
+)SOURCE";
+
+static const char* loops_source = R"SOURCE(
+    main :: fn() {
+        total := 0
+        for i := 0; i < 1000; i = i + 1 {
+            for j := 0; j < 1000; j = j + 1 {
+                total = total + j
+            }
+        }
+        std_println_int(total)
+    }
+)SOURCE";
+
+static const char* calls_source = R"SOURCE(
+    add :: fn(a: int, b: int) -> int {
+        return a + b
+    }
+
+    twice :: fn(a: int) -> int {
+        return add(a, a)
+    }
+
+    main :: fn() {
+        total := 0
+        for i := 0; i < 200000; i = i + 1 {
+            total = add(total, twice(i))
+        }
+        std_println_int(total)
+    }
+)SOURCE";
+
+static const char* print_source = R"SOURCE(
+    main :: fn() {
+        for i := 0; i < 100000; i = i + 1 {
+            std_print_int(i * 7919)
+            std_print_space()
+            std_println_int(i)
+        }
+    }
+)SOURCE";
+
+// Arguments: the program, and whether it runs with the JIT
+static void BM_Vm(benchmark::State& state) {
+    const char* sources[] = {fib_source, loops_source, calls_source,
+                             print_source};
+    const char* names[] = {"fib", "loops", "calls", "print"};
+    bool jit = state.range(1) != 0;
+    if (jit && !jit_supported()) {
+        state.SkipWithError("The JIT is not supported on this machine");
+        return;
+    }
+    state.SetLabel(std::string(names[state.range(0)]) +
+                   (jit ? " (jit)" : ""));
+
+    Arena arena = {};
+    arena_init(&arena, 1024 * 1024);
+    defer(arena_free(&arena));
+    std::string source = sources[state.range(0)];
+    AstFile* file = parse(source, &arena);
+    semantic_analysis(file, &arena);
+    CodeUnit code = ast_compile_to_bytecode(&file->ast, true, &arena,
+                                            CompilerBackend::Register);
+    VmImage image = vm_image_make(code, &arena, jit);
+    defer(vm_image_free(&image));
+    VM* vm = vm_make(image, 1024 * 1024, &arena);
+    FILE* null_output = fopen("/dev/null", "w");
+    defer(fclose(null_output));
+
+    // The instructions of one run, counted once by the profiler
+    Profile* profile = profile_make(vm->linked, false, &arena);
+    vm_enable_profiling(vm, profile);
+    vm->stdout = null_output;
+    vm_run(vm);
+    isize instructions = 0;
+    for (isize f = 0; f < profile->counts.size; f++) {
+        for (isize i = 0; i < profile->counts[f].size; i++) {
+            instructions += profile->counts[f][i];
+        }
+    }
+
+    for (auto _ : state) {
+        vm_reset(vm, image);
+        vm->stdout = null_output;
+        vm_run(vm);
+        benchmark::DoNotOptimize(vm->stack.size);
+    }
+    // With the JIT these are the instructions the interpreter would execute
+    set_rate(state, "instructions", instructions);
+}
+BENCHMARK(BM_Vm)
+    ->ArgsProduct({{0, 1, 2, 3}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    std::vector<char*> args(argv, argv + argc);
+    bool has_format = false;
+    for (int i = 1; i < argc; i++) {
+        has_format = has_format || strncmp(argv[i], "--benchmark_format",
+                                           strlen("--benchmark_format")) == 0;
+    }
+    char json_format[] = "--benchmark_format=json";
+    if (!has_format) {
+        args.push_back(json_format);
+    }
+    int arg_count = args.size();
+    benchmark::Initialize(&arg_count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(arg_count, args.data())) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -254,8 +254,8 @@ struct AstNodeLiteral : public AstNode {
     Token token;
     AstLiteralKind literal_kind;
 
-    // Used for compilation
-    MemPtr static_data_ptr;
+    // Used for compilation, an immediate or a pointer into the static data
+    MemPtr ptr;
 
     static AstNodeLiteral* make(Token token, AstLiteralKind kind,
                                 Arena* arena) {
@@ -263,7 +263,7 @@ struct AstNodeLiteral : public AstNode {
         node->kind = AstNodeKind::Literal;
         node->token = token;
         node->literal_kind = kind;
-        node->static_data_ptr = mem_ptr_invalid();
+        node->ptr = mem_ptr_invalid();
         return node;
     }
 };
@@ -1,20 +1,26 @@
 #include "builtin.hpp"
 #include "ast.hpp"
+#include "output.hpp"
 #include "vm.hpp"
 
 void std_println_int(VM* vm) {
     isize value = *stack_peek<isize>(&vm->stack);
-    fprintf(vm->stdout, "%ld\n", value);
+    output_write_int(&vm->output, vm->stdout, value);
+    output_write_char(&vm->output, vm->stdout, '\n');
 }
 
 void std_print_int(VM* vm) {
     isize value = *stack_peek<isize>(&vm->stack);
-    fprintf(vm->stdout, "%ld", value);
+    output_write_int(&vm->output, vm->stdout, value);
 }
 
-void std_print_space(VM* vm) { fprintf(vm->stdout, " "); }
+void std_print_space(VM* vm) {
+    output_write_char(&vm->output, vm->stdout, ' ');
+}
 
-void std_print_newline(VM* vm) { fprintf(vm->stdout, "\n"); }
+void std_print_newline(VM* vm) {
+    output_write_char(&vm->output, vm->stdout, '\n');
+}
 
 Slice<BuiltinFunction> builtin_functions(Arena* arena) {
     Array<BuiltinFunction>* functions = array_make<BuiltinFunction>(1, arena);
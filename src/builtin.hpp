@@ -19,11 +19,53 @@ struct BuiltinFunction {
 
 Slice<BuiltinFunction> builtin_functions(Arena* arena);
 
+// The builtins by a stable index, which serialized code refers to them by
+// (see `bytecode_file.hpp`). New builtins are only ever appended.
+const BuiltinFunctionPtr BUILTIN_FUNCTION_TABLE[] = {
+    std_println_int,
+    std_print_int,
+    std_print_space,
+    std_print_newline,
+};
+const isize BUILTIN_FUNCTION_COUNT =
+    sizeof(BUILTIN_FUNCTION_TABLE) / sizeof(BUILTIN_FUNCTION_TABLE[0]);
+
+// Returns -1 for an unknown function
+inline isize builtin_function_index(BuiltinFunctionPtr function_ptr) {
+    for (isize i = 0; i < BUILTIN_FUNCTION_COUNT; i++) {
+        if (BUILTIN_FUNCTION_TABLE[i] == function_ptr) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 inline const char* builtin_function_name(BuiltinFunctionPtr function_ptr) {
     if (function_ptr == std_println_int) {
+        return "std_println_int";
+    }
+    if (function_ptr == std_print_int) {
         return "std_print_int";
     }
+    if (function_ptr == std_print_space) {
+        return "std_print_space";
+    }
+    if (function_ptr == std_print_newline) {
+        return "std_print_newline";
+    }
 
     core_assert_msg(false, "Unknown builtin function");
     return nullptr;
 }
+
+// The size of the arguments the builtin reads from the top of the stack, or -1
+// for an unknown function
+inline isize builtin_function_args_size(BuiltinFunctionPtr function_ptr) {
+    if (function_ptr == std_println_int || function_ptr == std_print_int) {
+        return sizeof(isize);
+    }
+    if (function_ptr == std_print_space || function_ptr == std_print_newline) {
+        return 0;
+    }
+    return -1;
+}
@@ -11,6 +11,9 @@ enum class MemPtrType : u8 {
     StackRel = 2,
     Heap = 3,
     StaticData = 4,
+    // Not a pointer, `mem_offset` is the value itself. Used for small integer
+    // and bool constants, so reading them does not go through memory.
+    Immediate = 5,
 };
 
 struct MemPtr {
@@ -30,6 +33,50 @@ inline MemPtr mem_ptr_static_data(isize offset) {
     return MemPtr{.type = MemPtrType::StaticData, .mem_offset = offset};
 }
 
+// Immediates are signed and limited to this many bits, so the linker can
+// encode them into an operand together with the addressing mode
+const isize MEM_PTR_IMMEDIATE_BITS = 29;
+
+inline bool mem_ptr_fits_immediate(i64 value) {
+    return value >= -((i64)1 << (MEM_PTR_IMMEDIATE_BITS - 1)) &&
+           value < ((i64)1 << (MEM_PTR_IMMEDIATE_BITS - 1));
+}
+
+inline MemPtr mem_ptr_immediate(i64 value) {
+    core_assert(mem_ptr_fits_immediate(value));
+    return MemPtr{.type = MemPtrType::Immediate, .mem_offset = value};
+}
+
+// Table of the binary operators, with the type of their operands, the type of
+// the result and the C++ operator implementing them. Must be kept in the same
+// order as `BinOperand`. `X` is called as X(extra..., name, type, result,
+// symbol).
+#define BIN_OPERANDS(X, ...)                                                   \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_Add, i64, i64, +)                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_Sub, i64, i64, -)                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_Mul, i64, i64, *)                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_Div, i64, i64, /)                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_BinaryAnd, i64, i64, &)                   \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_BinaryOr, i64, i64, |)                    \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_Equal, i64, bool, ==)                     \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_NotEqual, i64, bool, !=)                  \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_LessThan, i64, bool, <)                   \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_LessEqual, i64, bool, <=)                 \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_GreaterThan, i64, bool, >)                \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_GreaterEqual, i64, bool, >=)              \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_Add, f64, f64, +)                       \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_Sub, f64, f64, -)                       \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_Mul, f64, f64, *)                       \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_Div, f64, f64, /)                       \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_Equal, f64, bool, ==)                   \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_NotEqual, f64, bool, !=)                \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_LessThan, f64, bool, <)                 \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_LessEqual, f64, bool, <=)               \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_GreaterThan, f64, bool, >)              \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_GreaterEqual, f64, bool, >=)            \
+    X(__VA_ARGS__ __VA_OPT__(, ) Bool_Equal, bool, bool, ==)                   \
+    X(__VA_ARGS__ __VA_OPT__(, ) Bool_NotEqual, bool, bool, !=)
+
 enum class BinOperand {
     // Int
     Int_Add,
@@ -69,6 +116,12 @@ struct InstBinaryOp {
     MemPtr right;
 };
 
+// Same as `BIN_OPERANDS`, must be kept in the same order as `UnaryOperand`
+#define UNARY_OPERANDS(X, ...)                                                 \
+    X(__VA_ARGS__ __VA_OPT__(, ) Int_Negation, i64, i64, -)                    \
+    X(__VA_ARGS__ __VA_OPT__(, ) Float_Negation, f64, f64, -)                  \
+    X(__VA_ARGS__ __VA_OPT__(, ) Bool_Not, bool, bool, !)
+
 enum class UnaryOperand {
     Int_Negation,
     Float_Negation,
@@ -81,12 +134,36 @@ struct InstUnaryOp {
     MemPtr operand;
 };
 
-const isize CALL_METADATA_SIZE = 3 * sizeof(isize);
+#define OPERAND_SIZES_CASE(Operand, op, type, result, symbol)                 \
+    case Operand::op: {                                                        \
+        *operand_size = sizeof(type);                                          \
+        *result_size = sizeof(result);                                         \
+        break;                                                                 \
+    }
+
+// The size in bytes of each operand and of the result
+inline void bin_operand_sizes(BinOperand op, isize* operand_size,
+                              isize* result_size) {
+    switch (op) { BIN_OPERANDS(OPERAND_SIZES_CASE, BinOperand) }
+}
+
+inline void unary_operand_sizes(UnaryOperand op, isize* operand_size,
+                                isize* result_size) {
+    switch (op) { UNARY_OPERANDS(OPERAND_SIZES_CASE, UnaryOperand) }
+}
+
+#undef OPERAND_SIZES_CASE
 
 struct InstCall {
     isize fp;
 };
 
+// Calls the function in place of the current one, with the same BP. The frame
+// has to be popped and the arguments moved to where the caller passed its own.
+struct InstTailCall {
+    isize fp;
+};
+
 struct InstCallBuiltin {
     void* builtin;
 };
@@ -125,6 +202,7 @@ enum class InstType {
     BinaryOp,
     UnaryOp,
     Call,
+    TailCall,
     CallBuiltin,
     Return,
     Mov,
@@ -141,6 +219,7 @@ struct Inst {
         InstBinaryOp binary;
         InstUnaryOp unary;
         InstCall call;
+        InstTailCall tail_call;
         InstCallBuiltin call_builtin;
         InstReturn ret;
         InstMov mov;
@@ -169,6 +248,11 @@ inline Inst inst_call(isize fp) {
     return Inst{.type = InstType::Call, .call = InstCall{.fp = fp}};
 }
 
+inline Inst inst_tail_call(isize fp) {
+    return Inst{.type = InstType::TailCall,
+                .tail_call = InstTailCall{.fp = fp}};
+}
+
 inline Inst inst_call_builtin(void* builtin) {
     return Inst{.type = InstType::CallBuiltin,
                 .call_builtin = InstCallBuiltin{.builtin = builtin}};
@@ -238,6 +322,9 @@ inline std::ostream& operator<<(std::ostream& os, MemPtr ptr) {
     case MemPtrType::StaticData:
         os << "(StaticData " << ptr.mem_offset << ")";
         break;
+    case MemPtrType::Immediate:
+        os << "(Immediate " << ptr.mem_offset << ")";
+        break;
     }
 
     return os;
@@ -336,6 +423,36 @@ inline std::ostream& operator<<(std::ostream& os, const UnaryOperand& op) {
     return os;
 }
 
+inline const char* inst_type_name(InstType type) {
+    switch (type) {
+    case InstType::BinaryOp:
+        return "BinaryOp";
+    case InstType::UnaryOp:
+        return "UnaryOp";
+    case InstType::Call:
+        return "Call";
+    case InstType::TailCall:
+        return "TailCall";
+    case InstType::CallBuiltin:
+        return "CallBuiltin";
+    case InstType::Return:
+        return "Return";
+    case InstType::Mov:
+        return "Mov";
+    case InstType::PushStack:
+        return "PushStack";
+    case InstType::PopStack:
+        return "PopStack";
+    case InstType::JumpIf:
+        return "JumpIf";
+    case InstType::Jump:
+        return "Jump";
+    case InstType::Exit:
+        return "Exit";
+    }
+    return "Unknown";
+}
+
 inline std::ostream& operator<<(std::ostream& os, const Inst& inst) {
     switch (inst.type) {
     case InstType::BinaryOp: {
@@ -352,6 +469,10 @@ inline std::ostream& operator<<(std::ostream& os, const Inst& inst) {
         os << "Call(" << inst.call.fp << ")";
         break;
     }
+    case InstType::TailCall: {
+        os << "TailCall(" << inst.tail_call.fp << ")";
+        break;
+    }
     case InstType::CallBuiltin: {
         os << "CallBuiltin(" << inst.call_builtin.builtin << ")";
         break;
@@ -0,0 +1,291 @@
+#include "bytecode_file.hpp"
+#include "builtin.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(linked_op_size(LinkedOp::CallBuiltin) ==
+                  LINK_OPCODE_SIZE + sizeof(u64),
+              "The builtin address is the last 8 bytes of `CallBuiltin`");
+
+static void hash_bytes(u32* hash, const void* data, isize size) {
+    // FNV-1a
+    for (isize i = 0; i < size; i++) {
+        *hash = (*hash ^ ((const u8*)data)[i]) * 16777619u;
+    }
+}
+
+u32 bytecode_file_linked_ops_hash() {
+    u32 hash = 2166136261u;
+    for (isize i = 0; i < (isize)LinkedOp::Count; i++) {
+        LinkedOpInfo info = LINKED_OP_INFO[i];
+        hash_bytes(&hash, info.name, strlen(info.name) + 1);
+        u32 fields[] = {(u32)info.type, (u32)info.size, (u32)info.implied};
+        hash_bytes(&hash, fields, sizeof(fields));
+    }
+    return hash;
+}
+
+static isize align8(isize offset) { return (offset + 7) & ~(isize)7; }
+
+static void append_bytes(Array<u8>* out, const void* data, isize size) {
+    for (isize i = 0; i < size; i++) {
+        array_push(out, ((const u8*)data)[i]);
+    }
+}
+
+static void append_padding(Array<u8>* out) {
+    while (out->size != align8(out->size)) {
+        array_push(out, (u8)0);
+    }
+}
+
+Slice<u8> bytecode_file_serialize(LinkedUnit linked, Slice<u8> static_data,
+                                  Arena* arena) {
+    Array<BytecodeFileRelocation> relocations = {};
+    array_init(&relocations, 16, arena);
+    for (isize i = 0; i < linked.functions.size; i++) {
+        Slice<u8> function = linked.functions[i];
+        isize function_offset = function.data - linked.code.data;
+        isize offset = 0;
+        while (offset < function.size) {
+            LinkedDecoded decoded = link_decode(function, offset);
+            offset += decoded.size;
+            if (decoded.inst.type != InstType::CallBuiltin) {
+                continue;
+            }
+            isize builtin = builtin_function_index(
+                (BuiltinFunctionPtr)decoded.inst.call_builtin.builtin);
+            core_assert_msg(builtin >= 0, "Unknown builtin function");
+            // The address ends the instruction, superinstructions included
+            array_push(&relocations,
+                       BytecodeFileRelocation{
+                           .offset = (u64)(function_offset + offset -
+                                           (isize)sizeof(u64)),
+                           .builtin = (u64)builtin,
+                       });
+        }
+    }
+
+    BytecodeFileHeader header = {};
+    memcpy(header.magic, BYTECODE_FILE_MAGIC, sizeof(header.magic));
+    header.version = BYTECODE_FILE_VERSION;
+    header.linked_ops_hash = bytecode_file_linked_ops_hash();
+    header.static_data_offset = align8(sizeof(header));
+    header.static_data_size = static_data.size;
+    header.code_offset =
+        align8(header.static_data_offset + header.static_data_size);
+    header.code_size = linked.code.size;
+    header.functions_offset = align8(header.code_offset + header.code_size);
+    header.function_count = linked.functions.size;
+    header.relocations_offset =
+        header.functions_offset +
+        header.function_count * sizeof(BytecodeFileFunction);
+    header.relocation_count = relocations.size;
+    header.file_size = header.relocations_offset +
+                       header.relocation_count * sizeof(BytecodeFileRelocation);
+
+    Array<u8> out = {};
+    array_init(&out, header.file_size, arena);
+    append_bytes(&out, &header, sizeof(header));
+    append_padding(&out);
+    append_bytes(&out, static_data.data, static_data.size);
+    append_padding(&out);
+
+    // The builtin addresses are left out, so the same program always gives
+    // the same bytes
+    isize code_start = out.size;
+    append_bytes(&out, linked.code.data, linked.code.size);
+    for (isize i = 0; i < relocations.size; i++) {
+        memset(out.data + code_start + relocations[i].offset, 0, sizeof(u64));
+    }
+    append_padding(&out);
+
+    for (isize i = 0; i < linked.functions.size; i++) {
+        BytecodeFileFunction function = {
+            .offset = (u64)(linked.functions[i].data - linked.code.data),
+            .size = (u64)linked.functions[i].size,
+        };
+        append_bytes(&out, &function, sizeof(function));
+    }
+    append_bytes(&out, relocations.data,
+                 relocations.size * sizeof(BytecodeFileRelocation));
+    core_assert(out.size == (isize)header.file_size);
+    return array_to_slice(&out);
+}
+
+bool bytecode_file_write(const char* path, LinkedUnit linked,
+                         Slice<u8> static_data) {
+    Arena arena = {};
+    arena_init(&arena, 16 * 1024);
+    defer(arena_free(&arena));
+    Slice<u8> bytes = bytecode_file_serialize(linked, static_data, &arena);
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written =
+        fwrite(bytes.data, 1, bytes.size, file) == (size_t)bytes.size;
+    return fclose(file) == 0 && written;
+}
+
+// Whether [offset, offset + size) is inside the file
+static bool in_file(u64 offset, u64 size, u64 file_size) {
+    return offset <= file_size && size <= file_size - offset;
+}
+
+static bool check_header(const BytecodeFileHeader* header, u64 file_size,
+                         const char** error) {
+    if (memcmp(header->magic, BYTECODE_FILE_MAGIC, sizeof(header->magic))) {
+        *error = "Not a .jazzc file";
+        return false;
+    }
+    if (header->version != BYTECODE_FILE_VERSION) {
+        *error = "Unsupported .jazzc version";
+        return false;
+    }
+    if (header->linked_ops_hash != bytecode_file_linked_ops_hash()) {
+        *error = "Compiled with a different instruction set";
+        return false;
+    }
+    if (header->file_size != file_size) {
+        *error = "Truncated file";
+        return false;
+    }
+    bool sections_valid =
+        header->static_data_offset % 8 == 0 &&
+        in_file(header->static_data_offset, header->static_data_size,
+                file_size) &&
+        in_file(header->code_offset, header->code_size, file_size) &&
+        header->functions_offset % 8 == 0 &&
+        header->function_count <= file_size / sizeof(BytecodeFileFunction) &&
+        in_file(header->functions_offset,
+                header->function_count * sizeof(BytecodeFileFunction),
+                file_size) &&
+        header->relocations_offset % 8 == 0 &&
+        header->relocation_count <=
+            file_size / sizeof(BytecodeFileRelocation) &&
+        in_file(header->relocations_offset,
+                header->relocation_count * sizeof(BytecodeFileRelocation),
+                file_size);
+    if (!sections_valid || header->function_count == 0) {
+        *error = "Invalid section";
+        return false;
+    }
+    return true;
+}
+
+bool bytecode_file_load(const char* path, BytecodeFile* file, Arena* arena,
+                        const char** error) {
+    *file = {};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *error = "Could not open file";
+        return false;
+    }
+    defer(close(fd));
+
+    struct stat stat_buffer;
+    if (fstat(fd, &stat_buffer) != 0 ||
+        stat_buffer.st_size < (off_t)sizeof(BytecodeFileHeader)) {
+        *error = "Not a .jazzc file";
+        return false;
+    }
+    isize size = stat_buffer.st_size;
+
+    // Private, the relocations must not end up in the file
+    u8* mapping = (u8*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                            fd, 0);
+    if (mapping == MAP_FAILED) {
+        *error = "Could not map file";
+        return false;
+    }
+    bool loaded = false;
+    defer({
+        if (!loaded) {
+            munmap(mapping, size);
+        }
+    });
+
+    BytecodeFileHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    if (!check_header(&header, size, error)) {
+        return false;
+    }
+
+    u8* code = mapping + header.code_offset;
+    Slice<Slice<u8>> functions = {
+        arena_alloc<Slice<u8>>(arena, header.function_count),
+        (isize)header.function_count};
+    for (u64 i = 0; i < header.function_count; i++) {
+        BytecodeFileFunction function;
+        memcpy(&function,
+               mapping + header.functions_offset +
+                   i * sizeof(BytecodeFileFunction),
+               sizeof(function));
+        if (!in_file(function.offset, function.size, header.code_size)) {
+            *error = "Function outside of the code";
+            return false;
+        }
+        functions[i] = Slice<u8>{code + function.offset, (isize)function.size};
+    }
+
+    for (u64 i = 0; i < header.relocation_count; i++) {
+        BytecodeFileRelocation relocation;
+        memcpy(&relocation,
+               mapping + header.relocations_offset +
+                   i * sizeof(BytecodeFileRelocation),
+               sizeof(relocation));
+        if (!in_file(relocation.offset, sizeof(u64), header.code_size) ||
+            relocation.builtin >= (u64)BUILTIN_FUNCTION_COUNT) {
+            *error = "Invalid relocation";
+            return false;
+        }
+        u64 address = (u64)BUILTIN_FUNCTION_TABLE[relocation.builtin];
+        memcpy(code + relocation.offset, &address, sizeof(address));
+    }
+
+    if (mprotect(mapping, size, PROT_READ) != 0) {
+        *error = "Could not protect the mapping";
+        return false;
+    }
+
+    loaded = true;
+    file->mapping = mapping;
+    file->size = size;
+    file->linked = LinkedUnit{
+        .code = Slice<u8>{code, (isize)header.code_size},
+        .functions = functions,
+    };
+    file->static_data =
+        Slice<u8>{mapping + header.static_data_offset,
+                  (isize)header.static_data_size};
+    return true;
+}
+
+void bytecode_file_unload(BytecodeFile* file) {
+    if (file->mapping) {
+        munmap(file->mapping, file->size);
+    }
+    *file = {};
+}
+
+bool bytecode_file_image(const BytecodeFile* file, bool jit, Arena* arena,
+                         VmImage* image, const char** error) {
+    CodeUnit code = {.static_data = file->static_data, .functions = {}};
+    *image = vm_image_make_linked(code, file->linked, arena);
+    if (!image->verified) {
+        *error = "The code did not pass the verifier";
+        return false;
+    }
+    if (jit) {
+        image->code = link_unlink_unit(file->linked, file->static_data, arena);
+        image->jit = jit_compile(image->code, arena);
+    }
+    return true;
+}
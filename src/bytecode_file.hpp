@@ -0,0 +1,91 @@
+#pragma once
+
+#include "core.hpp"
+#include "linker.hpp"
+#include "vm.hpp"
+
+// The `.jazzc` file format, linked code ready to be run without the frontend.
+//
+// The file is the linked code (`linker.hpp`) and the static data exactly as
+// the VM reads them, so the loader maps the file and the VM runs it in place.
+// All the integers are little endian, every section starts 8 byte aligned:
+// - `BytecodeFileHeader`
+// - the static data
+// - the linked code of all the functions, one after another
+// - `BytecodeFileFunction` for every function, where its code is
+// - `BytecodeFileRelocation` for every `CallBuiltin`
+//
+// Function indices (`Call`, `TailCall`) and jump targets are relative already,
+// only the builtin addresses change from process to process. In the file their
+// slots are zero, a relocation names the builtin by its index in
+// `BUILTIN_FUNCTION_TABLE`. The loader maps the file copy-on-write, patches the
+// slots and makes the mapping read-only, only the pages with builtin calls get
+// copied.
+//
+// A file written by a build with a different instruction set (other
+// superinstructions, another encoding) is rejected, the header carries a hash
+// of `LINKED_OP_INFO`. Unlike freshly compiled code, code from a file is only
+// run if it passes the verifier, a missing relocation would leave a null
+// builtin address which even the checked interpreter would call.
+
+const u8 BYTECODE_FILE_MAGIC[8] = {'J', 'A', 'Z', 'Z', 'C', 0, 0, 0};
+const u32 BYTECODE_FILE_VERSION = 1;
+
+struct BytecodeFileHeader {
+    u8 magic[8];
+    u32 version;
+    u32 linked_ops_hash;
+    u64 file_size;
+    u64 static_data_offset;
+    u64 static_data_size;
+    u64 code_offset;
+    u64 code_size;
+    u64 functions_offset;
+    u64 function_count;
+    u64 relocations_offset;
+    u64 relocation_count;
+};
+
+// Relative to the start of the code
+struct BytecodeFileFunction {
+    u64 offset;
+    u64 size;
+};
+
+// The 8 byte slot at `offset` in the code gets the address of the builtin
+struct BytecodeFileRelocation {
+    u64 offset;
+    u64 builtin;
+};
+
+// Hash of the instruction encoding the file was written with
+u32 bytecode_file_linked_ops_hash();
+
+// Returns false if the file could not be written
+bool bytecode_file_write(const char* path, LinkedUnit linked,
+                         Slice<u8> static_data);
+
+// The same bytes `bytecode_file_write` writes
+Slice<u8> bytecode_file_serialize(LinkedUnit linked, Slice<u8> static_data,
+                                  Arena* arena);
+
+struct BytecodeFile {
+    // The whole file, mapped read-only
+    u8* mapping;
+    isize size;
+    LinkedUnit linked;
+    Slice<u8> static_data;
+};
+
+// Maps and checks the file. Returns false and sets `error` if it is not a
+// valid `.jazzc` file of this build.
+bool bytecode_file_load(const char* path, BytecodeFile* file, Arena* arena,
+                        const char** error);
+
+void bytecode_file_unload(BytecodeFile* file);
+
+// Verifies the loaded code and makes an image of it, runs in place. Only with
+// `jit` are the instructions decoded (`link_unlink_unit`) for the JIT,
+// otherwise `image->code` has just the static data.
+bool bytecode_file_image(const BytecodeFile* file, bool jit, Arena* arena,
+                         VmImage* image, const char** error);
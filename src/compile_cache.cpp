@@ -0,0 +1,70 @@
+#include "compile_cache.hpp"
+#include "bytecode_file.hpp"
+#include "core.hpp"
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void hash_bytes(u64* hash, const void* data, isize size) {
+    // FNV-1a
+    for (isize i = 0; i < size; i++) {
+        *hash = (*hash ^ ((const u8*)data)[i]) * 1099511628211ull;
+    }
+}
+
+u64 compile_cache_key(String source, bool optimize, CompilerBackend backend) {
+    u64 hash = 14695981039346656037ull;
+    u64 options[] = {
+        (u64)optimize,
+        (u64)backend,
+        (u64)BYTECODE_FILE_VERSION,
+        (u64)bytecode_file_linked_ops_hash(),
+    };
+    hash_bytes(&hash, options, sizeof(options));
+
+    // The compiler has no version of its own, any rebuild can
+    // change the code it emits.
+    struct stat binary;
+    if (stat("/proc/self/exe", &binary) == 0) {
+        u64 identity[] = {(u64)binary.st_size, (u64)binary.st_mtim.tv_sec,
+                          (u64)binary.st_mtim.tv_nsec};
+        hash_bytes(&hash, identity, sizeof(identity));
+    }
+
+    hash_bytes(&hash, &source.size, sizeof(source.size));
+    hash_bytes(&hash, source.data, source.size);
+    return hash;
+}
+
+const char* compile_cache_path(const char* dir, u64 key, Arena* arena) {
+    isize size = strlen(dir) + 1 + 16 + strlen(".jazzc") + 1;
+    char* path = arena_alloc<char>(arena, size);
+    snprintf(path, size, "%s/%016llx.jazzc", dir, (unsigned long long)key);
+    return path;
+}
+
+bool compile_cache_lookup(const char* dir, u64 key, BytecodeFile* file,
+                          Arena* arena) {
+    const char* error = nullptr;
+    return bytecode_file_load(compile_cache_path(dir, key, arena), file, arena,
+                              &error);
+}
+
+bool compile_cache_store(const char* dir, u64 key, LinkedUnit linked,
+                         Slice<u8> static_data, Arena* arena) {
+    // Fails if it exists already, which is fine
+    mkdir(dir, 0755);
+
+    const char* path = compile_cache_path(dir, key, arena);
+    // Unique to this process, on the same file system as the entry
+    isize size = strlen(path) + 32;
+    char* temp_path = arena_alloc<char>(arena, size);
+    snprintf(temp_path, size, "%s.%ld.tmp", path, (long)getpid());
+
+    if (!bytecode_file_write(temp_path, linked, static_data) ||
+        rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "bytecode_file.hpp"
+#include "compiler.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+
+// Content-addressed cache of compiled programs. The key is a hash of the
+// source bytes, the compiler options and the `jazz` binary itself (its size
+// and modification time, so a rebuilt compiler never sees the programs of the
+// previous one). An entry is the `.jazzc` file of the program
+// (`bytecode_file.hpp`), named after the key.
+//
+// Entries are written to a temporary file and renamed into place, so many
+// processes can share one directory: a reader sees either no entry or a
+// whole one, and writers racing on the same key write the same bytes.
+
+u64 compile_cache_key(String source, bool optimize, CompilerBackend backend);
+
+// `<dir>/<key as 16 hex digits>.jazzc`
+const char* compile_cache_path(const char* dir, u64 key, Arena* arena);
+
+// Returns false on a miss, or if the entry could not be loaded
+bool compile_cache_lookup(const char* dir, u64 key, BytecodeFile* file,
+                          Arena* arena);
+
+// Creates the directory if needed. Returns false if the entry could not be
+// written, the cache is left as it was.
+bool compile_cache_store(const char* dir, u64 key, LinkedUnit linked,
+                         Slice<u8> static_data, Arena* arena);
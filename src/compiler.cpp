@@ -2,6 +2,7 @@
 #include "ast.hpp"
 #include "bytecode.hpp"
 #include "core.hpp"
+#include "fold.hpp"
 #include "optimizer.hpp"
 #include "tokenizer.hpp"
 #include <iostream>
@@ -10,22 +11,66 @@ struct CompilerContext {
     Arena* arena;
     Array<Slice<Inst>> functions;
     Array<u8> static_data;
+    // The offsets of the constants in `static_data`, see
+    // `ctx_push_static_data`
+    HashMap<String, isize> constants;
     HashMap<String, isize> function_name_offset_map;
     isize stack_frame_size;
     Array<MemPtr> return_ptrs;
+    // The size of the return value and the arguments of the current function,
+    // right below its BP
+    isize arguments_size;
     bool optimize;
+
+    CompilerBackend backend;
+    // Register backend: the size of the frame with all the registers of the
+    // current function, known after the first pass over it
+    isize frame_size;
+    // Register backend: the first free register, and the highest it got
+    isize register_top;
+    isize register_max;
+    // Register backend: the call areas (return value and arguments) pushed
+    // above the frame
+    isize call_area_size;
 };
 
+// Every distinct constant is stored once, in a slot aligned to its size. The
+// key is the size and the bytes, constants of different types with the same
+// bytes share the slot.
 template <typename T>
 isize ctx_push_static_data(CompilerContext* ctx, T value) {
-    isize offset = ctx->static_data.size;
-    u8* data = (u8*)&value;
-    for (isize i = 0; i < (isize)sizeof(T); i++) {
-        array_push(&ctx->static_data, data[i]);
+    static_assert(sizeof(T) <= 8, "Constants are at most 8 bytes");
+    char key_data[1 + sizeof(T)];
+    key_data[0] = (char)sizeof(T);
+    memcpy(key_data + 1, &value, sizeof(T));
+    String key = {.data = key_data, .size = (isize)sizeof(key_data)};
+    isize* existing = hash_map_get_ptr(&ctx->constants, key);
+    if (existing) {
+        return *existing;
     }
+
+    while (ctx->static_data.size % alignof(T) != 0) {
+        array_push(&ctx->static_data, (u8)0);
+    }
+    isize offset = ctx->static_data.size;
+    array_push_from_slice(&ctx->static_data,
+                          Slice<u8>{(u8*)&value, (isize)sizeof(T)});
+
+    char* stored = arena_alloc<char>(ctx->arena, key.size);
+    memcpy(stored, key_data, key.size);
+    hash_map_insert_or_set(&ctx->constants, String{stored, key.size}, offset);
     return offset;
 }
 
+// Small integer and bool constants are encoded right into the instructions,
+// the rest goes into the static data
+template <typename T> MemPtr ctx_constant_ptr(CompilerContext* ctx, T value) {
+    if (mem_ptr_fits_immediate((i64)value)) {
+        return mem_ptr_immediate((i64)value);
+    }
+    return mem_ptr_static_data(ctx_push_static_data(ctx, value));
+}
+
 i64 string_parse_to_i64(String str) {
     core_assert(str.size > 0);
 
@@ -86,14 +131,18 @@ void pop_stack(CompilerContext* ctx, isize size, Array<Inst>* instructions) {
 void compile_block(CompilerContext* ctx, AstNodeBlock* block,
                    Array<Inst>* instructions);
 
+// Whether the function ends with the instruction, without falling through
+bool inst_is_terminator(Inst inst) {
+    return inst.type == InstType::Return || inst.type == InstType::TailCall;
+}
+
 void define_literal(CompilerContext* ctx, AstNodeLiteral* literal) {
     Type* type = type_set_get_single(literal->type_set);
     switch (literal->literal_kind) {
     case AstLiteralKind::Integer: {
         core_assert(type->size == sizeof(i64));
         i64 value = string_parse_to_i64(literal->token.source);
-        isize offset = ctx_push_static_data(ctx, value);
-        literal->static_data_ptr = mem_ptr_static_data(offset);
+        literal->ptr = ctx_constant_ptr(ctx, value);
         break;
     }
     case AstLiteralKind::Float:
@@ -102,11 +151,83 @@ void define_literal(CompilerContext* ctx, AstNodeLiteral* literal) {
     case AstLiteralKind::Bool: {
         core_assert(type->size == sizeof(bool));
         bool value = string_parse_to_bool(literal->token.source);
-        isize offset = ctx_push_static_data(ctx, value);
-        literal->static_data_ptr = mem_ptr_static_data(offset);
+        literal->ptr = ctx_constant_ptr(ctx, value);
+        break;
+    }
+    }
+}
+
+BinOperand compile_bin_operand(Type* left_type, TokenKind token) {
+    BinOperand op = BinOperand::Int_Add;
+    switch (left_type->kind) {
+    case TypeKind::Integer: {
+        switch (token) {
+        case TokenKind::Plus: {
+            op = BinOperand::Int_Add;
+            break;
+        }
+        case TokenKind::Minus: {
+            op = BinOperand::Int_Sub;
+            break;
+        }
+        case TokenKind::Asterisk: {
+            op = BinOperand::Int_Mul;
+            break;
+        }
+        case TokenKind::Slash: {
+            op = BinOperand::Int_Div;
+            break;
+        }
+        case TokenKind::BinaryOr: {
+            op = BinOperand::Int_BinaryOr;
+            break;
+        }
+        case TokenKind::BinaryAnd: {
+            op = BinOperand::Int_BinaryAnd;
+            break;
+        }
+        case TokenKind::Equal: {
+            op = BinOperand::Int_Equal;
+            break;
+        }
+        case TokenKind::NotEqual: {
+            op = BinOperand::Int_NotEqual;
+            break;
+        }
+        case TokenKind::LessThan: {
+            op = BinOperand::Int_LessThan;
+            break;
+        }
+        case TokenKind::LessEqual: {
+            op = BinOperand::Int_LessEqual;
+            break;
+        }
+        case TokenKind::GreaterThan: {
+            op = BinOperand::Int_GreaterThan;
+            break;
+        }
+        case TokenKind::GreaterEqual: {
+            op = BinOperand::Int_GreaterEqual;
+            break;
+        }
+        default: {
+            core_assert(false);
+            break;
+        }
+        }
         break;
     }
+    case TypeKind::Float:
+    case TypeKind::String:
+    case TypeKind::Bool:
+    case TypeKind::Void:
+    case TypeKind::Function: {
+        core_assert(false);
+        break;
     }
+    }
+
+    return op;
 }
 
 void compile_expression(CompilerContext* ctx, AstNode* expression,
@@ -118,12 +239,12 @@ void compile_expression(CompilerContext* ctx, AstNode* expression,
         switch (literal->literal_kind) {
         case AstLiteralKind::Integer: {
             i64 value = string_parse_to_i64(literal->token.source);
-            isize offset = ctx_push_static_data(ctx, value);
+            MemPtr value_ptr = ctx_constant_ptr(ctx, value);
             core_assert(type->size == sizeof(i64));
             push_stack(ctx, type->size, instructions);
             Inst mov =
                 inst_mov(mem_ptr_stack_rel(ctx->stack_frame_size - type->size),
-                         mem_ptr_static_data(offset), type->size);
+                         value_ptr, type->size);
             array_push(instructions, mov);
             break;
         }
@@ -132,12 +253,12 @@ void compile_expression(CompilerContext* ctx, AstNode* expression,
             break;
         case AstLiteralKind::Bool: {
             bool value = string_parse_to_bool(literal->token.source);
-            isize offset = ctx_push_static_data(ctx, value);
+            MemPtr value_ptr = ctx_constant_ptr(ctx, value);
             core_assert(type->size == sizeof(bool));
             push_stack(ctx, type->size, instructions);
             Inst mov =
                 inst_mov(mem_ptr_stack_rel(ctx->stack_frame_size - type->size),
-                         mem_ptr_static_data(offset), type->size);
+                         value_ptr, type->size);
             array_push(instructions, mov);
             break;
         }
@@ -185,7 +306,7 @@ void compile_expression(CompilerContext* ctx, AstNode* expression,
         case AstNodeKind::Literal: {
             AstNodeLiteral* literal = binary->left->as_literal();
             define_literal(ctx, literal);
-            left_ptr = literal->static_data_ptr;
+            left_ptr = literal->ptr;
             break;
         }
         case AstNodeKind::Identifier: {
@@ -226,7 +347,7 @@ void compile_expression(CompilerContext* ctx, AstNode* expression,
         case AstNodeKind::Literal: {
             AstNodeLiteral* literal = binary->right->as_literal();
             define_literal(ctx, literal);
-            right_ptr = literal->static_data_ptr;
+            right_ptr = literal->ptr;
             break;
         }
         case AstNodeKind::Identifier: {
@@ -263,74 +384,7 @@ void compile_expression(CompilerContext* ctx, AstNode* expression,
 
         core_assert(left_type->kind == right_type->kind);
 
-        BinOperand op = BinOperand::Int_Add;
-        switch (left_type->kind) {
-        case TypeKind::Integer: {
-            switch (binary->op) {
-            case TokenKind::Plus: {
-                op = BinOperand::Int_Add;
-                break;
-            }
-            case TokenKind::Minus: {
-                op = BinOperand::Int_Sub;
-                break;
-            }
-            case TokenKind::Asterisk: {
-                op = BinOperand::Int_Mul;
-                break;
-            }
-            case TokenKind::Slash: {
-                op = BinOperand::Int_Div;
-                break;
-            }
-            case TokenKind::BinaryOr: {
-                op = BinOperand::Int_BinaryOr;
-                break;
-            }
-            case TokenKind::BinaryAnd: {
-                op = BinOperand::Int_BinaryAnd;
-                break;
-            }
-            case TokenKind::Equal: {
-                op = BinOperand::Int_Equal;
-                break;
-            }
-            case TokenKind::NotEqual: {
-                op = BinOperand::Int_NotEqual;
-                break;
-            }
-            case TokenKind::LessThan: {
-                op = BinOperand::Int_LessThan;
-                break;
-            }
-            case TokenKind::LessEqual: {
-                op = BinOperand::Int_LessEqual;
-                break;
-            }
-            case TokenKind::GreaterThan: {
-                op = BinOperand::Int_GreaterThan;
-                break;
-            }
-            case TokenKind::GreaterEqual: {
-                op = BinOperand::Int_GreaterEqual;
-                break;
-            }
-            default: {
-                core_assert(false);
-                break;
-            }
-            }
-            break;
-        }
-        case TypeKind::Float:
-        case TypeKind::String:
-        case TypeKind::Bool:
-        case TypeKind::Void:
-        case TypeKind::Function: {
-            core_assert(false);
-            break;
-        }
-        }
+        BinOperand op = compile_bin_operand(left_type, binary->op);
 
         isize space_on_stack = ctx->stack_frame_size - before_left;
         core_assert(space_on_stack >= 0);
@@ -422,6 +476,61 @@ void compile_expression(CompilerContext* ctx, AstNode* expression,
     }
 }
 
+// `return f(...)` can reuse the frame of the current function, if `f` takes
+// its arguments and returns its value in the same place below BP. Returns the
+// function to tail call, or null if it has to be a regular call.
+AstNodeFunction* tail_call_target(CompilerContext* ctx, AstNode* value) {
+    if (value->kind != AstNodeKind::Call) {
+        return nullptr;
+    }
+    AstNodeCall* call = value->as_call();
+    AstNodeIdentifier* callee_ident = call->callee->as_identifier();
+    if (callee_ident->def->kind != AstNodeKind::Declaration) {
+        return nullptr;
+    }
+    AstNodeFunction* fn =
+        callee_ident->def->as_declaration()->value->as_function();
+    if (fn->builtin != nullptr) {
+        return nullptr;
+    }
+
+    // The return type is the same as ours, so if the sizes match, so do the
+    // slots of the arguments
+    isize arguments_size = type_set_get_single(value->type_set)->size;
+    for (isize i = 0; i < call->arguments.size; i++) {
+        arguments_size +=
+            type_set_get_single(call->arguments[i]->type_set)->size;
+    }
+    return arguments_size == ctx->arguments_size ? fn : nullptr;
+}
+
+// Calling convention of a tail call:
+// 1. Push the arguments on the stack
+// 2. Move them over the arguments of the current function
+// 3. Pop the whole frame and jump to the function, it returns to our caller
+void compile_tail_call(CompilerContext* ctx, AstNodeCall* call,
+                       AstNodeFunction* fn, Array<Inst>* instructions) {
+    isize before_size = ctx->stack_frame_size;
+    for (isize i = 0; i < call->arguments.size; i++) {
+        compile_expression(ctx, call->arguments[i], instructions);
+    }
+
+    // The arguments are above BP and the slots below it, they never overlap
+    isize arguments_size = ctx->stack_frame_size - before_size;
+    if (arguments_size > 0) {
+        array_push(instructions,
+                   inst_mov(mem_ptr_stack_rel(-arguments_size),
+                            mem_ptr_stack_rel(before_size), arguments_size));
+    }
+
+    // Same as with `Return`, the frame size is not changed
+    if (ctx->stack_frame_size > 0) {
+        array_push(instructions, inst_pop_stack(ctx->stack_frame_size));
+    }
+    array_push(instructions, inst_tail_call(fn->offset));
+    ctx->stack_frame_size = before_size;
+}
+
 void compile_statement(CompilerContext* ctx, AstNode* statement,
                        Array<Inst>* instructions) {
     switch (statement->kind) {
@@ -520,6 +629,14 @@ void compile_statement(CompilerContext* ctx, AstNode* statement,
     }
     case AstNodeKind::Return: {
         AstNodeReturn* ret = statement->as_return();
+        AstNodeFunction* tail_callee =
+            ret->value ? tail_call_target(ctx, ret->value) : nullptr;
+        if (tail_callee) {
+            compile_tail_call(ctx, ret->value->as_call(), tail_callee,
+                              instructions);
+            break;
+        }
+
         if (ret->value) {
             Type* type = type_set_get_single(ret->value->type_set);
             isize before_size = ctx->stack_frame_size;
@@ -625,13 +742,427 @@ void compile_block(CompilerContext* ctx, AstNodeBlock* block,
     }
 }
 
+
+// ------------------
+// Register backend
+// ------------------
+//
+// The frame of a function is [registers][call areas]. The registers are
+// allocated like a stack at compile time, the whole frame is pushed once on
+// function entry. Call areas are pushed above the frame right before a call,
+// the arguments are evaluated straight into them.
+
+isize register_alloc(CompilerContext* ctx, isize size) {
+    isize offset = ctx->register_top;
+    ctx->register_top += size;
+    if (ctx->register_top > ctx->register_max) {
+        ctx->register_max = ctx->register_top;
+    }
+    return offset;
+}
+
+MemPtr identifier_ptr(AstNodeIdentifier* ident) {
+    switch (ident->def->kind) {
+    case AstNodeKind::Declaration:
+        return ident->def->as_declaration()->name->ptr;
+    case AstNodeKind::Parameter:
+        return ident->def->as_parameter()->name->ptr;
+    default:
+        core_assert(false);
+        return mem_ptr_invalid();
+    }
+}
+
+void register_compile_expression(CompilerContext* ctx, AstNode* expression,
+                                 MemPtr dest, Array<Inst>* instructions);
+
+// Returns where the value of the expression can be read from. Literals and
+// variables are used in place, everything else is computed into a new
+// register, which stays allocated until the caller resets `register_top`.
+MemPtr register_compile_operand(CompilerContext* ctx, AstNode* expression,
+                                Array<Inst>* instructions) {
+    switch (expression->kind) {
+    case AstNodeKind::Literal: {
+        AstNodeLiteral* literal = expression->as_literal();
+        define_literal(ctx, literal);
+        core_assert(literal->ptr.type != MemPtrType::Invalid);
+        return literal->ptr;
+    }
+    case AstNodeKind::Identifier: {
+        return identifier_ptr(expression->as_identifier());
+    }
+    default: {
+        Type* type = type_set_get_single(expression->type_set);
+        MemPtr temp = mem_ptr_stack_rel(register_alloc(ctx, type->size));
+        register_compile_expression(ctx, expression, temp, instructions);
+        return temp;
+    }
+    }
+}
+
+// `dest` may be invalid, if the result of the call is not used
+void register_compile_call(CompilerContext* ctx, AstNodeCall* call,
+                           MemPtr dest, Array<Inst>* instructions) {
+    AstNodeIdentifier* callee_ident = call->callee->as_identifier();
+    FunctionType* callee_type =
+        type_set_get_single(callee_ident->type_set)->as_function();
+    Type* return_type = type_set_get_single(callee_type->return_type);
+
+    // The calling convention is the same as with the stack backend, the
+    // return value and the arguments are on the top of the stack
+    isize area_start = ctx->frame_size + ctx->call_area_size;
+    isize area_size = return_type->size;
+    for (isize i = 0; i < call->arguments.size; i++) {
+        area_size += type_set_get_single(call->arguments[i]->type_set)->size;
+    }
+
+    if (area_size > 0) {
+        array_push(instructions, inst_push_stack(area_size));
+    }
+    ctx->call_area_size += area_size;
+
+    isize arg_offset = area_start + return_type->size;
+    for (isize i = 0; i < call->arguments.size; i++) {
+        AstNode* arg = call->arguments[i];
+        isize before_registers = ctx->register_top;
+        register_compile_expression(ctx, arg, mem_ptr_stack_rel(arg_offset),
+                                    instructions);
+        ctx->register_top = before_registers;
+        arg_offset += type_set_get_single(arg->type_set)->size;
+    }
+
+    AstNodeFunction* fn = nullptr;
+    switch (callee_ident->def->kind) {
+    case AstNodeKind::Declaration: {
+        fn = callee_ident->def->as_declaration()->value->as_function();
+        break;
+    }
+    case AstNodeKind::Parameter: {
+        core_assert_msg(false, "Function pointers are not yet implemented");
+        break;
+    }
+    default: {
+        core_assert(false);
+        break;
+    }
+    }
+
+    if (fn->builtin != nullptr) {
+        array_push(instructions, inst_call_builtin(fn->builtin));
+    } else {
+        array_push(instructions, inst_call(fn->offset));
+    }
+
+    if (dest.type != MemPtrType::Invalid && return_type->size > 0) {
+        array_push(instructions, inst_mov(dest, mem_ptr_stack_rel(area_start),
+                                          return_type->size));
+    }
+
+    if (area_size > 0) {
+        array_push(instructions, inst_pop_stack(area_size));
+    }
+    ctx->call_area_size -= area_size;
+}
+
+// Computes the value of the expression directly into `dest`
+void register_compile_expression(CompilerContext* ctx, AstNode* expression,
+                                 MemPtr dest, Array<Inst>* instructions) {
+    Type* type = type_set_get_single(expression->type_set);
+
+    switch (expression->kind) {
+    case AstNodeKind::Literal:
+    case AstNodeKind::Identifier: {
+        MemPtr src = register_compile_operand(ctx, expression, instructions);
+        if (src.type != dest.type || src.mem_offset != dest.mem_offset) {
+            array_push(instructions, inst_mov(dest, src, type->size));
+        }
+        break;
+    }
+    case AstNodeKind::Binary: {
+        AstNodeBinary* binary = expression->as_binary();
+        Type* left_type = type_set_get_single(binary->left->type_set);
+        Type* right_type = type_set_get_single(binary->right->type_set);
+        core_assert(left_type->kind == right_type->kind);
+
+        isize before_registers = ctx->register_top;
+        MemPtr left = register_compile_operand(ctx, binary->left, instructions);
+        MemPtr right =
+            register_compile_operand(ctx, binary->right, instructions);
+        ctx->register_top = before_registers;
+
+        BinOperand op = compile_bin_operand(left_type, binary->op);
+        array_push(instructions, inst_binary_op(op, dest, left, right));
+        break;
+    }
+    case AstNodeKind::Call: {
+        register_compile_call(ctx, expression->as_call(), dest, instructions);
+        break;
+    }
+    case AstNodeKind::Unary:
+    case AstNodeKind::If:
+    case AstNodeKind::For:
+    case AstNodeKind::Break:
+    case AstNodeKind::Continue:
+    case AstNodeKind::Return:
+    case AstNodeKind::Block:
+    case AstNodeKind::Parameter:
+    case AstNodeKind::Function:
+    case AstNodeKind::Declaration:
+    case AstNodeKind::Assignment: {
+        core_assert(false);
+        break;
+    }
+    }
+}
+
+bool mem_ptr_overlap(MemPtr a, isize a_size, MemPtr b, isize b_size) {
+    return a.type == b.type && a.mem_offset < b.mem_offset + b_size &&
+           b.mem_offset < a.mem_offset + a_size;
+}
+
+// The arguments are moved straight over our own, which may still be read by
+// the later ones. Those are copied out to registers first.
+void register_compile_tail_call(CompilerContext* ctx, AstNodeCall* call,
+                                AstNodeFunction* fn,
+                                Array<Inst>* instructions) {
+    isize before_registers = ctx->register_top;
+    isize arg_count = call->arguments.size;
+    MemPtr* sources = arena_alloc<MemPtr>(ctx->arena, arg_count);
+    MemPtr* slots = arena_alloc<MemPtr>(ctx->arena, arg_count);
+    isize* sizes = arena_alloc<isize>(ctx->arena, arg_count);
+
+    isize arguments_size = 0;
+    for (isize i = 0; i < arg_count; i++) {
+        sizes[i] = type_set_get_single(call->arguments[i]->type_set)->size;
+        arguments_size += sizes[i];
+    }
+
+    isize slot_offset = -arguments_size;
+    for (isize i = 0; i < arg_count; i++) {
+        sources[i] =
+            register_compile_operand(ctx, call->arguments[i], instructions);
+        slots[i] = mem_ptr_stack_rel(slot_offset);
+        slot_offset += sizes[i];
+    }
+
+    // A slot that already holds its argument is not written. A source that
+    // only partly overlaps its own slot can not be moved in place either.
+    bool* in_place = arena_alloc<bool>(ctx->arena, arg_count);
+    for (isize i = 0; i < arg_count; i++) {
+        in_place[i] = sources[i].type == slots[i].type &&
+                      sources[i].mem_offset == slots[i].mem_offset;
+    }
+
+    for (isize i = 0; i < arg_count; i++) {
+        if (in_place[i]) {
+            continue;
+        }
+        bool clobbered =
+            mem_ptr_overlap(sources[i], sizes[i], slots[i], sizes[i]);
+        for (isize j = 0; j < i && !clobbered; j++) {
+            clobbered = !in_place[j] && mem_ptr_overlap(sources[i], sizes[i],
+                                                        slots[j], sizes[j]);
+        }
+        if (clobbered) {
+            MemPtr temp = mem_ptr_stack_rel(register_alloc(ctx, sizes[i]));
+            array_push(instructions, inst_mov(temp, sources[i], sizes[i]));
+            sources[i] = temp;
+        }
+    }
+
+    for (isize i = 0; i < arg_count; i++) {
+        if (!in_place[i]) {
+            array_push(instructions,
+                       inst_mov(slots[i], sources[i], sizes[i]));
+        }
+    }
+    ctx->register_top = before_registers;
+
+    core_assert(ctx->call_area_size == 0);
+    if (ctx->frame_size > 0) {
+        array_push(instructions, inst_pop_stack(ctx->frame_size));
+    }
+    array_push(instructions, inst_tail_call(fn->offset));
+}
+
+void register_compile_block(CompilerContext* ctx, AstNodeBlock* block,
+                            Array<Inst>* instructions);
+
+void register_compile_statement(CompilerContext* ctx, AstNode* statement,
+                                Array<Inst>* instructions) {
+    switch (statement->kind) {
+    case AstNodeKind::Literal:
+    case AstNodeKind::Identifier:
+    case AstNodeKind::Binary:
+    case AstNodeKind::Unary: {
+        // Sema accepts expressions as statements, the value is dropped. It is
+        // still computed, a division by zero has to fail.
+        isize before_registers = ctx->register_top;
+        register_compile_operand(ctx, statement, instructions);
+        ctx->register_top = before_registers;
+        break;
+    }
+    case AstNodeKind::Break:
+    case AstNodeKind::Continue: {
+        core_assert_msg(false, "Break and continue are not yet implemented");
+        break;
+    }
+    case AstNodeKind::For: {
+        AstNodeFor* for_node = statement->as_for();
+        // The variables from `init` live until the end of the loop
+        isize before_registers = ctx->register_top;
+        register_compile_statement(ctx, for_node->init, instructions);
+
+        isize for_condition_ip = instructions->size;
+        isize before_condition = ctx->register_top;
+        MemPtr condition =
+            register_compile_operand(ctx, for_node->condition, instructions);
+        ctx->register_top = before_condition;
+
+        isize jump_to_end_index = instructions->size;
+        array_push(instructions, inst_jump_if_not(condition, -1));
+
+        register_compile_block(ctx, for_node->then_branch->as_block(),
+                               instructions);
+        register_compile_statement(ctx, for_node->update, instructions);
+        array_push(instructions, inst_jump(for_condition_ip));
+
+        (*instructions)[jump_to_end_index].jump_if.new_ip = instructions->size;
+        ctx->register_top = before_registers;
+        break;
+    }
+    case AstNodeKind::If: {
+        AstNodeIf* if_node = statement->as_if();
+        isize before_registers = ctx->register_top;
+        MemPtr condition =
+            register_compile_operand(ctx, if_node->condition, instructions);
+        ctx->register_top = before_registers;
+
+        isize condition_jump_index = instructions->size;
+        array_push(instructions, inst_jump_if_not(condition, -1));
+
+        register_compile_block(ctx, if_node->then_branch->as_block(),
+                               instructions);
+
+        if (if_node->else_branch != nullptr) {
+            isize else_jump_index = instructions->size;
+            array_push(instructions, inst_jump(-1));
+            (*instructions)[condition_jump_index].jump_if.new_ip =
+                instructions->size;
+
+            register_compile_block(ctx, if_node->else_branch->as_block(),
+                                   instructions);
+            (*instructions)[else_jump_index].jump.new_ip = instructions->size;
+        } else {
+            (*instructions)[condition_jump_index].jump_if.new_ip =
+                instructions->size;
+        }
+        break;
+    }
+    case AstNodeKind::Call: {
+        register_compile_call(ctx, statement->as_call(), mem_ptr_invalid(),
+                              instructions);
+        break;
+    }
+    case AstNodeKind::Return: {
+        AstNodeReturn* ret = statement->as_return();
+        AstNodeFunction* tail_callee =
+            ret->value ? tail_call_target(ctx, ret->value) : nullptr;
+        if (tail_callee) {
+            register_compile_tail_call(ctx, ret->value->as_call(), tail_callee,
+                                       instructions);
+            break;
+        }
+
+        if (ret->value) {
+            MemPtr current_return_ptr =
+                ctx->return_ptrs[ctx->return_ptrs.size - 1];
+            isize before_registers = ctx->register_top;
+            register_compile_expression(ctx, ret->value, current_return_ptr,
+                                        instructions);
+            ctx->register_top = before_registers;
+        }
+
+        core_assert(ctx->call_area_size == 0);
+        if (ctx->frame_size > 0) {
+            array_push(instructions, inst_pop_stack(ctx->frame_size));
+        }
+        array_push(instructions, inst_return());
+        break;
+    }
+    case AstNodeKind::Block: {
+        register_compile_block(ctx, statement->as_block(), instructions);
+        break;
+    }
+    case AstNodeKind::Declaration: {
+        AstNodeDeclaration* decl = statement->as_declaration();
+        Type* type = type_set_get_single(decl->value->type_set);
+        MemPtr value = mem_ptr_stack_rel(register_alloc(ctx, type->size));
+        // The temporaries of the value are freed, the variable keeps its
+        // register until the end of the block
+        isize after_value = ctx->register_top;
+        register_compile_expression(ctx, decl->value, value, instructions);
+        ctx->register_top = after_value;
+        decl->name->ptr = value;
+        break;
+    }
+    case AstNodeKind::Assignment: {
+        AstNodeAssignment* assign = statement->as_assignment();
+        MemPtr dest = identifier_ptr(assign->name->as_identifier());
+
+        isize before_registers = ctx->register_top;
+        register_compile_expression(ctx, assign->value, dest, instructions);
+        ctx->register_top = before_registers;
+        break;
+    }
+    case AstNodeKind::Parameter:
+    case AstNodeKind::Function: {
+        core_assert(false);
+        break;
+    }
+    }
+}
+
+void register_compile_block(CompilerContext* ctx, AstNodeBlock* block,
+                            Array<Inst>* instructions) {
+    isize before_registers = ctx->register_top;
+    for (isize i = 0; i < block->statements.size; i++) {
+        register_compile_statement(ctx, block->statements[i], instructions);
+    }
+    ctx->register_top = before_registers;
+}
+
+void register_compile_function_body(CompilerContext* ctx,
+                                    AstNodeFunction* function,
+                                    Array<Inst>* instructions) {
+    ctx->register_top = 0;
+    ctx->register_max = 0;
+    ctx->call_area_size = 0;
+
+    if (ctx->frame_size > 0) {
+        array_push(instructions, inst_push_stack(ctx->frame_size));
+    }
+
+    register_compile_block(ctx, function->body, instructions);
+
+    if (instructions->size == 0 ||
+        !inst_is_terminator((*instructions)[instructions->size - 1])) {
+        if (ctx->frame_size > 0) {
+            array_push(instructions, inst_pop_stack(ctx->frame_size));
+        }
+        array_push(instructions, inst_return());
+    }
+}
+
 void compile_function(CompilerContext* ctx, AstNodeFunction* function,
                       isize function_offset) {
     Array<Inst> instructions = {};
     array_init(&instructions, 32, ctx->arena);
     function->offset = function_offset;
 
-    isize offset = -CALL_METADATA_SIZE;
+    // The arguments are right below the callee's BP, the return value below
+    // them
+    isize offset = 0;
     for (isize i = function->parameters.size - 1; i >= 0; i--) {
         AstNodeParameter* param = function->parameters[i];
         Type* type = type_set_get_single(param->type_set);
@@ -644,17 +1175,38 @@ void compile_function(CompilerContext* ctx, AstNodeFunction* function,
     Type* return_type = type_set_get_single(function_type->return_type);
 
     isize return_value_offset = offset - return_type->size;
+    ctx->arguments_size = -return_value_offset;
     array_push(&ctx->return_ptrs, mem_ptr_stack_rel(return_value_offset));
     defer(array_pop(&ctx->return_ptrs));
 
-    ctx->stack_frame_size = 0;
+    switch (ctx->backend) {
+    case CompilerBackend::Stack: {
+        ctx->stack_frame_size = 0;
 
-    compile_block(ctx, function->body, &instructions);
+        compile_block(ctx, function->body, &instructions);
 
-    if (instructions.size == 0 ||
-        instructions[instructions.size - 1].type != InstType::Return) {
-        pop_stack(ctx, ctx->stack_frame_size, &instructions);
-        array_push(&instructions, inst_return());
+        if (instructions.size == 0 ||
+            !inst_is_terminator(instructions[instructions.size - 1])) {
+            pop_stack(ctx, ctx->stack_frame_size, &instructions);
+            array_push(&instructions, inst_return());
+        }
+        break;
+    }
+    case CompilerBackend::Register: {
+        // The addresses of the call areas depend on the size of the frame,
+        // which is only known once the whole function is compiled. So it is
+        // compiled twice, the first pass only measures the frame. The
+        // constants it stores are found again by the second pass.
+        Array<Inst> measure = {};
+        array_init(&measure, 32, ctx->arena);
+        ctx->frame_size = 0;
+        register_compile_function_body(ctx, function, &measure);
+
+        ctx->frame_size = ctx->register_max;
+        register_compile_function_body(ctx, function, &instructions);
+        core_assert(ctx->register_max == ctx->frame_size);
+        break;
+    }
     }
 
     if (ctx->optimize) {
@@ -675,7 +1227,12 @@ void add_init_function(CompilerContext* ctx) {
     ctx->functions[0] = slice_from_inline_alloc(instructions, ctx->arena);
 }
 
-CodeUnit ast_compile_to_bytecode(Ast* ast, bool optimize, Arena* arena) {
+CodeUnit ast_compile_to_bytecode(Ast* ast, bool optimize, Arena* arena,
+                                 CompilerBackend backend) {
+    if (optimize) {
+        fold_constants(ast, arena);
+    }
+
     Array<Slice<Inst>> functions = {};
     array_init(&functions, ast->declarations.size, arena);
     array_push(&functions, Slice<Inst>{});
@@ -683,6 +1240,9 @@ CodeUnit ast_compile_to_bytecode(Ast* ast, bool optimize, Arena* arena) {
     Array<u8> static_data = {};
     array_init(&static_data, 1024, arena);
 
+    HashMap<String, isize> constants = {};
+    hash_map_init(&constants, 64, arena);
+
     HashMap<String, isize> function_name_offset = {};
     hash_map_init(&function_name_offset, ast->declarations.size, arena);
 
@@ -693,10 +1253,17 @@ CodeUnit ast_compile_to_bytecode(Ast* ast, bool optimize, Arena* arena) {
         .arena = arena,
         .functions = functions,
         .static_data = static_data,
+        .constants = constants,
         .function_name_offset_map = function_name_offset,
         .stack_frame_size = 0,
         .return_ptrs = return_ptrs,
+        .arguments_size = 0,
         .optimize = optimize,
+        .backend = backend,
+        .frame_size = 0,
+        .register_top = 0,
+        .register_max = 0,
+        .call_area_size = 0,
     };
 
     // Do a first pass, where we register all the functions and all the
@@ -716,9 +1283,8 @@ CodeUnit ast_compile_to_bytecode(Ast* ast, bool optimize, Arena* arena) {
             AstNodeLiteral* literal = value->as_literal();
             core_assert(literal->literal_kind == AstLiteralKind::Integer);
             i64 value = string_parse_to_i64(literal->token.source);
-            isize offset = ctx_push_static_data(&ctx, value);
-            literal->static_data_ptr = mem_ptr_static_data(offset);
-            name->ptr = mem_ptr_static_data(offset);
+            literal->ptr = ctx_constant_ptr(&ctx, value);
+            name->ptr = literal->ptr;
             break;
         }
         case TypeKind::Float: {
@@ -769,6 +1335,9 @@ CodeUnit ast_compile_to_bytecode(Ast* ast, bool optimize, Arena* arena) {
     }
 
     add_init_function(&ctx);
+    if (optimize) {
+        inline_calls(array_to_slice(&ctx.functions), INLINE_BUDGET, arena);
+    }
 
     CodeUnit code = {
         .static_data = array_to_slice(&ctx.static_data),
@@ -1,5 +1,23 @@
+#pragma once
+
 #include "ast.hpp"
 #include "bytecode.hpp"
 #include "core.hpp"
 
-CodeUnit ast_compile_to_bytecode(Ast* ast, bool optimize, Arena* arena);
+enum class CompilerBackend {
+    // Every sub-expression is pushed on the stack and popped once used
+    Stack,
+    // Every local and temporary value gets its own slot (register) in a frame
+    // allocated once on function entry, instructions operate on the slots
+    // directly
+    Register,
+};
+
+// The values of integer and bool literals, from their source
+i64 string_parse_to_i64(String str);
+bool string_parse_to_bool(String str);
+
+// With `optimize`, the tree is folded first, see `fold_constants`
+CodeUnit ast_compile_to_bytecode(
+    Ast* ast, bool optimize, Arena* arena,
+    CompilerBackend backend = CompilerBackend::Stack);
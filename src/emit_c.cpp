@@ -0,0 +1,298 @@
+#include "emit_c.hpp"
+#include "builtin.hpp"
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "vm.hpp"
+
+// Everything the generated functions use, the VM's registers and helpers
+static const char* EMIT_C_PRELUDE = R"PRELUDE(#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int64_t i64;
+typedef double f64;
+
+static uint8_t* jazz_stack;
+static i64 jazz_stack_size;
+static i64 jazz_call_depth;
+
+static void jazz_fail(const char* message) {
+    fflush(stdout);
+    fprintf(stderr, "%s\n", message);
+    abort();
+}
+
+static inline i64 load_i64(const uint8_t* ptr) {
+    i64 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline f64 load_f64(const uint8_t* ptr) {
+    f64 value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline bool load_bool(const uint8_t* ptr) { return *ptr != 0; }
+
+static inline void store_i64(uint8_t* ptr, i64 value) {
+    memcpy(ptr, &value, sizeof(value));
+}
+
+static inline void store_f64(uint8_t* ptr, f64 value) {
+    memcpy(ptr, &value, sizeof(value));
+}
+
+static inline void store_bool(uint8_t* ptr, bool value) { *ptr = value; }
+
+static inline void jazz_push(i64 size) {
+    if (jazz_stack_size + size > JAZZ_STACK_SIZE) {
+        jazz_fail("Stack overflow");
+    }
+    memset(jazz_stack + jazz_stack_size, 0, size);
+    jazz_stack_size += size;
+}
+
+static inline void jazz_call_enter(void) {
+    if (++jazz_call_depth > JAZZ_CALL_STACK_CAPACITY) {
+        jazz_fail("Call stack overflow");
+    }
+}
+
+static inline void std_println_int(void) {
+    printf("%lld\n", (long long)load_i64(jazz_stack + jazz_stack_size - 8));
+}
+
+static inline void std_print_int(void) {
+    printf("%lld", (long long)load_i64(jazz_stack + jazz_stack_size - 8));
+}
+
+static inline void std_print_space(void) { printf(" "); }
+
+static inline void std_print_newline(void) { printf("\n"); }
+)PRELUDE";
+
+static void emit_c_address(MemPtr ptr, std::ostream& os) {
+    switch (ptr.type) {
+    case MemPtrType::StackRel: {
+        os << "(bp + " << ptr.mem_offset << ")";
+        return;
+    }
+    case MemPtrType::StackAbs: {
+        os << "(jazz_stack + " << ptr.mem_offset << ")";
+        return;
+    }
+    case MemPtrType::StaticData: {
+        os << "(jazz_static_data + " << ptr.mem_offset << ")";
+        return;
+    }
+    default: {
+        core_assert_msg(false, "Operand mode not supported in C");
+        return;
+    }
+    }
+}
+
+static void emit_c_load(MemPtr ptr, const char* type, std::ostream& os) {
+    if (ptr.type == MemPtrType::Immediate) {
+        os << "((" << type << ")" << ptr.mem_offset << ")";
+        return;
+    }
+    os << "load_" << type << "(";
+    emit_c_address(ptr, os);
+    os << ")";
+}
+
+static void emit_c_dest(MemPtr ptr, std::ostream& os) {
+    core_assert_msg(ptr.type != MemPtrType::StaticData &&
+                        ptr.type != MemPtrType::Immediate,
+                    "Cannot write to static data or an immediate");
+    emit_c_address(ptr, os);
+}
+
+static void emit_c_binary_op(InstBinaryOp binary, const char* type,
+                             const char* result_type, const char* op_symbol,
+                             std::ostream& os) {
+    os << "store_" << result_type << "(";
+    emit_c_dest(binary.dest, os);
+    os << ", ";
+    emit_c_load(binary.left, type, os);
+    os << " " << op_symbol << " ";
+    emit_c_load(binary.right, type, os);
+    os << ");";
+}
+
+static void emit_c_unary_op(InstUnaryOp unary, const char* type,
+                            const char* result_type, const char* op_symbol,
+                            std::ostream& os) {
+    os << "store_" << result_type << "(";
+    emit_c_dest(unary.dest, os);
+    os << ", " << op_symbol;
+    emit_c_load(unary.operand, type, os);
+    os << ");";
+}
+
+#define EMIT_C_BINARY_OP(op, type, result_type, op_symbol)                     \
+    case BinOperand::op: {                                                     \
+        emit_c_binary_op(inst.binary, #type, #result_type, #op_symbol, os);    \
+        break;                                                                 \
+    }
+
+#define EMIT_C_UNARY_OP(op, type, result_type, op_symbol)                      \
+    case UnaryOperand::op: {                                                   \
+        emit_c_unary_op(inst.unary, #type, #result_type, #op_symbol, os);      \
+        break;                                                                 \
+    }
+
+static void emit_c_inst(Inst inst, isize fp, std::ostream& os) {
+    switch (inst.type) {
+    case InstType::BinaryOp: {
+        switch (inst.binary.op) { BIN_OPERANDS(EMIT_C_BINARY_OP) }
+        break;
+    }
+    case InstType::UnaryOp: {
+        switch (inst.unary.op) { UNARY_OPERANDS(EMIT_C_UNARY_OP) }
+        break;
+    }
+    case InstType::Mov: {
+        if (inst.mov.src.type == MemPtrType::Immediate) {
+            // The value is stored in the low bytes, same as in the VM
+            core_assert(inst.mov.size <= (isize)sizeof(i64));
+            os << "{ i64 value = " << inst.mov.src.mem_offset
+               << "; memcpy(";
+            emit_c_dest(inst.mov.dest, os);
+            os << ", &value, " << inst.mov.size << "); }";
+        } else {
+            os << "memmove(";
+            emit_c_dest(inst.mov.dest, os);
+            os << ", ";
+            emit_c_address(inst.mov.src, os);
+            os << ", " << inst.mov.size << ");";
+        }
+        break;
+    }
+    case InstType::PushStack: {
+        os << "jazz_push(" << inst.push_stack.size << ");";
+        break;
+    }
+    case InstType::PopStack: {
+        os << "jazz_stack_size -= " << inst.pop_stack.size << ";";
+        break;
+    }
+    case InstType::Call: {
+        os << "jazz_call_enter(); jazz_fn_" << inst.call.fp
+           << "(jazz_stack + jazz_stack_size); jazz_call_depth--;";
+        break;
+    }
+    case InstType::TailCall: {
+        if (inst.tail_call.fp == fp) {
+            os << "goto L0;";
+        } else {
+            os << "jazz_fn_" << inst.tail_call.fp << "(bp); return;";
+        }
+        break;
+    }
+    case InstType::CallBuiltin: {
+        os << builtin_function_name(
+                  (BuiltinFunctionPtr)inst.call_builtin.builtin)
+           << "();";
+        break;
+    }
+    case InstType::Return: {
+        os << "return;";
+        break;
+    }
+    case InstType::JumpIf: {
+        os << "if (";
+        emit_c_load(inst.jump_if.condition, "bool", os);
+        os << " == " << (inst.jump_if.expected ? "true" : "false")
+           << ") goto L" << inst.jump_if.new_ip << ";";
+        break;
+    }
+    case InstType::Jump: {
+        os << "goto L" << inst.jump.new_ip << ";";
+        break;
+    }
+    case InstType::Exit: {
+        os << "exit(" << (isize)inst.exit.code << ");";
+        break;
+    }
+    }
+}
+
+static void emit_c_function(Slice<Inst> function, isize fp, std::ostream& os) {
+    // Only jump targets get a label, so the C compiler does not warn about
+    // the unused ones
+    Array<bool> labels = {};
+    Arena arena = {};
+    arena_init(&arena, 1024);
+    defer(arena_free(&arena));
+    array_init(&labels, function.size + 1, &arena);
+    for (isize i = 0; i <= function.size; i++) {
+        array_push(&labels, false);
+    }
+    for (isize i = 0; i < function.size; i++) {
+        Inst inst = function[i];
+        if (inst.type == InstType::Jump) {
+            labels[inst.jump.new_ip] = true;
+        } else if (inst.type == InstType::JumpIf) {
+            labels[inst.jump_if.new_ip] = true;
+        } else if (inst.type == InstType::TailCall &&
+                   inst.tail_call.fp == fp) {
+            labels[0] = true;
+        }
+    }
+
+    os << "static void jazz_fn_" << fp << "(uint8_t* bp) {\n";
+    os << "    (void)bp;\n";
+    for (isize i = 0; i < function.size; i++) {
+        if (labels[i]) {
+            os << "L" << i << ":;\n";
+        }
+        os << "    ";
+        emit_c_inst(function[i], fp, os);
+        os << "\n";
+    }
+    if (labels[function.size]) {
+        os << "L" << function.size << ":;\n";
+    }
+    os << "}\n\n";
+}
+
+void emit_c(CodeUnit code, isize stack_size, std::ostream& os) {
+    os << "// Generated by `jazz --emit-c`\n";
+    os << "#define JAZZ_STACK_SIZE " << stack_size << "\n";
+    os << "#define JAZZ_CALL_STACK_CAPACITY " << VM_CALL_STACK_CAPACITY
+       << "\n";
+    os << EMIT_C_PRELUDE << "\n";
+
+    // One more byte, C does not allow empty arrays
+    os << "static const uint8_t jazz_static_data["
+       << code.static_data.size + 1 << "] = {";
+    for (isize i = 0; i < code.static_data.size; i++) {
+        os << (i % 16 == 0 ? "\n    " : " ")
+           << (isize)code.static_data[i] << ",";
+    }
+    os << "\n    0,\n};\n\n";
+
+    for (isize i = 0; i < code.functions.size; i++) {
+        os << "static void jazz_fn_" << i << "(uint8_t* bp);\n";
+    }
+    os << "\n";
+    for (isize i = 0; i < code.functions.size; i++) {
+        emit_c_function(code.functions[i], i, os);
+    }
+
+    os << "int main(void) {\n"
+       << "    jazz_stack = malloc(JAZZ_STACK_SIZE);\n"
+       << "    if (!jazz_stack) {\n"
+       << "        jazz_fail(\"Could not allocate the stack\");\n"
+       << "    }\n"
+       << "    (void)jazz_static_data;\n"
+       << "    jazz_fn_0(jazz_stack);\n"
+       << "    return 0;\n"
+       << "}\n";
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include "core.hpp"
+#include <ostream>
+
+// Lowers a `CodeUnit` to a C translation unit, for ahead-of-time compilation
+// with the system compiler (`cc -O2 out.c`).
+//
+// The generated program keeps the VM's memory model: one stack of
+// `stack_size` bytes, every function gets BP as its only parameter and reads
+// its operands at the same offsets the VM does, and the static data is a byte
+// array. Every instruction becomes a statement (a `goto` for jumps), the
+// operators come from `BIN_OPERANDS` and `UNARY_OPERANDS` like in the VM, so
+// the semantics are the same. The builtins are re-implemented in C, the stack
+// capacity and the call depth are checked the same as in the VM. A tail call to
+// the function itself is a `goto`, other tail calls rely on the C compiler.
+//
+// Operands in the `Heap` mode are not supported.
+void emit_c(CodeUnit code, isize stack_size, std::ostream& os);
@@ -0,0 +1,430 @@
+#include "fold.hpp"
+#include "ast.hpp"
+#include "compiler.hpp"
+#include "core.hpp"
+#include "tokenizer.hpp"
+#include <climits>
+#include <string>
+
+struct FoldContext {
+    Arena* arena;
+    // Declarations that are assigned to somewhere, their value can change
+    HashMap<AstNode*, bool> assigned;
+    // The top level declarations, and whether their value is folded already.
+    // They can be used before they are declared.
+    HashMap<AstNode*, bool> top_level;
+};
+
+static void fold_collect_assigned(FoldContext* ctx, AstNode* node) {
+    if (!node) {
+        return;
+    }
+
+    switch (node->kind) {
+    case AstNodeKind::Literal:
+    case AstNodeKind::Identifier:
+    case AstNodeKind::Continue:
+    case AstNodeKind::Parameter: {
+        break;
+    }
+    case AstNodeKind::Binary: {
+        fold_collect_assigned(ctx, node->as_binary()->left);
+        fold_collect_assigned(ctx, node->as_binary()->right);
+        break;
+    }
+    case AstNodeKind::Unary: {
+        fold_collect_assigned(ctx, node->as_unary()->operand);
+        break;
+    }
+    case AstNodeKind::Call: {
+        AstNodeCall* call = node->as_call();
+        for (isize i = 0; i < call->arguments.size; i++) {
+            fold_collect_assigned(ctx, call->arguments[i]);
+        }
+        break;
+    }
+    case AstNodeKind::If: {
+        AstNodeIf* if_node = node->as_if();
+        fold_collect_assigned(ctx, if_node->condition);
+        fold_collect_assigned(ctx, if_node->then_branch);
+        fold_collect_assigned(ctx, if_node->else_branch);
+        break;
+    }
+    case AstNodeKind::For: {
+        AstNodeFor* for_node = node->as_for();
+        fold_collect_assigned(ctx, for_node->init);
+        fold_collect_assigned(ctx, for_node->condition);
+        fold_collect_assigned(ctx, for_node->update);
+        fold_collect_assigned(ctx, for_node->then_branch);
+        fold_collect_assigned(ctx, for_node->else_branch);
+        break;
+    }
+    case AstNodeKind::Break: {
+        fold_collect_assigned(ctx, node->as_break()->value);
+        break;
+    }
+    case AstNodeKind::Return: {
+        fold_collect_assigned(ctx, node->as_return()->value);
+        break;
+    }
+    case AstNodeKind::Block: {
+        AstNodeBlock* block = node->as_block();
+        for (isize i = 0; i < block->statements.size; i++) {
+            fold_collect_assigned(ctx, block->statements[i]);
+        }
+        break;
+    }
+    case AstNodeKind::Function: {
+        fold_collect_assigned(ctx, node->as_function()->body);
+        break;
+    }
+    case AstNodeKind::Declaration: {
+        fold_collect_assigned(ctx, node->as_declaration()->value);
+        break;
+    }
+    case AstNodeKind::Assignment: {
+        AstNodeAssignment* assign = node->as_assignment();
+        if (assign->name->kind == AstNodeKind::Identifier) {
+            hash_map_insert_or_set(&ctx->assigned,
+                                   assign->name->as_identifier()->def, true);
+        }
+        fold_collect_assigned(ctx, assign->value);
+        break;
+    }
+    }
+}
+
+static bool fold_int_value(AstNode* node, i64* value) {
+    if (node->kind != AstNodeKind::Literal ||
+        node->as_literal()->literal_kind != AstLiteralKind::Integer) {
+        return false;
+    }
+    *value = string_parse_to_i64(node->as_literal()->token.source);
+    return true;
+}
+
+static bool fold_bool_value(AstNode* node, bool* value) {
+    if (node->kind != AstNodeKind::Literal ||
+        node->as_literal()->literal_kind != AstLiteralKind::Bool) {
+        return false;
+    }
+    *value = string_parse_to_bool(node->as_literal()->token.source);
+    return true;
+}
+
+// The compiler reads the literals from their source, which
+// `string_parse_to_i64` only accepts up to INT_MAX. Larger results are left to
+// be computed at runtime.
+static bool fold_int_fits(i64 value) {
+    return value >= -(i64)INT_MAX && value <= (i64)INT_MAX;
+}
+
+// The literal takes the place of `replaced`, and keeps its type
+static AstNode* fold_int_literal(AstNode* replaced, Token token, i64 value,
+                                 Arena* arena) {
+    token.kind = TokenKind::Integer;
+    token.source = string_from_cstr_alloc(std::to_string(value).c_str(), arena);
+    AstNodeLiteral* literal =
+        AstNodeLiteral::make(token, AstLiteralKind::Integer, arena);
+    literal->type_set = replaced->type_set;
+    return literal;
+}
+
+static AstNode* fold_bool_literal(AstNode* replaced, Token token, bool value,
+                                  Arena* arena) {
+    token.kind = TokenKind::Bool;
+    token.source = string_from_cstr(value ? "true" : "false");
+    AstNodeLiteral* literal =
+        AstNodeLiteral::make(token, AstLiteralKind::Bool, arena);
+    literal->type_set = replaced->type_set;
+    return literal;
+}
+
+static bool fold_is_propagated(FoldContext* ctx, AstNodeDeclaration* decl) {
+    if (decl->value->kind != AstNodeKind::Literal ||
+        hash_map_get_ptr(&ctx->assigned, (AstNode*)decl)) {
+        return false;
+    }
+    AstLiteralKind kind = decl->value->as_literal()->literal_kind;
+    return kind == AstLiteralKind::Integer || kind == AstLiteralKind::Bool;
+}
+
+static AstNode* fold_expression(FoldContext* ctx, AstNode* expression);
+
+static void fold_top_level(FoldContext* ctx, AstNodeDeclaration* decl) {
+    bool* folded = hash_map_get_ptr(&ctx->top_level, (AstNode*)decl);
+    if (*folded || decl->value->kind == AstNodeKind::Function) {
+        return;
+    }
+    // Set first, a cycle stops here
+    *folded = true;
+    decl->value = fold_expression(ctx, decl->value);
+}
+
+static AstNode* fold_binary(FoldContext* ctx, AstNodeBinary* binary) {
+    binary->left = fold_expression(ctx, binary->left);
+    binary->right = fold_expression(ctx, binary->right);
+
+    bool left_bool = false;
+    bool right_bool = false;
+    if (fold_bool_value(binary->left, &left_bool)) {
+        // The right side only runs if the left one does not decide
+        if (binary->op == TokenKind::LogicalAnd) {
+            return left_bool ? binary->right : binary->left;
+        }
+        if (binary->op == TokenKind::LogicalOr) {
+            return left_bool ? binary->left : binary->right;
+        }
+        if (!fold_bool_value(binary->right, &right_bool)) {
+            return binary;
+        }
+        switch (binary->op) {
+        case TokenKind::Equal:
+            return fold_bool_literal(binary, binary->token,
+                                     left_bool == right_bool, ctx->arena);
+        case TokenKind::NotEqual:
+            return fold_bool_literal(binary, binary->token,
+                                     left_bool != right_bool, ctx->arena);
+        default:
+            return binary;
+        }
+    }
+
+    i64 left = 0;
+    i64 right = 0;
+    if (!fold_int_value(binary->left, &left) ||
+        !fold_int_value(binary->right, &right)) {
+        return binary;
+    }
+
+    // Wraps around, the same as the VM
+    u64 left_bits = left;
+    u64 right_bits = right;
+    i64 result = 0;
+    switch (binary->op) {
+    case TokenKind::Plus: {
+        result = (i64)(left_bits + right_bits);
+        break;
+    }
+    case TokenKind::Minus: {
+        result = (i64)(left_bits - right_bits);
+        break;
+    }
+    case TokenKind::Asterisk: {
+        result = (i64)(left_bits * right_bits);
+        break;
+    }
+    case TokenKind::Slash: {
+        // Left to fail at runtime, as it would without folding
+        if (right == 0) {
+            return binary;
+        }
+        result = left / right;
+        break;
+    }
+    case TokenKind::BinaryAnd: {
+        result = left & right;
+        break;
+    }
+    case TokenKind::BinaryOr: {
+        result = left | right;
+        break;
+    }
+    case TokenKind::Equal:
+        return fold_bool_literal(binary, binary->token, left == right,
+                                 ctx->arena);
+    case TokenKind::NotEqual:
+        return fold_bool_literal(binary, binary->token, left != right,
+                                 ctx->arena);
+    case TokenKind::LessThan:
+        return fold_bool_literal(binary, binary->token, left < right,
+                                 ctx->arena);
+    case TokenKind::LessEqual:
+        return fold_bool_literal(binary, binary->token, left <= right,
+                                 ctx->arena);
+    case TokenKind::GreaterThan:
+        return fold_bool_literal(binary, binary->token, left > right,
+                                 ctx->arena);
+    case TokenKind::GreaterEqual:
+        return fold_bool_literal(binary, binary->token, left >= right,
+                                 ctx->arena);
+    default: {
+        return binary;
+    }
+    }
+
+    if (!fold_int_fits(result)) {
+        return binary;
+    }
+    return fold_int_literal(binary, binary->token, result, ctx->arena);
+}
+
+static AstNode* fold_unary(FoldContext* ctx, AstNodeUnary* unary) {
+    unary->operand = fold_expression(ctx, unary->operand);
+
+    i64 int_value = 0;
+    bool bool_value = false;
+    switch (unary->op) {
+    case TokenKind::Plus: {
+        return unary->operand;
+    }
+    case TokenKind::Minus: {
+        // Every literal that fits negates into one that fits
+        if (fold_int_value(unary->operand, &int_value)) {
+            return fold_int_literal(unary, unary->token, -int_value,
+                                    ctx->arena);
+        }
+        return unary;
+    }
+    case TokenKind::Bang: {
+        if (fold_bool_value(unary->operand, &bool_value)) {
+            return fold_bool_literal(unary, unary->token, !bool_value,
+                                     ctx->arena);
+        }
+        return unary;
+    }
+    default: {
+        return unary;
+    }
+    }
+}
+
+// Returns the node that replaces the expression, it may be the same one
+static AstNode* fold_expression(FoldContext* ctx, AstNode* expression) {
+    switch (expression->kind) {
+    case AstNodeKind::Identifier: {
+        AstNodeIdentifier* ident = expression->as_identifier();
+        if (ident->def->kind != AstNodeKind::Declaration) {
+            return ident;
+        }
+        AstNodeDeclaration* decl = ident->def->as_declaration();
+        if (hash_map_get_ptr(&ctx->top_level, ident->def)) {
+            fold_top_level(ctx, decl);
+        }
+        if (!fold_is_propagated(ctx, decl)) {
+            return ident;
+        }
+        AstNodeLiteral* value = decl->value->as_literal();
+        AstNodeLiteral* literal =
+            AstNodeLiteral::make(value->token, value->literal_kind, ctx->arena);
+        literal->type_set = ident->type_set;
+        return literal;
+    }
+    case AstNodeKind::Binary: {
+        return fold_binary(ctx, expression->as_binary());
+    }
+    case AstNodeKind::Unary: {
+        return fold_unary(ctx, expression->as_unary());
+    }
+    case AstNodeKind::Call: {
+        AstNodeCall* call = expression->as_call();
+        for (isize i = 0; i < call->arguments.size; i++) {
+            call->arguments[i] = fold_expression(ctx, call->arguments[i]);
+        }
+        return call;
+    }
+    default: {
+        return expression;
+    }
+    }
+}
+
+static void fold_block(FoldContext* ctx, AstNodeBlock* block);
+
+// Returns the node that replaces the statement, nullptr if it is removed
+static AstNode* fold_statement(FoldContext* ctx, AstNode* statement) {
+    switch (statement->kind) {
+    case AstNodeKind::Declaration: {
+        AstNodeDeclaration* decl = statement->as_declaration();
+        decl->value = fold_expression(ctx, decl->value);
+        // Every use is replaced by the value
+        if (fold_is_propagated(ctx, decl)) {
+            return nullptr;
+        }
+        return decl;
+    }
+    case AstNodeKind::Assignment: {
+        AstNodeAssignment* assign = statement->as_assignment();
+        assign->value = fold_expression(ctx, assign->value);
+        return assign;
+    }
+    case AstNodeKind::Call: {
+        return fold_expression(ctx, statement);
+    }
+    case AstNodeKind::Return: {
+        AstNodeReturn* ret = statement->as_return();
+        if (ret->value) {
+            ret->value = fold_expression(ctx, ret->value);
+        }
+        return ret;
+    }
+    case AstNodeKind::Block: {
+        fold_block(ctx, statement->as_block());
+        return statement;
+    }
+    case AstNodeKind::If: {
+        AstNodeIf* if_node = statement->as_if();
+        if_node->condition = fold_expression(ctx, if_node->condition);
+
+        bool condition = false;
+        if (fold_bool_value(if_node->condition, &condition)) {
+            AstNode* branch =
+                condition ? if_node->then_branch : if_node->else_branch;
+            return branch ? fold_statement(ctx, branch) : nullptr;
+        }
+
+        fold_block(ctx, if_node->then_branch->as_block());
+        if (if_node->else_branch) {
+            fold_block(ctx, if_node->else_branch->as_block());
+        }
+        return if_node;
+    }
+    case AstNodeKind::For: {
+        AstNodeFor* for_node = statement->as_for();
+        // The loop needs its `init`, even if it is not used anymore
+        fold_statement(ctx, for_node->init);
+        for_node->condition = fold_expression(ctx, for_node->condition);
+        fold_statement(ctx, for_node->update);
+        fold_block(ctx, for_node->then_branch);
+        if (for_node->else_branch) {
+            fold_block(ctx, for_node->else_branch);
+        }
+        return for_node;
+    }
+    default: {
+        return statement;
+    }
+    }
+}
+
+static void fold_block(FoldContext* ctx, AstNodeBlock* block) {
+    isize kept = 0;
+    for (isize i = 0; i < block->statements.size; i++) {
+        AstNode* statement = fold_statement(ctx, block->statements[i]);
+        if (statement) {
+            block->statements[kept] = statement;
+            kept++;
+        }
+    }
+    block->statements.size = kept;
+}
+
+void fold_constants(Ast* ast, Arena* arena) {
+    FoldContext ctx = {};
+    ctx.arena = arena;
+    hash_map_init(&ctx.assigned, 16, arena);
+    hash_map_init(&ctx.top_level, ast->declarations.size, arena);
+
+    for (isize i = 0; i < ast->declarations.size; i++) {
+        hash_map_insert_or_set(&ctx.top_level, ast->declarations[i], false);
+        fold_collect_assigned(&ctx, ast->declarations[i]);
+    }
+
+    for (isize i = 0; i < ast->declarations.size; i++) {
+        AstNodeDeclaration* decl = ast->declarations[i]->as_declaration();
+        fold_top_level(&ctx, decl);
+        if (decl->value->kind == AstNodeKind::Function) {
+            fold_block(&ctx, decl->value->as_function()->body);
+        }
+    }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "ast.hpp"
+#include "core.hpp"
+
+// Constant folding on the analysed tree, `ast_compile_to_bytecode` runs it
+// when optimizing.
+//
+// Integer and bool expressions of literals are replaced by their value.
+// Declarations with a literal value which are never assigned to are replaced
+// by the literal wherever they are used, the top level ones as well as the
+// local ones, and the local declaration itself is removed. An `if` on a
+// constant condition is replaced by the branch that would run.
+void fold_constants(Ast* ast, Arena* arena);
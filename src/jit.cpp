@@ -0,0 +1,878 @@
+#include "jit.hpp"
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "vm.hpp"
+#include <cstddef>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+
+#include <sys/mman.h>
+
+enum JitReg : u8 {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+    R15 = 15,
+};
+
+// The condition codes of `jcc` and `setcc`, flipping the lowest bit negates
+// the condition
+enum JitCond : u8 {
+    COND_AE = 0x3,
+    COND_E = 0x4,
+    COND_NE = 0x5,
+    COND_A = 0x7,
+    COND_L = 0xc,
+    COND_GE = 0xd,
+    COND_LE = 0xe,
+    COND_G = 0xf,
+};
+
+const JitReg JIT_BP = RBX;
+const JitReg JIT_VM = R12;
+const JitReg JIT_STATIC_DATA = R13;
+const JitReg JIT_STACK = R15;
+
+const i32 VM_STACK_SIZE_OFFSET = offsetof(VM, stack) + offsetof(Stack, size);
+const i32 VM_STACK_CAPACITY_OFFSET =
+    offsetof(VM, stack) + offsetof(Stack, capacity);
+const i32 VM_STACK_DATA_OFFSET = offsetof(VM, stack) + offsetof(Stack, data);
+const i32 VM_CALLS_SIZE_OFFSET =
+    offsetof(VM, calls) + offsetof(CallStack, size);
+const i32 VM_CALLS_CAPACITY_OFFSET =
+    offsetof(VM, calls) + offsetof(CallStack, capacity);
+const i32 VM_STATIC_DATA_OFFSET = offsetof(VM, code) +
+                                  offsetof(CodeUnit, static_data) +
+                                  offsetof(Slice<u8>, data);
+
+// A rel32 at `at`, to be filled in once `target` (an instruction, a function
+// or a stub, depending on the list it is in) has its address
+struct JitPatch {
+    isize at;
+    isize target;
+};
+
+// A memory operand [base + disp] or an immediate
+struct JitOperand {
+    bool immediate;
+    JitReg base;
+    i32 disp;
+    i64 value;
+};
+
+struct JitContext {
+    CodeUnit code;
+    Array<u8> out;
+    // Calls to other functions, `target` is the function index
+    Array<JitPatch> calls;
+
+    // The current function
+    Slice<isize> inst_offsets;
+    Slice<bool> jump_targets;
+    // `target` is the instruction index
+    Array<JitPatch> jumps;
+    Array<JitPatch> stack_overflows;
+    Array<JitPatch> call_overflows;
+};
+
+// ------------------
+// Encoding
+// ------------------
+
+static void emit8(JitContext* ctx, u8 value) { array_push(&ctx->out, value); }
+
+static void emit32(JitContext* ctx, i32 value) {
+    for (isize i = 0; i < 4; i++) {
+        emit8(ctx, (u8)(value >> (8 * i)));
+    }
+}
+
+static void emit64(JitContext* ctx, u64 value) {
+    for (isize i = 0; i < 8; i++) {
+        emit8(ctx, (u8)(value >> (8 * i)));
+    }
+}
+
+static void emit_rex(JitContext* ctx, bool wide, u8 reg, u8 rm) {
+    u8 rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) {
+        emit8(ctx, rex);
+    }
+}
+
+// Opcodes above 0xff are two bytes, 0x0f and the low byte
+static void emit_opcode(JitContext* ctx, u16 opcode) {
+    if (opcode > 0xff) {
+        emit8(ctx, opcode >> 8);
+    }
+    emit8(ctx, (u8)opcode);
+}
+
+// `opcode reg, [base + disp]`, `reg` is the opcode extension for the single
+// operand instructions
+static void emit_mem(JitContext* ctx, bool wide, u16 opcode, u8 reg,
+                     JitReg base, i32 disp) {
+    emit_rex(ctx, wide, reg, base);
+    emit_opcode(ctx, opcode);
+    u8 mod = 2;
+    if (disp == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    }
+    emit8(ctx, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit8(ctx, 0x24);
+    }
+    if (mod == 1) {
+        emit8(ctx, (u8)disp);
+    } else if (mod == 2) {
+        emit32(ctx, disp);
+    }
+}
+
+// `opcode rm, reg` with both in registers
+static void emit_reg(JitContext* ctx, bool wide, u16 opcode, u8 reg, u8 rm) {
+    emit_rex(ctx, wide, reg, rm);
+    emit_opcode(ctx, opcode);
+    emit8(ctx, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Leaves room for a rel32 and records where it is
+static void emit_rel32(JitContext* ctx, Array<JitPatch>* patches,
+                       isize target) {
+    array_push(patches, JitPatch{ctx->out.size, target});
+    emit32(ctx, 0);
+}
+
+static void patch_rel32(JitContext* ctx, isize at, isize target_offset) {
+    i32 rel = (i32)(target_offset - (at + 4));
+    memcpy(ctx->out.data + at, &rel, sizeof(rel));
+}
+
+static void emit_jcc(JitContext* ctx, JitCond cond, Array<JitPatch>* patches,
+                     isize target) {
+    emit8(ctx, 0x0f);
+    emit8(ctx, 0x80 | cond);
+    emit_rel32(ctx, patches, target);
+}
+
+static void emit_jmp(JitContext* ctx, Array<JitPatch>* patches,
+                     isize target) {
+    emit8(ctx, 0xe9);
+    emit_rel32(ctx, patches, target);
+}
+
+// mov reg, imm64 / call reg
+static void emit_call_abs(JitContext* ctx, const void* function) {
+    emit_rex(ctx, true, 0, RAX);
+    emit8(ctx, 0xb8 | RAX);
+    emit64(ctx, (u64)function);
+    emit8(ctx, 0xff);
+    emit8(ctx, 0xd0 | RAX);
+}
+
+static void emit_setcc(JitContext* ctx, JitCond cond) {
+    emit8(ctx, 0x0f);
+    emit8(ctx, 0x90 | cond);
+    emit8(ctx, 0xc0 | RAX);
+}
+
+// ------------------
+// Templates
+// ------------------
+
+static bool jit_fits(isize value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool jit_mode_supported(MemPtr ptr, bool write) {
+    switch (ptr.type) {
+    case MemPtrType::StackRel:
+        return jit_fits(ptr.mem_offset);
+    case MemPtrType::StaticData:
+    case MemPtrType::Immediate:
+        return !write && jit_fits(ptr.mem_offset);
+    default:
+        return false;
+    }
+}
+
+static JitOperand jit_operand(MemPtr ptr) {
+    switch (ptr.type) {
+    case MemPtrType::StackRel:
+        return JitOperand{false, JIT_BP, (i32)ptr.mem_offset, 0};
+    case MemPtrType::StaticData:
+        return JitOperand{false, JIT_STATIC_DATA, (i32)ptr.mem_offset, 0};
+    case MemPtrType::Immediate:
+        return JitOperand{true, RAX, 0, ptr.mem_offset};
+    default:
+        core_assert(false);
+        return {};
+    }
+}
+
+// mov reg, operand (64 bits)
+static void emit_load(JitContext* ctx, JitReg reg, JitOperand op) {
+    if (op.immediate) {
+        emit_reg(ctx, true, 0xc7, 0, reg);
+        emit32(ctx, (i32)op.value);
+    } else {
+        emit_mem(ctx, true, 0x8b, reg, op.base, op.disp);
+    }
+}
+
+// movzx eax, byte operand
+static void emit_load_byte(JitContext* ctx, JitOperand op) {
+    if (op.immediate) {
+        emit8(ctx, 0xb8 | RAX);
+        emit32(ctx, (i32)(op.value & 0xff));
+    } else {
+        emit_mem(ctx, false, 0x0fb6, RAX, op.base, op.disp);
+    }
+}
+
+// The classic two operand ALU instructions, `mem_opcode` is `op reg, r/m` and
+// `imm_ext` the extension of `op r/m, imm32`
+static void emit_alu(JitContext* ctx, u8 mem_opcode, u8 imm_ext,
+                     JitOperand right) {
+    if (right.immediate) {
+        emit_reg(ctx, true, 0x81, imm_ext, RAX);
+        emit32(ctx, (i32)right.value);
+    } else {
+        emit_mem(ctx, true, mem_opcode, RAX, right.base, right.disp);
+    }
+}
+
+// Copies `size` bytes of the memory operand to `dest` through rax, in the
+// largest chunks possible
+static void emit_copy(JitContext* ctx, JitOperand dest, JitOperand src,
+                      isize size) {
+    isize offset = 0;
+    while (offset < size) {
+        isize chunk = 8;
+        while (chunk > size - offset) {
+            chunk /= 2;
+        }
+        i32 src_disp = src.disp + (i32)offset;
+        i32 dest_disp = dest.disp + (i32)offset;
+        bool wide = chunk == 8;
+        u8 load = chunk == 1 ? 0x8a : 0x8b;
+        u8 store = chunk == 1 ? 0x88 : 0x89;
+        if (chunk == 2) {
+            emit8(ctx, 0x66);
+        }
+        emit_mem(ctx, wide, load, RAX, src.base, src_disp);
+        if (chunk == 2) {
+            emit8(ctx, 0x66);
+        }
+        emit_mem(ctx, wide, store, RAX, dest.base, dest_disp);
+        offset += chunk;
+    }
+}
+
+// Stores the low `size` bytes of the immediate to `dest`
+static void emit_store_immediate(JitContext* ctx, JitOperand dest, i64 value,
+                                 isize size) {
+    switch (size) {
+    case 8:
+    case 4:
+        emit_mem(ctx, size == 8, 0xc7, 0, dest.base, dest.disp);
+        emit32(ctx, (i32)value);
+        return;
+    case 2:
+        emit8(ctx, 0x66);
+        emit_mem(ctx, false, 0xc7, 0, dest.base, dest.disp);
+        emit8(ctx, (u8)value);
+        emit8(ctx, (u8)(value >> 8));
+        return;
+    default:
+        for (isize i = 0; i < size; i++) {
+            emit_mem(ctx, false, 0xc6, 0, dest.base, dest.disp + (i32)i);
+            emit8(ctx, (u8)(value >> (8 * i)));
+        }
+        return;
+    }
+}
+
+static bool jit_bin_operand_supported(BinOperand op) {
+    switch (op) {
+    case BinOperand::Float_Add:
+    case BinOperand::Float_Sub:
+    case BinOperand::Float_Mul:
+    case BinOperand::Float_Div:
+    case BinOperand::Float_Equal:
+    case BinOperand::Float_NotEqual:
+    case BinOperand::Float_LessThan:
+    case BinOperand::Float_LessEqual:
+    case BinOperand::Float_GreaterThan:
+    case BinOperand::Float_GreaterEqual:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// The condition a comparison sets, false if `op` is not one
+static bool jit_compare_cond(BinOperand op, JitCond* cond) {
+    switch (op) {
+    case BinOperand::Int_Equal:
+    case BinOperand::Bool_Equal:
+        *cond = COND_E;
+        return true;
+    case BinOperand::Int_NotEqual:
+    case BinOperand::Bool_NotEqual:
+        *cond = COND_NE;
+        return true;
+    case BinOperand::Int_LessThan:
+        *cond = COND_L;
+        return true;
+    case BinOperand::Int_LessEqual:
+        *cond = COND_LE;
+        return true;
+    case BinOperand::Int_GreaterThan:
+        *cond = COND_G;
+        return true;
+    case BinOperand::Int_GreaterEqual:
+        *cond = COND_GE;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool jit_inst_supported(Inst inst) {
+    switch (inst.type) {
+    case InstType::BinaryOp:
+        return jit_bin_operand_supported(inst.binary.op) &&
+               jit_mode_supported(inst.binary.dest, true) &&
+               jit_mode_supported(inst.binary.left, false) &&
+               jit_mode_supported(inst.binary.right, false);
+    case InstType::UnaryOp:
+        return inst.unary.op != UnaryOperand::Float_Negation &&
+               jit_mode_supported(inst.unary.dest, true) &&
+               jit_mode_supported(inst.unary.operand, false);
+    case InstType::Mov:
+        return jit_mode_supported(inst.mov.dest, true) &&
+               jit_mode_supported(inst.mov.src, false) &&
+               jit_fits(inst.mov.size);
+    case InstType::JumpIf:
+        return jit_mode_supported(inst.jump_if.condition, false);
+    case InstType::PushStack:
+        return jit_fits(inst.push_stack.size);
+    case InstType::PopStack:
+        return jit_fits(inst.pop_stack.size);
+    case InstType::Call:
+    case InstType::TailCall:
+    case InstType::CallBuiltin:
+    case InstType::Return:
+    case InstType::Jump:
+        return true;
+    case InstType::Exit:
+        return false;
+    }
+    return false;
+}
+
+// Sets the flags for a comparison, or computes the result into rax
+static void emit_binary_op(JitContext* ctx, InstBinaryOp binary) {
+    JitOperand left = jit_operand(binary.left);
+    JitOperand right = jit_operand(binary.right);
+    JitOperand dest = jit_operand(binary.dest);
+
+    JitCond cond;
+    if (jit_compare_cond(binary.op, &cond)) {
+        if (binary.op == BinOperand::Bool_Equal ||
+            binary.op == BinOperand::Bool_NotEqual) {
+            emit_load_byte(ctx, left);
+            if (right.immediate) {
+                emit8(ctx, 0x3c);
+                emit8(ctx, (u8)right.value);
+            } else {
+                emit_mem(ctx, false, 0x3a, RAX, right.base, right.disp);
+            }
+        } else {
+            emit_load(ctx, RAX, left);
+            emit_alu(ctx, 0x3b, 7, right);
+        }
+        emit_setcc(ctx, cond);
+        emit_mem(ctx, false, 0x88, RAX, dest.base, dest.disp);
+        return;
+    }
+
+    emit_load(ctx, RAX, left);
+    switch (binary.op) {
+    case BinOperand::Int_Add:
+        emit_alu(ctx, 0x03, 0, right);
+        break;
+    case BinOperand::Int_Sub:
+        emit_alu(ctx, 0x2b, 5, right);
+        break;
+    case BinOperand::Int_BinaryAnd:
+        emit_alu(ctx, 0x23, 4, right);
+        break;
+    case BinOperand::Int_BinaryOr:
+        emit_alu(ctx, 0x0b, 1, right);
+        break;
+    case BinOperand::Int_Mul: {
+        if (right.immediate) {
+            emit_reg(ctx, true, 0x69, RAX, RAX);
+            emit32(ctx, (i32)right.value);
+        } else {
+            emit_mem(ctx, true, 0x0faf, RAX, right.base, right.disp);
+        }
+        break;
+    }
+    case BinOperand::Int_Div: {
+        // cqo, idiv
+        if (right.immediate) {
+            emit_load(ctx, RCX, right);
+            emit_rex(ctx, true, 0, 0);
+            emit8(ctx, 0x99);
+            emit_reg(ctx, true, 0xf7, 7, RCX);
+        } else {
+            emit_rex(ctx, true, 0, 0);
+            emit8(ctx, 0x99);
+            emit_mem(ctx, true, 0xf7, 7, right.base, right.disp);
+        }
+        break;
+    }
+    default:
+        core_assert(false);
+        break;
+    }
+    emit_mem(ctx, true, 0x89, RAX, dest.base, dest.disp);
+}
+
+static void emit_unary_op(JitContext* ctx, InstUnaryOp unary) {
+    JitOperand operand = jit_operand(unary.operand);
+    JitOperand dest = jit_operand(unary.dest);
+    switch (unary.op) {
+    case UnaryOperand::Int_Negation: {
+        emit_load(ctx, RAX, operand);
+        emit_reg(ctx, true, 0xf7, 3, RAX);
+        emit_mem(ctx, true, 0x89, RAX, dest.base, dest.disp);
+        break;
+    }
+    case UnaryOperand::Bool_Not: {
+        // test al, al / sete al
+        emit_load_byte(ctx, operand);
+        emit8(ctx, 0x84);
+        emit8(ctx, 0xc0);
+        emit_setcc(ctx, COND_E);
+        emit_mem(ctx, false, 0x88, RAX, dest.base, dest.disp);
+        break;
+    }
+    case UnaryOperand::Float_Negation: {
+        core_assert(false);
+        break;
+    }
+    }
+}
+
+static void emit_push_stack(JitContext* ctx, isize size) {
+    // rax = the old size, rcx = the new one
+    emit_mem(ctx, true, 0x8b, RAX, JIT_VM, VM_STACK_SIZE_OFFSET);
+    emit_reg(ctx, true, 0x89, RAX, RCX);
+    emit_reg(ctx, true, 0x81, 0, RCX);
+    emit32(ctx, (i32)size);
+    emit_mem(ctx, true, 0x3b, RCX, JIT_VM, VM_STACK_CAPACITY_OFFSET);
+    emit_jcc(ctx, COND_A, &ctx->stack_overflows, 0);
+    emit_mem(ctx, true, 0x89, RCX, JIT_VM, VM_STACK_SIZE_OFFSET);
+
+    // The pushed memory is zeroed, same as `stack_push_size`
+    emit_reg(ctx, true, 0x89, RAX, RDI);
+    emit_reg(ctx, true, 0x01, JIT_STACK, RDI);
+    if (size > 64) {
+        // mov rcx, size / xor eax, eax / rep stosb
+        emit_reg(ctx, true, 0xc7, 0, RCX);
+        emit32(ctx, (i32)size);
+        emit_reg(ctx, false, 0x31, RAX, RAX);
+        emit8(ctx, 0xf3);
+        emit8(ctx, 0xaa);
+        return;
+    }
+
+    emit_reg(ctx, false, 0x31, RDX, RDX);
+    isize offset = 0;
+    while (offset < size) {
+        isize chunk = 8;
+        while (chunk > size - offset) {
+            chunk /= 2;
+        }
+        if (chunk == 2) {
+            emit8(ctx, 0x66);
+        }
+        emit_mem(ctx, chunk == 8, chunk == 1 ? 0x88 : 0x89, RDX, RDI,
+                 (i32)offset);
+        offset += chunk;
+    }
+}
+
+static void emit_call(JitContext* ctx, isize callee) {
+    // The same depth limit as the interpreter's call stack
+    emit_mem(ctx, true, 0x8b, RAX, JIT_VM, VM_CALLS_SIZE_OFFSET);
+    emit_mem(ctx, true, 0x3b, RAX, JIT_VM, VM_CALLS_CAPACITY_OFFSET);
+    emit_jcc(ctx, COND_AE, &ctx->call_overflows, 0);
+    emit_mem(ctx, true, 0xff, 0, JIT_VM, VM_CALLS_SIZE_OFFSET);
+
+    // push rbx / rbx = stack + size / call / pop rbx
+    emit8(ctx, 0x50 | JIT_BP);
+    emit_mem(ctx, true, 0x8b, JIT_BP, JIT_VM, VM_STACK_SIZE_OFFSET);
+    emit_reg(ctx, true, 0x01, JIT_STACK, JIT_BP);
+    emit8(ctx, 0xe8);
+    emit_rel32(ctx, &ctx->calls, callee);
+    emit8(ctx, 0x58 | JIT_BP);
+
+    emit_mem(ctx, true, 0xff, 1, JIT_VM, VM_CALLS_SIZE_OFFSET);
+}
+
+static void emit_call_builtin(JitContext* ctx, void* builtin) {
+    // Every native function runs with the stack 8 bytes off the alignment
+    // C functions expect (the return address)
+    emit_reg(ctx, true, 0x83, 5, RSP);
+    emit8(ctx, 8);
+    emit_reg(ctx, true, 0x89, JIT_VM, RDI);
+    emit_call_abs(ctx, builtin);
+    emit_reg(ctx, true, 0x83, 0, RSP);
+    emit8(ctx, 8);
+}
+
+[[noreturn]] static void jit_stack_overflow() {
+    core_assert_msg(false, "Stack overflow");
+    abort();
+}
+
+[[noreturn]] static void jit_call_stack_overflow() {
+    core_assert_msg(false, "Call stack overflow");
+    abort();
+}
+
+// Aligns the stack and calls the function, which does not return
+static void emit_abort_stub(JitContext* ctx, void (*function)()) {
+    emit_reg(ctx, true, 0x83, 4, RSP);
+    emit8(ctx, 0xf0);
+    emit_call_abs(ctx, (const void*)function);
+    emit8(ctx, 0x0f);
+    emit8(ctx, 0x0b);
+}
+
+static void jit_compile_function(JitContext* ctx, Slice<Inst> function,
+                                 Arena* arena) {
+    ctx->inst_offsets = {arena_alloc<isize>(arena, function.size + 1),
+                         function.size + 1};
+    ctx->jump_targets = {arena_alloc<bool>(arena, function.size + 1),
+                         function.size + 1};
+    ctx->jumps.size = 0;
+    ctx->stack_overflows.size = 0;
+    ctx->call_overflows.size = 0;
+
+    for (isize i = 0; i < function.size; i++) {
+        Inst inst = function[i];
+        if (inst.type == InstType::Jump) {
+            ctx->jump_targets[inst.jump.new_ip] = true;
+        } else if (inst.type == InstType::JumpIf) {
+            ctx->jump_targets[inst.jump_if.new_ip] = true;
+        }
+    }
+
+    // The comparison whose result is still in the flags, a `JumpIf` right
+    // after it branches on them instead of reading the result back
+    bool flags_live = false;
+    MemPtr flags_dest = {};
+    JitCond flags_cond = COND_E;
+
+    for (isize i = 0; i < function.size; i++) {
+        ctx->inst_offsets[i] = ctx->out.size;
+        Inst inst = function[i];
+        bool flags_were_live = flags_live && !ctx->jump_targets[i];
+        flags_live = false;
+
+        switch (inst.type) {
+        case InstType::BinaryOp: {
+            emit_binary_op(ctx, inst.binary);
+            flags_live = jit_compare_cond(inst.binary.op, &flags_cond);
+            flags_dest = inst.binary.dest;
+            break;
+        }
+        case InstType::UnaryOp: {
+            emit_unary_op(ctx, inst.unary);
+            break;
+        }
+        case InstType::Mov: {
+            JitOperand dest = jit_operand(inst.mov.dest);
+            JitOperand src = jit_operand(inst.mov.src);
+            if (src.immediate) {
+                emit_store_immediate(ctx, dest, src.value, inst.mov.size);
+            } else {
+                emit_copy(ctx, dest, src, inst.mov.size);
+            }
+            break;
+        }
+        case InstType::PushStack: {
+            emit_push_stack(ctx, inst.push_stack.size);
+            break;
+        }
+        case InstType::PopStack: {
+            emit_mem(ctx, true, 0x81, 5, JIT_VM, VM_STACK_SIZE_OFFSET);
+            emit32(ctx, (i32)inst.pop_stack.size);
+            break;
+        }
+        case InstType::JumpIf: {
+            MemPtr condition = inst.jump_if.condition;
+            bool expected = inst.jump_if.expected;
+            if (flags_were_live && condition.type == flags_dest.type &&
+                condition.mem_offset == flags_dest.mem_offset) {
+                JitCond cond =
+                    expected ? flags_cond : (JitCond)(flags_cond ^ 1);
+                emit_jcc(ctx, cond, &ctx->jumps, inst.jump_if.new_ip);
+            } else if (condition.type == MemPtrType::Immediate) {
+                if ((condition.mem_offset != 0) == expected) {
+                    emit_jmp(ctx, &ctx->jumps, inst.jump_if.new_ip);
+                }
+            } else {
+                // cmp byte [condition], 0
+                JitOperand operand = jit_operand(condition);
+                emit_mem(ctx, false, 0x80, 7, operand.base, operand.disp);
+                emit8(ctx, 0);
+                emit_jcc(ctx, expected ? COND_NE : COND_E, &ctx->jumps,
+                         inst.jump_if.new_ip);
+            }
+            break;
+        }
+        case InstType::Jump: {
+            emit_jmp(ctx, &ctx->jumps, inst.jump.new_ip);
+            break;
+        }
+        case InstType::Call: {
+            emit_call(ctx, inst.call.fp);
+            break;
+        }
+        case InstType::TailCall: {
+            // BP stays, the callee returns straight to our caller
+            emit8(ctx, 0xe9);
+            emit_rel32(ctx, &ctx->calls, inst.tail_call.fp);
+            break;
+        }
+        case InstType::CallBuiltin: {
+            emit_call_builtin(ctx, inst.call_builtin.builtin);
+            break;
+        }
+        case InstType::Return: {
+            emit8(ctx, 0xc3);
+            break;
+        }
+        case InstType::Exit: {
+            core_assert(false);
+            break;
+        }
+        }
+    }
+    ctx->inst_offsets[function.size] = ctx->out.size;
+
+    isize stack_overflow = ctx->out.size;
+    emit_abort_stub(ctx, jit_stack_overflow);
+    isize call_overflow = ctx->out.size;
+    emit_abort_stub(ctx, jit_call_stack_overflow);
+
+    for (isize i = 0; i < ctx->jumps.size; i++) {
+        JitPatch patch = ctx->jumps[i];
+        patch_rel32(ctx, patch.at, ctx->inst_offsets[patch.target]);
+    }
+    for (isize i = 0; i < ctx->stack_overflows.size; i++) {
+        patch_rel32(ctx, ctx->stack_overflows[i].at, stack_overflow);
+    }
+    for (isize i = 0; i < ctx->call_overflows.size; i++) {
+        patch_rel32(ctx, ctx->call_overflows[i].at, call_overflow);
+    }
+}
+
+// void enter(VM* vm, u8* frame, JitFunction function), sets up the fixed
+// registers and calls the function
+static void jit_compile_enter(JitContext* ctx) {
+    // push rbx, r12, r13, r15, 4 pushes and the return address keep the stack
+    // 8 bytes off
+    emit8(ctx, 0x50 | RBX);
+    emit8(ctx, 0x41);
+    emit8(ctx, 0x50 | (R12 & 7));
+    emit8(ctx, 0x41);
+    emit8(ctx, 0x50 | (R13 & 7));
+    emit8(ctx, 0x41);
+    emit8(ctx, 0x50 | (R15 & 7));
+    emit_reg(ctx, true, 0x83, 5, RSP);
+    emit8(ctx, 8);
+
+    emit_reg(ctx, true, 0x89, RDI, JIT_VM);
+    emit_reg(ctx, true, 0x89, RSI, JIT_BP);
+    emit_mem(ctx, true, 0x8b, JIT_STACK, JIT_VM, VM_STACK_DATA_OFFSET);
+    emit_mem(ctx, true, 0x8b, JIT_STATIC_DATA, JIT_VM, VM_STATIC_DATA_OFFSET);
+    // call rdx
+    emit8(ctx, 0xff);
+    emit8(ctx, 0xd0 | RDX);
+
+    emit_reg(ctx, true, 0x83, 0, RSP);
+    emit8(ctx, 8);
+    emit8(ctx, 0x41);
+    emit8(ctx, 0x58 | (R15 & 7));
+    emit8(ctx, 0x41);
+    emit8(ctx, 0x58 | (R13 & 7));
+    emit8(ctx, 0x41);
+    emit8(ctx, 0x58 | (R12 & 7));
+    emit8(ctx, 0x58 | RBX);
+    emit8(ctx, 0xc3);
+}
+
+static isize jit_callee(Inst inst) {
+    if (inst.type == InstType::Call) {
+        return inst.call.fp;
+    }
+    if (inst.type == InstType::TailCall) {
+        return inst.tail_call.fp;
+    }
+    return -1;
+}
+
+// Which of the `wanted` functions and the functions they call can be
+// compiled, a function calling one that can not stays interpreted too
+static Slice<bool> jit_select_functions(CodeUnit code, Slice<bool> wanted,
+                                        Arena* arena) {
+    Slice<bool> compiled = {arena_alloc<bool>(arena, code.functions.size),
+                            code.functions.size};
+    Array<isize> worklist = {};
+    array_init(&worklist, code.functions.size, arena);
+    for (isize i = 0; i < code.functions.size; i++) {
+        if (wanted[i]) {
+            compiled[i] = true;
+            array_push(&worklist, i);
+        }
+    }
+    while (worklist.size > 0) {
+        Slice<Inst> function = code.functions[worklist[worklist.size - 1]];
+        worklist.size--;
+        for (isize j = 0; j < function.size; j++) {
+            isize callee = jit_callee(function[j]);
+            if (callee >= 0 && !compiled[callee]) {
+                compiled[callee] = true;
+                array_push(&worklist, callee);
+            }
+        }
+    }
+
+    for (isize i = 0; i < code.functions.size; i++) {
+        Slice<Inst> function = code.functions[i];
+        compiled[i] = compiled[i] && function.size > 0;
+        for (isize j = 0; j < function.size && compiled[i]; j++) {
+            compiled[i] = jit_inst_supported(function[j]);
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (isize i = 0; i < code.functions.size; i++) {
+            Slice<Inst> function = code.functions[i];
+            for (isize j = 0; j < function.size && compiled[i]; j++) {
+                isize callee = jit_callee(function[j]);
+                if (callee >= 0 && !compiled[callee]) {
+                    compiled[i] = false;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return compiled;
+}
+
+JitCode* jit_compile(CodeUnit code, Arena* arena) {
+    Slice<bool> wanted = {arena_alloc<bool>(arena, code.functions.size),
+                          code.functions.size};
+    for (isize i = 0; i < wanted.size; i++) {
+        wanted[i] = true;
+    }
+    return jit_compile(code, wanted, arena);
+}
+
+JitCode* jit_compile(CodeUnit code, Slice<bool> wanted, Arena* arena) {
+    Slice<bool> compiled = jit_select_functions(code, wanted, arena);
+    bool any = false;
+    for (isize i = 0; i < compiled.size; i++) {
+        any = any || compiled[i];
+    }
+    if (!any) {
+        return nullptr;
+    }
+
+    JitContext ctx = {};
+    ctx.code = code;
+    array_init(&ctx.out, 4096, arena);
+    array_init(&ctx.calls, 64, arena);
+    array_init(&ctx.jumps, 64, arena);
+    array_init(&ctx.stack_overflows, 16, arena);
+    array_init(&ctx.call_overflows, 16, arena);
+
+    jit_compile_enter(&ctx);
+
+    Slice<isize> offsets = {arena_alloc<isize>(arena, code.functions.size),
+                            code.functions.size};
+    for (isize i = 0; i < code.functions.size; i++) {
+        offsets[i] = -1;
+        if (compiled[i]) {
+            offsets[i] = ctx.out.size;
+            jit_compile_function(&ctx, code.functions[i], arena);
+        }
+    }
+    for (isize i = 0; i < ctx.calls.size; i++) {
+        JitPatch patch = ctx.calls[i];
+        core_assert(offsets[patch.target] >= 0);
+        patch_rel32(&ctx, patch.at, offsets[patch.target]);
+    }
+
+    // W^X: the code is written while the memory is only writable, and then
+    // it is made only executable
+    u8* memory = (u8*)mmap(nullptr, ctx.out.size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    memcpy(memory, ctx.out.data, ctx.out.size);
+    if (mprotect(memory, ctx.out.size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, ctx.out.size);
+        return nullptr;
+    }
+
+    JitCode* jit = arena_alloc<JitCode>(arena);
+    jit->code = memory;
+    jit->size = ctx.out.size;
+    jit->functions = {arena_alloc<JitFunction>(arena, code.functions.size),
+                      code.functions.size};
+    for (isize i = 0; i < code.functions.size; i++) {
+        jit->functions[i] =
+            offsets[i] >= 0 ? (JitFunction)(memory + offsets[i]) : nullptr;
+    }
+    jit->enter = (void (*)(VM*, u8*, JitFunction))memory;
+    return jit;
+}
+
+void jit_free(JitCode* jit) {
+    if (jit) {
+        munmap(jit->code, jit->size);
+        jit->code = nullptr;
+    }
+}
+
+#else
+
+JitCode* jit_compile(CodeUnit, Arena*) { return nullptr; }
+
+JitCode* jit_compile(CodeUnit, Slice<bool>, Arena*) { return nullptr; }
+
+void jit_free(JitCode*) {}
+
+#endif
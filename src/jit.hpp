@@ -0,0 +1,57 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include "core.hpp"
+
+struct VM;
+
+// A baseline template JIT for x86-64. Every instruction of a function is
+// translated on its own, by a fixed template for its opcode and the addressing
+// modes of its operands. The frame stays in the VM's stack exactly as the
+// interpreter lays it out, so the native code and the interpreter agree on
+// where every value is.
+//
+// While running native code these registers are fixed:
+//   rbx - BP, the address of the current frame in the VM's stack
+//   r12 - the VM
+//   r13 - the static data
+//   r15 - the start of the VM's stack
+// `Call` pushes rbx and calls the callee's native code directly, `Return` is
+// `ret`. Builtins are called with the VM, like from the interpreter.
+//
+// A function is only compiled if all of its instructions have a template
+// (floats, `StackAbs` and `Heap` operands and `Exit` do not) and all the
+// functions it calls are compiled too. Everything else stays interpreted, the
+// interpreter enters the native code on `Call`. Only verified code is compiled,
+// the templates do no checks besides the stack capacity and the call depth.
+
+// The native entry of every function, null if it stays interpreted
+typedef void (*JitFunction)();
+
+struct JitCode {
+    // The executable memory, mapped read-only once the code is written
+    u8* code;
+    isize size;
+    Slice<JitFunction> functions;
+    // Switches from C++ to the native code of `function`, with BP at `frame`
+    void (*enter)(VM* vm, u8* frame, JitFunction function);
+};
+
+// Compiles every function it can. Returns null if native code is not supported
+// on this platform or no function could be compiled.
+JitCode* jit_compile(CodeUnit code, Arena* arena);
+
+// Same, but only the `wanted` functions (indexed like `code.functions`) and
+// the functions they call are compiled
+JitCode* jit_compile(CodeUnit code, Slice<bool> wanted, Arena* arena);
+
+// Unmaps the executable memory
+void jit_free(JitCode* jit);
+
+inline bool jit_supported() {
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,532 @@
+#include "linker.hpp"
+#include "bytecode.hpp"
+#include "core.hpp"
+
+#define LINK_BINARY_FIRST(op, type, result, symbol)                            \
+    case BinOperand::op: {                                                     \
+        first = LinkedOp::BinaryOp_##op##_StackRel_StackRel;                   \
+        break;                                                                 \
+    }
+
+#define LINK_UNARY_FIRST(op, type, result, symbol)                             \
+    case UnaryOperand::op: {                                                   \
+        first = LinkedOp::UnaryOp_##op##_StackRel;                             \
+        break;                                                                 \
+    }
+
+LinkedOp link_select_op(Inst inst) {
+    switch (inst.type) {
+    case InstType::BinaryOp: {
+        isize left = link_mode_index(inst.binary.left.type);
+        isize right = link_mode_index(inst.binary.right.type);
+        if (inst.binary.dest.type != MemPtrType::StackRel || left < 0 ||
+            right < 0) {
+            return LinkedOp::BinaryOp;
+        }
+
+        // The variants of one operator follow each other, in the order of
+        // `LINK_FOR_EACH_MODE_PAIR`
+        LinkedOp first = LinkedOp::BinaryOp;
+        switch (inst.binary.op) { BIN_OPERANDS(LINK_BINARY_FIRST) }
+        return (LinkedOp)((isize)first + left * LINK_MODE_COUNT + right);
+    }
+    case InstType::UnaryOp: {
+        isize operand = link_mode_index(inst.unary.operand.type);
+        if (inst.unary.dest.type != MemPtrType::StackRel || operand < 0) {
+            return LinkedOp::UnaryOp;
+        }
+
+        LinkedOp first = LinkedOp::UnaryOp;
+        switch (inst.unary.op) { UNARY_OPERANDS(LINK_UNARY_FIRST) }
+        return (LinkedOp)((isize)first + operand);
+    }
+    case InstType::Mov: {
+        isize src = link_mode_index(inst.mov.src.type);
+        if (inst.mov.dest.type != MemPtrType::StackRel || src < 0) {
+            return LinkedOp::Mov;
+        }
+
+        isize size = -1;
+        if (inst.mov.size == 1) {
+            size = 0;
+        } else if (inst.mov.size == 8) {
+            size = 1;
+        } else {
+            return LinkedOp::Mov;
+        }
+
+        return (LinkedOp)((isize)LinkedOp::Mov_StackRel_1 + src * 2 + size);
+    }
+    case InstType::JumpIf: {
+        isize condition = link_mode_index(inst.jump_if.condition.type);
+        if (condition < 0) {
+            return LinkedOp::JumpIf;
+        }
+
+        isize expected = inst.jump_if.expected ? 0 : 1;
+        return (LinkedOp)((isize)LinkedOp::JumpIf_StackRel_True +
+                          condition * 2 + expected);
+    }
+    case InstType::Call:
+        return LinkedOp::Call;
+    case InstType::TailCall:
+        return LinkedOp::TailCall;
+    case InstType::CallBuiltin:
+        return LinkedOp::CallBuiltin;
+    case InstType::Return:
+        return LinkedOp::Return;
+    case InstType::PushStack:
+        return LinkedOp::PushStack;
+    case InstType::PopStack:
+        return LinkedOp::PopStack;
+    case InstType::Jump:
+        return LinkedOp::Jump;
+    case InstType::Exit:
+        return LinkedOp::Exit;
+    }
+
+    core_assert(false);
+    return LinkedOp::Count;
+}
+
+#define LINK_FUSE(first_op, second_op)                                         \
+    if (first == LinkedOp::first_op && second == LinkedOp::second_op) {        \
+        return LinkedOp::Fused_##first_op##_##second_op;                       \
+    }
+
+LinkedOp link_fuse_ops(LinkedOp first, LinkedOp second) {
+    SUPERINSTRUCTIONS(LINK_FUSE)
+    return LinkedOp::Count;
+}
+
+static void link_write_u8(u8** cursor, u8 value) {
+    **cursor = value;
+    *cursor += sizeof(u8);
+}
+
+static void link_write_u16(u8** cursor, u16 value) {
+    memcpy(*cursor, &value, sizeof(u16));
+    *cursor += sizeof(u16);
+}
+
+static void link_write_u32(u8** cursor, u32 value) {
+    memcpy(*cursor, &value, sizeof(u32));
+    *cursor += sizeof(u32);
+}
+
+static void link_write_u64(u8** cursor, u64 value) {
+    memcpy(*cursor, &value, sizeof(u64));
+    *cursor += sizeof(u64);
+}
+
+static void link_write_mem_ptr(u8** cursor, MemPtr ptr) {
+    link_write_u32(cursor, link_encode_mem_ptr(ptr));
+}
+
+static void link_write_u32_checked(u8** cursor, isize value) {
+    core_assert_msg(value >= 0 && value <= UINT32_MAX,
+                    "%ld does not fit into an operand", value);
+    link_write_u32(cursor, (u32)value);
+}
+
+// `offsets` maps instruction indices of the function to byte offsets
+static void link_encode_inst(u8** cursor, Inst inst, const isize* offsets) {
+    LinkedOp op = link_select_op(inst);
+    bool generic = LINKED_OP_INFO[(isize)op].implied < 0;
+    link_write_u16(cursor, (u16)op);
+
+    switch (inst.type) {
+    case InstType::BinaryOp: {
+        link_write_mem_ptr(cursor, inst.binary.dest);
+        link_write_mem_ptr(cursor, inst.binary.left);
+        link_write_mem_ptr(cursor, inst.binary.right);
+        if (generic) {
+            link_write_u8(cursor, (u8)inst.binary.op);
+        }
+        break;
+    }
+    case InstType::UnaryOp: {
+        link_write_mem_ptr(cursor, inst.unary.dest);
+        link_write_mem_ptr(cursor, inst.unary.operand);
+        if (generic) {
+            link_write_u8(cursor, (u8)inst.unary.op);
+        }
+        break;
+    }
+    case InstType::Call: {
+        link_write_u32_checked(cursor, inst.call.fp);
+        break;
+    }
+    case InstType::TailCall: {
+        link_write_u32_checked(cursor, inst.tail_call.fp);
+        break;
+    }
+    case InstType::CallBuiltin: {
+        link_write_u64(cursor, (u64)inst.call_builtin.builtin);
+        break;
+    }
+    case InstType::Return:
+        break;
+    case InstType::Mov: {
+        link_write_mem_ptr(cursor, inst.mov.dest);
+        link_write_mem_ptr(cursor, inst.mov.src);
+        if (generic) {
+            link_write_u32_checked(cursor, inst.mov.size);
+        }
+        break;
+    }
+    case InstType::PushStack: {
+        link_write_u32_checked(cursor, inst.push_stack.size);
+        break;
+    }
+    case InstType::PopStack: {
+        link_write_u32_checked(cursor, inst.pop_stack.size);
+        break;
+    }
+    case InstType::JumpIf: {
+        link_write_mem_ptr(cursor, inst.jump_if.condition);
+        link_write_u32_checked(cursor, offsets[inst.jump_if.new_ip]);
+        if (generic) {
+            link_write_u8(cursor, inst.jump_if.expected);
+        }
+        break;
+    }
+    case InstType::Jump: {
+        link_write_u32_checked(cursor, offsets[inst.jump.new_ip]);
+        break;
+    }
+    case InstType::Exit: {
+        link_write_u8(cursor, inst.exit.code);
+        break;
+    }
+    }
+}
+
+// Selects the instructions of the function and fuses them into
+// superinstructions. `fused[i]` is the superinstruction starting with the i-th
+// instruction, or `LinkedOp::Count`.
+static void link_select_function(Slice<Inst> function, bool fuse, LinkedOp* ops,
+                                 LinkedOp* fused, bool* jump_targets) {
+    for (isize i = 0; i < function.size; i++) {
+        ops[i] = link_select_op(function[i]);
+        fused[i] = LinkedOp::Count;
+        jump_targets[i] = false;
+    }
+
+    if (!fuse) {
+        return;
+    }
+
+    for (isize i = 0; i < function.size; i++) {
+        Inst inst = function[i];
+        if (inst.type == InstType::JumpIf && inst.jump_if.new_ip >= 0 &&
+            inst.jump_if.new_ip < function.size) {
+            jump_targets[inst.jump_if.new_ip] = true;
+        } else if (inst.type == InstType::Jump && inst.jump.new_ip >= 0 &&
+                   inst.jump.new_ip < function.size) {
+            jump_targets[inst.jump.new_ip] = true;
+        }
+    }
+
+    // The second instruction can not be a jump target, as it is not an
+    // instruction of its own anymore
+    for (isize i = 0; i + 1 < function.size; i++) {
+        if (jump_targets[i + 1]) {
+            continue;
+        }
+
+        fused[i] = link_fuse_ops(ops[i], ops[i + 1]);
+        if (fused[i] != LinkedOp::Count) {
+            i += 1;
+        }
+    }
+}
+
+LinkedUnit link_code_unit(CodeUnit code, Arena* arena, bool fuse) {
+    isize max_function_size = 0;
+    for (isize i = 0; i < code.functions.size; i++) {
+        if (code.functions[i].size > max_function_size) {
+            max_function_size = code.functions[i].size;
+        }
+    }
+
+    LinkedOp* ops = arena_alloc<LinkedOp>(arena, max_function_size);
+    LinkedOp* fused = arena_alloc<LinkedOp>(arena, max_function_size);
+    bool* jump_targets = arena_alloc<bool>(arena, max_function_size);
+    // Jumps may target one past the last instruction
+    isize* offsets = arena_alloc<isize>(arena, max_function_size + 1);
+
+    // The sizes of all the instructions are known up front, so the whole unit
+    // is encoded into a single allocation
+    isize code_size = 0;
+    for (isize i = 0; i < code.functions.size; i++) {
+        Slice<Inst> function = code.functions[i];
+        link_select_function(function, fuse, ops, fused, jump_targets);
+        for (isize j = 0; j < function.size; j++) {
+            if (fused[j] != LinkedOp::Count) {
+                code_size += LINK_OPCODE_SIZE;
+            }
+            code_size += linked_op_size(ops[j]);
+        }
+    }
+
+    u8* data = arena_alloc<u8>(arena, code_size);
+    Slice<u8>* functions = arena_alloc<Slice<u8>>(arena, code.functions.size);
+
+    u8* cursor = data;
+    for (isize i = 0; i < code.functions.size; i++) {
+        Slice<Inst> function = code.functions[i];
+        link_select_function(function, fuse, ops, fused, jump_targets);
+
+        // A jump to the first instruction of a superinstruction lands on the
+        // superinstruction
+        isize offset = 0;
+        for (isize j = 0; j < function.size; j++) {
+            offsets[j] = offset;
+            if (fused[j] != LinkedOp::Count) {
+                offset += LINK_OPCODE_SIZE;
+            }
+            offset += linked_op_size(ops[j]);
+        }
+        offsets[function.size] = offset;
+
+        u8* start = cursor;
+        for (isize j = 0; j < function.size; j++) {
+            Inst inst = function[j];
+            if (inst.type == InstType::JumpIf) {
+                core_assert(inst.jump_if.new_ip >= 0 &&
+                            inst.jump_if.new_ip <= function.size);
+            } else if (inst.type == InstType::Jump) {
+                core_assert(inst.jump.new_ip >= 0 &&
+                            inst.jump.new_ip <= function.size);
+            }
+
+            if (fused[j] != LinkedOp::Count) {
+                link_write_u16(&cursor, (u16)fused[j]);
+            }
+            link_encode_inst(&cursor, inst, offsets);
+            core_assert(cursor - start == offsets[j + 1]);
+        }
+
+        functions[i] = Slice<u8>{start, offset};
+    }
+
+    core_assert(cursor - data == code_size);
+    return LinkedUnit{
+        .code = Slice<u8>{data, code_size},
+        .functions = Slice<Slice<u8>>{functions, code.functions.size},
+    };
+}
+
+LinkedDecoded link_decode(Slice<u8> function, isize offset) {
+    core_assert_msg(offset >= 0 && offset + LINK_OPCODE_SIZE <= function.size,
+                    "Offset %ld out of bounds", offset);
+
+    const u8* inst = function.data + offset;
+    LinkedOp op = link_read_op(inst);
+    core_assert_msg(op < LinkedOp::Count, "Invalid opcode %d", (int)op);
+
+    LinkedOpInfo info = LINKED_OP_INFO[(isize)op];
+    core_assert_msg(offset + info.size <= function.size,
+                    "Instruction at %ld is truncated", offset);
+
+    if (linked_op_is_fused(op)) {
+        LinkedDecoded first = link_decode(function, offset + LINK_OPCODE_SIZE);
+        core_assert(first.op == info.first);
+        first.op = op;
+        first.size += LINK_OPCODE_SIZE;
+        return first;
+    }
+
+    bool generic = info.implied < 0;
+    // The fields only generic instructions have, after the operands
+    const u8* extra = inst + info.size - (generic ? sizeof(u8) : 0);
+
+    Inst result;
+    switch (info.type) {
+    case InstType::BinaryOp: {
+        BinOperand bin_op = generic ? (BinOperand)link_read<u8>(extra)
+                                    : (BinOperand)info.implied;
+        result = inst_binary_op(bin_op,
+                                link_decode_mem_ptr(link_operand(inst, 0)),
+                                link_decode_mem_ptr(link_operand(inst, 1)),
+                                link_decode_mem_ptr(link_operand(inst, 2)));
+        break;
+    }
+    case InstType::UnaryOp: {
+        UnaryOperand unary_op = generic ? (UnaryOperand)link_read<u8>(extra)
+                                        : (UnaryOperand)info.implied;
+        result = inst_unary_op(unary_op,
+                               link_decode_mem_ptr(link_operand(inst, 0)),
+                               link_decode_mem_ptr(link_operand(inst, 1)));
+        break;
+    }
+    case InstType::Call: {
+        result = inst_call(link_operand(inst, 0));
+        break;
+    }
+    case InstType::TailCall: {
+        result = inst_tail_call(link_operand(inst, 0));
+        break;
+    }
+    case InstType::CallBuiltin: {
+        result = inst_call_builtin(
+            (void*)link_read<u64>(inst + LINK_OPCODE_SIZE));
+        break;
+    }
+    case InstType::Return: {
+        result = inst_return();
+        break;
+    }
+    case InstType::Mov: {
+        isize size = generic ? link_operand(inst, 2) : info.implied;
+        result = inst_mov(link_decode_mem_ptr(link_operand(inst, 0)),
+                          link_decode_mem_ptr(link_operand(inst, 1)), size);
+        break;
+    }
+    case InstType::PushStack: {
+        result = inst_push_stack(link_operand(inst, 0));
+        break;
+    }
+    case InstType::PopStack: {
+        result = inst_pop_stack(link_operand(inst, 0));
+        break;
+    }
+    case InstType::JumpIf: {
+        bool expected = generic ? link_read<u8>(extra) != 0 : info.implied;
+        MemPtr condition = link_decode_mem_ptr(link_operand(inst, 0));
+        isize new_ip = link_operand(inst, 1);
+        result = expected ? inst_jump_if(condition, new_ip)
+                          : inst_jump_if_not(condition, new_ip);
+        break;
+    }
+    case InstType::Jump: {
+        result = inst_jump(link_operand(inst, 0));
+        break;
+    }
+    case InstType::Exit: {
+        result = inst_exit(link_read<u8>(inst + LINK_OPCODE_SIZE));
+        break;
+    }
+    }
+
+    return LinkedDecoded{.op = op, .inst = result, .size = info.size};
+}
+
+CodeUnit link_unlink_unit(LinkedUnit linked, Slice<u8> static_data,
+                          Arena* arena) {
+    Slice<Slice<Inst>> functions = {
+        arena_alloc<Slice<Inst>>(arena, linked.functions.size),
+        linked.functions.size};
+    for (isize i = 0; i < linked.functions.size; i++) {
+        Slice<u8> function = linked.functions[i];
+        // Jumps may target one past the last instruction
+        isize* indices = arena_alloc<isize>(arena, function.size + 1);
+        Array<Inst> instructions = {};
+        array_init(&instructions, function.size / LINK_OPCODE_SIZE, arena);
+
+        isize offset = 0;
+        while (offset < function.size) {
+            LinkedDecoded decoded = link_decode(function, offset);
+            indices[offset] = instructions.size;
+            array_push(&instructions, decoded.inst);
+            offset += decoded.size;
+        }
+        indices[function.size] = instructions.size;
+
+        for (isize j = 0; j < instructions.size; j++) {
+            Inst* inst = &instructions[j];
+            if (inst->type == InstType::Jump) {
+                inst->jump.new_ip = indices[inst->jump.new_ip];
+            } else if (inst->type == InstType::JumpIf) {
+                inst->jump_if.new_ip = indices[inst->jump_if.new_ip];
+            }
+        }
+        functions[i] = array_to_slice(&instructions);
+    }
+    return CodeUnit{.static_data = static_data, .functions = functions};
+}
+
+void link_disassemble(Slice<u8> function, std::ostream& os) {
+    isize offset = 0;
+    while (offset < function.size) {
+        LinkedDecoded decoded = link_decode(function, offset);
+        Inst inst = decoded.inst;
+        // Only print what is not already part of the name
+        bool generic = LINKED_OP_INFO[(isize)decoded.op].implied < 0;
+
+        LinkedOpInfo info = LINKED_OP_INFO[(isize)decoded.op];
+        if (linked_op_is_fused(decoded.op)) {
+            // The second instruction is printed on its own line
+            os << offset << ": fused " << info.first;
+            generic = LINKED_OP_INFO[(isize)info.first].implied < 0;
+        } else {
+            os << offset << ": " << decoded.op;
+        }
+        switch (inst.type) {
+        case InstType::BinaryOp: {
+            if (generic) {
+                os << " " << inst.binary.op;
+            }
+            os << " " << inst.binary.dest << " " << inst.binary.left << " "
+               << inst.binary.right;
+            break;
+        }
+        case InstType::UnaryOp: {
+            if (generic) {
+                os << " " << inst.unary.op;
+            }
+            os << " " << inst.unary.dest << " " << inst.unary.operand;
+            break;
+        }
+        case InstType::Call: {
+            os << " " << inst.call.fp;
+            break;
+        }
+        case InstType::TailCall: {
+            os << " " << inst.tail_call.fp;
+            break;
+        }
+        case InstType::CallBuiltin: {
+            os << " " << inst.call_builtin.builtin;
+            break;
+        }
+        case InstType::Return:
+            break;
+        case InstType::Mov: {
+            os << " " << inst.mov.dest << " " << inst.mov.src;
+            if (generic) {
+                os << " " << inst.mov.size;
+            }
+            break;
+        }
+        case InstType::PushStack: {
+            os << " " << inst.push_stack.size;
+            break;
+        }
+        case InstType::PopStack: {
+            os << " " << inst.pop_stack.size;
+            break;
+        }
+        case InstType::JumpIf: {
+            os << " " << inst.jump_if.condition;
+            if (generic) {
+                os << " " << (inst.jump_if.expected ? "true" : "false");
+            }
+            os << " -> " << inst.jump_if.new_ip;
+            break;
+        }
+        case InstType::Jump: {
+            os << " -> " << inst.jump.new_ip;
+            break;
+        }
+        case InstType::Exit: {
+            os << " " << (isize)inst.exit.code;
+            break;
+        }
+        }
+        os << std::endl;
+
+        offset += decoded.size;
+    }
+}
@@ -0,0 +1,381 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "superinstructions.hpp"
+#include <ostream>
+
+// Before a CodeUnit is executed by the VM it is linked. Every instruction is
+// rewritten to a variant specialized on the addressing modes of its operands,
+// so the VM does not have to switch on the `MemPtrType` of each operand.
+// Instructions with operands in any other mode keep their generic variant.
+//
+// The linked instructions are encoded into a compact byte stream:
+// - a 16 bit opcode (`LinkedOp`)
+// - the operands, `MemPtr`s take 32 bits with the addressing mode in the low
+//   `LINK_MODE_BITS` bits (immediates keep their value in place of the
+//   offset), jump targets are 32 bit byte offsets from the start of the
+//   function
+// - generic instructions also carry what the specialized variants encode in
+//   their opcode (the operator, the size of a `Mov`, ...) after the operands
+// All the operands are at the same place for the generic and the specialized
+// variants, see `link_operand`.
+//
+// Pairs of instructions that often execute one after another are fused into
+// superinstructions (see `superinstructions.hpp`), so the VM dispatches once
+// for both. A superinstruction is encoded as its own opcode followed by the two
+// encoded instructions.
+
+// Addressing modes which get specialized variants. The order must match
+// `link_mode_index`. `X` is called as X(extra..., mode).
+#define LINK_FOR_EACH_MODE(X, ...)                                             \
+    X(__VA_ARGS__ __VA_OPT__(, ) StackRel)                                     \
+    X(__VA_ARGS__ __VA_OPT__(, ) StaticData)                                   \
+    X(__VA_ARGS__ __VA_OPT__(, ) Immediate)
+
+// Every pair of the modes above, the left mode changes slowest
+#define LINK_FOR_EACH_MODE_PAIR(X, ...)                                        \
+    X(__VA_ARGS__ __VA_OPT__(, ) StackRel, StackRel)                           \
+    X(__VA_ARGS__ __VA_OPT__(, ) StackRel, StaticData)                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) StackRel, Immediate)                          \
+    X(__VA_ARGS__ __VA_OPT__(, ) StaticData, StackRel)                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) StaticData, StaticData)                       \
+    X(__VA_ARGS__ __VA_OPT__(, ) StaticData, Immediate)                        \
+    X(__VA_ARGS__ __VA_OPT__(, ) Immediate, StackRel)                          \
+    X(__VA_ARGS__ __VA_OPT__(, ) Immediate, StaticData)                        \
+    X(__VA_ARGS__ __VA_OPT__(, ) Immediate, Immediate)
+
+const isize LINK_MODE_COUNT = 3;
+
+// Sizes of `Mov` with a specialized variant
+#define LINK_FOR_EACH_MOV_SIZE(X, ...)                                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) 1)                                            \
+    X(__VA_ARGS__ __VA_OPT__(, ) 8)
+
+#define LINK_FOR_EACH_EXPECTED(X, ...)                                         \
+    X(__VA_ARGS__ __VA_OPT__(, ) True, true)                                   \
+    X(__VA_ARGS__ __VA_OPT__(, ) False, false)
+
+// The table of linked instructions, without the superinstructions. Each family
+// calls its own callback:
+//   GENERIC(name) - the unspecialized instruction, same as `InstType`
+//   BINARY(op, type, result, symbol, left_mode, right_mode) - dest is
+//       StackRel
+//   UNARY(op, type, result, symbol, operand_mode) - dest is StackRel
+//   MOV(src_mode, size) - dest is StackRel
+//   JUMP_IF(condition_mode, expected_name, expected)
+#define LINKED_BASE_OPS(GENERIC, BINARY, UNARY, MOV, JUMP_IF)                  \
+    GENERIC(BinaryOp)                                                          \
+    GENERIC(UnaryOp)                                                           \
+    GENERIC(Call)                                                              \
+    GENERIC(TailCall)                                                          \
+    GENERIC(CallBuiltin)                                                       \
+    GENERIC(Return)                                                            \
+    GENERIC(Mov)                                                               \
+    GENERIC(PushStack)                                                         \
+    GENERIC(PopStack)                                                          \
+    GENERIC(JumpIf)                                                            \
+    GENERIC(Jump)                                                              \
+    GENERIC(Exit)                                                              \
+    BIN_OPERANDS(LINK_FOR_EACH_MODE_PAIR, BINARY)                              \
+    UNARY_OPERANDS(LINK_FOR_EACH_MODE, UNARY)                                  \
+    LINK_FOR_EACH_MODE(LINK_FOR_EACH_MOV_SIZE, MOV)                            \
+    LINK_FOR_EACH_MODE(LINK_FOR_EACH_EXPECTED, JUMP_IF)
+
+// The full table of linked instructions. Everything that needs one entry per
+// linked instruction (the opcodes, `LINKED_OP_INFO`, the VM handlers) is
+// generated from it. The superinstructions call FUSED(first, second).
+#define LINKED_OPS(GENERIC, BINARY, UNARY, MOV, JUMP_IF, FUSED)                \
+    LINKED_BASE_OPS(GENERIC, BINARY, UNARY, MOV, JUMP_IF)                      \
+    SUPERINSTRUCTIONS(FUSED)
+
+#define LINK_GENERIC_NAME(name) name,
+#define LINK_BINARY_NAME(op, type, result, symbol, left, right)                \
+    BinaryOp_##op##_##left##_##right,
+#define LINK_UNARY_NAME(op, type, result, symbol, operand)                     \
+    UnaryOp_##op##_##operand,
+#define LINK_MOV_NAME(src, size) Mov_##src##_##size,
+#define LINK_JUMP_IF_NAME(condition, expected_name, expected)                  \
+    JumpIf_##condition##_##expected_name,
+#define LINK_FUSED_NAME(first, second) Fused_##first##_##second,
+
+enum class LinkedOp : u16 {
+    LINKED_OPS(LINK_GENERIC_NAME, LINK_BINARY_NAME, LINK_UNARY_NAME,
+               LINK_MOV_NAME, LINK_JUMP_IF_NAME, LINK_FUSED_NAME)
+    // Not an instruction, the number of linked instructions
+    Count,
+};
+
+static_assert((isize)LinkedOp::BinaryOp_Int_Add_Immediate_Immediate -
+                  (isize)LinkedOp::BinaryOp_Int_Add_StackRel_StackRel ==
+              LINK_MODE_COUNT * LINK_MODE_COUNT - 1);
+
+#undef LINK_GENERIC_NAME
+#undef LINK_BINARY_NAME
+#undef LINK_UNARY_NAME
+#undef LINK_MOV_NAME
+#undef LINK_JUMP_IF_NAME
+#undef LINK_FUSED_NAME
+
+// ------------------
+// Encoding
+// ------------------
+
+const isize LINK_OPCODE_SIZE = sizeof(u16);
+const isize LINK_OPERAND_SIZE = sizeof(u32);
+const isize LINK_MODE_BITS = 3;
+static_assert((isize)MemPtrType::Immediate < (1 << LINK_MODE_BITS));
+static_assert(MEM_PTR_IMMEDIATE_BITS + LINK_MODE_BITS == 32);
+
+// Encoded size of the generic variant of each instruction
+constexpr isize link_generic_size(InstType type) {
+    switch (type) {
+    case InstType::BinaryOp:
+        return LINK_OPCODE_SIZE + 3 * LINK_OPERAND_SIZE + sizeof(u8);
+    case InstType::UnaryOp:
+        return LINK_OPCODE_SIZE + 2 * LINK_OPERAND_SIZE + sizeof(u8);
+    case InstType::Call:
+    case InstType::TailCall:
+        return LINK_OPCODE_SIZE + LINK_OPERAND_SIZE;
+    case InstType::CallBuiltin:
+        return LINK_OPCODE_SIZE + sizeof(u64);
+    case InstType::Return:
+        return LINK_OPCODE_SIZE;
+    case InstType::Mov:
+        return LINK_OPCODE_SIZE + 3 * LINK_OPERAND_SIZE;
+    case InstType::PushStack:
+    case InstType::PopStack:
+        return LINK_OPCODE_SIZE + LINK_OPERAND_SIZE;
+    case InstType::JumpIf:
+        return LINK_OPCODE_SIZE + 2 * LINK_OPERAND_SIZE + sizeof(u8);
+    case InstType::Jump:
+        return LINK_OPCODE_SIZE + LINK_OPERAND_SIZE;
+    case InstType::Exit:
+        return LINK_OPCODE_SIZE + sizeof(u8);
+    }
+    return 0;
+}
+
+struct LinkedOpInfo {
+    const char* name;
+    InstType type;
+    // Encoded size of the instruction in bytes
+    isize size;
+    // What the specialized variants encode in the opcode: the operator of
+    // `BinaryOp` and `UnaryOp`, the size of `Mov`, the expected value of
+    // `JumpIf`. -1 for the generic instructions.
+    isize implied;
+    // The fused instructions of a superinstruction, `LinkedOp::Count`
+    // otherwise. The type of a superinstruction is the type of `first`.
+    LinkedOp first;
+    LinkedOp second;
+};
+
+#define LINK_GENERIC_INFO(name)                                                \
+    LinkedOpInfo{#name,                                                        \
+                 InstType::name,                                               \
+                 link_generic_size(InstType::name),                            \
+                 -1,                                                           \
+                 LinkedOp::Count,                                              \
+                 LinkedOp::Count},
+#define LINK_BINARY_INFO(op, type, result, symbol, left, right)                \
+    LinkedOpInfo{"BinaryOp_" #op "_" #left "_" #right,                         \
+                 InstType::BinaryOp,                                           \
+                 LINK_OPCODE_SIZE + 3 * LINK_OPERAND_SIZE,                     \
+                 (isize)BinOperand::op,                                        \
+                 LinkedOp::Count,                                              \
+                 LinkedOp::Count},
+#define LINK_UNARY_INFO(op, type, result, symbol, operand)                     \
+    LinkedOpInfo{"UnaryOp_" #op "_" #operand,                                  \
+                 InstType::UnaryOp,                                            \
+                 LINK_OPCODE_SIZE + 2 * LINK_OPERAND_SIZE,                     \
+                 (isize)UnaryOperand::op,                                      \
+                 LinkedOp::Count,                                              \
+                 LinkedOp::Count},
+#define LINK_MOV_INFO(src, size)                                               \
+    LinkedOpInfo{"Mov_" #src "_" #size,                                        \
+                 InstType::Mov,                                                \
+                 LINK_OPCODE_SIZE + 2 * LINK_OPERAND_SIZE,                     \
+                 size,                                                         \
+                 LinkedOp::Count,                                              \
+                 LinkedOp::Count},
+#define LINK_JUMP_IF_INFO(condition, expected_name, expected)                  \
+    LinkedOpInfo{"JumpIf_" #condition "_" #expected_name,                      \
+                 InstType::JumpIf,                                             \
+                 LINK_OPCODE_SIZE + 2 * LINK_OPERAND_SIZE,                     \
+                 expected,                                                     \
+                 LinkedOp::Count,                                              \
+                 LinkedOp::Count},
+
+// The superinstructions are described in terms of the instructions they fuse,
+// so those get a table of their own
+inline constexpr LinkedOpInfo LINKED_BASE_OP_INFO[] = {
+    LINKED_BASE_OPS(LINK_GENERIC_INFO, LINK_BINARY_INFO, LINK_UNARY_INFO,
+                    LINK_MOV_INFO, LINK_JUMP_IF_INFO)};
+
+#define LINK_FUSED_INFO(first, second)                                         \
+    LinkedOpInfo{"Fused_" #first "_" #second,                                  \
+                 LINKED_BASE_OP_INFO[(isize)LinkedOp::first].type,             \
+                 LINK_OPCODE_SIZE +                                            \
+                     LINKED_BASE_OP_INFO[(isize)LinkedOp::first].size +        \
+                     LINKED_BASE_OP_INFO[(isize)LinkedOp::second].size,        \
+                 -1,                                                           \
+                 LinkedOp::first,                                              \
+                 LinkedOp::second},
+
+inline constexpr LinkedOpInfo LINKED_OP_INFO[] = {
+    LINKED_OPS(LINK_GENERIC_INFO, LINK_BINARY_INFO, LINK_UNARY_INFO,
+               LINK_MOV_INFO, LINK_JUMP_IF_INFO, LINK_FUSED_INFO)};
+
+static_assert(sizeof(LINKED_OP_INFO) / sizeof(LINKED_OP_INFO[0]) ==
+              (isize)LinkedOp::Count);
+
+#undef LINK_GENERIC_INFO
+#undef LINK_BINARY_INFO
+#undef LINK_UNARY_INFO
+#undef LINK_MOV_INFO
+#undef LINK_JUMP_IF_INFO
+#undef LINK_FUSED_INFO
+
+constexpr isize linked_op_size(LinkedOp op) {
+    return LINKED_OP_INFO[(isize)op].size;
+}
+
+constexpr bool linked_op_is_fused(LinkedOp op) {
+    return LINKED_OP_INFO[(isize)op].first != LinkedOp::Count;
+}
+
+// Whether the instruction may continue somewhere else than right after it,
+// within the same function
+constexpr bool linked_op_jumps(LinkedOp op) {
+    if (op >= LinkedOp::Count || linked_op_is_fused(op)) {
+        return false;
+    }
+    InstType type = LINKED_OP_INFO[(isize)op].type;
+    return type == InstType::Jump || type == InstType::JumpIf;
+}
+
+// Whether the instruction can be a part of a superinstruction, as `first` if
+// `as_first` is set. The VM runs the fused instructions in the same function,
+// so calls and returns can not be fused. Nothing after an unconditional jump
+// would ever run.
+constexpr bool linked_op_is_fusable(LinkedOp op, bool as_first) {
+    if (op >= LinkedOp::Count || linked_op_is_fused(op)) {
+        return false;
+    }
+
+    switch (LINKED_OP_INFO[(isize)op].type) {
+    case InstType::Call:
+    case InstType::TailCall:
+    case InstType::Return:
+    case InstType::Exit:
+        return false;
+    case InstType::Jump:
+        return !as_first;
+    default:
+        return true;
+    }
+}
+
+#define LINK_ASSERT_FUSABLE(first, second)                                     \
+    static_assert(linked_op_is_fusable(LinkedOp::first, true) &&               \
+                  linked_op_is_fusable(LinkedOp::second, false));
+SUPERINSTRUCTIONS(LINK_ASSERT_FUSABLE)
+#undef LINK_ASSERT_FUSABLE
+
+template <typename T> inline T link_read(const u8* code) {
+    T value;
+    memcpy(&value, code, sizeof(T));
+    return value;
+}
+
+inline LinkedOp link_read_op(const u8* inst) {
+    return (LinkedOp)link_read<u16>(inst);
+}
+
+// Returns the raw value of the `index`-th operand of the instruction
+inline u32 link_operand(const u8* inst, isize index) {
+    return link_read<u32>(inst + LINK_OPCODE_SIZE + index * LINK_OPERAND_SIZE);
+}
+
+inline u32 link_encode_mem_ptr(MemPtr ptr) {
+    core_assert_msg(ptr.mem_offset >= INT32_MIN >> LINK_MODE_BITS &&
+                        ptr.mem_offset <= INT32_MAX >> LINK_MODE_BITS,
+                    "Offset %ld does not fit into an operand", ptr.mem_offset);
+    return ((u32)ptr.mem_offset << LINK_MODE_BITS) | (u32)ptr.type;
+}
+
+// The offset of an encoded `MemPtr`, the mode is known by the caller
+inline isize link_operand_offset(u32 operand) {
+    return (i32)operand >> LINK_MODE_BITS;
+}
+
+inline MemPtr link_decode_mem_ptr(u32 operand) {
+    return MemPtr{
+        .type = (MemPtrType)(operand & ((1 << LINK_MODE_BITS) - 1)),
+        .mem_offset = link_operand_offset(operand),
+    };
+}
+
+// ------------------
+// Linking
+// ------------------
+
+struct LinkedUnit {
+    // The encoded instructions of all the functions, one after another
+    Slice<u8> code;
+    // Points into `code`, same indices as `CodeUnit::functions`
+    Slice<Slice<u8>> functions;
+};
+
+// Returns the index of the mode in `LINK_FOR_EACH_MODE`, or -1 if there are no
+// variants specialized on it
+inline isize link_mode_index(MemPtrType type) {
+    switch (type) {
+    case MemPtrType::StackRel:
+        return 0;
+    case MemPtrType::StaticData:
+        return 1;
+    case MemPtrType::Immediate:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+LinkedOp link_select_op(Inst inst);
+// Returns the superinstruction fusing the two instructions, or
+// `LinkedOp::Count` if there is none
+LinkedOp link_fuse_ops(LinkedOp first, LinkedOp second);
+// `fuse` can be turned off to see the instructions as they are, for example
+// when looking for new superinstructions
+LinkedUnit link_code_unit(CodeUnit code, Arena* arena, bool fuse = true);
+
+struct LinkedDecoded {
+    LinkedOp op;
+    // Jump targets are byte offsets from the start of the function. For a
+    // superinstruction this is the first fused instruction, the second one
+    // follows as a regular instruction.
+    Inst inst;
+    isize size;
+};
+
+LinkedDecoded link_decode(Slice<u8> function, isize offset);
+
+// The reverse of `link_code_unit`, decodes every function back to
+// instructions (superinstructions to the instructions they fuse) with jump
+// targets as instruction indices again
+CodeUnit link_unlink_unit(LinkedUnit linked, Slice<u8> static_data,
+                          Arena* arena);
+
+void link_disassemble(Slice<u8> function, std::ostream& os);
+
+inline const char* linked_op_name(LinkedOp op) {
+    core_assert(op < LinkedOp::Count);
+    return LINKED_OP_INFO[(isize)op].name;
+}
+
+inline std::ostream& operator<<(std::ostream& os, LinkedOp op) {
+    os << linked_op_name(op);
+    return os;
+}
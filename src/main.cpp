@@ -1,19 +1,27 @@
+#include "bytecode_file.hpp"
+#include "compile_cache.hpp"
 #include "compiler.hpp"
 #include "core.hpp"
+#include "emit_c.hpp"
+#include "optimizer.hpp"
 #include "parser.hpp"
+#include "runner.hpp"
 #include "sema.hpp"
+#include "snapshot.hpp"
 #include "vm.hpp"
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 
 String read_file(Arena* arena, const char* file_name) {
     FILE* file = fopen(file_name, "r");
-    defer(fclose(file));
-
     if (!file) {
         std::cerr << "Error: Could not open file " << file_name << std::endl;
         return {};
     }
+    defer(fclose(file));
 
     if (fseek(file, 0, SEEK_END) != 0) {
         std::cerr << "Error: Could not seek file " << file_name << std::endl;
@@ -38,57 +46,327 @@ String read_file(Arena* arena, const char* file_name) {
     return String{.data = buffer, .size = file_size};
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <source_file.jazz>" << std::endl;
-        return 1;
-    }
-
-    Arena arena;
-    arena_init(&arena, 16 * 1024);
-    defer(arena_free(&arena));
-    defer({
-        std::cerr << "Memory used: " << arena_get_size(&arena) << " bytes"
-                  << std::endl;
-    });
-
-    const char* source_file = argv[1];
-    String source_code = read_file(&arena, source_file);
+const bool OPTIMIZE = true;
+const CompilerBackend BACKEND = CompilerBackend::Register;
 
+// Parses, checks and compiles the source. Returns false (and prints the
+// errors) if the source could not be compiled.
+bool compile_source(String source_code, Arena* arena, CodeUnit* code_unit) {
     Tokenizer tokenizer;
     tokenizer_init(&tokenizer, source_code);
-    AstFile* file = ast_file_make(tokenizer, 16, &arena);
-    ast_file_parse(file, &arena);
+    AstFile* file = ast_file_make(tokenizer, 16, arena);
+    ast_file_parse(file, arena);
 
     if (file->errors.size > 0) {
         TokenLocator locator;
-        token_locator_init(&locator, source_code, &arena);
+        token_locator_init(&locator, source_code, arena);
 
         for (isize i = 0; i < file->errors.size; i++) {
             ParseError error = file->errors[i];
             // std::cerr << error.token.kind << ": " << error.token.source
             //           << std::endl;
             Array<String> parts =
-                parse_error_pretty_print(&error, &locator, &arena);
+                parse_error_pretty_print(&error, &locator, arena);
 
             for (isize j = 0; j < parts.size; j++) {
                 std::cout << parts[j];
             }
             std::cout << std::endl;
         }
+        return false;
+    }
+
+    semantic_analysis(file, arena);
+
+    *code_unit = ast_compile_to_bytecode(&file->ast, OPTIMIZE, arena, BACKEND);
+    return true;
+}
+
+bool is_bytecode_file(const char* file_name) {
+    isize size = strlen(file_name);
+    return size >= 6 && strcmp(file_name + size - 6, ".jazzc") == 0;
+}
+
+// A `.jazzc` file is mapped and run in place, anything else is compiled. With
+// a `cache_dir` the compiled program is looked up in the cache first, and
+// stored there on a miss. `bytecode` has to stay loaded for as long as the
+// image is used.
+bool load_image(const char* file_name, bool jit, const char* cache_dir,
+                Arena* arena, VmImage* image, BytecodeFile* bytecode) {
+    *bytecode = {};
+    const char* error = nullptr;
+    if (is_bytecode_file(file_name)) {
+        if (!bytecode_file_load(file_name, bytecode, arena, &error) ||
+            !bytecode_file_image(bytecode, jit, arena, image, &error)) {
+            std::cerr << "Error: " << file_name << ": " << error << std::endl;
+            bytecode_file_unload(bytecode);
+            return false;
+        }
+        return true;
+    }
+
+    String source_code = read_file(arena, file_name);
+    if (!source_code.data) {
+        return false;
+    }
+    u64 key = 0;
+    if (cache_dir) {
+        key = compile_cache_key(source_code, OPTIMIZE, BACKEND);
+        if (compile_cache_lookup(cache_dir, key, bytecode, arena)) {
+            if (bytecode_file_image(bytecode, jit, arena, image, &error)) {
+                return true;
+            }
+            // A broken entry, compiled again and replaced below
+            bytecode_file_unload(bytecode);
+        }
+    }
+
+    CodeUnit code_unit = {};
+    if (!compile_source(source_code, arena, &code_unit)) {
+        return false;
+    }
+    *image = vm_image_make(code_unit, arena, jit);
+    if (cache_dir) {
+        // Best effort, a cache that can't be written to just
+        // means compiling every time.
+        compile_cache_store(cache_dir, key, image->linked,
+                            code_unit.static_data, arena);
+    }
+    return true;
+}
+
+// The instructions of the image, decoded from the linked code if the image
+// came from a `.jazzc` file
+CodeUnit image_code_unit(const VmImage* image, Arena* arena) {
+    if (image->code.functions.size > 0) {
+        return image->code;
+    }
+    return link_unlink_unit(image->linked, image->code.static_data, arena);
+}
+
+const isize STACK_SIZE = 8 * 1024 * 1024;
+
+// The report goes to `file_name`, the folded stacks next to it
+void write_profile(const Profile* profile, const char* file_name) {
+    std::ofstream report(file_name);
+    profile_report(profile, report);
+    std::string folded_name = std::string(file_name) + ".folded";
+    std::ofstream folded(folded_name);
+    profile_write_folded(profile, folded);
+    if (!report || !folded) {
+        std::cerr << "Error: Could not write the profile to " << file_name
+                  << std::endl;
+        return;
+    }
+    std::cerr << "Profile written to " << file_name << " and " << folded_name
+              << std::endl;
+}
+
+// Every file is compiled once, then each run of each file is a job for the
+// pool of threads. The output of every run is collected separately and
+// printed in order once all of them are done. With a `snapshot_file` (of the
+// only file) every run continues from the snapshot.
+int run_batch(Array<const char*> files, isize runs, isize thread_count,
+              bool jit, const char* cache_dir, const char* snapshot_file,
+              Arena* arena) {
+    Slice<VmImage> images = {arena_alloc<VmImage>(arena, files.size),
+                             files.size};
+    Slice<BytecodeFile> bytecode = {
+        arena_alloc<BytecodeFile>(arena, files.size), files.size};
+    isize loaded = 0;
+    defer({
+        for (isize i = 0; i < loaded; i++) {
+            vm_image_free(&images[i]);
+            bytecode_file_unload(&bytecode[i]);
+        }
+    });
+    for (isize i = 0; i < files.size; i++) {
+        if (!load_image(files[i], jit, cache_dir, arena, &images[i],
+                        &bytecode[i])) {
+            return 1;
+        }
+        loaded++;
+    }
+
+    Snapshot snapshot = {};
+    if (snapshot_file) {
+        const char* error = nullptr;
+        if (files.size != 1 ||
+            !snapshot_load(snapshot_file, images[0], &snapshot, arena,
+                           &error)) {
+            std::cerr << "Error: " << snapshot_file << ": "
+                      << (error ? error : "Restores exactly one source file")
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    isize job_count = files.size * runs;
+    Slice<RunJob> jobs = {arena_alloc<RunJob>(arena, job_count), job_count};
+    Slice<char*> outputs = {arena_alloc<char*>(arena, job_count), job_count};
+    Slice<size_t> output_sizes = {arena_alloc<size_t>(arena, job_count),
+                                  job_count};
+    for (isize i = 0; i < job_count; i++) {
+        FILE* output = open_memstream(&outputs[i], &output_sizes[i]);
+        core_assert(output);
+        jobs[i] = RunJob{
+            .image = &images[i / runs],
+            .snapshot = snapshot_file ? &snapshot : nullptr,
+            .stdout = output,
+            .stderr = stderr,
+            .exit_code = 0,
+        };
+    }
+
+    run_jobs(jobs, thread_count, STACK_SIZE);
+
+    int exit_code = 0;
+    for (isize i = 0; i < job_count; i++) {
+        fclose(jobs[i].stdout);
+        fwrite(outputs[i], 1, output_sizes[i], stdout);
+        free(outputs[i]);
+        if (exit_code == 0) {
+            exit_code = jobs[i].exit_code;
+        }
+    }
+
+    std::cerr << "Ran " << job_count << " programs on " << thread_count
+              << " threads" << std::endl;
+    return exit_code;
+}
+
+int main(int argc, char* argv[]) {
+    Arena arena;
+    arena_init(&arena, 16 * 1024);
+    defer(arena_free(&arena));
+    defer({
+        std::cerr << "Memory used: " << arena_get_size(&arena) << " bytes"
+                  << std::endl;
+    });
+
+    isize thread_count = 0;
+    isize runs = 1;
+    bool jit = false;
+    const char* emit_c_file = nullptr;
+    const char* emit_bytecode_file = nullptr;
+    // No cache unless given
+    const char* cache_dir = getenv("JAZZ_CACHE_DIR");
+    const char* snapshot_file = nullptr;
+    isize snapshot_fuel = 0;
+    const char* restore_file = nullptr;
+    const char* profile_file = nullptr;
+    bool profile_time = false;
+    // Zero unless tiered
+    u64 tier_threshold = 0;
+    Array<const char*> files = {};
+    array_init(&files, 4, &arena);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if (strcmp(argv[i], "--tiered") == 0) {
+            tier_threshold = TIERING_DEFAULT_THRESHOLD;
+        } else if (strcmp(argv[i], "--tier-threshold") == 0 &&
+                   i + 1 < argc) {
+            tier_threshold = std::max(atol(argv[++i]), 1l);
+        } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+            emit_c_file = argv[++i];
+        } else if (strcmp(argv[i], "--emit-bytecode") == 0 && i + 1 < argc) {
+            emit_bytecode_file = argv[++i];
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 2 < argc) {
+            snapshot_fuel = atol(argv[++i]);
+            snapshot_file = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore_file = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_file = argv[++i];
+        } else if (strcmp(argv[i], "--profile-time") == 0) {
+            profile_time = true;
+        } else {
+            array_push(&files, (const char*)argv[i]);
+        }
+    }
+
+    if (cache_dir && cache_dir[0] == '\0') {
+        cache_dir = nullptr;
+    }
+
+    if (files.size == 0 || runs < 1 || thread_count < 0 ||
+        (snapshot_file && snapshot_fuel < 1)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--threads <n>] [--runs <n>] [--jit] [--emit-c <out.c>]"
+                  << " [--emit-bytecode <out.jazzc>] [--tiered]"
+                  << " [--tier-threshold <n>] [--cache-dir <dir>]"
+                  << " [--snapshot <fuel> <out.jazzs>] [--restore <in.jazzs>]"
+                  << " [--profile <report.txt>] [--profile-time]"
+                  << " <source_file.jazz|.jazzc>..."
+                  << std::endl;
         return 1;
     }
 
-    semantic_analysis(file, &arena);
+    // A batch only runs the programs and prints their output
+    bool batch = thread_count > 0 || runs > 1 || files.size > 1;
+    if (batch && tier_threshold > 0) {
+        std::cerr << "--tiered and --tier-threshold take one run of one source "
+                     "file"
+                  << std::endl;
+        return 1;
+    }
+    if (batch && snapshot_file) {
+        std::cerr << "--snapshot takes one run of one source file" << std::endl;
+        return 1;
+    }
+    if (batch && (profile_file || profile_time)) {
+        std::cerr << "--profile and --profile-time take one run of one source "
+                     "file"
+                  << std::endl;
+        return 1;
+    }
 
-    CodeUnit code_unit = ast_compile_to_bytecode(&file->ast, true, &arena);
+    // Compiled ahead of time, nothing is run
+    if (emit_c_file || emit_bytecode_file) {
+        if (files.size != 1) {
+            std::cerr << "--emit-c and --emit-bytecode take exactly one source "
+                         "file"
+                      << std::endl;
+            return 1;
+        }
+        VmImage image = {};
+        BytecodeFile bytecode = {};
+        if (!load_image(files[0], false, cache_dir, &arena, &image,
+                        &bytecode)) {
+            return 1;
+        }
+        defer(bytecode_file_unload(&bytecode));
 
-    for (isize i = 0; i < code_unit.functions.size; i++) {
-        Slice<Inst> function = code_unit.functions[i];
-        for (isize j = 0; j < function.size; j++) {
-            std::cerr << j << ": " << function[j] << std::endl;
+        if (emit_bytecode_file &&
+            !bytecode_file_write(emit_bytecode_file, image.linked,
+                                 image.code.static_data)) {
+            std::cerr << "Error: Could not write file " << emit_bytecode_file
+                      << std::endl;
+            return 1;
         }
-        std::cerr << std::endl;
+        if (emit_c_file) {
+            std::ofstream out(emit_c_file);
+            if (!out) {
+                std::cerr << "Error: Could not open file " << emit_c_file
+                          << std::endl;
+                return 1;
+            }
+            emit_c(image_code_unit(&image, &arena), STACK_SIZE, out);
+        }
+        return 0;
+    }
+
+    // A batch of programs, nothing but their output is printed
+    if (batch) {
+        return run_batch(files, runs, std::max<isize>(thread_count, 1), jit,
+                         cache_dir, restore_file, &arena);
     }
 
     Arena exec_arena = {};
@@ -99,20 +377,83 @@ int main(int argc, char* argv[]) {
                   << " bytes" << std::endl;
     });
 
-    VM* vm = vm_make(code_unit, 8 * 1024 * 1024, &exec_arena);
-    isize instructions_executed = 0;
+    VmImage image = {};
+    BytecodeFile bytecode = {};
+    if (!load_image(files[0], jit, cache_dir, &arena, &image, &bytecode)) {
+        return 1;
+    }
+    defer(bytecode_file_unload(&bytecode));
+    defer(vm_image_free(&image));
+    VM* vm = vm_make(image, STACK_SIZE, &exec_arena);
+
+    if (restore_file) {
+        Snapshot snapshot = {};
+        const char* error = nullptr;
+        if (!snapshot_load(restore_file, image, &snapshot, &exec_arena,
+                           &error) ||
+            !snapshot_restore(vm, image, &snapshot, &error)) {
+            std::cerr << "Error: " << restore_file << ": " << error
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    Tiering* tiering = nullptr;
+    if (tier_threshold > 0) {
+        tiering = tiering_make(image_code_unit(&image, &arena),
+                               tier_threshold, &exec_arena);
+        vm_enable_tiering(vm, tiering);
+    }
     defer({
-        std::cerr << "Instructions executed: " << instructions_executed
-                  << std::endl;
+        if (tiering) {
+            tiering_dump(tiering, std::cerr);
+            tiering_free(tiering);
+        }
     });
 
-    while (true) {
-        bool did_work = vm_execute_inst(vm);
-        instructions_executed += 1;
-        if (!did_work) {
-            // The top value on the stack is the exit code
-            u8 exit_code = stack_pop<u8>(&vm->stack);
-            return exit_code;
+    // Takes precedence over tiering, the profiled VM only interprets
+    Profile* profile = nullptr;
+    if (profile_file) {
+        profile = profile_make(vm->linked, profile_time, &exec_arena);
+        vm_enable_profiling(vm, profile);
+    }
+    defer({
+        if (profile) {
+            write_profile(profile, profile_file);
         }
+    });
+
+    for (isize i = 0; i < vm->linked.functions.size; i++) {
+        std::cerr << "fn " << i << ":" << std::endl;
+        link_disassemble(vm->linked.functions[i], std::cerr);
+        std::cerr << std::endl;
     }
+    optimizer_report(std::cerr);
+
+    // Runs the setup, the snapshot is where it stopped
+    if (snapshot_file) {
+        VmStatus status = vm_run_for(vm, snapshot_fuel);
+        if (status == VmStatus::Error) {
+            std::cerr << "Error: The program failed before the snapshot"
+                      << std::endl;
+            return 1;
+        }
+        if (status == VmStatus::Yielded) {
+            if (!snapshot_write(snapshot_file, vm)) {
+                std::cerr << "Error: Could not write file " << snapshot_file
+                          << std::endl;
+                return 1;
+            }
+            std::cerr << "Snapshot after " << snapshot_fuel << " fuel written"
+                      << " to " << snapshot_file << std::endl;
+            return 0;
+        }
+        std::cerr << "The program finished before the snapshot" << std::endl;
+    } else {
+        vm_run(vm);
+    }
+
+    // The top value on the stack is the exit code
+    u8 exit_code = stack_pop<u8>(&vm->stack);
+    return exit_code;
 }
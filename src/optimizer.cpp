@@ -1,115 +1,956 @@
 #include "optimizer.hpp"
 #include "bytecode.hpp"
 #include "core.hpp"
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iomanip>
 
-void combine_stack_pop_push_instructions(Array<Inst>* instructions,
-                                         Arena* arena) {
-    Array<Inst> new_instructions = {};
-    array_init(&new_instructions, instructions->size / 2, arena);
+// The instructions are rewritten in one pass. Every instruction is appended
+// to the output, then the rules are tried on the end of the output until none
+// applies, so a rewrite can enable another one right away.
+//
+// A window never spans a jump target, except at its first instruction, so
+// jumps only ever land on the start of a replacement. A target removed with
+// nothing in its place moves to the next input instruction, which is pushed
+// after every rewrite before it. The jumps keep their targets as input indices
+// until the end, where they are all mapped to the output at once.
 
-    Array<isize> jmp_instruction_indices = {};
-    array_init(&jmp_instruction_indices, 4, arena);
+const isize HEIGHT_UNKNOWN = -1;
 
-    Array<isize> old_new_inst_mapping = {};
-    array_init(&old_new_inst_mapping, instructions->size, arena);
+// The last instructions of the output, with the stack height before each of
+// them, relative to the BP. The height is `HEIGHT_UNKNOWN` if the function
+// does not use the stack in a structured way.
+struct PeepholeWindow {
+    const Inst* insts;
+    const isize* heights;
+    // The input index of the instruction that comes next
+    isize next_ip;
+};
 
-    Array<isize> jump_targets = {};
-    array_init(&jump_targets, 4, arena);
-    for (isize i = instructions->size - 1; i >= 0; i--) {
-        Inst inst = (*instructions)[i];
-        if (inst.type == InstType::Jump) {
-            array_push(&jump_targets, inst.jump.new_ip);
-        } else if (inst.type == InstType::JumpIf) {
-            array_push(&jump_targets, inst.jump_if.new_ip);
+// Appends the replacement of the window to `out`, or returns false if the rule
+// does not apply. The replacement must change the stack height the same way,
+// and a replacement of the same size must not match the rule again.
+typedef bool (*PeepholeApply)(PeepholeWindow window, Array<Inst>* out);
+
+struct PeepholeRule {
+    const char* name;
+    isize size;
+    PeepholeApply apply;
+};
+
+static isize stack_effect(Inst inst) {
+    switch (inst.type) {
+    case InstType::PushStack:
+        return inst.push_stack.size;
+    case InstType::PopStack:
+        return -inst.pop_stack.size;
+    default:
+        return 0;
+    }
+}
+
+static bool mem_ptr_equal(MemPtr a, MemPtr b) {
+    return a.type == b.type && a.mem_offset == b.mem_offset;
+}
+
+// Whether writing one can change what is read from the other. Addresses
+// relative to the BP can be the same memory as absolute ones.
+static bool mem_may_overlap(MemPtr a, isize a_size, MemPtr b, isize b_size) {
+    bool a_stack =
+        a.type == MemPtrType::StackAbs || a.type == MemPtrType::StackRel;
+    bool b_stack =
+        b.type == MemPtrType::StackAbs || b.type == MemPtrType::StackRel;
+    if (a.type == MemPtrType::Immediate || b.type == MemPtrType::Immediate) {
+        return false;
+    }
+    if (a.type != b.type) {
+        return a_stack && b_stack;
+    }
+    return a.mem_offset < b.mem_offset + b_size &&
+           b.mem_offset < a.mem_offset + a_size;
+}
+
+// Whether `ptr` is in the part of the stack between the heights, which is gone
+// once it is popped
+static bool mem_in_stack_range(MemPtr ptr, isize size, isize from, isize to) {
+    return ptr.type == MemPtrType::StackRel && ptr.mem_offset >= from &&
+           ptr.mem_offset + size <= to;
+}
+
+// `mov a a`
+static bool rule_mov_to_self(PeepholeWindow window, Array<Inst>*) {
+    Inst mov = window.insts[0];
+    return mov.type == InstType::Mov &&
+           mem_ptr_equal(mov.mov.dest, mov.mov.src);
+}
+
+// `mov a b; mov a c` to `mov a c`
+static bool rule_mov_overwritten(PeepholeWindow window, Array<Inst>* out) {
+    Inst first = window.insts[0];
+    Inst second = window.insts[1];
+    if (first.type != InstType::Mov || second.type != InstType::Mov ||
+        !mem_ptr_equal(first.mov.dest, second.mov.dest) ||
+        second.mov.size < first.mov.size ||
+        mem_may_overlap(second.mov.src, second.mov.size, first.mov.dest,
+                        first.mov.size)) {
+        return false;
+    }
+    array_push(out, second);
+    return true;
+}
+
+// `mov a b; mov b a` to `mov a b`
+static bool rule_mov_back(PeepholeWindow window, Array<Inst>* out) {
+    Inst first = window.insts[0];
+    Inst second = window.insts[1];
+    if (first.type != InstType::Mov || second.type != InstType::Mov ||
+        !mem_ptr_equal(first.mov.dest, second.mov.src) ||
+        !mem_ptr_equal(first.mov.src, second.mov.dest) ||
+        first.mov.size != second.mov.size ||
+        mem_may_overlap(first.mov.dest, first.mov.size, first.mov.src,
+                        first.mov.size)) {
+        return false;
+    }
+    array_push(out, first);
+    return true;
+}
+
+// `mov t a; mov b t` to `mov t a; mov b a`, then `t` may not be needed. `b`
+// and `a` must not overlap, a `Mov` can not copy between them.
+static bool rule_mov_chain(PeepholeWindow window, Array<Inst>* out) {
+    Inst first = window.insts[0];
+    Inst second = window.insts[1];
+    if (first.type != InstType::Mov || second.type != InstType::Mov ||
+        !mem_ptr_equal(first.mov.dest, second.mov.src) ||
+        first.mov.size != second.mov.size ||
+        mem_may_overlap(first.mov.dest, first.mov.size, first.mov.src,
+                        first.mov.size) ||
+        mem_may_overlap(second.mov.dest, second.mov.size, first.mov.src,
+                        first.mov.size)) {
+        return false;
+    }
+    second.mov.src = first.mov.src;
+    array_push(out, first);
+    array_push(out, second);
+    return true;
+}
+
+// `mov a b; pop` to `pop`, if `a` is popped
+static bool rule_dead_mov_before_pop(PeepholeWindow window, Array<Inst>* out) {
+    Inst mov = window.insts[0];
+    Inst pop = window.insts[1];
+    isize height = window.heights[1];
+    if (mov.type != InstType::Mov || pop.type != InstType::PopStack ||
+        height == HEIGHT_UNKNOWN ||
+        !mem_in_stack_range(mov.mov.dest, mov.mov.size,
+                            height - pop.pop_stack.size, height)) {
+        return false;
+    }
+    array_push(out, pop);
+    return true;
+}
+
+// `mov a b; mov c d; pop` to `mov c d; pop`, if `a` is popped and not read
+static bool rule_dead_mov_past_mov(PeepholeWindow window, Array<Inst>* out) {
+    Inst mov = window.insts[0];
+    Inst next = window.insts[1];
+    Inst pop = window.insts[2];
+    isize height = window.heights[2];
+    if (mov.type != InstType::Mov || next.type != InstType::Mov ||
+        pop.type != InstType::PopStack || height == HEIGHT_UNKNOWN ||
+        !mem_in_stack_range(mov.mov.dest, mov.mov.size,
+                            height - pop.pop_stack.size, height) ||
+        mem_may_overlap(next.mov.src, next.mov.size, mov.mov.dest,
+                        mov.mov.size)) {
+        return false;
+    }
+    array_push(out, next);
+    array_push(out, pop);
+    return true;
+}
+
+// `push n; mov a b; pop n` to nothing, if `a` is in the pushed memory
+static bool rule_push_mov_pop(PeepholeWindow window, Array<Inst>*) {
+    Inst push = window.insts[0];
+    Inst mov = window.insts[1];
+    Inst pop = window.insts[2];
+    isize height = window.heights[0];
+    return push.type == InstType::PushStack && mov.type == InstType::Mov &&
+           pop.type == InstType::PopStack &&
+           push.push_stack.size == pop.pop_stack.size &&
+           height != HEIGHT_UNKNOWN &&
+           mem_in_stack_range(mov.mov.dest, mov.mov.size, height,
+                              height + push.push_stack.size);
+}
+
+// Pushes and pops next to each other become one, or none if they cancel out
+static bool rule_combine_push_pop(PeepholeWindow window, Array<Inst>* out) {
+    Inst first = window.insts[0];
+    Inst second = window.insts[1];
+    bool first_stack = first.type == InstType::PushStack ||
+                       first.type == InstType::PopStack;
+    bool second_stack = second.type == InstType::PushStack ||
+                        second.type == InstType::PopStack;
+    if (!first_stack || !second_stack) {
+        return false;
+    }
+    isize total = stack_effect(first) + stack_effect(second);
+    if (total > 0) {
+        array_push(out, inst_push_stack(total));
+    } else if (total < 0) {
+        array_push(out, inst_pop_stack(-total));
+    }
+    return true;
+}
+
+// A jump to the instruction right after it
+static bool rule_jump_to_next(PeepholeWindow window, Array<Inst>*) {
+    Inst jump = window.insts[0];
+    return (jump.type == InstType::Jump &&
+            jump.jump.new_ip == window.next_ip) ||
+           (jump.type == InstType::JumpIf &&
+            jump.jump_if.new_ip == window.next_ip);
+}
+
+static const PeepholeRule PEEPHOLE_RULES[] = {
+    {"mov_to_self", 1, rule_mov_to_self},
+    {"jump_to_next", 1, rule_jump_to_next},
+    {"push_mov_pop", 3, rule_push_mov_pop},
+    {"mov_overwritten", 2, rule_mov_overwritten},
+    {"mov_back", 2, rule_mov_back},
+    {"mov_chain", 2, rule_mov_chain},
+    {"dead_mov_before_pop", 2, rule_dead_mov_before_pop},
+    {"dead_mov_past_mov", 3, rule_dead_mov_past_mov},
+    {"combine_push_pop", 2, rule_combine_push_pop},
+};
+const isize PEEPHOLE_RULE_COUNT =
+    sizeof(PEEPHOLE_RULES) / sizeof(PEEPHOLE_RULES[0]);
+
+static std::atomic<u64> peephole_hits[PEEPHOLE_RULE_COUNT];
+
+// The rewrites made outside of the peephole rules
+enum class OptimizerPass {
+    CopyPropagation,
+    ResultForwarding,
+    DeadStore,
+    Inlining,
+};
+static const char* OPTIMIZER_PASS_NAMES[] = {
+    "copy_propagation",
+    "result_forwarding",
+    "dead_store",
+    "inlined_calls",
+};
+const isize OPTIMIZER_PASS_COUNT =
+    sizeof(OPTIMIZER_PASS_NAMES) / sizeof(OPTIMIZER_PASS_NAMES[0]);
+
+static std::atomic<u64> pass_hits[OPTIMIZER_PASS_COUNT];
+
+static void optimizer_hits_add(OptimizerPass pass) {
+    pass_hits[(isize)pass].fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool bitset_get(Slice<u64> bits, isize index) {
+    return (bits[index / 64] >> (index % 64)) & 1;
+}
+
+static void bitset_set(Slice<u64> bits, isize index) {
+    bits[index / 64] |= (u64)1 << (index % 64);
+}
+
+static bool inst_is_jump(Inst inst, isize* new_ip) {
+    if (inst.type == InstType::Jump) {
+        *new_ip = inst.jump.new_ip;
+        return true;
+    }
+    if (inst.type == InstType::JumpIf) {
+        *new_ip = inst.jump_if.new_ip;
+        return true;
+    }
+    return false;
+}
+
+static void inst_set_jump_target(Inst* inst, isize new_ip) {
+    if (inst->type == InstType::Jump) {
+        inst->jump.new_ip = new_ip;
+    } else {
+        core_assert(inst->type == InstType::JumpIf);
+        inst->jump_if.new_ip = new_ip;
+    }
+}
+
+// Whether the next instruction is only reached by jumping to it
+static bool inst_ends_flow(Inst inst) {
+    return inst.type == InstType::Jump || inst.type == InstType::Return ||
+           inst.type == InstType::TailCall || inst.type == InstType::Exit;
+}
+
+// The stack height before every instruction. All of them are unknown if the
+// paths to some instruction do not agree on it.
+static Slice<isize> stack_heights(Slice<Inst> instructions, Arena* arena) {
+    isize size = instructions.size;
+    Slice<isize> heights = {arena_alloc<isize>(arena, size + 1), size + 1};
+    // The heights at the targets of forward jumps
+    Slice<isize> jumped = {arena_alloc<isize>(arena, size + 1), size + 1};
+    for (isize i = 0; i <= size; i++) {
+        jumped[i] = HEIGHT_UNKNOWN;
+    }
+
+    bool valid = true;
+    isize height = 0;
+    for (isize i = 0; i < size && valid; i++) {
+        if (i > 0 && inst_ends_flow(instructions[i - 1])) {
+            height = jumped[i];
+        } else if (jumped[i] != HEIGHT_UNKNOWN && jumped[i] != height) {
+            valid = false;
+        }
+        heights[i] = height;
+        if (height == HEIGHT_UNKNOWN) {
+            continue;
+        }
+
+        isize target = 0;
+        if (inst_is_jump(instructions[i], &target)) {
+            if (target < 0 || target > size) {
+                valid = false;
+            } else if (target <= i) {
+                valid = heights[target] == height;
+            } else if (jumped[target] == HEIGHT_UNKNOWN) {
+                jumped[target] = height;
+            } else {
+                valid = jumped[target] == height;
+            }
+        }
+        height += stack_effect(instructions[i]);
+        valid = valid && height >= 0;
+    }
+
+    for (isize i = 0; i <= size; i++) {
+        if (!valid || i == size) {
+            heights[i] = HEIGHT_UNKNOWN;
+        }
+    }
+    return heights;
+}
+
+// The input instructions that are jump targets form lists, one for every
+// output instruction they ended up at, -1 ends a list
+struct Peephole {
+    Array<Inst> out;
+    Array<isize> heights;
+    // The first target that ended up at each output instruction
+    Array<isize> targets;
+    Slice<isize> next_target;
+    // The targets whose instruction was removed, they end up at the next input
+    // instruction that is pushed
+    isize carried;
+    Array<Inst> replacement;
+};
+
+static isize peephole_append_targets(Peephole* p, isize list, isize other) {
+    if (list == -1) {
+        return other;
+    }
+    isize last = list;
+    while (p->next_target[last] != -1) {
+        last = p->next_target[last];
+    }
+    p->next_target[last] = other;
+    return list;
+}
+
+static void peephole_push(Peephole* p, Inst inst, isize height, isize target) {
+    array_push(&p->out, inst);
+    array_push(&p->heights, height);
+    array_push(&p->targets, target);
+}
+
+// Applies the first matching rule to the end of the output, returns false if
+// none does
+static bool peephole_rewrite(Peephole* p, isize next_ip) {
+    for (isize r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+        PeepholeRule rule = PEEPHOLE_RULES[r];
+        isize start = p->out.size - rule.size;
+        if (start < 0) {
+            continue;
+        }
+        bool spans_target = false;
+        for (isize i = start + 1; i < p->out.size; i++) {
+            spans_target = spans_target || p->targets[i] != -1;
+        }
+        if (spans_target) {
+            continue;
+        }
+
+        PeepholeWindow window = {
+            .insts = p->out.data + start,
+            .heights = p->heights.data + start,
+            .next_ip = next_ip,
+        };
+        array_clear(&p->replacement);
+        if (!rule.apply(window, &p->replacement)) {
+            continue;
         }
+        peephole_hits[r].fetch_add(1, std::memory_order_relaxed);
+
+        isize height = p->heights[start];
+        isize target = p->targets[start];
+        p->out.size = start;
+        p->heights.size = start;
+        p->targets.size = start;
+        for (isize i = 0; i < p->replacement.size; i++) {
+            Inst inst = p->replacement[i];
+            peephole_push(p, inst, height, i == 0 ? target : -1);
+            if (height != HEIGHT_UNKNOWN) {
+                height += stack_effect(inst);
+            }
+        }
+        if (p->replacement.size == 0) {
+            p->carried = peephole_append_targets(p, target, p->carried);
+        }
+        return true;
     }
+    return false;
+}
 
+static Slice<u64> jump_targets(Slice<Inst> instructions, Arena* arena) {
+    isize size = instructions.size;
+    Slice<u64> targets = {arena_alloc<u64>(arena, size / 64 + 1),
+                          size / 64 + 1};
+    memset(targets.data, 0, targets.size * sizeof(u64));
+    for (isize i = 0; i < size; i++) {
+        isize target = 0;
+        if (inst_is_jump(instructions[i], &target) && target >= 0 &&
+            target <= size) {
+            bitset_set(targets, target);
+        }
+    }
+    return targets;
+}
+
+// Points the jumps to where their targets ended up, `new_ips` has an entry for
+// every old instruction and one for the end of the function
+static void remap_jumps(Array<Inst>* instructions, Slice<isize> new_ips) {
     for (isize i = 0; i < instructions->size; i++) {
-        Inst inst = (*instructions)[i];
-
-        switch (inst.type) {
-        case InstType::JumpIf:
-        case InstType::Jump: {
-            array_push(&jmp_instruction_indices, new_instructions.size);
-            array_push(&new_instructions, inst);
-            break;
-        }
-        case InstType::PopStack:
-        case InstType::PushStack: {
-            isize total_push = 0;
-            if (inst.type == InstType::PushStack) {
-                total_push = inst.push_stack.size;
-            } else if (inst.type == InstType::PopStack) {
-                total_push = -inst.pop_stack.size;
+        Inst* inst = &(*instructions)[i];
+        isize target = 0;
+        if (inst_is_jump(*inst, &target)) {
+            inst_set_jump_target(inst, new_ips[target]);
+        }
+    }
+}
+
+static void peephole(Array<Inst>* instructions, Arena* arena) {
+    Slice<Inst> input = array_to_slice(instructions);
+    isize size = input.size;
+    Slice<u64> targets = jump_targets(input, arena);
+    Slice<isize> heights = stack_heights(input, arena);
+
+    Peephole p = {};
+    array_init(&p.out, size, arena);
+    array_init(&p.heights, size, arena);
+    array_init(&p.targets, size, arena);
+    p.next_target = {arena_alloc<isize>(arena, size), size};
+    p.carried = -1;
+    array_init(&p.replacement, 4, arena);
+
+    for (isize i = 0; i < size; i++) {
+        isize target = p.carried;
+        p.carried = -1;
+        if (bitset_get(targets, i)) {
+            p.next_target[i] = target;
+            target = i;
+        }
+        peephole_push(&p, input[i], heights[i], target);
+        while (peephole_rewrite(&p, i + 1)) {
+        }
+    }
+
+    // Where each jump target ended up in the output, the others are not read
+    Slice<isize> new_ips = {arena_alloc<isize>(arena, size + 1), size + 1};
+    for (isize i = 0; i < p.out.size; i++) {
+        for (isize t = p.targets[i]; t != -1; t = p.next_target[t]) {
+            new_ips[t] = i;
+        }
+    }
+    for (isize t = p.carried; t != -1; t = p.next_target[t]) {
+        new_ips[t] = p.out.size;
+    }
+    new_ips[size] = p.out.size;
+    remap_jumps(&p.out, new_ips);
+
+    array_clear(instructions);
+    array_clone_to(&p.out, instructions, arena);
+}
+
+// The memory an instruction reads and writes, the other instructions are not
+// described by their operands
+struct InstOperands {
+    MemPtr* reads[2];
+    isize read_sizes[2];
+    isize read_count;
+    MemPtr* write;
+    isize write_size;
+};
+
+static bool inst_operands(Inst* inst, InstOperands* operands) {
+    *operands = {};
+    isize operand_size = 0;
+    isize result_size = 0;
+    switch (inst->type) {
+    case InstType::BinaryOp: {
+        bin_operand_sizes(inst->binary.op, &operand_size, &result_size);
+        *operands = {
+            .reads = {&inst->binary.left, &inst->binary.right},
+            .read_sizes = {operand_size, operand_size},
+            .read_count = 2,
+            .write = &inst->binary.dest,
+            .write_size = result_size,
+        };
+        return true;
+    }
+    case InstType::UnaryOp: {
+        unary_operand_sizes(inst->unary.op, &operand_size, &result_size);
+        *operands = {
+            .reads = {&inst->unary.operand},
+            .read_sizes = {operand_size},
+            .read_count = 1,
+            .write = &inst->unary.dest,
+            .write_size = result_size,
+        };
+        return true;
+    }
+    case InstType::Mov: {
+        *operands = {
+            .reads = {&inst->mov.src},
+            .read_sizes = {inst->mov.size},
+            .read_count = 1,
+            .write = &inst->mov.dest,
+            .write_size = inst->mov.size,
+        };
+        return true;
+    }
+    case InstType::JumpIf: {
+        *operands = {
+            .reads = {&inst->jump_if.condition},
+            .read_sizes = {sizeof(bool)},
+            .read_count = 1,
+            .write = nullptr,
+            .write_size = 0,
+        };
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// `dest` holds the same value as `src`
+struct Copy {
+    MemPtr dest;
+    MemPtr src;
+    isize size;
+};
+
+static void copies_remove_overlapping(Array<Copy>* copies, MemPtr ptr,
+                                      isize size) {
+    for (isize c = copies->size - 1; c >= 0; c--) {
+        Copy copy = (*copies)[c];
+        if (mem_may_overlap(copy.dest, copy.size, ptr, size) ||
+            mem_may_overlap(copy.src, copy.size, ptr, size)) {
+            array_remove_at_unordered(copies, c);
+        }
+    }
+}
+
+// Operands which read the destination of an earlier `Mov` read its source
+// instead, as long as neither was written in between. The `Mov` is then often
+// a dead store.
+static void propagate_copies(Array<Inst>* instructions, Arena* arena) {
+    Slice<Inst> insts = array_to_slice(instructions);
+    Slice<u64> targets = jump_targets(insts, arena);
+    Slice<isize> heights = stack_heights(insts, arena);
+
+    Array<Copy> copies = {};
+    array_init(&copies, 8, arena);
+    for (isize i = 0; i < insts.size; i++) {
+        // Other paths to the instruction may not have made the copies
+        if (bitset_get(targets, i) || heights[i] == HEIGHT_UNKNOWN) {
+            array_clear(&copies);
+        }
+
+        Inst* inst = &insts[i];
+        InstOperands operands = {};
+        if (!inst_operands(inst, &operands)) {
+            isize height = heights[i];
+            if (inst->type == InstType::PushStack) {
+                copies_remove_overlapping(&copies, mem_ptr_stack_rel(height),
+                                          inst->push_stack.size);
+            } else if (inst->type == InstType::PopStack) {
+                isize size = inst->pop_stack.size;
+                copies_remove_overlapping(
+                    &copies, mem_ptr_stack_rel(height - size), size);
             } else {
-                core_assert(false);
+                // Calls can write anything, the rest leave the block
+                array_clear(&copies);
             }
+            continue;
+        }
 
-            for (i++; i < instructions->size; i++) {
-                // If we are jumping to this position we can't combine the
-                // instructions
-                bool is_jump_target = array_contains(&jump_targets, i);
-                if (is_jump_target) {
-                    i -= 1;
+        for (isize r = 0; r < operands.read_count; r++) {
+            MemPtr* read = operands.reads[r];
+            for (isize c = 0; c < copies.size; c++) {
+                Copy copy = copies[c];
+                // A `Mov` can not copy between overlapping ranges
+                if (mem_ptr_equal(*read, copy.dest) &&
+                    operands.read_sizes[r] == copy.size &&
+                    !(inst->type == InstType::JumpIf &&
+                      copy.src.type == MemPtrType::Immediate) &&
+                    !(inst->type == InstType::Mov &&
+                      mem_may_overlap(inst->mov.dest, inst->mov.size,
+                                      copy.src, copy.size))) {
+                    *read = copy.src;
+                    optimizer_hits_add(OptimizerPass::CopyPropagation);
                     break;
                 }
+            }
+        }
+
+        if (operands.write) {
+            copies_remove_overlapping(&copies, *operands.write,
+                                      operands.write_size);
+        }
+        if (inst->type == InstType::Mov &&
+            !mem_may_overlap(inst->mov.dest, inst->mov.size, inst->mov.src,
+                             inst->mov.size)) {
+            array_push(&copies,
+                       Copy{inst->mov.dest, inst->mov.src, inst->mov.size});
+        }
+    }
+}
 
-                Inst next_inst = (*instructions)[i];
-                if (next_inst.type == InstType::PushStack) {
-                    total_push += next_inst.push_stack.size;
-                    continue;
-                } else if (next_inst.type == InstType::PopStack) {
-                    total_push -= next_inst.pop_stack.size;
-                    continue;
+// How far a store is followed to find out if it is dead
+const isize DEAD_STORE_WINDOW = 64;
+
+// Whether the value written to `dest` before instruction `start` is never read.
+// Only the straight line code after it is followed, the value is dead once it
+// is overwritten or popped.
+static bool store_is_dead(Slice<Inst> insts, Slice<isize> heights,
+                          isize start, MemPtr dest, isize size) {
+    if (dest.type != MemPtrType::StackRel || dest.mem_offset < 0) {
+        return false;
+    }
+    isize end = std::min(insts.size, start + DEAD_STORE_WINDOW);
+    for (isize i = start; i < end; i++) {
+        if (heights[i] == HEIGHT_UNKNOWN) {
+            return false;
+        }
+        Inst inst = insts[i];
+        InstOperands operands = {};
+        if (inst_operands(&inst, &operands)) {
+            for (isize r = 0; r < operands.read_count; r++) {
+                if (mem_may_overlap(*operands.reads[r], operands.read_sizes[r],
+                                    dest, size)) {
+                    return false;
                 }
-                i -= 1;
-                break;
             }
-
-            if (total_push > 0) {
-                Inst new_inst = inst_push_stack(total_push);
-                array_push(&new_instructions, new_inst);
-            } else if (total_push < 0) {
-                Inst new_inst = inst_pop_stack(-total_push);
-                array_push(&new_instructions, new_inst);
+            if (inst.type == InstType::JumpIf) {
+                return false;
+            }
+            MemPtr write = *operands.write;
+            if (write.type == MemPtrType::StackRel &&
+                write.mem_offset <= dest.mem_offset &&
+                write.mem_offset + operands.write_size >=
+                    dest.mem_offset + size) {
+                return true;
+            }
+        } else if (inst.type == InstType::PopStack) {
+            if (heights[i] - inst.pop_stack.size <= dest.mem_offset) {
+                return true;
             }
+        } else if (inst.type != InstType::PushStack) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Removes the stores nothing reads. An operation whose result is only moved
+// somewhere else writes it there directly.
+static void remove_dead_stores(Array<Inst>* instructions, Arena* arena) {
+    Slice<Inst> insts = array_to_slice(instructions);
+    Slice<u64> targets = jump_targets(insts, arena);
+    Slice<isize> heights = stack_heights(insts, arena);
+
+    Slice<bool> removed = {arena_alloc<bool>(arena, insts.size), insts.size};
+    for (isize i = 0; i < insts.size; i++) {
+        removed[i] = false;
+    }
+    for (isize i = 0; i < insts.size; i++) {
+        Inst* inst = &insts[i];
+        InstOperands operands = {};
+        if (!inst_operands(inst, &operands) || !operands.write) {
+            continue;
+        }
+        MemPtr dest = *operands.write;
+        // A division by zero still has to fail
+        bool may_fail = inst->type == InstType::BinaryOp &&
+                        inst->binary.op == BinOperand::Int_Div;
+        if (!may_fail &&
+            store_is_dead(insts, heights, i + 1, dest, operands.write_size)) {
+            removed[i] = true;
+            optimizer_hits_add(OptimizerPass::DeadStore);
+            continue;
+        }
 
-            break;
+        // `op t a b; mov d t` to `op d a b`, if `t` is dead. Pushes between
+        // them are skipped, they are the frame of the next expression.
+        if (inst->type == InstType::Mov) {
+            continue;
+        }
+        isize m = i + 1;
+        while (m < insts.size && insts[m].type == InstType::PushStack &&
+               !bitset_get(targets, m)) {
+            m++;
+        }
+        if (m >= insts.size || bitset_get(targets, m)) {
+            continue;
+        }
+        Inst mov = insts[m];
+        if (mov.type != InstType::Mov || !mem_ptr_equal(mov.mov.src, dest) ||
+            mov.mov.size != operands.write_size ||
+            mem_may_overlap(mov.mov.dest, mov.mov.size, dest,
+                            operands.write_size) ||
+            !store_is_dead(insts, heights, m + 1, dest, operands.write_size)) {
+            continue;
+        }
+        // The operands are read before the result is written, so it may be
+        // written to one of them, but not partly over one. The skipped pushes
+        // must not clear it.
+        bool overlaps = false;
+        for (isize r = 0; r < operands.read_count; r++) {
+            overlaps = overlaps ||
+                       (!mem_ptr_equal(*operands.reads[r], mov.mov.dest) &&
+                        mem_may_overlap(*operands.reads[r],
+                                        operands.read_sizes[r], mov.mov.dest,
+                                        mov.mov.size));
         }
-        default: {
-            array_push(&new_instructions, inst);
-            break;
+        for (isize p = i + 1; p < m; p++) {
+            overlaps = overlaps || mem_may_overlap(
+                                       mem_ptr_stack_rel(heights[p]),
+                                       insts[p].push_stack.size,
+                                       mov.mov.dest, mov.mov.size);
         }
+        if (overlaps) {
+            continue;
         }
+        *operands.write = mov.mov.dest;
+        removed[m] = true;
+        optimizer_hits_add(OptimizerPass::ResultForwarding);
+        i = m;
+    }
 
-        while (old_new_inst_mapping.size < i + 1) {
-            array_push(&old_new_inst_mapping, new_instructions.size - 1);
+    Array<Inst> out = {};
+    array_init(&out, insts.size, arena);
+    Slice<isize> new_ips = {arena_alloc<isize>(arena, insts.size + 1),
+                            insts.size + 1};
+    for (isize i = 0; i < insts.size; i++) {
+        new_ips[i] = out.size;
+        if (!removed[i]) {
+            array_push(&out, insts[i]);
         }
     }
+    new_ips[insts.size] = out.size;
+    remap_jumps(&out, new_ips);
 
-    // Fix the jump instructions
-    for (isize i = 0; i < jmp_instruction_indices.size; i++) {
-        isize jmp_idx = jmp_instruction_indices[i];
-        Inst* jmp_inst = &new_instructions[jmp_idx];
+    array_clear(instructions);
+    array_clone_to(&out, instructions, arena);
+}
 
-        if (jmp_inst->type == InstType::JumpIf) {
-            isize new_ip = jmp_inst->jump_if.new_ip;
-            isize mapped_ip = old_new_inst_mapping[new_ip];
-            jmp_inst->jump_if.new_ip = mapped_ip;
-        } else if (jmp_inst->type == InstType::Jump) {
-            isize new_ip = jmp_inst->jump.new_ip;
-            isize mapped_ip = old_new_inst_mapping[new_ip];
-            jmp_inst->jump.new_ip = mapped_ip;
+void optimize(Array<Inst>* instructions, Arena* arena) {
+    peephole(instructions, arena);
+    propagate_copies(instructions, arena);
+    remove_dead_stores(instructions, arena);
+    // The stack operations left next to each other
+    peephole(instructions, arena);
+}
+
+static void mem_ptr_rebase(MemPtr* ptr, isize height) {
+    if (ptr->type == MemPtrType::StackRel) {
+        ptr->mem_offset += height;
+    }
+}
+
+// Whether the calls to the function can be replaced by its instructions. It
+// must not call anything, so it is not recursive, and it must leave the stack
+// as it found it on every `Return`. Once the heights are known, the
+// instructions without one are never reached (the stack backend leaves some
+// after a `Return`).
+static bool inline_candidate(Slice<Inst> callee, Arena* arena) {
+    if (callee.size == 0 || callee.size > INLINE_MAX_CALLEE_SIZE) {
+        return false;
+    }
+    Slice<isize> heights = stack_heights(callee, arena);
+    if (heights[0] == HEIGHT_UNKNOWN) {
+        return false;
+    }
+    for (isize i = 0; i < callee.size; i++) {
+        InstType type = callee[i].type;
+        if (type == InstType::Call || type == InstType::TailCall ||
+            type == InstType::Exit ||
+            (type == InstType::Return && heights[i] != 0 &&
+             heights[i] != HEIGHT_UNKNOWN)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Replaces the calls of one caller, returns how many were inlined
+static isize inline_calls_in(Slice<Slice<Inst>> functions, isize caller,
+                             Slice<bool> candidates, isize budget,
+                             Arena* arena) {
+    Slice<Inst> insts = functions[caller];
+    Slice<isize> heights = stack_heights(insts, arena);
+
+    // Which calls are inlined and where each instruction ends up
+    Slice<bool> inlined = {arena_alloc<bool>(arena, insts.size), insts.size};
+    Slice<isize> new_ips = {arena_alloc<isize>(arena, insts.size + 1),
+                            insts.size + 1};
+    isize count = 0;
+    isize size = 0;
+    for (isize i = 0; i < insts.size; i++) {
+        new_ips[i] = size;
+        inlined[i] = false;
+        Inst inst = insts[i];
+        if (inst.type == InstType::Call && inst.call.fp != caller &&
+            candidates[inst.call.fp] && heights[i] != HEIGHT_UNKNOWN &&
+            functions[inst.call.fp].size - 1 <= budget) {
+            inlined[i] = true;
+            budget -= functions[inst.call.fp].size - 1;
+            count += 1;
+            size += functions[inst.call.fp].size;
         } else {
-            core_assert(false);
+            size += 1;
         }
     }
+    new_ips[insts.size] = size;
+    if (count == 0) {
+        return 0;
+    }
 
-    array_clear(instructions);
-    array_clone_to(&new_instructions, instructions, arena);
+    Array<Inst> out = {};
+    array_init(&out, size, arena);
+    for (isize i = 0; i < insts.size; i++) {
+        Inst inst = insts[i];
+        if (!inlined[i]) {
+            isize target = 0;
+            if (inst_is_jump(inst, &target)) {
+                inst_set_jump_target(&inst, new_ips[target]);
+            }
+            array_push(&out, inst);
+            continue;
+        }
+
+        // The frame of the callee starts at the height of the call
+        Slice<Inst> callee = functions[inst.call.fp];
+        isize base = out.size;
+        for (isize c = 0; c < callee.size; c++) {
+            Inst callee_inst = callee[c];
+            InstOperands operands = {};
+            isize target = 0;
+            if (callee_inst.type == InstType::Return) {
+                callee_inst = inst_jump(new_ips[i + 1]);
+            } else if (inst_is_jump(callee_inst, &target)) {
+                inst_set_jump_target(&callee_inst, base + target);
+            }
+            if (inst_operands(&callee_inst, &operands)) {
+                for (isize r = 0; r < operands.read_count; r++) {
+                    mem_ptr_rebase(operands.reads[r], heights[i]);
+                }
+                if (operands.write) {
+                    mem_ptr_rebase(operands.write, heights[i]);
+                }
+            }
+            array_push(&out, callee_inst);
+        }
+        optimizer_hits_add(OptimizerPass::Inlining);
+    }
+
+    optimize(&out, arena);
+    functions[caller] = array_to_slice(&out);
+    return count;
 }
 
-void optimize(Array<Inst>* instructions, Arena* arena) {
-    combine_stack_pop_push_instructions(instructions, arena);
+isize inline_calls(Slice<Slice<Inst>> functions, isize budget, Arena* arena) {
+    Slice<bool> candidates = {arena_alloc<bool>(arena, functions.size),
+                              functions.size};
+    Slice<isize> budgets = {arena_alloc<isize>(arena, functions.size),
+                            functions.size};
+    for (isize f = 0; f < functions.size; f++) {
+        budgets[f] = budget;
+    }
+
+    // Inlining into a function can make it a candidate itself, every round
+    // removes calls until none are left to inline
+    isize total = 0;
+    while (true) {
+        for (isize f = 0; f < functions.size; f++) {
+            candidates[f] = inline_candidate(functions[f], arena);
+        }
+        isize round = 0;
+        for (isize f = 0; f < functions.size; f++) {
+            isize old_size = functions[f].size;
+            round += inline_calls_in(functions, f, candidates, budgets[f],
+                                     arena);
+            budgets[f] -= functions[f].size - old_size;
+        }
+        if (round == 0) {
+            return total;
+        }
+        total += round;
+    }
+}
+
+u64 optimizer_hits(const char* name) {
+    for (isize r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+        if (strcmp(PEEPHOLE_RULES[r].name, name) == 0) {
+            return peephole_hits[r].load(std::memory_order_relaxed);
+        }
+    }
+    for (isize p = 0; p < OPTIMIZER_PASS_COUNT; p++) {
+        if (strcmp(OPTIMIZER_PASS_NAMES[p], name) == 0) {
+            return pass_hits[p].load(std::memory_order_relaxed);
+        }
+    }
+    core_assert_msg(false, "Unknown optimization %s", name);
+    return 0;
+}
+
+static void optimizer_report_line(std::ostream& os, const char* name,
+                                  u64 hits, bool* any) {
+    if (hits == 0) {
+        return;
+    }
+    if (!*any) {
+        os << "Optimizations:" << std::endl;
+        *any = true;
+    }
+    os << "  " << std::left << std::setw(20) << name << std::right
+       << std::setw(8) << hits << std::endl;
+}
+
+void optimizer_report(std::ostream& os) {
+    bool any = false;
+    for (isize r = 0; r < PEEPHOLE_RULE_COUNT; r++) {
+        optimizer_report_line(os, PEEPHOLE_RULES[r].name,
+                              peephole_hits[r].load(std::memory_order_relaxed),
+                              &any);
+    }
+    for (isize p = 0; p < OPTIMIZER_PASS_COUNT; p++) {
+        optimizer_report_line(os, OPTIMIZER_PASS_NAMES[p],
+                              pass_hits[p].load(std::memory_order_relaxed),
+                              &any);
+    }
 }
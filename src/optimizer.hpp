@@ -1,4 +1,29 @@
+#pragma once
+
 #include "bytecode.hpp"
 #include "core.hpp"
+#include <ostream>
 
+// Optimizes the instructions of one function: the peephole rules (see
+// `PEEPHOLE_RULES` in `optimizer.cpp`), then copy propagation and dead store
+// elimination, then the peephole rules again. The jump targets are in
+// instruction indices, they are fixed up to the optimized instructions.
 void optimize(Array<Inst>* instructions, Arena* arena);
+
+// Functions of at most this many instructions are inlined
+const isize INLINE_MAX_CALLEE_SIZE = 32;
+// How many instructions inlining may add to a function
+const isize INLINE_BUDGET = 256;
+
+// Replaces the calls to small functions which do not call anything by the
+// instructions of the function, with its frame on top of the caller's. The
+// functions stay as they are for the other calls. Callers which had calls
+// inlined are optimized again. Returns how many calls were inlined.
+isize inline_calls(Slice<Slice<Inst>> functions, isize budget, Arena* arena);
+
+// How many times the peephole rule or the pass applied, in every function
+// optimized so far
+u64 optimizer_hits(const char* name);
+
+// The optimizations that applied, with their counts
+void optimizer_report(std::ostream& os);
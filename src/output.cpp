@@ -0,0 +1,83 @@
+#include "output.hpp"
+#include "core.hpp"
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static const char DIGIT_PAIRS[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+char* output_format_int(i64 value, char* end) {
+    // Negated as unsigned, so the smallest value works too
+    u64 magnitude = value < 0 ? 0 - (u64)value : (u64)value;
+    char* start = end;
+    while (magnitude >= 100) {
+        u64 pair = magnitude % 100;
+        magnitude /= 100;
+        start -= 2;
+        memcpy(start, DIGIT_PAIRS + pair * 2, 2);
+    }
+    if (magnitude >= 10) {
+        start -= 2;
+        memcpy(start, DIGIT_PAIRS + magnitude * 2, 2);
+    } else {
+        *--start = (char)('0' + magnitude);
+    }
+    if (value < 0) {
+        *--start = '-';
+    }
+    return start;
+}
+
+// Writes all of the vectors, `writev` may write only part of them
+static bool write_all(int fd, iovec* vectors, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, vectors, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t)written >= vectors->iov_len) {
+            written -= vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if (count > 0) {
+            vectors->iov_base = (u8*)vectors->iov_base + written;
+            vectors->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+bool output_flush(OutputBuffer* output, FILE* file, const u8* extra,
+                  isize extra_size) {
+    if (output->size == 0 && extra_size == 0) {
+        return true;
+    }
+    defer(output->size = 0);
+
+    // Memory streams (the runner, the tests) have no descriptor.
+    // Anything the file buffered itself goes first, so the order stays.
+    int fd = fileno(file);
+    if (fd < 0 || fflush(file) != 0) {
+        return fwrite(output->data, 1, output->size, file) ==
+                   (size_t)output->size &&
+               fwrite(extra, 1, extra_size, file) == (size_t)extra_size;
+    }
+    iovec vectors[] = {
+        {.iov_base = output->data, .iov_len = (size_t)output->size},
+        {.iov_base = (void*)extra, .iov_len = (size_t)extra_size},
+    };
+    return write_all(fd, vectors, extra_size > 0 ? 2 : 1);
+}
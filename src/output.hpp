@@ -0,0 +1,63 @@
+#pragma once
+
+#include "core.hpp"
+#include <cstdio>
+
+// The buffered output of a VM, which the print builtins write to instead of
+// calling stdio for every value. The buffer is written out when it is full
+// and whenever `vm_run` (or `vm_run_for`) returns, so the output of a
+// program is only complete once it stopped running.
+//
+// Integers are formatted by hand two digits at a time, no format string is
+// parsed and nothing is allocated after `output_init`.
+
+struct OutputBuffer {
+    u8* data;
+    isize size;
+    isize capacity;
+};
+
+const isize OUTPUT_BUFFER_CAPACITY = 64 * 1024;
+
+// The longest formatted integer, "-9223372036854775808"
+const isize OUTPUT_INT_MAX_SIZE = 20;
+
+inline void output_init(OutputBuffer* output, isize capacity, Arena* arena) {
+    output->data = arena_alloc<u8>(arena, capacity);
+    output->size = 0;
+    output->capacity = capacity;
+}
+
+// Writes the buffered bytes to `file`, followed by `extra` which did not fit
+// into the buffer. For a file with a descriptor both go out in one `writev`,
+// otherwise through stdio. Returns false on a write error, the buffer is
+// empty either way.
+bool output_flush(OutputBuffer* output, FILE* file, const u8* extra = nullptr,
+                  isize extra_size = 0);
+
+inline void output_write(OutputBuffer* output, FILE* file, const void* data,
+                         isize size) {
+    if (output->capacity - output->size < size) {
+        output_flush(output, file, (const u8*)data, size);
+        return;
+    }
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
+}
+
+inline void output_write_char(OutputBuffer* output, FILE* file, char c) {
+    if (output->size == output->capacity) {
+        output_flush(output, file);
+    }
+    output->data[output->size++] = c;
+}
+
+// Formats `value` so that it ends right before `end`, returns where it starts
+char* output_format_int(i64 value, char* end);
+
+inline void output_write_int(OutputBuffer* output, FILE* file, i64 value) {
+    char digits[OUTPUT_INT_MAX_SIZE];
+    char* end = digits + OUTPUT_INT_MAX_SIZE;
+    char* start = output_format_int(value, end);
+    output_write(output, file, start, end - start);
+}
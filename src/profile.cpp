@@ -0,0 +1,299 @@
+#include "profile.hpp"
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define PROFILE_COUNT_BIN_OPERAND(name, type, result, symbol) +1
+const isize BIN_OPERAND_COUNT = 0 BIN_OPERANDS(PROFILE_COUNT_BIN_OPERAND);
+const isize INST_TYPE_COUNT = (isize)InstType::Exit + 1;
+
+static isize profile_add_node(Profile* profile, isize function, isize parent) {
+    ProfileNode node = {
+        .function = function,
+        .parent = parent,
+        .first_child = -1,
+        .next_sibling = -1,
+        .calls = 1,
+        .instructions = 0,
+        .ticks = 0,
+    };
+    if (parent >= 0) {
+        node.next_sibling = profile->nodes[parent].first_child;
+    }
+    array_push(&profile->nodes, node);
+    isize index = profile->nodes.size - 1;
+    if (parent >= 0) {
+        profile->nodes[parent].first_child = index;
+    }
+    return index;
+}
+
+Profile* profile_make(LinkedUnit linked, bool timed, Arena* arena) {
+    Profile* profile = arena_alloc<Profile>(arena);
+    profile->linked = linked;
+    profile->timed = timed;
+    profile->counts = {arena_alloc<Slice<u64>>(arena, linked.functions.size),
+                       linked.functions.size};
+    for (isize i = 0; i < linked.functions.size; i++) {
+        isize size = linked.functions[i].size;
+        profile->counts[i] = {arena_alloc<u64>(arena, size), size};
+        memset(profile->counts[i].data, 0, size * sizeof(u64));
+    }
+    array_init(&profile->nodes, 64, arena);
+    profile->current = profile_add_node(profile, 0, -1);
+    profile->last_ticks = profile_ticks();
+    return profile;
+}
+
+// The node of `function` called from the current one, made on its first call
+static isize profile_child(Profile* profile, isize function) {
+    isize parent = profile->current;
+    for (isize child = profile->nodes[parent].first_child; child >= 0;
+         child = profile->nodes[child].next_sibling) {
+        if (profile->nodes[child].function == function) {
+            profile->nodes[child].calls++;
+            return child;
+        }
+    }
+    return profile_add_node(profile, function, parent);
+}
+
+void profile_call(Profile* profile, isize function) {
+    profile_charge_ticks(profile);
+    profile->current = profile_child(profile, function);
+}
+
+void profile_tail_call(Profile* profile, isize function) {
+    profile_charge_ticks(profile);
+    isize parent = profile->nodes[profile->current].parent;
+    if (parent < 0) {
+        // Only the entry function has no caller
+        profile->current = profile_add_node(profile, function, -1);
+        return;
+    }
+    profile->current = parent;
+    profile->current = profile_child(profile, function);
+}
+
+void profile_return(Profile* profile) {
+    profile_charge_ticks(profile);
+    isize parent = profile->nodes[profile->current].parent;
+    if (parent >= 0) {
+        profile->current = parent;
+    }
+}
+
+static void print_share(std::ostream& os, u64 count, u64 total) {
+    double share = total ? 100.0 * count / total : 0.0;
+    os << std::setw(16) << count << std::setw(8) << std::fixed
+       << std::setprecision(2) << share << "%";
+}
+
+void profile_report(const Profile* profile, std::ostream& os) {
+    isize function_count = profile->linked.functions.size;
+    std::vector<u64> function_instructions(function_count);
+    std::vector<u64> linked_ops((isize)LinkedOp::Count);
+    std::vector<u64> inst_types(INST_TYPE_COUNT);
+    std::vector<u64> bin_operands(BIN_OPERAND_COUNT);
+    struct Hot {
+        isize function;
+        isize offset;
+        u64 count;
+    };
+    std::vector<Hot> hot;
+    u64 total = 0;
+
+    for (isize f = 0; f < function_count; f++) {
+        Slice<u8> function = profile->linked.functions[f];
+        Slice<u64> counts = profile->counts[f];
+        for (isize offset = 0; offset < counts.size; offset++) {
+            u64 count = counts[offset];
+            if (count == 0) {
+                continue;
+            }
+            total += count;
+            function_instructions[f] += count;
+            hot.push_back(Hot{f, offset, count});
+
+            LinkedDecoded decoded = link_decode(function, offset);
+            linked_ops[(isize)decoded.op] += count;
+            // A superinstruction counts for both of its instructions
+            Inst insts[2] = {decoded.inst, decoded.inst};
+            isize inst_count = 1;
+            if (linked_op_is_fused(decoded.op)) {
+                LinkedOp first = LINKED_OP_INFO[(isize)decoded.op].first;
+                insts[inst_count++] =
+                    link_decode(function, offset + LINK_OPCODE_SIZE +
+                                              linked_op_size(first))
+                        .inst;
+            }
+            for (isize i = 0; i < inst_count; i++) {
+                inst_types[(isize)insts[i].type] += count;
+                if (insts[i].type == InstType::BinaryOp) {
+                    bin_operands[(isize)insts[i].binary.op] += count;
+                }
+            }
+        }
+    }
+
+    // The time of a function includes its callees, but a recursive call is
+    // not counted again
+    std::vector<u64> self_ticks(function_count);
+    std::vector<u64> total_ticks(function_count);
+    std::vector<u64> calls(function_count);
+    std::vector<u64> subtree_ticks(profile->nodes.size);
+    for (isize i = profile->nodes.size - 1; i >= 0; i--) {
+        ProfileNode node = profile->nodes.data[i];
+        subtree_ticks[i] += node.ticks;
+        self_ticks[node.function] += node.ticks;
+        calls[node.function] += node.calls;
+        if (node.parent >= 0) {
+            subtree_ticks[node.parent] += subtree_ticks[i];
+        }
+    }
+    std::vector<isize> on_path(function_count);
+    // Negative entries leave the node
+    std::vector<isize> stack;
+    for (isize root = 0; root < profile->nodes.size; root++) {
+        if (profile->nodes.data[root].parent < 0) {
+            stack.push_back(root);
+        }
+    }
+    while (!stack.empty()) {
+        isize entry = stack.back();
+        stack.pop_back();
+        if (entry < 0) {
+            on_path[profile->nodes.data[~entry].function]--;
+            continue;
+        }
+        ProfileNode node = profile->nodes.data[entry];
+        if (on_path[node.function]++ == 0) {
+            total_ticks[node.function] += subtree_ticks[entry];
+        }
+        stack.push_back(~entry);
+        for (isize child = node.first_child; child >= 0;
+             child = profile->nodes.data[child].next_sibling) {
+            stack.push_back(child);
+        }
+    }
+    u64 all_ticks = 0;
+    for (isize f = 0; f < function_count; f++) {
+        all_ticks += self_ticks[f];
+    }
+
+    os << "Profile, " << total << " instructions";
+    if (profile->timed) {
+        os << ", " << all_ticks << " " << PROFILE_TICKS_UNIT;
+    }
+    os << std::endl;
+
+    os << std::endl << "Functions:" << std::endl;
+    // The counts are followed by their share, 9 characters
+    os << std::setw(8) << "fn" << std::setw(16) << "calls" << std::setw(16)
+       << "instructions" << std::setw(9) << "";
+    if (profile->timed) {
+        os << std::setw(16) << std::string("self ") + PROFILE_TICKS_UNIT
+           << std::setw(9) << "" << std::setw(16)
+           << std::string("total ") + PROFILE_TICKS_UNIT;
+    }
+    os << std::endl;
+    std::vector<isize> order(function_count);
+    for (isize f = 0; f < function_count; f++) {
+        order[f] = f;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](isize a, isize b) {
+        return profile->timed ? self_ticks[a] > self_ticks[b]
+                              : function_instructions[a] >
+                                    function_instructions[b];
+    });
+    for (isize f : order) {
+        if (calls[f] == 0) {
+            continue;
+        }
+        os << std::setw(8) << f << std::setw(16) << calls[f];
+        print_share(os, function_instructions[f], total);
+        if (profile->timed) {
+            print_share(os, self_ticks[f], all_ticks);
+            print_share(os, total_ticks[f], all_ticks);
+        }
+        os << std::endl;
+    }
+
+    os << std::endl << "Instructions by type:" << std::endl;
+    for (isize i = 0; i < INST_TYPE_COUNT; i++) {
+        if (inst_types[i]) {
+            os << "  " << std::left << std::setw(22)
+               << inst_type_name((InstType)i) << std::right;
+            print_share(os, inst_types[i], total);
+            os << std::endl;
+        }
+    }
+
+    os << std::endl << "Binary operators:" << std::endl;
+    for (isize i = 0; i < BIN_OPERAND_COUNT; i++) {
+        if (bin_operands[i]) {
+            std::stringstream name;
+            name << (BinOperand)i;
+            os << "  " << std::left << std::setw(22) << name.str()
+               << std::right;
+            print_share(os, bin_operands[i], total);
+            os << std::endl;
+        }
+    }
+
+    os << std::endl << "Linked instructions:" << std::endl;
+    isize name_width = 0;
+    for (isize i = 0; i < (isize)LinkedOp::Count; i++) {
+        if (linked_ops[i]) {
+            name_width = std::max<isize>(name_width,
+                                         strlen(linked_op_name((LinkedOp)i)));
+        }
+    }
+    for (isize i = 0; i < (isize)LinkedOp::Count; i++) {
+        if (linked_ops[i]) {
+            os << "  " << std::left << std::setw(name_width)
+               << linked_op_name((LinkedOp)i) << std::right;
+            print_share(os, linked_ops[i], total);
+            os << std::endl;
+        }
+    }
+
+    const isize HOT_COUNT = 20;
+    isize hot_count = std::min<isize>(hot.size(), HOT_COUNT);
+    std::partial_sort(hot.begin(), hot.begin() + hot_count, hot.end(),
+                      [](Hot a, Hot b) { return a.count > b.count; });
+    os << std::endl << "Hottest instructions:" << std::endl;
+    for (isize i = 0; i < hot_count; i++) {
+        LinkedDecoded decoded =
+            link_decode(profile->linked.functions[hot[i].function],
+                        hot[i].offset);
+        os << std::setw(8) << hot[i].function << std::setw(8)
+           << hot[i].offset;
+        print_share(os, hot[i].count, total);
+        os << "  " << decoded.op << " " << decoded.inst << std::endl;
+    }
+}
+
+void profile_write_folded(const Profile* profile, std::ostream& os) {
+    std::vector<isize> path;
+    for (isize i = 0; i < profile->nodes.size; i++) {
+        ProfileNode node = profile->nodes.data[i];
+        u64 weight = profile->timed ? node.ticks : node.instructions;
+        if (weight == 0) {
+            continue;
+        }
+        path.clear();
+        for (isize n = i; n >= 0; n = profile->nodes.data[n].parent) {
+            path.push_back(profile->nodes.data[n].function);
+        }
+        for (isize j = path.size() - 1; j >= 0; j--) {
+            os << "fn" << path[j] << (j > 0 ? ";" : " ");
+        }
+        os << weight << "\n";
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "core.hpp"
+#include "linker.hpp"
+#include <ostream>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <ctime>
+#endif
+
+// Execution profile of one run of a VM, see `vm_enable_profiling`. The
+// interpreter counts every instruction it dispatches by its address, and
+// follows the calls in a tree of call paths. With `timed`, the time between
+// two calls or returns goes to the call path it was spent in, read from the
+// time stamp counter.
+//
+// A profiled VM only interprets, the native code is not used, and the counts
+// are of linked instructions: a superinstruction is one dispatch.
+
+// One path through the calls, from the entry function down to `function`
+struct ProfileNode {
+    isize function;
+    // Indices into `Profile::nodes`, -1 if there is none
+    isize parent;
+    isize first_child;
+    isize next_sibling;
+    u64 calls;
+    // Executed in this function on this path, the callees not included
+    u64 instructions;
+    u64 ticks;
+};
+
+struct Profile {
+    LinkedUnit linked;
+    bool timed;
+    // Dispatches by function, then by the offset of the instruction in the
+    // linked code of the function
+    Slice<Slice<u64>> counts;
+    // The first node is the entry function
+    Array<ProfileNode> nodes;
+    isize current;
+    u64 last_ticks;
+};
+
+#if defined(__x86_64__)
+const char* const PROFILE_TICKS_UNIT = "cycles";
+inline u64 profile_ticks() { return __rdtsc(); }
+#else
+const char* const PROFILE_TICKS_UNIT = "ns";
+inline u64 profile_ticks() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+Profile* profile_make(LinkedUnit linked, bool timed, Arena* arena);
+
+// Called by the interpreter for every instruction at `offset` in `function`
+inline void profile_count(Profile* profile, isize function, isize offset) {
+    profile->counts.data[function].data[offset]++;
+    profile->nodes.data[profile->current].instructions++;
+}
+
+// Gives the time since the last call or return to the current call path
+inline void profile_charge_ticks(Profile* profile) {
+    if (profile->timed) {
+        u64 now = profile_ticks();
+        profile->nodes.data[profile->current].ticks +=
+            now - profile->last_ticks;
+        profile->last_ticks = now;
+    }
+}
+
+void profile_call(Profile* profile, isize function);
+// The callee replaces the current function on the path
+void profile_tail_call(Profile* profile, isize function);
+void profile_return(Profile* profile);
+
+// Counts by function, by instruction type, binary operator and linked
+// instruction, and the hottest instructions
+void profile_report(const Profile* profile, std::ostream& os);
+
+// One line per call path, `fn0;fn1;fn3 <weight>` as flame graph tools read
+// them. The weight is the ticks if timed, the instructions otherwise.
+void profile_write_folded(const Profile* profile, std::ostream& os);
@@ -0,0 +1,70 @@
+#include "runner.hpp"
+#include "core.hpp"
+#include "snapshot.hpp"
+#include "vm.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+struct RunQueue {
+    Slice<RunJob> jobs;
+    std::atomic<isize> next;
+    isize stack_size;
+};
+
+// Takes jobs from the queue until it is empty
+static void run_worker(RunQueue* queue) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    // The VM is only allocated once the worker gets its first
+    // job, so idle workers do not touch the memory of the stacks.
+    VM* vm = nullptr;
+    while (true) {
+        isize index = queue->next.fetch_add(1, std::memory_order_relaxed);
+        if (index >= queue->jobs.size) {
+            break;
+        }
+
+        RunJob* job = &queue->jobs[index];
+        if (vm) {
+            vm_reset(vm, *job->image);
+        } else {
+            vm = vm_make(*job->image, queue->stack_size, &arena);
+        }
+        vm->stdout = job->stdout;
+        vm->stderr = job->stderr;
+
+        const char* error = nullptr;
+        if (job->snapshot &&
+            !snapshot_restore(vm, *job->image, job->snapshot, &error)) {
+            fprintf(job->stderr, "Error: %s\n", error);
+            job->exit_code = 1;
+            continue;
+        }
+        vm_run(vm);
+        job->exit_code = stack_pop<u8>(&vm->stack);
+    }
+}
+
+void run_jobs(Slice<RunJob> jobs, isize thread_count, isize stack_size) {
+    RunQueue queue;
+    queue.jobs = jobs;
+    queue.next = 0;
+    queue.stack_size = stack_size;
+
+    if (thread_count <= 1) {
+        run_worker(&queue);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+    for (isize i = 0; i < thread_count; i++) {
+        threads.emplace_back(run_worker, &queue);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "core.hpp"
+#include "vm.hpp"
+#include <cstdio>
+
+// Runs a batch of independent programs on a pool of threads, following the
+// execution model in `vm.hpp`. The images are shared, every worker has its own
+// VM, which it resets between the jobs.
+
+struct Snapshot;
+
+struct RunJob {
+    const VmImage* image;
+    // Where the program continues from (`snapshot.hpp`), null to run it from
+    // the start
+    const Snapshot* snapshot;
+    // Where the program prints, only touched by the thread running the job
+    FILE* stdout;
+    FILE* stderr;
+    // Filled in once the job ran, 1 if the snapshot could not be restored
+    u8 exit_code;
+};
+
+// Runs every job to its `Exit`. Blocks until all of them are done, with
+// `thread_count` <= 1 they run on the calling thread.
+void run_jobs(Slice<RunJob> jobs, isize thread_count, isize stack_size);
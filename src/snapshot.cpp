@@ -0,0 +1,284 @@
+#include "snapshot.hpp"
+#include "bytecode_file.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include "verifier.hpp"
+#include "vm.hpp"
+#include <cstdio>
+
+static isize align8(isize offset) { return (offset + 7) & ~(isize)7; }
+
+u64 snapshot_image_hash(VmImage image, Arena* arena) {
+    // The linked code has the addresses of the builtins in it,
+    // the serialized code does not.
+    Slice<u8> bytes =
+        bytecode_file_serialize(image.linked, image.code.static_data, arena);
+    u64 hash = 14695981039346656037ull;
+    for (isize i = 0; i < bytes.size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+Slice<u8> snapshot_take(const VM* vm, Arena* arena) {
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.finished = vm->finished;
+    header.image_hash =
+        snapshot_image_hash(VmImage{.code = vm->code,
+                                    .linked = vm->linked,
+                                    .verified = vm->verified,
+                                    .jit = nullptr},
+                            arena);
+    header.fp = vm->fp;
+    header.ip = vm->ip;
+    header.bp = vm->bp;
+    header.stack_size = vm->stack.size;
+    header.call_count = vm->calls.size;
+    header.output_size = vm->output.size;
+
+    isize stack_offset = align8(sizeof(header));
+    isize calls_offset = align8(stack_offset + vm->stack.size);
+    isize output_offset =
+        calls_offset + vm->calls.size * (isize)sizeof(SnapshotFrame);
+    isize size = output_offset + vm->output.size;
+
+    Slice<u8> bytes = {arena_alloc<u8>(arena, size), size};
+    memset(bytes.data, 0, size);
+    memcpy(bytes.data, &header, sizeof(header));
+    memcpy(bytes.data + stack_offset, vm->stack.data, vm->stack.size);
+    for (isize i = 0; i < vm->calls.size; i++) {
+        CallFrame call = vm->calls.data[i];
+        SnapshotFrame frame = {
+            .fp = (u64)call.fp,
+            .return_offset =
+                (u64)(call.return_ip - vm->linked.functions[call.fp].data),
+            .bp = (u64)call.bp,
+        };
+        memcpy(bytes.data + calls_offset + i * sizeof(SnapshotFrame), &frame,
+               sizeof(frame));
+    }
+    memcpy(bytes.data + output_offset, vm->output.data, vm->output.size);
+    return bytes;
+}
+
+bool snapshot_write(const char* path, const VM* vm) {
+    Arena arena = {};
+    arena_init(&arena, 16 * 1024);
+    defer(arena_free(&arena));
+    Slice<u8> bytes = snapshot_take(vm, &arena);
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written =
+        fwrite(bytes.data, 1, bytes.size, file) == (size_t)bytes.size;
+    return fclose(file) == 0 && written;
+}
+
+// Whether an instruction of the linked function starts at `offset`
+static bool is_instruction_start(Slice<u8> function, u64 offset) {
+    isize current = 0;
+    while (current < function.size && (u64)current < offset) {
+        current += link_decode(function, current).size;
+    }
+    return current < function.size && (u64)current == offset;
+}
+
+static bool is_code_position(LinkedUnit linked, u64 fp, u64 offset) {
+    return fp < (u64)linked.functions.size &&
+           is_instruction_start(linked.functions[fp], offset);
+}
+
+// Whether the instruction before `offset` is a `Call`, sets `call` to its
+// offset
+static bool follows_call(Slice<u8> function, u64 offset, isize* call) {
+    isize current = 0;
+    isize previous = -1;
+    while (current < function.size && (u64)current < offset) {
+        previous = current;
+        current += link_decode(function, current).size;
+    }
+    if ((u64)current != offset || previous < 0) {
+        return false;
+    }
+    *call = previous;
+    return link_decode(function, previous).inst.type == InstType::Call;
+}
+
+// Whether the frames are the ones the verified code could have built: the
+// outermost one is the entry function's at the bottom of the stack, every
+// return address follows a `Call`, every callee's BP is the top of its
+// caller's frame at that call and the callee does not reach below it, and the
+// current frame is as high as the verifier found it at the instruction
+// pointer. The registers already point into the code.
+static bool frames_consistent(VmImage image, SnapshotHeader header,
+                              Slice<SnapshotFrame> calls, Arena* arena) {
+    VerifyFrames frames = {};
+    if (!verify_linked_unit(image.linked, image.code.static_data, arena,
+                            nullptr, &frames) ||
+        header.fp >= (u64)image.linked.functions.size) {
+        return false;
+    }
+
+    u64 entry_fp = calls.size > 0 ? calls[0].fp : header.fp;
+    u64 entry_bp = calls.size > 0 ? calls[0].bp : header.bp;
+    if (entry_fp != 0 || entry_bp != 0) {
+        return false;
+    }
+    for (isize i = 0; i < calls.size; i++) {
+        SnapshotFrame frame = calls[i];
+        isize call = 0;
+        if (!follows_call(image.linked.functions[frame.fp],
+                          frame.return_offset, &call)) {
+            return false;
+        }
+        u64 callee_fp = i + 1 < calls.size ? calls[i + 1].fp : header.fp;
+        u64 callee_bp = i + 1 < calls.size ? calls[i + 1].bp : header.bp;
+        isize height = frames.heights[frame.fp][call];
+        if (height < 0 || callee_bp != frame.bp + (u64)height ||
+            frames.below[callee_fp] > height) {
+            return false;
+        }
+    }
+
+    // A finished VM does not run anymore, `Exit` left its code on the stack
+    if (header.finished) {
+        return true;
+    }
+    isize height = frames.heights[header.fp][header.ip];
+    return height >= 0 && header.stack_size == header.bp + (u64)height;
+}
+
+bool snapshot_decode(Slice<u8> bytes, VmImage image, Snapshot* snapshot,
+                     Arena* arena, const char** error) {
+    *snapshot = {};
+    SnapshotHeader header;
+    if (bytes.size < (isize)sizeof(header)) {
+        *error = "Not a snapshot";
+        return false;
+    }
+    memcpy(&header, bytes.data, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))) {
+        *error = "Not a snapshot";
+        return false;
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        *error = "Unsupported snapshot version";
+        return false;
+    }
+    if (header.image_hash != snapshot_image_hash(image, arena)) {
+        *error = "The snapshot is of a different program";
+        return false;
+    }
+
+    u64 size = bytes.size;
+    u64 stack_offset = align8(sizeof(header));
+    if (header.stack_size > size - stack_offset) {
+        *error = "Truncated snapshot";
+        return false;
+    }
+    u64 calls_offset = align8(stack_offset + header.stack_size);
+    if (calls_offset > size ||
+        header.call_count > (size - calls_offset) / sizeof(SnapshotFrame)) {
+        *error = "Truncated snapshot";
+        return false;
+    }
+    u64 output_offset =
+        calls_offset + header.call_count * sizeof(SnapshotFrame);
+    if (header.output_size != size - output_offset) {
+        *error = "Truncated snapshot";
+        return false;
+    }
+
+    Slice<SnapshotFrame> calls = {
+        arena_alloc<SnapshotFrame>(arena, header.call_count),
+        (isize)header.call_count};
+    memcpy(calls.data, bytes.data + calls_offset,
+           header.call_count * sizeof(SnapshotFrame));
+
+    // The registers and return addresses point into the code
+    bool valid = header.bp <= header.stack_size &&
+                 (header.finished ||
+                  is_code_position(image.linked, header.fp, header.ip));
+    for (isize i = 0; i < calls.size; i++) {
+        valid = valid && calls[i].bp <= header.stack_size &&
+                is_code_position(image.linked, calls[i].fp,
+                                 calls[i].return_offset);
+    }
+    if (!valid) {
+        *error = "The snapshot points outside of the program";
+        return false;
+    }
+    // Unverified code checks the frames as it runs
+    if (image.verified && !frames_consistent(image, header, calls, arena)) {
+        *error = "The snapshot's frames do not match the program";
+        return false;
+    }
+
+    snapshot->header = header;
+    snapshot->stack = {bytes.data + stack_offset, (isize)header.stack_size};
+    snapshot->calls = calls;
+    snapshot->output = {bytes.data + output_offset, (isize)header.output_size};
+    return true;
+}
+
+bool snapshot_load(const char* path, VmImage image, Snapshot* snapshot,
+                   Arena* arena, const char** error) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        *error = "Could not open file";
+        return false;
+    }
+    defer(fclose(file));
+
+    if (fseek(file, 0, SEEK_END) != 0) {
+        *error = "Could not seek file";
+        return false;
+    }
+    isize size = ftell(file);
+    rewind(file);
+    if (size < 0) {
+        *error = "Could not get file size";
+        return false;
+    }
+    Slice<u8> bytes = {arena_alloc<u8>(arena, size), size};
+    if ((isize)fread(bytes.data, 1, size, file) != size) {
+        *error = "Could not read file";
+        return false;
+    }
+    return snapshot_decode(bytes, image, snapshot, arena, error);
+}
+
+bool snapshot_restore(VM* vm, VmImage image, const Snapshot* snapshot,
+                      const char** error) {
+    if (snapshot->stack.size > vm->stack.capacity ||
+        snapshot->calls.size > vm->calls.capacity ||
+        snapshot->output.size > vm->output.capacity) {
+        *error = "The snapshot does not fit into the VM";
+        return false;
+    }
+
+    vm_reset(vm, image);
+    vm->fp = snapshot->header.fp;
+    vm->ip = snapshot->header.ip;
+    vm->bp = snapshot->header.bp;
+    vm->finished = snapshot->header.finished;
+    memcpy(vm->stack.data, snapshot->stack.data, snapshot->stack.size);
+    vm->stack.size = snapshot->stack.size;
+    for (isize i = 0; i < snapshot->calls.size; i++) {
+        SnapshotFrame frame = snapshot->calls[i];
+        vm->calls.data[i] = CallFrame{
+            .fp = (isize)frame.fp,
+            .return_ip = vm->linked.functions[frame.fp].data +
+                         frame.return_offset,
+            .bp = (isize)frame.bp,
+        };
+    }
+    vm->calls.size = snapshot->calls.size;
+    memcpy(vm->output.data, snapshot->output.data, snapshot->output.size);
+    vm->output.size = snapshot->output.size;
+    return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "core.hpp"
+#include "vm.hpp"
+
+// Snapshots of a paused VM, to run an expensive setup once and start any
+// number of VMs from where it ended.
+//
+// A snapshot is the state a program changes (`vm.hpp`): the registers, the
+// data and call stacks and the output not written out yet. The image is not
+// part of it, only a hash of the image, which the VM restoring the snapshot
+// has to run. Return addresses are stored relative to their function. The
+// VM has to be paused outside of native code: before its first run, after
+// `vm_run_for` yielded or finished, or between two `vm_execute_inst`.
+// Tiering counters and the JIT state are not saved, a restored VM starts
+// them anew.
+//
+// All the integers are little endian, the sections follow one another 8 byte
+// aligned:
+// - `SnapshotHeader`
+// - the data stack
+// - `SnapshotFrame` for every call frame, the outermost first
+// - the buffered output
+
+const u8 SNAPSHOT_MAGIC[8] = {'J', 'A', 'Z', 'Z', 'S', 0, 0, 0};
+const u32 SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    u8 magic[8];
+    u32 version;
+    u32 finished;
+    u64 image_hash;
+    u64 fp;
+    u64 ip;
+    u64 bp;
+    u64 stack_size;
+    u64 call_count;
+    u64 output_size;
+};
+
+struct SnapshotFrame {
+    u64 fp;
+    // Relative to the start of the caller's linked code
+    u64 return_offset;
+    u64 bp;
+};
+
+// Points into the bytes it was decoded from
+struct Snapshot {
+    SnapshotHeader header;
+    Slice<u8> stack;
+    Slice<SnapshotFrame> calls;
+    Slice<u8> output;
+};
+
+// Identifies the code of the image, the same in every process
+u64 snapshot_image_hash(VmImage image, Arena* arena);
+
+Slice<u8> snapshot_take(const VM* vm, Arena* arena);
+
+// Returns false if the file could not be written
+bool snapshot_write(const char* path, const VM* vm);
+
+// Decodes the snapshot and checks that it belongs to `image`, that every
+// register and return address points into its code and every frame into the
+// stack. For verified code the frames also have to match what the verifier
+// proved about them, as it runs without checks. Returns false and sets
+// `error` otherwise.
+bool snapshot_decode(Slice<u8> bytes, VmImage image, Snapshot* snapshot,
+                     Arena* arena, const char** error);
+
+// Reads the whole file and decodes it, the snapshot lives in `arena`
+bool snapshot_load(const char* path, VmImage image, Snapshot* snapshot,
+                   Arena* arena, const char** error);
+
+// Resets the VM to `image` and continues it from the snapshot, which was
+// decoded for the same image. Returns false if the stacks of the VM are too
+// small for it.
+bool snapshot_restore(VM* vm, VmImage image, const Snapshot* snapshot,
+                      const char** error);
@@ -0,0 +1,20 @@
+#pragma once
+
+// Generated by `jazz_superinstructions --emit src/superinstructions.hpp
+// examples/collatz.jazz examples/fib.jazz examples/gcd.jazz examples/loops.jazz
+// examples/primes.jazz examples/triangle.jazz`, do not edit by hand.
+//
+// Pairs of linked instructions which get fused into a single superinstruction,
+// the most frequently executed pairs first. `X` is called as X(first, second).
+#define SUPERINSTRUCTIONS(X)                                                   \
+    X(BinaryOp_Int_Add_StackRel_Immediate, Jump)                               \
+    X(JumpIf_StackRel_False, BinaryOp_Int_Div_StackRel_Immediate)              \
+    X(BinaryOp_Int_Equal_StackRel_Immediate, JumpIf_StackRel_False)            \
+    X(BinaryOp_Int_LessThan_StackRel_Immediate, JumpIf_StackRel_False)         \
+    X(BinaryOp_Int_Sub_StackRel_StackRel,                                      \
+      BinaryOp_Int_Equal_StackRel_Immediate)                                   \
+    X(BinaryOp_Int_Add_StackRel_Immediate,                                     \
+      BinaryOp_Int_Add_StackRel_Immediate)                                     \
+    X(BinaryOp_Int_Add_StackRel_StackRel,                                      \
+      BinaryOp_Int_Add_StackRel_Immediate)                                     \
+    X(JumpIf_StackRel_False, BinaryOp_Int_Add_StackRel_StackRel)
@@ -0,0 +1,91 @@
+#include "tiering.hpp"
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "jit.hpp"
+#include <iomanip>
+
+Tiering* tiering_make(CodeUnit code, u64 threshold, Arena* arena) {
+    Tiering* tiering = arena_alloc<Tiering>(arena);
+    tiering->code = code;
+    tiering->threshold = threshold;
+    tiering->functions = {
+        arena_alloc<TierCounters>(arena, code.functions.size),
+        code.functions.size};
+    array_init(&tiering->transitions, 8, arena);
+    tiering->jit = nullptr;
+    tiering->arena = arena;
+    return tiering;
+}
+
+void tiering_free(Tiering* tiering) {
+    jit_free(tiering->jit);
+    tiering->jit = nullptr;
+}
+
+void tiering_promote(Tiering* tiering, isize function) {
+    TierCounters* hot = &tiering->functions[function];
+    core_assert(hot->tier == Tier::Interpreted);
+
+    Slice<bool> wanted = {
+        arena_alloc<bool>(tiering->arena, tiering->functions.size),
+        tiering->functions.size};
+    for (isize i = 0; i < wanted.size; i++) {
+        wanted[i] = tiering->functions[i].tier == Tier::Native;
+    }
+    wanted[function] = true;
+
+    TierTransition transition = {
+        .function = function,
+        .tier = Tier::Unsupported,
+        .hot_function = function,
+        .invocations = hot->invocations,
+        .back_edges = hot->back_edges,
+    };
+
+    JitCode* jit = jit_compile(tiering->code, wanted, tiering->arena);
+    if (!jit || !jit->functions[function]) {
+        // The native code of the other functions is still the same
+        jit_free(jit);
+        hot->tier = Tier::Unsupported;
+        array_push(&tiering->transitions, transition);
+        return;
+    }
+
+    jit_free(tiering->jit);
+    tiering->jit = jit;
+    // The hot function first, then the callees that came along
+    transition.tier = Tier::Native;
+    hot->tier = Tier::Native;
+    array_push(&tiering->transitions, transition);
+    for (isize i = 0; i < tiering->functions.size; i++) {
+        TierCounters* counters = &tiering->functions[i];
+        if (jit->functions[i] && counters->tier != Tier::Native) {
+            counters->tier = Tier::Native;
+            transition.function = i;
+            array_push(&tiering->transitions, transition);
+        }
+    }
+}
+
+void tiering_dump(const Tiering* tiering, std::ostream& os) {
+    os << "Tiering, threshold " << tiering->threshold << std::endl;
+    os << "      fn   invocations    back edges  tier" << std::endl;
+    for (isize i = 0; i < tiering->functions.size; i++) {
+        TierCounters counters = tiering->functions.data[i];
+        os << std::setw(8) << i << std::setw(14) << counters.invocations
+           << std::setw(14) << counters.back_edges << "  "
+           << tier_name(counters.tier) << std::endl;
+    }
+
+    os << "Tier transitions:" << std::endl;
+    for (isize i = 0; i < tiering->transitions.size; i++) {
+        TierTransition transition = tiering->transitions.data[i];
+        os << "  fn " << transition.function << " -> "
+           << tier_name(transition.tier);
+        if (transition.function != transition.hot_function) {
+            os << " (callee of fn " << transition.hot_function << ")";
+        }
+        os << " after " << transition.invocations << " invocations, "
+           << transition.back_edges << " back edges" << std::endl;
+    }
+}
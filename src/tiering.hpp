@@ -0,0 +1,80 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "jit.hpp"
+#include <ostream>
+
+// Tiered execution. Every function starts out interpreted (tier 0), the VM
+// counts how often each one is called and how many backward jumps it takes.
+// Once the sum crosses the threshold on a call, the function is compiled by
+// the JIT (tier 1), together with the functions it calls, and the call enters
+// the native code from then on. Cold code is never compiled.
+//
+// The counters and the native code belong to one run of one VM, `vm_run` only
+// tiers up verified code. Native code is never left for the interpreter, so
+// when the interpreter tiers up a function no native code is running and the
+// previous native code can be replaced.
+
+enum class Tier : u8 {
+    Interpreted,
+    Native,
+    // Crossed the threshold, but the JIT could not compile it
+    Unsupported,
+};
+
+struct TierCounters {
+    u64 invocations;
+    u64 back_edges;
+    Tier tier;
+};
+
+struct TierTransition {
+    isize function;
+    Tier tier;
+    // The function that crossed the threshold, this one may have come along
+    // as its callee
+    isize hot_function;
+    // The counters of `hot_function` at that point
+    u64 invocations;
+    u64 back_edges;
+};
+
+struct Tiering {
+    CodeUnit code;
+    // Invocations plus back edges before a function is compiled
+    u64 threshold;
+    // Indexed by the function index of `code.functions`
+    Slice<TierCounters> functions;
+    Array<TierTransition> transitions;
+    // Every native function so far, replaced on every tier up
+    JitCode* jit;
+    Arena* arena;
+};
+
+const u64 TIERING_DEFAULT_THRESHOLD = 1000;
+
+Tiering* tiering_make(CodeUnit code, u64 threshold, Arena* arena);
+
+// Unmaps the native code
+void tiering_free(Tiering* tiering);
+
+// Compiles the hot `function` and everything it calls, keeps the previously
+// compiled functions
+void tiering_promote(Tiering* tiering, isize function);
+
+// The counters and the tier of every function, and the tier transitions in
+// the order they happened
+void tiering_dump(const Tiering* tiering, std::ostream& os);
+
+inline const char* tier_name(Tier tier) {
+    switch (tier) {
+    case Tier::Interpreted:
+        return "interpreted";
+    case Tier::Native:
+        return "native";
+    case Tier::Unsupported:
+        return "unsupported";
+    }
+    return "unknown";
+}
@@ -0,0 +1,416 @@
+#include "verifier.hpp"
+#include "builtin.hpp"
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+
+struct VerifyTailCall {
+    isize caller;
+    isize callee;
+};
+
+struct VerifyContext {
+    LinkedUnit linked;
+    Slice<u8> static_data;
+    // How far below BP each function reaches (its arguments and return
+    // value), 0 if it does not
+    Slice<isize> below;
+
+    // Every `TailCall`, the caller and the callee
+    Array<VerifyTailCall> tail_calls;
+
+    isize function;
+    isize offset;
+    const char* message;
+};
+
+static bool verify_fail(VerifyContext* ctx, const char* message) {
+    if (!ctx->message) {
+        ctx->message = message;
+    }
+    return false;
+}
+
+// `height` is the current height of the frame
+static bool verify_operand(VerifyContext* ctx, MemPtr ptr, isize size,
+                           isize height, bool write) {
+    switch (ptr.type) {
+    case MemPtrType::StackRel: {
+        if (ptr.mem_offset >= 0) {
+            if (ptr.mem_offset + size > height) {
+                return verify_fail(ctx, "Operand above the top of the stack");
+            }
+            return true;
+        }
+        if (ptr.mem_offset + size > 0) {
+            return verify_fail(ctx, "Operand crosses BP");
+        }
+        return true;
+    }
+    case MemPtrType::StaticData: {
+        if (write) {
+            return verify_fail(ctx, "Write to the static data");
+        }
+        if (ptr.mem_offset < 0 ||
+            ptr.mem_offset + size > ctx->static_data.size) {
+            return verify_fail(ctx, "Operand outside of the static data");
+        }
+        return true;
+    }
+    case MemPtrType::Immediate: {
+        if (write) {
+            return verify_fail(ctx, "Write to an immediate");
+        }
+        if (size > (isize)sizeof(i64)) {
+            return verify_fail(ctx, "Immediate wider than 8 bytes");
+        }
+        return true;
+    }
+    case MemPtrType::Invalid:
+    case MemPtrType::StackAbs:
+    case MemPtrType::Heap:
+        return verify_fail(ctx, "Operand in an unverifiable mode");
+    }
+    return verify_fail(ctx, "Invalid addressing mode");
+}
+
+// Checks the operands of the instruction against the height of the frame
+static bool verify_operands(VerifyContext* ctx, Inst inst, isize height) {
+    isize operand_size = 0;
+    isize result_size = 0;
+    switch (inst.type) {
+    case InstType::BinaryOp: {
+        bin_operand_sizes(inst.binary.op, &operand_size, &result_size);
+        return verify_operand(ctx, inst.binary.left, operand_size, height,
+                              false) &&
+               verify_operand(ctx, inst.binary.right, operand_size, height,
+                              false) &&
+               verify_operand(ctx, inst.binary.dest, result_size, height,
+                              true);
+    }
+    case InstType::UnaryOp: {
+        unary_operand_sizes(inst.unary.op, &operand_size, &result_size);
+        return verify_operand(ctx, inst.unary.operand, operand_size, height,
+                              false) &&
+               verify_operand(ctx, inst.unary.dest, result_size, height,
+                              true);
+    }
+    case InstType::Mov: {
+        if (inst.mov.size < 0) {
+            return verify_fail(ctx, "Negative size of Mov");
+        }
+        return verify_operand(ctx, inst.mov.src, inst.mov.size, height,
+                              false) &&
+               verify_operand(ctx, inst.mov.dest, inst.mov.size, height, true);
+    }
+    case InstType::JumpIf: {
+        return verify_operand(ctx, inst.jump_if.condition, sizeof(bool),
+                              height, false);
+    }
+    case InstType::CallBuiltin: {
+        isize args_size = builtin_function_args_size(
+            (BuiltinFunctionPtr)inst.call_builtin.builtin);
+        if (args_size < 0) {
+            return verify_fail(ctx, "Unknown builtin function");
+        }
+        if (args_size > height) {
+            return verify_fail(ctx, "Builtin reads below the frame");
+        }
+        return true;
+    }
+    case InstType::Call: {
+        if (inst.call.fp < 0 || inst.call.fp >= ctx->linked.functions.size) {
+            return verify_fail(ctx, "Call to an invalid function");
+        }
+        // The callee's BP is the top of the caller's frame
+        if (ctx->below[inst.call.fp] > height) {
+            return verify_fail(ctx, "Callee reaches below the caller's frame");
+        }
+        return true;
+    }
+    case InstType::TailCall: {
+        if (inst.tail_call.fp < 0 ||
+            inst.tail_call.fp >= ctx->linked.functions.size) {
+            return verify_fail(ctx, "Call to an invalid function");
+        }
+        // The callee gets our BP, `below` of a function already includes its
+        // tail callees
+        return true;
+    }
+    case InstType::Return:
+    case InstType::PushStack:
+    case InstType::PopStack:
+    case InstType::Jump:
+    case InstType::Exit:
+        return true;
+    }
+    return verify_fail(ctx, "Invalid instruction");
+}
+
+static void verify_below(isize* below, MemPtr ptr) {
+    if (ptr.type == MemPtrType::StackRel && -ptr.mem_offset > *below) {
+        *below = -ptr.mem_offset;
+    }
+}
+
+// Walks the function in order, checks that it decodes, marks where the
+// instructions start and finds how far below BP the function reaches
+static bool verify_decode(VerifyContext* ctx, Slice<u8> function,
+                          Slice<bool> starts, isize* below) {
+    isize offset = 0;
+    bool second = false;
+    while (offset < function.size) {
+        ctx->offset = offset;
+        if (offset + LINK_OPCODE_SIZE > function.size) {
+            return verify_fail(ctx, "Truncated instruction");
+        }
+        LinkedOp op = link_read_op(function.data + offset);
+        if (op >= LinkedOp::Count) {
+            return verify_fail(ctx, "Invalid opcode");
+        }
+        LinkedOpInfo info = LINKED_OP_INFO[(isize)op];
+        if (offset + info.size > function.size) {
+            return verify_fail(ctx, "Truncated instruction");
+        }
+
+        if (linked_op_is_fused(op)) {
+            const u8* first = function.data + offset + LINK_OPCODE_SIZE;
+            const u8* next = first + linked_op_size(info.first);
+            if (link_read_op(first) != info.first ||
+                link_read_op(next) != info.second) {
+                return verify_fail(ctx, "Malformed superinstruction");
+            }
+        }
+
+        // The second instruction of a superinstruction can not be jumped to
+        starts[offset] = !second;
+        second = linked_op_is_fused(op);
+
+        LinkedDecoded decoded = link_decode(function, offset);
+        Inst inst = decoded.inst;
+        switch (inst.type) {
+        case InstType::BinaryOp:
+            verify_below(below, inst.binary.dest);
+            verify_below(below, inst.binary.left);
+            verify_below(below, inst.binary.right);
+            break;
+        case InstType::UnaryOp:
+            verify_below(below, inst.unary.dest);
+            verify_below(below, inst.unary.operand);
+            break;
+        case InstType::Mov:
+            verify_below(below, inst.mov.dest);
+            verify_below(below, inst.mov.src);
+            break;
+        case InstType::JumpIf:
+            verify_below(below, inst.jump_if.condition);
+            break;
+        case InstType::TailCall:
+            array_push(&ctx->tail_calls,
+                       VerifyTailCall{ctx->function, inst.tail_call.fp});
+            break;
+        default:
+            break;
+        }
+
+        offset += decoded.size;
+    }
+    return true;
+}
+
+// Records the height of the frame at `target`, it has to agree with the other
+// paths leading there
+static bool verify_branch(VerifyContext* ctx, Slice<bool> starts,
+                          Slice<isize> heights, Array<isize>* worklist,
+                          isize target, isize height) {
+    if (target < 0 || target >= starts.size || !starts[target]) {
+        return verify_fail(ctx, "Jump into the middle of an instruction");
+    }
+    if (heights[target] < 0) {
+        heights[target] = height;
+        array_push(worklist, target);
+        return true;
+    }
+    if (heights[target] != height) {
+        return verify_fail(ctx, "Inconsistent stack height");
+    }
+    return true;
+}
+
+// Fills in `heights`, which is as long as the function
+static bool verify_function(VerifyContext* ctx, Slice<u8> function,
+                            Slice<bool> starts, Slice<isize> heights,
+                            Arena* arena) {
+    for (isize i = 0; i < heights.size; i++) {
+        heights[i] = -1;
+    }
+    Array<isize> worklist = {};
+    array_init(&worklist, 16, arena);
+
+    // Every function starts with an empty frame
+    if (!verify_branch(ctx, starts, heights, &worklist, 0, 0)) {
+        return false;
+    }
+
+    while (worklist.size > 0) {
+        isize offset = array_pop(&worklist);
+        isize height = heights[offset];
+        ctx->offset = offset;
+
+        LinkedDecoded decoded = link_decode(function, offset);
+        Inst inst = decoded.inst;
+        isize next = offset + decoded.size;
+        if (!verify_operands(ctx, inst, height)) {
+            return false;
+        }
+
+        bool falls_through = true;
+        switch (inst.type) {
+        case InstType::PushStack: {
+            if (inst.push_stack.size < 0) {
+                return verify_fail(ctx, "Negative push");
+            }
+            height += inst.push_stack.size;
+            break;
+        }
+        case InstType::PopStack: {
+            if (inst.pop_stack.size < 0 || inst.pop_stack.size > height) {
+                return verify_fail(ctx, "Pop below the frame");
+            }
+            height -= inst.pop_stack.size;
+            break;
+        }
+        case InstType::Return: {
+            if (ctx->function == 0) {
+                return verify_fail(ctx, "Return from the entry function");
+            }
+            if (height != 0) {
+                return verify_fail(ctx, "Return with a non-empty frame");
+            }
+            falls_through = false;
+            break;
+        }
+        case InstType::TailCall: {
+            if (ctx->function == 0) {
+                return verify_fail(ctx, "Tail call from the entry function");
+            }
+            if (height != 0) {
+                return verify_fail(ctx, "Tail call with a non-empty frame");
+            }
+            falls_through = false;
+            break;
+        }
+        case InstType::Exit: {
+            falls_through = false;
+            break;
+        }
+        case InstType::Jump: {
+            if (!verify_branch(ctx, starts, heights, &worklist,
+                               inst.jump.new_ip, height)) {
+                return false;
+            }
+            falls_through = false;
+            break;
+        }
+        case InstType::JumpIf: {
+            if (!verify_branch(ctx, starts, heights, &worklist,
+                               inst.jump_if.new_ip, height)) {
+                return false;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (!falls_through) {
+            continue;
+        }
+        if (next >= function.size) {
+            return verify_fail(ctx, "Falls off the end of the function");
+        }
+        // The second instruction of a superinstruction is not a jump target,
+        // it is only reached from the first one
+        if (!starts[next]) {
+            heights[next] = height;
+            array_push(&worklist, next);
+        } else if (!verify_branch(ctx, starts, heights, &worklist, next,
+                                  height)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool verify_linked_unit(LinkedUnit linked, Slice<u8> static_data,
+                        Arena* arena, VerifyError* error,
+                        VerifyFrames* frames) {
+    VerifyContext ctx = {};
+    ctx.linked = linked;
+    ctx.static_data = static_data;
+    ctx.below = {arena_alloc<isize>(arena, linked.functions.size),
+                 linked.functions.size};
+
+    bool ok = linked.functions.size > 0;
+    if (!ok) {
+        verify_fail(&ctx, "No entry function");
+    }
+
+    Slice<Slice<bool>> starts = {
+        arena_alloc<Slice<bool>>(arena, linked.functions.size),
+        linked.functions.size};
+    array_init(&ctx.tail_calls, 8, arena);
+    for (isize i = 0; ok && i < linked.functions.size; i++) {
+        Slice<u8> function = linked.functions[i];
+        ctx.function = i;
+        starts[i] = {arena_alloc<bool>(arena, function.size), function.size};
+        memset(starts[i].data, 0, function.size);
+        ok = verify_decode(&ctx, function, starts[i], &ctx.below[i]);
+    }
+
+    // A tail callee runs with our BP, so whoever calls us has to leave room
+    // for it too. The reach only grows, so this stops even with recursion.
+    for (bool changed = ok; changed;) {
+        changed = false;
+        for (isize i = 0; i < ctx.tail_calls.size; i++) {
+            VerifyTailCall call = ctx.tail_calls[i];
+            if (call.callee < 0 || call.callee >= linked.functions.size) {
+                continue;
+            }
+            if (ctx.below[call.callee] > ctx.below[call.caller]) {
+                ctx.below[call.caller] = ctx.below[call.callee];
+                changed = true;
+            }
+        }
+    }
+
+    // The entry function runs with BP at the bottom of the stack
+    if (ok && ctx.below[0] > 0) {
+        ctx.function = 0;
+        ctx.offset = 0;
+        ok = verify_fail(&ctx, "Entry function reaches below the stack");
+    }
+
+    Slice<Slice<isize>> heights = {
+        arena_alloc<Slice<isize>>(arena, linked.functions.size),
+        linked.functions.size};
+    for (isize i = 0; ok && i < linked.functions.size; i++) {
+        Slice<u8> function = linked.functions[i];
+        ctx.function = i;
+        heights[i] = {arena_alloc<isize>(arena, function.size), function.size};
+        ok = verify_function(&ctx, function, starts[i], heights[i], arena);
+    }
+
+    if (ok && frames) {
+        *frames = VerifyFrames{.below = ctx.below, .heights = heights};
+    }
+    if (!ok && error) {
+        *error = VerifyError{
+            .function = ctx.function,
+            .offset = ctx.offset,
+            .message = ctx.message,
+        };
+    }
+    return ok;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+
+// The verifier proves, once before the code is run, what the VM would
+// otherwise check on every instruction. For every reachable instruction of
+// every function:
+// - it is a valid instruction and does not fall off the end of the function
+// - jump targets are at the start of an instruction (not in the middle of a
+//   superinstruction)
+// - the height of the stack frame (everything above BP) is the same no matter
+//   how the instruction is reached, it never drops below zero and it is zero
+//   on `Return` and `TailCall`
+// - every `StackRel` operand is inside the frame, or below BP (arguments and
+//   the return value), every `StaticData` operand is inside the static data
+//   and immediates are only read
+// - a callee only reaches below its BP into the frame of its caller, counting
+//   what the functions it tail calls reach, as they get the same BP
+//
+// Operands in the other modes (`StackAbs`, `Heap`) can not be verified. Only
+// the stack capacity is left to be checked at runtime, as the depth of the
+// recursion is not known.
+
+struct VerifyError {
+    isize function;
+    // Byte offset of the instruction in the linked function
+    isize offset;
+    const char* message;
+};
+
+// What the verifier found out about the stack frames, a paused VM can be
+// checked against it (`snapshot.hpp`)
+struct VerifyFrames {
+    // How far below BP each function reaches, with its tail callees
+    Slice<isize> below;
+    // The height of the frame before the instruction at every byte offset of
+    // every function, -1 where no reachable instruction starts
+    Slice<Slice<isize>> heights;
+};
+
+// Returns false and fills in `error` (if not null) if the code could not be
+// verified. The code is still valid, it just has to be run with the checks.
+// `frames` (if not null) is filled in for verified code.
+bool verify_linked_unit(LinkedUnit linked, Slice<u8> static_data,
+                        Arena* arena, VerifyError* error = nullptr,
+                        VerifyFrames* frames = nullptr);
@@ -3,99 +3,135 @@
 #include "bytecode.hpp"
 #include "core.hpp"
 
-#define CASE_BINARY_OP(op, type, op_symbol)                                    \
+#define CASE_BINARY_OP(op, type, result_type, op_symbol)                       \
     case BinOperand::op: {                                                     \
-        type left = *vm_ptr_read<type>(vm, current_inst.binary.left);          \
-        type right = *vm_ptr_read<type>(vm, current_inst.binary.right);        \
+        type left = vm_ptr_load<type>(vm, binary->left);                       \
+        type right = vm_ptr_load<type>(vm, binary->right);                     \
                                                                                \
-        type result = left op_symbol right;                                    \
-        vm_ptr_write<type>(vm, current_inst.binary.dest, result);              \
+        result_type result = left op_symbol right;                             \
+        vm_ptr_write<result_type>(vm, binary->dest, result);                   \
         break;                                                                 \
     }
 
+#define CASE_UNARY_OP(op, type, result_type, op_symbol)                        \
+    case UnaryOperand::op: {                                                   \
+        type value = vm_ptr_load<type>(vm, unary->operand);                    \
+                                                                               \
+        result_type result = op_symbol value;                                  \
+        vm_ptr_write<result_type>(vm, unary->dest, result);                    \
+        break;                                                                 \
+    }
+
+inline void vm_execute_unary_op(VM* vm, const InstUnaryOp* unary) {
+    switch (unary->op) { UNARY_OPERANDS(CASE_UNARY_OP) }
+}
+
+inline void vm_execute_binary_op(VM* vm, const InstBinaryOp* binary) {
+    switch (binary->op) { BIN_OPERANDS(CASE_BINARY_OP) }
+}
+
+inline void vm_execute_mov(VM* vm, MemPtr dest, MemPtr src, isize size) {
+    // The static data is shared by all the VMs running the code
+    core_assert_msg(dest.type != MemPtrType::StaticData,
+                    "Cannot write to static data, this should never happen");
+    u8* dest_raw = vm_ptr_to_raw(vm, dest);
+    if (src.type == MemPtrType::Immediate) {
+        // Only ints and bools are immediates, the value is stored
+        // in the low bytes (little endian)
+        i64 value = src.mem_offset;
+        core_assert(size <= (isize)sizeof(value));
+        memcpy(dest_raw, &value, size);
+        return;
+    }
+    memcpy(dest_raw, vm_ptr_to_raw(vm, src), size);
+}
+
+// Checks done by the interpreter unless it runs verified code, see
+// `verifier.hpp`. Needs `CHECKED` in scope.
+#define VM_CHECK(cond)                                                         \
+    do {                                                                       \
+        if constexpr (CHECKED) {                                               \
+            core_assert(cond);                                                 \
+        }                                                                      \
+    } while (0)
+
+// Operand access for the specialized instructions, where the addressing mode
+// is known at compile time
+template <typename T, MemPtrType MODE, bool CHECKED>
+inline T* vm_operand(VM* vm, isize offset) {
+    if constexpr (MODE == MemPtrType::StackRel) {
+        VM_CHECK(vm->bp + offset >= 0);
+        VM_CHECK(vm->bp + offset + (isize)sizeof(T) <= vm->stack.size);
+        return (T*)(vm->stack.data + vm->bp + offset);
+    } else {
+        static_assert(MODE == MemPtrType::StaticData);
+        VM_CHECK(offset >= 0);
+        VM_CHECK(offset + (isize)sizeof(T) <= vm->code.static_data.size);
+        return (T*)(vm->code.static_data.data + offset);
+    }
+}
+
+// Reads an encoded operand, immediates are decoded right from the instruction
+template <typename T, MemPtrType MODE, bool CHECKED>
+inline T vm_operand_value(VM* vm, u32 operand) {
+    if constexpr (MODE == MemPtrType::Immediate) {
+        return (T)link_operand_offset(operand);
+    } else {
+        return *vm_operand<T, MODE, CHECKED>(vm, link_operand_offset(operand));
+    }
+}
+
+template <isize SIZE> struct MovUnit;
+template <> struct MovUnit<1> {
+    using Type = u8;
+};
+template <> struct MovUnit<8> {
+    using Type = u64;
+};
+
 bool vm_execute_inst(VM* vm) {
-    Inst current_inst = vm->code.functions[vm->fp][vm->ip];
-    vm->ip += 1;
+    LinkedDecoded decoded = link_decode(vm->linked.functions[vm->fp], vm->ip);
+    Inst current_inst = decoded.inst;
+    vm->ip += decoded.size;
 
     switch (current_inst.type) {
     case InstType::UnaryOp: {
-        switch (current_inst.unary.op) {
-        case UnaryOperand::Int_Negation: {
-            i64 value = *vm_ptr_read<i64>(vm, current_inst.unary.operand);
-            i64 result = -value;
-            vm_ptr_write<i64>(vm, current_inst.unary.dest, result);
-            break;
-        }
-        case UnaryOperand::Float_Negation: {
-            f64 value = *vm_ptr_read<f64>(vm, current_inst.unary.operand);
-            f64 result = -value;
-            vm_ptr_write<f64>(vm, current_inst.unary.dest, result);
-            break;
-        }
-        case UnaryOperand::Bool_Not: {
-            bool value = *vm_ptr_read<bool>(vm, current_inst.unary.operand);
-            bool result = !value;
-            vm_ptr_write<bool>(vm, current_inst.unary.dest, result);
-            break;
-        }
-        }
+        vm_execute_unary_op(vm, &current_inst.unary);
         break;
     }
     case InstType::BinaryOp: {
-        switch (current_inst.binary.op) {
-            CASE_BINARY_OP(Int_Add, i64, +)
-            CASE_BINARY_OP(Int_Sub, i64, -)
-            CASE_BINARY_OP(Int_Mul, i64, *)
-            CASE_BINARY_OP(Int_Div, i64, /)
-            CASE_BINARY_OP(Int_BinaryAnd, i64, &)
-            CASE_BINARY_OP(Int_BinaryOr, i64, |)
-            CASE_BINARY_OP(Int_Equal, i64, ==)
-            CASE_BINARY_OP(Int_NotEqual, i64, !=)
-            CASE_BINARY_OP(Int_LessThan, i64, <)
-            CASE_BINARY_OP(Int_LessEqual, i64, <=)
-            CASE_BINARY_OP(Int_GreaterThan, i64, >)
-            CASE_BINARY_OP(Int_GreaterEqual, i64, >=)
-
-            CASE_BINARY_OP(Float_Add, f64, +)
-            CASE_BINARY_OP(Float_Sub, f64, -)
-            CASE_BINARY_OP(Float_Mul, f64, *)
-            CASE_BINARY_OP(Float_Div, f64, /)
-            CASE_BINARY_OP(Float_Equal, f64, ==)
-            CASE_BINARY_OP(Float_NotEqual, f64, !=)
-            CASE_BINARY_OP(Float_LessThan, f64, <)
-            CASE_BINARY_OP(Float_LessEqual, f64, <=)
-            CASE_BINARY_OP(Float_GreaterThan, f64, >)
-            CASE_BINARY_OP(Float_GreaterEqual, f64, >=)
-
-            CASE_BINARY_OP(Bool_Equal, bool, ==)
-            CASE_BINARY_OP(Bool_NotEqual, bool, !=)
-        }
+        vm_execute_binary_op(vm, &current_inst.binary);
         break;
     }
     case InstType::Call: {
-        stack_push(&vm->stack, vm->fp);
-        stack_push(&vm->stack, vm->ip);
-        stack_push(&vm->stack, vm->bp);
+        const u8* return_ip = vm->linked.functions[vm->fp].data + vm->ip;
+        call_stack_push(&vm->calls, CallFrame{vm->fp, return_ip, vm->bp});
         vm->fp = current_inst.call.fp;
         vm->ip = 0;
         vm->bp = vm->stack.size;
         break;
     }
+    case InstType::TailCall: {
+        vm->fp = current_inst.tail_call.fp;
+        vm->ip = 0;
+        break;
+    }
     case InstType::Return: {
-        vm->bp = stack_pop<isize>(&vm->stack);
-        vm->ip = stack_pop<isize>(&vm->stack);
-        vm->fp = stack_pop<isize>(&vm->stack);
+        CallFrame frame = call_stack_pop(&vm->calls);
+        vm->fp = frame.fp;
+        vm->ip = frame.return_ip - vm->linked.functions[vm->fp].data;
+        vm->bp = frame.bp;
         break;
     }
     case InstType::Exit: {
         stack_push(&vm->stack, current_inst.exit.code);
+        vm->finished = true;
+        output_flush(&vm->output, vm->stdout);
         return false;
     }
     case InstType::Mov: {
-        isize size = current_inst.mov.size;
-        u8* src = vm_ptr_to_raw(vm, current_inst.mov.src);
-        u8* dest = vm_ptr_to_raw(vm, current_inst.mov.dest);
-        memcpy(dest, src, size);
+        vm_execute_mov(vm, current_inst.mov.dest, current_inst.mov.src,
+                       current_inst.mov.size);
         break;
     }
     case InstType::PushStack: {
@@ -115,8 +151,8 @@ bool vm_execute_inst(VM* vm) {
     case InstType::JumpIf: {
         core_assert(current_inst.jump_if.new_ip >= 0);
         core_assert(current_inst.jump_if.new_ip <
-                    vm->code.functions[vm->fp].size);
-        bool condition = *vm_ptr_read<bool>(vm, current_inst.jump_if.condition);
+                    vm->linked.functions[vm->fp].size);
+        bool condition = vm_ptr_load<bool>(vm, current_inst.jump_if.condition);
         if (condition == current_inst.jump_if.expected) {
             vm->ip = current_inst.jump_if.new_ip;
         }
@@ -124,7 +160,8 @@ bool vm_execute_inst(VM* vm) {
     }
     case InstType::Jump: {
         core_assert(current_inst.jump.new_ip >= 0);
-        core_assert(current_inst.jump.new_ip < vm->code.functions[vm->fp].size);
+        core_assert(current_inst.jump.new_ip <
+                    vm->linked.functions[vm->fp].size);
         vm->ip = current_inst.jump.new_ip;
         break;
     }
@@ -132,3 +169,442 @@ bool vm_execute_inst(VM* vm) {
 
     return true;
 }
+
+// The effect of a single linked instruction, shared by its handler in `vm_run`
+// and by the superinstructions containing it. `run` returns the next
+// instruction, `next` unless the instruction jumps. Calls and returns switch
+// the current function, so they are written out in `vm_run_loop`.
+//
+// This is a struct and not a function template, so the steps can
+// be specialized on the instruction while keeping `CHECKED` open.
+template <LinkedOp OP, bool CHECKED> struct VmStep;
+
+// The steps have to be inlined into `vm_run`, gcc stops inlining
+// them on its own as the function is huge.
+#if defined(__GNUC__)
+#define VM_STEP_INLINE __attribute__((always_inline)) inline
+#else
+#define VM_STEP_INLINE inline
+#endif
+
+// Declares the step of `name` and starts its definition, followed by the body
+#define VM_STEP(name)                                                          \
+    template <bool CHECKED> struct VmStep<LinkedOp::name, CHECKED> {           \
+        VM_STEP_INLINE static const u8* run(VM* vm, Slice<u8> function,        \
+                                            const u8* inst, const u8* next);   \
+    };                                                                         \
+    template <bool CHECKED>                                                    \
+    VM_STEP_INLINE const u8* VmStep<LinkedOp::name, CHECKED>::run(             \
+        [[maybe_unused]] VM* vm, [[maybe_unused]] Slice<u8> function,          \
+        [[maybe_unused]] const u8* inst, [[maybe_unused]] const u8* next)
+
+// The offset of the `index`-th operand of the current instruction
+#define VM_OFFSET(index) link_operand_offset(link_operand(inst, index))
+// The value of the `index`-th operand of the current instruction
+#define VM_VALUE(type, mode, index)                                            \
+    vm_operand_value<type, MemPtrType::mode, CHECKED>(vm,                      \
+                                                      link_operand(inst, index))
+// The `StackRel` destination of the current instruction
+#define VM_DEST(type)                                                          \
+    (*vm_operand<type, MemPtrType::StackRel, CHECKED>(vm, VM_OFFSET(0)))
+
+#define VM_BINARY_STEP(op, type, result_type, symbol, left_mode, right_mode)   \
+    VM_STEP(BinaryOp_##op##_##left_mode##_##right_mode) {                      \
+        type left = VM_VALUE(type, left_mode, 1);                              \
+        type right = VM_VALUE(type, right_mode, 2);                            \
+        VM_DEST(result_type) = left symbol right;                              \
+        return next;                                                           \
+    }
+
+#define VM_UNARY_STEP(op, type, result_type, symbol, operand_mode)             \
+    VM_STEP(UnaryOp_##op##_##operand_mode) {                                   \
+        type value = VM_VALUE(type, operand_mode, 1);                          \
+        VM_DEST(result_type) = symbol value;                                   \
+        return next;                                                           \
+    }
+
+#define VM_MOV_STEP(src_mode, size)                                            \
+    VM_STEP(Mov_##src_mode##_##size) {                                         \
+        using T = MovUnit<size>::Type;                                         \
+        VM_DEST(T) = VM_VALUE(T, src_mode, 1);                                 \
+        return next;                                                           \
+    }
+
+#define VM_JUMP_IF_STEP(condition_mode, expected_name, expected)               \
+    VM_STEP(JumpIf_##condition_mode##_##expected_name) {                       \
+        bool condition = VM_VALUE(bool, condition_mode, 0);                    \
+        if (condition == expected) {                                           \
+            u32 new_ip = link_operand(inst, 1);                                \
+            VM_CHECK(new_ip < function.size);                                  \
+            return function.data + new_ip;                                     \
+        }                                                                      \
+        return next;                                                           \
+    }
+
+// The generic instructions are written out below
+#define VM_GENERIC_STEP(name)
+
+LINKED_BASE_OPS(VM_GENERIC_STEP, VM_BINARY_STEP, VM_UNARY_STEP, VM_MOV_STEP,
+                VM_JUMP_IF_STEP)
+
+// The generic instructions are rare (only operands in the
+// unspecialized modes), they always go through the checked accessors.
+VM_STEP(UnaryOp) {
+    Inst decoded = link_decode(function, inst - function.data).inst;
+    vm_execute_unary_op(vm, &decoded.unary);
+    return next;
+}
+
+VM_STEP(BinaryOp) {
+    Inst decoded = link_decode(function, inst - function.data).inst;
+    vm_execute_binary_op(vm, &decoded.binary);
+    return next;
+}
+
+VM_STEP(Mov) {
+    vm_execute_mov(vm, link_decode_mem_ptr(link_operand(inst, 0)),
+                   link_decode_mem_ptr(link_operand(inst, 1)),
+                   link_operand(inst, 2));
+    return next;
+}
+
+// The stack capacity is checked even for verified code, the verifier does not
+// know how deep the calls go
+VM_STEP(PushStack) {
+    stack_push_size(&vm->stack, link_operand(inst, 0));
+    return next;
+}
+
+VM_STEP(PopStack) {
+    isize size = link_operand(inst, 0);
+    VM_CHECK(vm->stack.size >= size);
+    vm->stack.size -= size;
+    return next;
+}
+
+VM_STEP(CallBuiltin) {
+    BuiltinFunctionPtr fn_ptr =
+        (BuiltinFunctionPtr)link_read<u64>(inst + LINK_OPCODE_SIZE);
+    fn_ptr(vm);
+    return next;
+}
+
+VM_STEP(JumpIf) {
+    MemPtr condition_ptr = link_decode_mem_ptr(link_operand(inst, 0));
+    bool expected = link_read<u8>(next - sizeof(u8)) != 0;
+    bool condition = vm_ptr_load<bool>(vm, condition_ptr);
+    if (condition == expected) {
+        u32 new_ip = link_operand(inst, 1);
+        VM_CHECK(new_ip < function.size);
+        return function.data + new_ip;
+    }
+    return next;
+}
+
+VM_STEP(Jump) {
+    u32 new_ip = link_operand(inst, 0);
+    VM_CHECK(new_ip < function.size);
+    return function.data + new_ip;
+}
+
+// Labels as values are a GNU extension (supported by both gcc and
+// clang). Other compilers get the same loop, dispatched through a switch.
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+// Counts the instruction about to be dispatched when profiling
+#define VM_PROFILE_INST()                                                      \
+    do {                                                                       \
+        if constexpr (PROFILED) {                                              \
+            profile_count(vm->profile, vm->fp, inst - function.data);          \
+        }                                                                      \
+    } while (0)
+
+// Every handler starts with `ip` already pointing to the next instruction and
+// `inst` to the encoded current one
+#ifdef VM_COMPUTED_GOTO
+#define VM_CASE(name)                                                          \
+    op_##name : ip = inst + linked_op_size(LinkedOp::name);
+#define VM_DISPATCH()                                                          \
+    do {                                                                       \
+        inst = ip;                                                             \
+        VM_PROFILE_INST();                                                     \
+        goto* dispatch_table[(isize)link_read_op(inst)];                       \
+    } while (0)
+#else
+#define VM_CASE(name)                                                          \
+    case LinkedOp::name:                                                       \
+        ip = inst + linked_op_size(LinkedOp::name);
+#define VM_DISPATCH() continue
+#endif
+
+#define VM_GENERIC_LABEL(name) &&op_##name,
+#define VM_BINARY_LABEL(op, type, result, symbol, left, right)                 \
+    &&op_BinaryOp_##op##_##left##_##right,
+#define VM_UNARY_LABEL(op, type, result, symbol, operand)                      \
+    &&op_UnaryOp_##op##_##operand,
+#define VM_MOV_LABEL(src, size) &&op_Mov_##src##_##size,
+#define VM_JUMP_IF_LABEL(condition, expected_name, expected)                   \
+    &&op_JumpIf_##condition##_##expected_name,
+#define VM_FUSED_LABEL(first, second) &&op_Fused_##first##_##second,
+
+#define VM_STEP_HANDLER(name)                                                  \
+    VM_CASE(name) {                                                            \
+        ip = VmStep<LinkedOp::name, CHECKED>::run(vm, function, inst, ip);     \
+        VM_DISPATCH();                                                         \
+    }
+
+// Spends a unit of fuel, once it runs out the state is written back to the VM
+// and the loop yields at `ip`
+#define VM_CHARGE()                                                            \
+    do {                                                                       \
+        if constexpr (METERED) {                                               \
+            if (--fuel <= 0) {                                                 \
+                vm->ip = ip - function.data;                                   \
+                return VmStatus::Yielded;                                      \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+// Only a jump to the current instruction or before it spends fuel, the
+// forward ones can not loop
+#define VM_CHARGE_BACKWARD()                                                   \
+    do {                                                                       \
+        if constexpr (METERED) {                                               \
+            if (ip <= inst) {                                                  \
+                VM_CHARGE();                                                   \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+// Counts the backward jumps of the current function for tiering
+#define VM_COUNT_BACK_EDGE()                                                   \
+    do {                                                                       \
+        if constexpr (TIERED) {                                                \
+            if (ip <= inst) {                                                  \
+                vm->tiering->functions.data[vm->fp].back_edges++;              \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+#define VM_JUMP_HANDLER(name)                                                  \
+    VM_CASE(name) {                                                            \
+        ip = VmStep<LinkedOp::name, CHECKED>::run(vm, function, inst, ip);     \
+        VM_CHARGE_BACKWARD();                                                  \
+        VM_COUNT_BACK_EDGE();                                                  \
+        VM_DISPATCH();                                                         \
+    }
+
+// The generic instructions are written out in `vm_run_loop`, this is a no-op
+#define VM_GENERIC_HANDLER(name)
+#define VM_BINARY_HANDLER(op, type, result, symbol, left, right)               \
+    VM_STEP_HANDLER(BinaryOp_##op##_##left##_##right)
+#define VM_UNARY_HANDLER(op, type, result, symbol, operand)                    \
+    VM_STEP_HANDLER(UnaryOp_##op##_##operand)
+#define VM_MOV_HANDLER(src, size) VM_STEP_HANDLER(Mov_##src##_##size)
+#define VM_JUMP_IF_HANDLER(condition, expected_name, expected)                 \
+    VM_JUMP_HANDLER(JumpIf_##condition##_##expected_name)
+
+// The second instruction only runs if the first one did not jump
+#define VM_FUSED_HANDLER(first, second)                                        \
+    VM_CASE(Fused_##first##_##second) {                                        \
+        const u8* first_inst = inst + LINK_OPCODE_SIZE;                        \
+        const u8* second_inst = first_inst + linked_op_size(LinkedOp::first);  \
+        ip = VmStep<LinkedOp::first, CHECKED>::run(vm, function, first_inst,   \
+                                                   second_inst);               \
+        if (ip == second_inst) {                                               \
+            ip = VmStep<LinkedOp::second, CHECKED>::run(                       \
+                vm, function, second_inst,                                     \
+                second_inst + linked_op_size(LinkedOp::second));               \
+        }                                                                      \
+        if constexpr (linked_op_jumps(LinkedOp::first) ||                      \
+                      linked_op_jumps(LinkedOp::second)) {                     \
+            VM_CHARGE_BACKWARD();                                              \
+            VM_COUNT_BACK_EDGE();                                              \
+        }                                                                      \
+        VM_DISPATCH();                                                         \
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// Counts a call of `callee` and tiers it up once it is hot, `Call` then
+// enters its native code
+static inline void vm_tier_call(VM* vm, isize callee) {
+    Tiering* tiering = vm->tiering;
+    TierCounters* counters = &tiering->functions.data[callee];
+    counters->invocations++;
+    if (counters->tier == Tier::Interpreted &&
+        counters->invocations + counters->back_edges >= tiering->threshold) {
+        tiering_promote(tiering, callee);
+        vm->jit = tiering->jit;
+    }
+}
+
+// The interpreter loop, `CHECKED` turns the runtime checks on. Without them it
+// may only run code accepted by the verifier. `METERED` spends `fuel` on
+// backward jumps and calls, without it `fuel` is ignored. `TIERED` counts
+// calls and back edges in `vm->tiering`, `PROFILED` every instruction, call
+// and return in `vm->profile`.
+template <bool CHECKED, bool METERED, bool TIERED = false,
+          bool PROFILED = false>
+static VmStatus vm_run_loop(VM* vm, [[maybe_unused]] isize fuel) {
+    static_assert(!TIERED || (!CHECKED && !METERED));
+    static_assert(!PROFILED || (!METERED && !TIERED));
+#ifdef VM_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        LINKED_OPS(VM_GENERIC_LABEL, VM_BINARY_LABEL, VM_UNARY_LABEL,
+                   VM_MOV_LABEL, VM_JUMP_IF_LABEL, VM_FUSED_LABEL)};
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+                  (isize)LinkedOp::Count);
+#endif
+
+    // The current function and the instruction pointer into it are kept in
+    // locals, and only written back to the VM on calls and on exit.
+    Slice<u8> function = vm->linked.functions[vm->fp];
+    const u8* ip = function.data + vm->ip;
+    const u8* inst = nullptr;
+
+#ifdef VM_COMPUTED_GOTO
+    VM_DISPATCH();
+#else
+    while (true) {
+        inst = ip;
+        VM_PROFILE_INST();
+        switch (link_read_op(inst)) {
+#endif
+
+    LINKED_OPS(VM_GENERIC_HANDLER, VM_BINARY_HANDLER, VM_UNARY_HANDLER,
+               VM_MOV_HANDLER, VM_JUMP_IF_HANDLER, VM_FUSED_HANDLER)
+
+    VM_STEP_HANDLER(UnaryOp)
+    VM_STEP_HANDLER(BinaryOp)
+    VM_STEP_HANDLER(Mov)
+    VM_STEP_HANDLER(PushStack)
+    VM_STEP_HANDLER(PopStack)
+    VM_STEP_HANDLER(CallBuiltin)
+    VM_JUMP_HANDLER(JumpIf)
+    VM_JUMP_HANDLER(Jump)
+
+    VM_CASE(Call) {
+        if constexpr (TIERED) {
+            vm_tier_call(vm, link_operand(inst, 0));
+        }
+        if constexpr (!CHECKED && !METERED && !PROFILED) {
+            JitFunction native =
+                vm->jit ? vm->jit->functions.data[link_operand(inst, 0)]
+                        : nullptr;
+            if (native) {
+                // The native code runs the whole call, its own calls included,
+                // and returns here
+                core_assert_msg(vm->calls.size < vm->calls.capacity,
+                                "Call stack overflow");
+                vm->calls.size++;
+                vm->jit->enter(vm, vm->stack.data + vm->stack.size, native);
+                vm->calls.size--;
+                VM_DISPATCH();
+            }
+        }
+        // A runaway recursion must not take down the other VMs
+        // of the thread, so the metered loop stops instead of asserting.
+        if constexpr (METERED) {
+            if (vm->calls.size == vm->calls.capacity) {
+                vm->ip = inst - function.data;
+                return VmStatus::Error;
+            }
+        }
+        call_stack_push(&vm->calls, CallFrame{vm->fp, ip, vm->bp});
+        vm->fp = link_operand(inst, 0);
+        vm->bp = vm->stack.size;
+        VM_CHECK(vm->fp < vm->linked.functions.size);
+        function = vm->linked.functions.data[vm->fp];
+        ip = function.data;
+        if constexpr (PROFILED) {
+            profile_call(vm->profile, vm->fp);
+        }
+        VM_CHARGE();
+        VM_DISPATCH();
+    }
+    VM_CASE(TailCall) {
+        // Nothing is saved, the callee returns straight to our caller
+        if constexpr (TIERED) {
+            vm_tier_call(vm, link_operand(inst, 0));
+        }
+        vm->fp = link_operand(inst, 0);
+        VM_CHECK(vm->fp < vm->linked.functions.size);
+        function = vm->linked.functions.data[vm->fp];
+        ip = function.data;
+        if constexpr (PROFILED) {
+            profile_tail_call(vm->profile, vm->fp);
+        }
+        VM_CHARGE();
+        VM_DISPATCH();
+    }
+    VM_CASE(Return) {
+        VM_CHECK(vm->calls.size > 0);
+        CallFrame frame = vm->calls.data[--vm->calls.size];
+        vm->fp = frame.fp;
+        vm->bp = frame.bp;
+        function = vm->linked.functions.data[vm->fp];
+        ip = frame.return_ip;
+        if constexpr (PROFILED) {
+            profile_return(vm->profile);
+        }
+        VM_DISPATCH();
+    }
+    VM_CASE(Exit) {
+        if constexpr (PROFILED) {
+            profile_charge_ticks(vm->profile);
+        }
+        vm->ip = ip - function.data;
+        stack_push(&vm->stack, link_read<u8>(inst + LINK_OPCODE_SIZE));
+        vm->finished = true;
+        return VmStatus::Finished;
+    }
+
+#ifndef VM_COMPUTED_GOTO
+        case LinkedOp::Count:
+            core_assert(false);
+        }
+    }
+#endif
+}
+
+#pragma GCC diagnostic pop
+
+void vm_run(VM* vm) {
+    if (vm->profile) {
+        // Nothing before the run is counted
+        vm->profile->last_ticks = profile_ticks();
+        if (vm->verified) {
+            vm_run_loop<false, false, false, true>(vm, 0);
+        } else {
+            vm_run_loop<true, false, false, true>(vm, 0);
+        }
+    } else if (vm->verified && vm->tiering) {
+        vm_run_loop<false, false, true>(vm, 0);
+    } else if (vm->verified) {
+        vm_run_loop<false, false>(vm, 0);
+    } else {
+        vm_run_loop<true, false>(vm, 0);
+    }
+    output_flush(&vm->output, vm->stdout);
+}
+
+VmStatus vm_run_for(VM* vm, isize budget) {
+    if (vm->finished) {
+        return VmStatus::Finished;
+    }
+    if (budget <= 0) {
+        return VmStatus::Yielded;
+    }
+
+    // The output of every slice is written out, a long running program
+    // prints as it goes
+    defer(output_flush(&vm->output, vm->stdout));
+    if (vm->verified) {
+        return vm_run_loop<false, true>(vm, budget);
+    }
+    return vm_run_loop<true, true>(vm, budget);
+}
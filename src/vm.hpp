@@ -2,6 +2,12 @@
 
 #include "bytecode.hpp"
 #include "core.hpp"
+#include "jit.hpp"
+#include "linker.hpp"
+#include "output.hpp"
+#include "profile.hpp"
+#include "tiering.hpp"
+#include "verifier.hpp"
 #include <cstdio>
 
 struct Stack {
@@ -38,8 +44,113 @@ inline void stack_pop_size(Stack* stack, isize size) {
     stack->size -= size;
 }
 
+// What `Call` saves to return to the caller. The frames are kept apart from
+// the data stack, the arguments of a call are right below the callee's BP.
+struct CallFrame {
+    // The caller's function
+    isize fp;
+    // Where the caller continues, points into `VM::linked`
+    const u8* return_ip;
+    isize bp;
+};
+
+struct CallStack {
+    CallFrame* data;
+    isize size;
+    isize capacity;
+};
+
+// Maximum depth of the calls, 1.5 MB of frames
+const isize VM_CALL_STACK_CAPACITY = 64 * 1024;
+
+// The capacity is checked even for verified code, the depth of
+// the calls is not known before running.
+inline void call_stack_push(CallStack* calls, CallFrame frame) {
+    core_assert_msg(calls->size < calls->capacity, "Call stack overflow");
+    calls->data[calls->size++] = frame;
+}
+
+inline CallFrame call_stack_pop(CallStack* calls) {
+    core_assert(calls->size > 0);
+    return calls->data[--calls->size];
+}
+
+// What `vm_run_for` stopped on
+enum class VmStatus {
+    // Ran out of the budget, the next call continues where it stopped
+    Yielded,
+    // Executed `Exit`, the exit code is on the top of the stack
+    Finished,
+    // Overflowed the call stack, the VM can not continue
+    Error,
+};
+
+// Execution model
+// ---------------
+// A compiled `CodeUnit` is linked and verified once into a `VmImage`. From
+// then on the image is immutable, the VM only ever reads the linked code and
+// the static data (the verifier rejects writes to the static data, unverified
+// code asserts on them). So any number of VMs, on any number of threads, can
+// run the same image at once without locking and without recompiling it.
+//
+// Everything a running program changes belongs to its VM: the registers, the
+// data and call stacks and the output sinks (`stdout`, `stderr`), which the
+// builtins print to. A VM is only used by one thread at a time. Two VMs only
+// share a sink if the caller sets them up that way, `runner.hpp` gives every
+// job its own.
+struct VmImage {
+    CodeUnit code;
+    // The code executed by `vm_run`
+    LinkedUnit linked;
+    // Whether the verifier accepted `linked`
+    bool verified;
+    // Native code of the functions the JIT could compile, or null
+    JitCode* jit;
+};
+
+// For code that is already linked (loaded from a file). Only verified code is
+// compiled by the JIT (see `jit.hpp`), which needs the instructions in `code`.
+inline VmImage vm_image_make_linked(CodeUnit code, LinkedUnit linked,
+                                    Arena* arena, bool jit = false) {
+    VmImage image = {
+        .code = code,
+        .linked = linked,
+        .verified = verify_linked_unit(linked, code.static_data, arena),
+        .jit = nullptr,
+    };
+    if (jit && image.verified) {
+        image.jit = jit_compile(code, arena);
+    }
+    return image;
+}
+
+inline VmImage vm_image_make(CodeUnit code, Arena* arena, bool jit = false) {
+    return vm_image_make_linked(code, link_code_unit(code, arena), arena, jit);
+}
+
+// Releases the native code, the rest of the image lives in its arena
+inline void vm_image_free(VmImage* image) {
+    jit_free(image->jit);
+    image->jit = nullptr;
+}
+
 struct VM {
+    // Copied from the `VmImage`, the data they point to is shared with every
+    // other VM running the same image and never written to
     CodeUnit code;
+    LinkedUnit linked;
+    // `vm_run` then skips the runtime checks, it can be turned off to run
+    // verified code with the checks too.
+    bool verified;
+    // `Call` enters the native code of a compiled callee, unless the VM runs
+    // with the checks or metered
+    const JitCode* jit;
+    // Counts the calls and back edges of every function and replaces `jit`
+    // as functions get hot, null unless enabled with `vm_enable_tiering`
+    Tiering* tiering;
+    // Counts every instruction `vm_run` executes, null unless enabled with
+    // `vm_enable_profiling`
+    Profile* profile;
 
     // Function pointer - points to the current function being executed
     isize fp;
@@ -47,32 +158,75 @@ struct VM {
     isize ip;
     // Base pointer - points to the base of the current stack frame
     isize bp;
+    // Set once `Exit` is executed
+    bool finished;
 
     FILE* stdout;
     FILE* stderr;
+    // What the program printed to `stdout` and was not written out yet
+    OutputBuffer output;
 
     Stack stack;
+    CallStack calls;
     // TODO(juraj): heap?
 };
 
-inline void vm_init(VM* vm, CodeUnit code, isize stack_size, Arena* arena) {
-    vm->code = code;
+// Prepares the VM to run `image` from the start. The stacks are reused, so a
+// worker can run many programs one after another without allocating.
+inline void vm_reset(VM* vm, VmImage image) {
+    vm->code = image.code;
+    vm->linked = image.linked;
+    vm->verified = image.verified;
+    vm->jit = image.jit;
+    vm->tiering = nullptr;
+    vm->profile = nullptr;
     vm->fp = 0;
     vm->ip = 0;
     vm->bp = 0;
+    vm->finished = false;
+    vm->stack.size = 0;
+    vm->calls.size = 0;
+}
+
+inline void vm_init(VM* vm, VmImage image, isize stack_size, Arena* arena) {
     vm->stdout = stdout;
     vm->stderr = stderr;
+    output_init(&vm->output, OUTPUT_BUFFER_CAPACITY, arena);
     vm->stack.data = arena_alloc<u8>(arena, stack_size);
-    vm->stack.size = 0;
     vm->stack.capacity = stack_size;
+    vm->calls.data = arena_alloc<CallFrame>(arena, VM_CALL_STACK_CAPACITY);
+    vm->calls.capacity = VM_CALL_STACK_CAPACITY;
+    vm_reset(vm, image);
 }
 
-inline VM* vm_make(CodeUnit code, isize stack_size, Arena* arena) {
+inline void vm_init(VM* vm, CodeUnit code, isize stack_size, Arena* arena) {
+    vm_init(vm, vm_image_make(code, arena), stack_size, arena);
+}
+
+inline VM* vm_make(VmImage image, isize stack_size, Arena* arena) {
     VM* vm = arena_alloc<VM>(arena);
-    vm_init(vm, code, stack_size, arena);
+    vm_init(vm, image, stack_size, arena);
     return vm;
 }
 
+inline VM* vm_make(CodeUnit code, isize stack_size, Arena* arena) {
+    return vm_make(vm_image_make(code, arena), stack_size, arena);
+}
+
+// Starts the VM on tier 0, the native code of the image is not used. Has to be
+// enabled again after `vm_reset`.
+inline void vm_enable_tiering(VM* vm, Tiering* tiering) {
+    vm->tiering = tiering;
+    vm->jit = tiering->jit;
+}
+
+// `vm_run` then counts every instruction in `profile` and only interprets,
+// tiering and the native code are not used. Has to be enabled again after
+// `vm_reset`.
+inline void vm_enable_profiling(VM* vm, Profile* profile) {
+    vm->profile = profile;
+}
+
 template <typename T> inline T* vm_ptr_read(VM* vm, MemPtr ptr) {
     switch (ptr.type) {
     case MemPtrType::Invalid: {
@@ -101,9 +255,22 @@ template <typename T> inline T* vm_ptr_read(VM* vm, MemPtr ptr) {
         return (T*)(vm->code.static_data.data + ptr.mem_offset);
         break;
     }
+    case MemPtrType::Immediate: {
+        core_assert_msg(false, "Immediates have no address, use vm_ptr_load");
+        break;
+    }
     }
 }
 
+// Reads the value of an operand, unlike `vm_ptr_read` this works for
+// immediates too
+template <typename T> inline T vm_ptr_load(VM* vm, MemPtr ptr) {
+    if (ptr.type == MemPtrType::Immediate) {
+        return (T)ptr.mem_offset;
+    }
+    return *vm_ptr_read<T>(vm, ptr);
+}
+
 template <typename T> inline void vm_ptr_write(VM* vm, MemPtr ptr, T value) {
     switch (ptr.type) {
     case MemPtrType::Invalid: {
@@ -131,6 +298,11 @@ template <typename T> inline void vm_ptr_write(VM* vm, MemPtr ptr, T value) {
             false, "Cannot write to static data, this should never happen");
         break;
     }
+    case MemPtrType::Immediate: {
+        core_assert_msg(
+            false, "Cannot write to an immediate, this should never happen");
+        break;
+    }
     }
 }
 
@@ -163,9 +335,29 @@ inline u8* vm_ptr_to_raw(VM* vm, MemPtr ptr) {
         core_assert(ptr.mem_offset >= 0);
         return vm->code.static_data.data + ptr.mem_offset;
     }
+    case MemPtrType::Immediate: {
+        core_assert_msg(false, "Immediates have no address");
+        break;
+    }
     }
 
     core_assert(false);
 }
 
+// Executes a single instruction. Returns false once the `Exit` instruction
+// was executed. This is slow and meant only for debugging, use `vm_run`.
 bool vm_execute_inst(VM* vm);
+
+// Executes the program until the `Exit` instruction. Just like with
+// `vm_execute_inst` the exit code is left on the top of the stack. Verified
+// code runs without the per instruction checks, and tiers up if tiering is
+// enabled (or is profiled if profiling is). The output is written to `stdout`
+// before it returns.
+void vm_run(VM* vm);
+
+// Executes the program until `Exit`, or until it spends `budget` units of
+// fuel. Only backward jumps and calls (the only ways to run for long) spend a
+// unit each, straight-line code runs without any checks. Between two units at
+// most the rest of one function runs, so the budget bounds how long a slice
+// takes. Called again after `Yielded`, it continues where it stopped.
+VmStatus vm_run_for(VM* vm, isize budget);
@@ -0,0 +1,214 @@
+#include "builtin.hpp"
+#include "bytecode_file.hpp"
+#include "common.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <string>
+
+static const char* source = R"SOURCE(
+    fib :: fn(n: int) -> int {
+        if n < 2 {
+            return n
+        }
+        return fib(n - 1) + fib(n - 2)
+    }
+
+    main :: fn() {
+        std_println_int(fib(15))
+        std_print_int(1000000007)
+        std_print_space()
+        std_print_int(3)
+        std_print_newline()
+    }
+)SOURCE";
+
+static void write_bytes(const char* path, Slice<u8> bytes) {
+    FILE* file = fopen(path, "wb");
+    core_assert(file);
+    fwrite(bytes.data, 1, bytes.size, file);
+    fclose(file);
+}
+
+TEST(BytecodeFile, RoundTrip) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena);
+    LinkedUnit linked = link_code_unit(code, &arena);
+    TempFile temp;
+    ASSERT_TRUE(bytecode_file_write(temp.path, linked, code.static_data));
+
+    BytecodeFile file = {};
+    const char* error = nullptr;
+    ASSERT_TRUE(bytecode_file_load(temp.path, &file, &arena, &error))
+        << error;
+    defer(bytecode_file_unload(&file));
+
+    // The builtin addresses are patched back, the code is the same bytes
+    ASSERT_EQ(file.linked.functions.size, linked.functions.size);
+    for (isize i = 0; i < linked.functions.size; i++) {
+        ASSERT_EQ(file.linked.functions[i].size, linked.functions[i].size);
+        EXPECT_EQ(memcmp(file.linked.functions[i].data,
+                         linked.functions[i].data, linked.functions[i].size),
+                  0);
+    }
+    ASSERT_EQ(file.static_data.size, code.static_data.size);
+    EXPECT_EQ(memcmp(file.static_data.data, code.static_data.data,
+                     code.static_data.size),
+              0);
+
+    // Run in place, straight from the mapping
+    VmImage image = {};
+    ASSERT_TRUE(bytecode_file_image(&file, false, &arena, &image, &error))
+        << error;
+    EXPECT_GE(file.linked.code.data, file.mapping);
+    EXPECT_LT(file.linked.code.data, file.mapping + file.size);
+    VmImage compiled = vm_image_make(code, &arena);
+    EXPECT_EQ(run_captured(vm_make(image, 1024 * 1024, &arena)),
+              run_captured(vm_make(compiled, 1024 * 1024, &arena)));
+    EXPECT_EQ(run_captured(vm_make(image, 1024 * 1024, &arena)),
+              "610\n1000000007 3\n");
+}
+
+TEST(BytecodeFile, DecodesInstructionsForJit) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena);
+    LinkedUnit linked = link_code_unit(code, &arena);
+    TempFile temp;
+    ASSERT_TRUE(bytecode_file_write(temp.path, linked, code.static_data));
+
+    BytecodeFile file = {};
+    const char* error = nullptr;
+    ASSERT_TRUE(bytecode_file_load(temp.path, &file, &arena, &error))
+        << error;
+    defer(bytecode_file_unload(&file));
+
+    VmImage image = {};
+    ASSERT_TRUE(bytecode_file_image(&file, true, &arena, &image, &error))
+        << error;
+    defer(vm_image_free(&image));
+
+    // Linking the decoded instructions again gives the same code
+    LinkedUnit relinked = link_code_unit(image.code, &arena);
+    ASSERT_EQ(relinked.code.size, linked.code.size);
+    EXPECT_EQ(memcmp(relinked.code.data, linked.code.data, linked.code.size),
+              0);
+    if (jit_supported()) {
+        EXPECT_NE(image.jit, nullptr);
+    }
+    EXPECT_EQ(run_captured(vm_make(image, 1024 * 1024, &arena)),
+              "610\n1000000007 3\n");
+}
+
+TEST(BytecodeFile, SameProgramSameBytes) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit first = compile_source(source, &arena);
+    CodeUnit second = compile_source(source, &arena);
+    Slice<u8> a = bytecode_file_serialize(link_code_unit(first, &arena),
+                                          first.static_data, &arena);
+    Slice<u8> b = bytecode_file_serialize(link_code_unit(second, &arena),
+                                          second.static_data, &arena);
+    ASSERT_EQ(a.size, b.size);
+    EXPECT_EQ(memcmp(a.data, b.data, a.size), 0);
+
+    // No process specific address is left in the file
+    u64 address = (u64)BUILTIN_FUNCTION_TABLE[0];
+    for (isize i = 0; i + (isize)sizeof(u64) <= a.size; i++) {
+        EXPECT_NE(memcmp(a.data + i, &address, sizeof(address)), 0);
+    }
+}
+
+TEST(BytecodeFile, RejectsInvalidFiles) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena);
+    Slice<u8> bytes = bytecode_file_serialize(link_code_unit(code, &arena),
+                                              code.static_data, &arena);
+    TempFile temp;
+    BytecodeFile file = {};
+    const char* error = nullptr;
+
+    auto load_modified = [&](auto modify, isize size) {
+        Slice<u8> copy = {arena_alloc<u8>(&arena, bytes.size), size};
+        memcpy(copy.data, bytes.data, bytes.size);
+        modify(copy);
+        write_bytes(temp.path, copy);
+        error = nullptr;
+        bool loaded = bytecode_file_load(temp.path, &file, &arena, &error);
+        bytecode_file_unload(&file);
+        return loaded;
+    };
+    auto keep = [](Slice<u8>) {};
+
+    EXPECT_TRUE(load_modified(keep, bytes.size));
+
+    EXPECT_FALSE(load_modified([](Slice<u8> b) { b[0] = 'X'; }, bytes.size));
+    EXPECT_STREQ(error, "Not a .jazzc file");
+
+    EXPECT_FALSE(load_modified(
+        [](Slice<u8> b) { b[offsetof(BytecodeFileHeader, version)] = 99; },
+        bytes.size));
+    EXPECT_STREQ(error, "Unsupported .jazzc version");
+
+    EXPECT_FALSE(load_modified(
+        [](Slice<u8> b) {
+            b[offsetof(BytecodeFileHeader, linked_ops_hash)] ^= 1;
+        },
+        bytes.size));
+    EXPECT_STREQ(error, "Compiled with a different instruction set");
+
+    EXPECT_FALSE(load_modified(keep, bytes.size - 8));
+    EXPECT_STREQ(error, "Truncated file");
+
+    EXPECT_FALSE(load_modified(keep, 4));
+    EXPECT_STREQ(error, "Not a .jazzc file");
+
+    // The last relocation names a builtin that does not exist
+    EXPECT_FALSE(load_modified(
+        [](Slice<u8> b) { b[b.size - sizeof(u64)] = 0xff; }, bytes.size));
+    EXPECT_STREQ(error, "Invalid relocation");
+
+    EXPECT_FALSE(
+        bytecode_file_load("/nonexistent.jazzc", &file, &arena, &error));
+}
+
+TEST(BytecodeFile, UnverifiedCodeIsNotRun) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena);
+    Slice<u8> bytes = bytecode_file_serialize(link_code_unit(code, &arena),
+                                              code.static_data, &arena);
+    // Without its relocations the builtin addresses stay zero
+    BytecodeFileHeader header;
+    memcpy(&header, bytes.data, sizeof(header));
+    ASSERT_GT(header.relocation_count, 0u);
+    header.file_size = header.relocations_offset;
+    header.relocation_count = 0;
+    memcpy(bytes.data, &header, sizeof(header));
+    bytes.size = header.file_size;
+
+    TempFile temp;
+    write_bytes(temp.path, bytes);
+    BytecodeFile file = {};
+    const char* error = nullptr;
+    ASSERT_TRUE(bytecode_file_load(temp.path, &file, &arena, &error))
+        << error;
+    defer(bytecode_file_unload(&file));
+
+    VmImage image = {};
+    EXPECT_FALSE(bytecode_file_image(&file, false, &arena, &image, &error));
+    EXPECT_STREQ(error, "The code did not pass the verifier");
+}
@@ -1,6 +1,16 @@
 #pragma once
 
+#include "compiler.hpp"
 #include "parser.hpp"
+#include "sema.hpp"
+#include "vm.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
 
 inline AstFile* setup_ast_file(const char* source, Arena* arena) {
     Tokenizer tokenizer;
@@ -10,3 +20,78 @@ inline AstFile* setup_ast_file(const char* source, Arena* arena) {
 
     return file;
 }
+
+// Compiles a program that has no errors
+inline CodeUnit compile_source(
+    const char* source, Arena* arena, bool optimize = true,
+    CompilerBackend backend = CompilerBackend::Register) {
+    AstFile* file = setup_ast_file(source, arena);
+    ast_file_parse(file, arena);
+    core_assert(file->errors.size == 0);
+    semantic_analysis(file, arena);
+    return ast_compile_to_bytecode(&file->ast, optimize, arena, backend);
+}
+
+// Captures what the VM prints from now on
+struct Capture {
+    char* data = nullptr;
+    size_t size = 0;
+    VM* vm;
+    explicit Capture(VM* vm) : vm(vm) {
+        vm->stdout = open_memstream(&data, &size);
+    }
+    std::string finish() {
+        fclose(vm->stdout);
+        vm->stdout = stdout;
+        std::string result(data, size);
+        free(data);
+        return result;
+    }
+};
+
+// Runs the VM to the end, it must exit with 0. Returns what it printed.
+inline std::string run_captured(VM* vm) {
+    Capture capture(vm);
+    vm_run(vm);
+    std::string result = capture.finish();
+    EXPECT_EQ(stack_pop<u8>(&vm->stack), 0);
+    return result;
+}
+
+inline std::vector<std::string> list_directory(const char* path) {
+    std::vector<std::string> result;
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return result;
+    }
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            result.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+// A temporary file, removed at the end of the test
+struct TempFile {
+    char path[32] = "/tmp/jazz_test_XXXXXX";
+    TempFile() {
+        int fd = mkstemp(path);
+        core_assert(fd >= 0);
+        close(fd);
+    }
+    ~TempFile() { unlink(path); }
+};
+
+// A temporary directory, removed with its entries at the end of the test
+struct TempDir {
+    char path[32] = "/tmp/jazz_test_XXXXXX";
+    TempDir() { core_assert(mkdtemp(path)); }
+    ~TempDir() {
+        for (const std::string& entry : list_directory(path)) {
+            unlink((std::string(path) + "/" + entry).c_str());
+        }
+        rmdir(path);
+    }
+};
@@ -0,0 +1,72 @@
+#include "common.hpp"
+#include "compile_cache.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static const char* source = R"SOURCE(
+    main :: fn() {
+        std_println_int(42)
+    }
+)SOURCE";
+
+TEST(CompileCache, KeyDependsOnSourceAndOptions) {
+    String a = string_from_cstr(source);
+    String b = string_from_cstr("main :: fn() {}");
+    u64 key = compile_cache_key(a, true, CompilerBackend::Register);
+    EXPECT_EQ(key, compile_cache_key(a, true, CompilerBackend::Register));
+    EXPECT_NE(key, compile_cache_key(b, true, CompilerBackend::Register));
+    EXPECT_NE(key, compile_cache_key(a, false, CompilerBackend::Register));
+    EXPECT_NE(key, compile_cache_key(a, true, CompilerBackend::Stack));
+
+    // A prefix of the source is a different source
+    String prefix = {a.data, a.size - 1};
+    EXPECT_NE(key, compile_cache_key(prefix, true, CompilerBackend::Register));
+}
+
+TEST(CompileCache, MissThenHit) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+    // The first store creates the directory
+    TempDir temp;
+    const char* dir = temp.path;
+    rmdir(dir);
+
+    String source_code = string_from_cstr(source);
+    u64 key = compile_cache_key(source_code, true, CompilerBackend::Register);
+    BytecodeFile file = {};
+    EXPECT_FALSE(compile_cache_lookup(dir, key, &file, &arena));
+
+    CodeUnit code = compile_source(source, &arena);
+    LinkedUnit linked = link_code_unit(code, &arena);
+    ASSERT_TRUE(
+        compile_cache_store(dir, key, linked, code.static_data, &arena));
+
+    ASSERT_TRUE(compile_cache_lookup(dir, key, &file, &arena));
+    defer(bytecode_file_unload(&file));
+    ASSERT_EQ(file.linked.code.size, linked.code.size);
+    EXPECT_EQ(
+        memcmp(file.linked.code.data, linked.code.data, linked.code.size), 0);
+
+    // Just the entry, no temporary file is left behind
+    std::vector<std::string> entries = list_directory(dir);
+    ASSERT_EQ(entries.size(), 1u);
+    EXPECT_EQ(std::string(dir) + "/" + entries[0],
+              compile_cache_path(dir, key, &arena));
+}
+
+TEST(CompileCache, StoreFailsWithoutDirectory) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena);
+    EXPECT_FALSE(compile_cache_store("/nonexistent/jazz/cache", 1,
+                                     link_code_unit(code, &arena),
+                                     code.static_data, &arena));
+}
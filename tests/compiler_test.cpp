@@ -0,0 +1,79 @@
+#include "common.hpp"
+#include "compiler.hpp"
+#include "core.hpp"
+#include "parser.hpp"
+#include "sema.hpp"
+#include <gtest/gtest.h>
+
+// Neither fits into an immediate
+static const char* constants_source = R"SOURCE(
+    big :: 2000000000
+
+    calc :: fn(n: int) -> int {
+        a := n * 2000000000 + n / 2000000000
+        for i := 0; i < n; i = i + 1 {
+            a = a + 1000000000 - 2000000000
+        }
+        return a + big
+    }
+
+    main :: fn() {
+        calc(1000000000)
+    }
+)SOURCE";
+
+TEST(Compiler, StoresEachConstantOnce) {
+    CompilerBackend backends[] = {CompilerBackend::Stack,
+                                  CompilerBackend::Register};
+    for (CompilerBackend backend : backends) {
+        Arena arena;
+        arena_init(&arena, 16 * 1024);
+        defer(arena_free(&arena));
+
+        CodeUnit code = compile_source(constants_source, &arena, true, backend);
+        ASSERT_EQ(code.static_data.size, 2 * (isize)sizeof(i64));
+        i64 first = 0;
+        i64 second = 0;
+        memcpy(&first, code.static_data.data, sizeof(i64));
+        memcpy(&second, code.static_data.data + sizeof(i64), sizeof(i64));
+        EXPECT_EQ(first, 2000000000);
+        EXPECT_EQ(second, 1000000000);
+
+        // Every use reads an aligned slot
+        for (isize f = 0; f < code.functions.size; f++) {
+            Slice<Inst> function = code.functions[f];
+            for (isize i = 0; i < function.size; i++) {
+                Inst inst = function[i];
+                if (inst.type != InstType::BinaryOp) {
+                    continue;
+                }
+                MemPtr operands[] = {inst.binary.left, inst.binary.right};
+                for (MemPtr ptr : operands) {
+                    if (ptr.type == MemPtrType::StaticData) {
+                        EXPECT_EQ(ptr.mem_offset % (isize)sizeof(i64), 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// The value of an expression statement is dropped, but it is still computed
+TEST(Compiler, RegisterBackendEvaluatesExpressionStatements) {
+    Arena arena;
+    arena_init(&arena, 16 * 1024);
+    defer(arena_free(&arena));
+
+    const char* source = R"SOURCE(
+        main :: fn() {
+            a := 6
+            a
+            1
+            a * 7
+            std_println_int(a)
+        }
+    )SOURCE";
+    CodeUnit code =
+        compile_source(source, &arena, false, CompilerBackend::Register);
+    EXPECT_EQ(run_captured(vm_make(code, 64 * 1024, &arena)), "6\n");
+}
@@ -1,14 +1,18 @@
 #include "bytecode.hpp"
 #include "compiler.hpp"
 #include "core.hpp"
+#include "emit_c.hpp"
 #include "parser.hpp"
 #include "sema.hpp"
 #include "vm.hpp"
 #include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <iostream>
-
-const bool OPTIMIZE = true;
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
 
 String read_file_full(FILE* file, Arena* arena) {
     if (!file) {
@@ -38,8 +42,9 @@ String read_file_full(FILE* file, Arena* arena) {
     return string_from_cstr(buffer);
 }
 
-u8 execute_to_end(const char* source_code_str, FILE* stdout_file,
-                  FILE* stderr_file) {
+u8 execute_to_end_with(const char* source_code_str, CompilerBackend backend,
+                       bool jit, bool optimize, FILE* stdout_file,
+                       FILE* stderr_file) {
     Arena arena;
     arena_init(&arena, 16 * 1024);
     defer(arena_free(&arena));
@@ -77,7 +82,8 @@ u8 execute_to_end(const char* source_code_str, FILE* stdout_file,
     // }
 
     semantic_analysis(file, &arena);
-    CodeUnit code_unit = ast_compile_to_bytecode(&file->ast, OPTIMIZE, &arena);
+    CodeUnit code_unit =
+        ast_compile_to_bytecode(&file->ast, optimize, &arena, backend);
 
     // NOTE(juraj): Uncomment this to see the compiled bytecode for each test
     // for (isize i = 0; i < code_unit.functions.size; i++) {
@@ -96,22 +102,24 @@ u8 execute_to_end(const char* source_code_str, FILE* stdout_file,
     //               << " bytes" << std::endl;
     // });
 
-    VM* vm = vm_make(code_unit, 8 * 1024 * 1024, &exec_arena);
+    VmImage image = vm_image_make(code_unit, &exec_arena, jit);
+    defer(vm_image_free(&image));
+    VM* vm = vm_make(image, 8 * 1024 * 1024, &exec_arena);
+    EXPECT_TRUE(vm->verified);
     vm->stdout = stdout_file;
     vm->stderr = stderr_file;
-    while (true) {
-        bool did_work = vm_execute_inst(vm);
-        if (!did_work) {
-            // The top value on the stack is the exit code
-            u8 exit_code = stack_pop<u8>(&vm->stack);
-            return exit_code;
-        }
-    }
+    vm_run(vm);
+
+    // The top value on the stack is the exit code
+    u8 exit_code = stack_pop<u8>(&vm->stack);
+    return exit_code;
 }
 
-Slice<u8> execute_function(const char* source_code_str, isize function_pointer,
-                           isize return_value_size, FILE* stdout_file,
-                           FILE* stderr_file, Arena* arena) {
+Slice<u8> execute_function_with(const char* source_code_str,
+                                CompilerBackend backend, bool jit,
+                                bool optimize, isize function_pointer,
+                                isize return_value_size, FILE* stdout_file,
+                                FILE* stderr_file, Arena* arena) {
     String source_code = string_from_cstr(source_code_str);
 
     Tokenizer tokenizer;
@@ -141,7 +149,8 @@ Slice<u8> execute_function(const char* source_code_str, isize function_pointer,
     // }
 
     semantic_analysis(file, arena);
-    CodeUnit code_unit = ast_compile_to_bytecode(&file->ast, OPTIMIZE, arena);
+    CodeUnit code_unit =
+        ast_compile_to_bytecode(&file->ast, optimize, arena, backend);
 
     Array<Inst> init_function = {};
     array_init(&init_function, 3, arena);
@@ -164,23 +173,192 @@ Slice<u8> execute_function(const char* source_code_str, isize function_pointer,
     //     std::cerr << std::endl;
     // }
 
-    VM* vm = vm_make(code_unit, 8 * 1024 * 1024, arena);
+    VmImage image = vm_image_make(code_unit, arena, jit);
+    defer(vm_image_free(&image));
+    VM* vm = vm_make(image, 8 * 1024 * 1024, arena);
+    EXPECT_TRUE(vm->verified);
     vm->stdout = stdout_file;
     vm->stderr = stderr_file;
-    while (true) {
-        bool did_work = vm_execute_inst(vm);
-        if (!did_work) {
-            // The top value on the stack is the exit code
-            u8 exit_code = stack_pop<u8>(&vm->stack);
-            core_assert(exit_code == 0);
+    vm_run(vm);
 
-            core_assert(vm->stack.size >= return_value_size);
+    // The top value on the stack is the exit code
+    u8 exit_code = stack_pop<u8>(&vm->stack);
+    core_assert(exit_code == 0);
 
-            u8* return_value =
-                vm->stack.data + vm->stack.size - return_value_size;
-            return Slice<u8>{return_value, return_value_size};
-        }
+    core_assert(vm->stack.size >= return_value_size);
+
+    u8* return_value = vm->stack.data + vm->stack.size - return_value_size;
+    return Slice<u8>{return_value, return_value_size};
+}
+
+// With `JAZZ_E2E_EMIT_C` set, every program is also lowered to C by `emit_c`,
+// built with the system compiler (`CC`, or `cc`) and run
+bool emit_c_enabled() { return getenv("JAZZ_E2E_EMIT_C") != nullptr; }
+
+// Returns the exit code of the C program, its output goes to `output`
+u8 execute_emitted_c(const char* source_code_str, std::string* output) {
+    Arena arena = {};
+    arena_init(&arena, 16 * 1024);
+    defer(arena_free(&arena));
+
+    Tokenizer tokenizer;
+    tokenizer_init(&tokenizer, string_from_cstr(source_code_str));
+    AstFile* file = ast_file_make(tokenizer, 16, &arena);
+    ast_file_parse(file, &arena);
+    core_assert(file->errors.size == 0);
+    semantic_analysis(file, &arena);
+    CodeUnit code_unit = ast_compile_to_bytecode(
+        &file->ast, true, &arena, CompilerBackend::Register);
+
+    char dir[] = "/tmp/jazz_e2e_XXXXXX";
+    core_assert(mkdtemp(dir));
+    std::string c_file = std::string(dir) + "/out.c";
+    std::string exe_file = std::string(dir) + "/out";
+    defer(system(("rm -rf " + std::string(dir)).c_str()));
+    {
+        std::ofstream out(c_file);
+        emit_c(code_unit, 8 * 1024 * 1024, out);
+    }
+
+    const char* cc = getenv("CC") ? getenv("CC") : "cc";
+    std::string build =
+        std::string(cc) + " -std=c99 -O1 -o " + exe_file + " " + c_file;
+    int build_status = system(build.c_str());
+    EXPECT_EQ(build_status, 0) << build;
+    if (build_status != 0) {
+        return 0xff;
+    }
+
+    FILE* program = popen(exe_file.c_str(), "r");
+    core_assert(program);
+    char buffer[4096];
+    isize read_size = 0;
+    while ((read_size = fread(buffer, 1, sizeof(buffer), program)) > 0) {
+        output->append(buffer, read_size);
+    }
+    int status = pclose(program);
+    core_assert(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+// Every program is run with both compiler backends, with the JIT and without
+// the optimizer, the tests check the results of the optimized register
+// backend, which must match the others. Programs that only compile once their
+// constants are folded are not run without the optimizer.
+u8 execute_to_end(const char* source_code_str, FILE* stdout_file,
+                  FILE* stderr_file, bool needs_folding = false) {
+    u8 exit_code =
+        execute_to_end_with(source_code_str, CompilerBackend::Register, false,
+                            true, stdout_file, stderr_file);
+
+    Arena arena = {};
+    arena_init(&arena, 4 * 1024);
+    defer(arena_free(&arena));
+
+    FILE* stack_stdout = tmpfile();
+    FILE* stack_stderr = tmpfile();
+    defer(fclose(stack_stdout));
+    defer(fclose(stack_stderr));
+    u8 stack_exit_code =
+        execute_to_end_with(source_code_str, CompilerBackend::Stack, false,
+                            true, stack_stdout, stack_stderr);
+
+    EXPECT_EQ(exit_code, stack_exit_code);
+    EXPECT_EQ(read_file_full(stdout_file, &arena),
+              read_file_full(stack_stdout, &arena));
+    EXPECT_EQ(read_file_full(stderr_file, &arena),
+              read_file_full(stack_stderr, &arena));
+
+    FILE* jit_stdout = tmpfile();
+    FILE* jit_stderr = tmpfile();
+    defer(fclose(jit_stdout));
+    defer(fclose(jit_stderr));
+    u8 jit_exit_code =
+        execute_to_end_with(source_code_str, CompilerBackend::Register, true,
+                            true, jit_stdout, jit_stderr);
+
+    EXPECT_EQ(exit_code, jit_exit_code);
+    EXPECT_EQ(read_file_full(stdout_file, &arena),
+              read_file_full(jit_stdout, &arena));
+    EXPECT_EQ(read_file_full(stderr_file, &arena),
+              read_file_full(jit_stderr, &arena));
+
+    CompilerBackend backends[] = {CompilerBackend::Register,
+                                  CompilerBackend::Stack};
+    for (isize i = 0; !needs_folding && i < 2; i++) {
+        FILE* plain_stdout = tmpfile();
+        FILE* plain_stderr = tmpfile();
+        defer(fclose(plain_stdout));
+        defer(fclose(plain_stderr));
+        u8 plain_exit_code =
+            execute_to_end_with(source_code_str, backends[i], false, false,
+                                plain_stdout, plain_stderr);
+
+        EXPECT_EQ(exit_code, plain_exit_code);
+        EXPECT_EQ(read_file_full(stdout_file, &arena),
+                  read_file_full(plain_stdout, &arena));
+        EXPECT_EQ(read_file_full(stderr_file, &arena),
+                  read_file_full(plain_stderr, &arena));
+    }
+
+    if (emit_c_enabled()) {
+        std::string c_output;
+        u8 c_exit_code = execute_emitted_c(source_code_str, &c_output);
+        EXPECT_EQ(exit_code, c_exit_code);
+        String output = read_file_full(stdout_file, &arena);
+        EXPECT_EQ(std::string(output.data, output.size), c_output);
     }
+
+    return exit_code;
+}
+
+Slice<u8> execute_function(const char* source_code_str, isize function_pointer,
+                           isize return_value_size, FILE* stdout_file,
+                           FILE* stderr_file, Arena* arena) {
+    Slice<u8> result = execute_function_with(
+        source_code_str, CompilerBackend::Register, false, true,
+        function_pointer, return_value_size, stdout_file, stderr_file, arena);
+
+    FILE* stack_stdout = tmpfile();
+    FILE* stack_stderr = tmpfile();
+    defer(fclose(stack_stdout));
+    defer(fclose(stack_stderr));
+    Slice<u8> stack_result = execute_function_with(
+        source_code_str, CompilerBackend::Stack, false, true,
+        function_pointer, return_value_size, stack_stdout, stack_stderr, arena);
+
+    EXPECT_EQ(result.size, stack_result.size);
+    EXPECT_EQ(memcmp(result.data, stack_result.data, result.size), 0);
+    EXPECT_EQ(read_file_full(stdout_file, arena),
+              read_file_full(stack_stdout, arena));
+
+    FILE* jit_stdout = tmpfile();
+    FILE* jit_stderr = tmpfile();
+    defer(fclose(jit_stdout));
+    defer(fclose(jit_stderr));
+    Slice<u8> jit_result = execute_function_with(
+        source_code_str, CompilerBackend::Register, true, true,
+        function_pointer, return_value_size, jit_stdout, jit_stderr, arena);
+
+    EXPECT_EQ(result.size, jit_result.size);
+    EXPECT_EQ(memcmp(result.data, jit_result.data, result.size), 0);
+    EXPECT_EQ(read_file_full(stdout_file, arena),
+              read_file_full(jit_stdout, arena));
+
+    FILE* plain_stdout = tmpfile();
+    FILE* plain_stderr = tmpfile();
+    defer(fclose(plain_stdout));
+    defer(fclose(plain_stderr));
+    Slice<u8> plain_result = execute_function_with(
+        source_code_str, CompilerBackend::Register, false, false,
+        function_pointer, return_value_size, plain_stdout, plain_stderr, arena);
+
+    EXPECT_EQ(result.size, plain_result.size);
+    EXPECT_EQ(memcmp(result.data, plain_result.data, result.size), 0);
+    EXPECT_EQ(read_file_full(stdout_file, arena),
+              read_file_full(plain_stdout, arena));
+
+    return result;
 }
 
 TEST(e2e, EmptyMain) {
@@ -314,6 +492,34 @@ TEST(e2e, SimpleAdditionReturn) {
     EXPECT_EQ(ftell(stderr_file), 0);
 }
 
+TEST(e2e, LargeIntegerLiterals) {
+    Arena arena;
+    arena_init(&arena, 128 * 1024);
+    defer(arena_free(&arena));
+
+    FILE* stdout_file = tmpfile();
+    FILE* stderr_file = tmpfile();
+    // Literals that do not fit into an immediate go to the static data
+    const char* source = R"SOURCE(
+        calc :: fn() {
+            a := 268435455 + 268435456
+            a = a * 4 + 2000000000
+
+            return a
+        }
+
+        main :: fn() {
+            a := calc()
+        }
+    )SOURCE";
+    Slice<u8> result = execute_function(source, 1, sizeof(isize), stdout_file,
+                                        stderr_file, &arena);
+    isize value = *slice_cast_raw<isize>(result);
+    EXPECT_EQ(value, (isize)4147483644);
+    EXPECT_EQ(ftell(stdout_file), 0);
+    EXPECT_EQ(ftell(stderr_file), 0);
+}
+
 TEST(e2e, SimpleAdditionReturnUsingVariables) {
     Arena arena;
     arena_init(&arena, 128 * 1024);
@@ -557,6 +763,100 @@ TEST(e2e, SimpleRecursion) {
     EXPECT_EQ(ftell(stderr_file), 0);
 }
 
+TEST(e2e, DeepTailRecursion) {
+    Arena arena;
+    arena_init(&arena, 128 * 1024);
+    defer(arena_free(&arena));
+
+    FILE* stdout_file = tmpfile();
+    FILE* stderr_file = tmpfile();
+    // Way deeper than the call stack, only runs if the frame is reused
+    const char* source = R"SOURCE(
+        sum :: fn(n, acc) {
+            if n == 0 {
+                return acc
+            }
+            return sum(n - 1, acc + n)
+        }
+
+        main :: fn() {
+            std_println_int(sum(1000000, 0))
+        }
+    )SOURCE";
+    u8 exit_code = execute_to_end(source, stdout_file, stderr_file);
+    EXPECT_EQ(exit_code, 0);
+
+    String output = read_file_full(stdout_file, &arena);
+    EXPECT_EQ(output, string_from_cstr("500000500000\n"));
+
+    EXPECT_EQ(ftell(stderr_file), 0);
+}
+
+TEST(e2e, TailCallSwapsArguments) {
+    Arena arena;
+    arena_init(&arena, 128 * 1024);
+    defer(arena_free(&arena));
+
+    FILE* stdout_file = tmpfile();
+    FILE* stderr_file = tmpfile();
+    // The arguments are read from the slots they are moved to
+    const char* source = R"SOURCE(
+        swap :: fn(a, b, n) {
+            if n == 0 {
+                return a * 10 + b
+            }
+            return swap(b, a, n - 1)
+        }
+
+        main :: fn() {
+            std_println_int(swap(1, 2, 0))
+            std_println_int(swap(1, 2, 1))
+            std_println_int(swap(1, 2, 7))
+        }
+    )SOURCE";
+    u8 exit_code = execute_to_end(source, stdout_file, stderr_file);
+    EXPECT_EQ(exit_code, 0);
+
+    String output = read_file_full(stdout_file, &arena);
+    EXPECT_EQ(output, string_from_cstr("12\n21\n21\n"));
+
+    EXPECT_EQ(ftell(stderr_file), 0);
+}
+
+TEST(e2e, TailCallSwapsMixedArguments) {
+    Arena arena;
+    arena_init(&arena, 128 * 1024);
+    defer(arena_free(&arena));
+
+    FILE* stdout_file = tmpfile();
+    FILE* stderr_file = tmpfile();
+    // The int is moved over part of the bool before the bool is read
+    const char* source = R"SOURCE(
+        h :: fn(x: int, y: bool) -> int {
+            if y {
+                return x
+            }
+            return 0
+        }
+
+        g :: fn(a: bool, b: int) -> int {
+            return h(b, a)
+        }
+
+        main :: fn() {
+            std_println_int(g(true, 256))
+            std_println_int(g(false, 256))
+        }
+    )SOURCE";
+    u8 exit_code = execute_to_end(source, stdout_file, stderr_file);
+    EXPECT_EQ(exit_code, 0);
+
+    String output = read_file_full(stdout_file, &arena);
+    EXPECT_EQ(output, string_from_cstr("256\n0\n"));
+
+    EXPECT_EQ(ftell(stderr_file), 0);
+}
+
 TEST(e2e, Fibonacci) {
     Arena arena;
     arena_init(&arena, 128 * 1024);
@@ -669,3 +969,75 @@ TEST(e2e, NextedLoops) {
 
     EXPECT_EQ(ftell(stderr_file), 0);
 }
+
+TEST(e2e, ConstantFolding) {
+    Arena arena;
+    arena_init(&arena, 128 * 1024);
+    defer(arena_free(&arena));
+
+    FILE* stdout_file = tmpfile();
+    FILE* stderr_file = tmpfile();
+    // Negative literals only compile with the register backend once folded,
+    // and constants only once they are literals
+    const char* source = R"SOURCE(
+        verbose :: true
+        width :: 4 * 20
+
+        main :: fn() {
+            half := width / 2
+            if verbose {
+                std_println_int(half - -2)
+            } else {
+                std_println_int(0)
+            }
+            for i := 0; i < half / 20; i = i + 1 {
+                std_print_int(i * width)
+                std_print_space()
+            }
+            std_print_newline()
+        }
+    )SOURCE";
+    u8 exit_code = execute_to_end(source, stdout_file, stderr_file, true);
+    EXPECT_EQ(exit_code, 0);
+
+    String output = read_file_full(stdout_file, &arena);
+    EXPECT_EQ(output, string_from_cstr("42\n0 80 \n"));
+
+    EXPECT_EQ(ftell(stderr_file), 0);
+}
+
+TEST(e2e, ElseWithEmptyIf) {
+    Arena arena;
+    arena_init(&arena, 128 * 1024);
+    defer(arena_free(&arena));
+
+    FILE* stdout_file = tmpfile();
+    FILE* stderr_file = tmpfile();
+    // The empty `if` compiles to nothing the optimizer keeps, so the jump over
+    // the `else` has to land past the instructions removed with it
+    const char* source = R"SOURCE(
+        f :: fn(c: int) -> int {
+            b := c == 2
+            if c == 1 {
+                std_println_int(10)
+            } else {
+                if b {}
+            }
+            std_println_int(20)
+            return 0
+        }
+
+        main :: fn() {
+            f(1)
+            f(2)
+            f(3)
+        }
+    )SOURCE";
+    u8 exit_code = execute_to_end(source, stdout_file, stderr_file);
+    EXPECT_EQ(exit_code, 0);
+
+    String output = read_file_full(stdout_file, &arena);
+    EXPECT_EQ(output, string_from_cstr("10\n20\n20\n20\n"));
+
+    EXPECT_EQ(ftell(stderr_file), 0);
+}
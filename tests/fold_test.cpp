@@ -0,0 +1,172 @@
+#include "common.hpp"
+#include "core.hpp"
+#include "fold.hpp"
+#include "parser.hpp"
+#include "sema.hpp"
+#include <gtest/gtest.h>
+
+static AstFile* analyse(const char* source, Arena* arena) {
+    AstFile* file = setup_ast_file(source, arena);
+    ast_file_parse(file, arena);
+    core_assert(file->errors.size == 0);
+    semantic_analysis(file, arena);
+    return file;
+}
+
+// The body of the top level function `name`
+static AstNodeBlock* function_body(AstFile* file, const char* name) {
+    for (isize i = 0; i < file->ast.declarations.size; i++) {
+        AstNodeDeclaration* decl = file->ast.declarations[i]->as_declaration();
+        if (decl->name->token.source == string_from_cstr(name)) {
+            return decl->value->as_function()->body;
+        }
+    }
+    core_assert(false);
+    return nullptr;
+}
+
+static AstNode* returned_value(AstNodeBlock* body) {
+    AstNode* last = body->statements[body->statements.size - 1];
+    return last->as_return()->value;
+}
+
+TEST(Fold, FoldsArithmetic) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+    AstFile* file = analyse(R"SOURCE(
+        calc :: fn() -> int {
+            return 3 + 2 * 4 - 10 / 5 - -1
+        }
+
+        main :: fn() {
+            calc()
+        }
+    )SOURCE",
+                            &arena);
+
+    fold_constants(&file->ast, &arena);
+
+    AstNode* value = returned_value(function_body(file, "calc"));
+    ASSERT_EQ(value->kind, AstNodeKind::Literal);
+    EXPECT_EQ(value->as_literal()->token.source, string_from_cstr("10"));
+    EXPECT_EQ(type_set_get_single(value->type_set)->kind, TypeKind::Integer);
+}
+
+TEST(Fold, PropagatesConstants) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+    AstFile* file = analyse(R"SOURCE(
+        calc :: fn() -> int {
+            a := limit + 1
+            b := a * 2
+            return b
+        }
+
+        limit :: scale * 5
+        scale :: 2
+
+        main :: fn() {
+            calc()
+        }
+    )SOURCE",
+                            &arena);
+
+    fold_constants(&file->ast, &arena);
+
+    // The declarations are not needed anymore
+    AstNodeBlock* body = function_body(file, "calc");
+    ASSERT_EQ(body->statements.size, 1);
+    AstNode* value = returned_value(body);
+    ASSERT_EQ(value->kind, AstNodeKind::Literal);
+    EXPECT_EQ(value->as_literal()->token.source, string_from_cstr("22"));
+}
+
+TEST(Fold, KeepsAssignedVariables) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+    AstFile* file = analyse(R"SOURCE(
+        calc :: fn() -> int {
+            a := 1
+            a = a + 1
+            return a
+        }
+
+        main :: fn() {
+            calc()
+        }
+    )SOURCE",
+                            &arena);
+
+    fold_constants(&file->ast, &arena);
+
+    AstNodeBlock* body = function_body(file, "calc");
+    ASSERT_EQ(body->statements.size, 3);
+    EXPECT_EQ(body->statements[0]->kind, AstNodeKind::Declaration);
+    EXPECT_EQ(returned_value(body)->kind, AstNodeKind::Identifier);
+}
+
+TEST(Fold, SimplifiesIf) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+    AstFile* file = analyse(R"SOURCE(
+        debug :: false
+        level :: 3
+
+        calc :: fn() -> int {
+            if debug {
+                std_println_int(1)
+            }
+            if level > 2 {
+                return 1
+            } else {
+                return 2
+            }
+        }
+
+        main :: fn() {
+            calc()
+        }
+    )SOURCE",
+                            &arena);
+
+    fold_constants(&file->ast, &arena);
+
+    AstNodeBlock* body = function_body(file, "calc");
+    ASSERT_EQ(body->statements.size, 1);
+    ASSERT_EQ(body->statements[0]->kind, AstNodeKind::Block);
+    AstNode* value = returned_value(body->statements[0]->as_block());
+    EXPECT_EQ(value->as_literal()->token.source, string_from_cstr("1"));
+}
+
+TEST(Fold, LeavesRuntimeFailures) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+    AstFile* file = analyse(R"SOURCE(
+        divide :: fn() -> int {
+            return 1 / 0
+        }
+
+        large :: fn() -> int {
+            return 2000000000 * 4
+        }
+
+        main :: fn() {
+            divide()
+            large()
+        }
+    )SOURCE",
+                            &arena);
+
+    fold_constants(&file->ast, &arena);
+
+    // The compiler reads literals only up to INT_MAX
+    EXPECT_EQ(returned_value(function_body(file, "divide"))->kind,
+              AstNodeKind::Binary);
+    EXPECT_EQ(returned_value(function_body(file, "large"))->kind,
+              AstNodeKind::Binary);
+}
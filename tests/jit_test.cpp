@@ -0,0 +1,133 @@
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "jit.hpp"
+#include "vm.hpp"
+#include <gtest/gtest.h>
+
+static CodeUnit make_code_unit(Slice<Slice<Inst>> functions, Arena* arena) {
+    i64* constants = arena_alloc<i64>(arena, 2);
+    constants[0] = 1;
+    constants[1] = 5;
+    return CodeUnit{
+        .static_data = Slice<u8>{(u8*)constants, 2 * sizeof(i64)},
+        .functions = functions,
+    };
+}
+
+static u8 run(VmImage image, i64* result, Arena* arena) {
+    VM* vm = vm_make(image, 1024, arena);
+    vm_run(vm);
+    EXPECT_EQ(vm->calls.size, 0);
+    u8 exit_code = stack_pop<u8>(&vm->stack);
+    *result = *stack_peek<i64>(&vm->stack);
+    return exit_code;
+}
+
+// Increments the return value until it reaches 5
+static MemPtr return_ptr = mem_ptr_stack_rel(-8);
+static Inst counter[] = {
+    inst_push_stack(sizeof(bool)),
+    inst_binary_op(BinOperand::Int_Add, return_ptr, return_ptr,
+                   mem_ptr_immediate(1)),
+    inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(0), return_ptr,
+                   mem_ptr_static_data(8)),
+    inst_jump_if(mem_ptr_stack_rel(0), 1),
+    inst_pop_stack(sizeof(bool)),
+    inst_return(),
+};
+
+static Inst entry[] = {
+    inst_push_stack(sizeof(i64)),
+    inst_call(1),
+    inst_exit(0),
+};
+
+TEST(Jit, RunsCalledFunction) {
+    if (!jit_supported()) {
+        GTEST_SKIP();
+    }
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Slice<Inst> functions[] = {{entry, 3}, {counter, 6}};
+    CodeUnit code = make_code_unit({functions, 2}, &arena);
+
+    VmImage image = vm_image_make(code, &arena, true);
+    defer(vm_image_free(&image));
+    ASSERT_NE(image.jit, nullptr);
+    // `Exit` keeps the entry function interpreted
+    EXPECT_EQ(image.jit->functions[0], nullptr);
+    EXPECT_NE(image.jit->functions[1], nullptr);
+
+    i64 result = 0;
+    EXPECT_EQ(run(image, &result, &arena), 0);
+    EXPECT_EQ(result, 5);
+}
+
+TEST(Jit, UnsupportedInstructionStaysInterpreted) {
+    if (!jit_supported()) {
+        GTEST_SKIP();
+    }
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    // Writes 1.0 + 1.0 to the return value
+    Inst adder[] = {
+        inst_mov(return_ptr, mem_ptr_static_data(0), 8),
+        inst_binary_op(BinOperand::Float_Add, return_ptr, return_ptr,
+                       return_ptr),
+        inst_return(),
+    };
+    Slice<Inst> functions[] = {{entry, 3}, {adder, 3}};
+    CodeUnit code = make_code_unit({functions, 2}, &arena);
+    f64 one = 1.0;
+    memcpy(code.static_data.data, &one, sizeof(one));
+
+    VmImage image = vm_image_make(code, &arena, true);
+    defer(vm_image_free(&image));
+    EXPECT_EQ(image.jit, nullptr);
+
+    i64 result = 0;
+    EXPECT_EQ(run(image, &result, &arena), 0);
+    f64 value = 0;
+    memcpy(&value, &result, sizeof(value));
+    EXPECT_EQ(value, 2.0);
+}
+
+TEST(Jit, CallerOfInterpretedFunctionStaysInterpreted) {
+    if (!jit_supported()) {
+        GTEST_SKIP();
+    }
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    // Calls `counter` through a function that reads the stack absolutely
+    Inst caller[] = {
+        inst_call(2),
+        inst_return(),
+    };
+    Inst absolute[] = {
+        inst_mov(return_ptr, {MemPtrType::StackAbs, 0}, 8),
+        inst_call(3),
+        inst_return(),
+    };
+    Slice<Inst> functions[] = {
+        {entry, 3}, {caller, 2}, {absolute, 3}, {counter, 6}};
+    CodeUnit code = make_code_unit({functions, 4}, &arena);
+
+    VmImage image = vm_image_make(code, &arena, true);
+    defer(vm_image_free(&image));
+    ASSERT_FALSE(image.verified);
+    EXPECT_EQ(image.jit, nullptr);
+
+    // Only verified code is compiled, so compile it directly
+    JitCode* jit = jit_compile(code, &arena);
+    defer(jit_free(jit));
+    ASSERT_NE(jit, nullptr);
+    EXPECT_EQ(jit->functions[1], nullptr);
+    EXPECT_EQ(jit->functions[2], nullptr);
+    EXPECT_NE(jit->functions[3], nullptr);
+}
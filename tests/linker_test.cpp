@@ -0,0 +1,254 @@
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include <gtest/gtest.h>
+#include <sstream>
+
+TEST(Linker, SpecializesBinaryOp) {
+    Inst inst = inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(16),
+                               mem_ptr_stack_rel(0), mem_ptr_static_data(8));
+    EXPECT_EQ(link_select_op(inst),
+              LinkedOp::BinaryOp_Int_LessThan_StackRel_StaticData);
+
+    inst = inst_binary_op(BinOperand::Bool_NotEqual, mem_ptr_stack_rel(16),
+                          mem_ptr_static_data(0), mem_ptr_stack_rel(8));
+    EXPECT_EQ(link_select_op(inst),
+              LinkedOp::BinaryOp_Bool_NotEqual_StaticData_StackRel);
+}
+
+TEST(Linker, SpecializesImmediates) {
+    Inst inst = inst_binary_op(BinOperand::Int_Add, mem_ptr_stack_rel(0),
+                               mem_ptr_stack_rel(0), mem_ptr_immediate(1));
+    EXPECT_EQ(link_select_op(inst),
+              LinkedOp::BinaryOp_Int_Add_StackRel_Immediate);
+
+    inst = inst_binary_op(BinOperand::Int_Sub, mem_ptr_stack_rel(0),
+                          mem_ptr_immediate(-1), mem_ptr_static_data(8));
+    EXPECT_EQ(link_select_op(inst),
+              LinkedOp::BinaryOp_Int_Sub_Immediate_StaticData);
+
+    inst = inst_mov(mem_ptr_stack_rel(0), mem_ptr_immediate(0), 8);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::Mov_Immediate_8);
+
+    inst = inst_jump_if(mem_ptr_immediate(1), 3);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::JumpIf_Immediate_True);
+}
+
+TEST(Linker, KeepsGenericForOtherModes) {
+    Inst inst = inst_binary_op(BinOperand::Int_Add, {MemPtrType::StackAbs, 0},
+                               mem_ptr_stack_rel(0), mem_ptr_stack_rel(8));
+    EXPECT_EQ(link_select_op(inst), LinkedOp::BinaryOp);
+
+    inst = inst_binary_op(BinOperand::Int_Add, mem_ptr_stack_rel(0),
+                          {MemPtrType::StackAbs, 0}, mem_ptr_stack_rel(8));
+    EXPECT_EQ(link_select_op(inst), LinkedOp::BinaryOp);
+
+    inst = inst_mov(mem_ptr_static_data(0), mem_ptr_stack_rel(0), 8);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::Mov);
+}
+
+TEST(Linker, SpecializesMovOnSize) {
+    Inst inst = inst_mov(mem_ptr_stack_rel(0), mem_ptr_static_data(0), 8);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::Mov_StaticData_8);
+
+    inst = inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(8), 1);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::Mov_StackRel_1);
+
+    inst = inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(8), 24);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::Mov);
+}
+
+TEST(Linker, SpecializesJumpIf) {
+    Inst inst = inst_jump_if(mem_ptr_stack_rel(0), 3);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::JumpIf_StackRel_True);
+
+    inst = inst_jump_if_not(mem_ptr_static_data(0), 3);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::JumpIf_StaticData_False);
+
+    inst = inst_jump_if(mem_ptr_invalid(), 3);
+    EXPECT_EQ(link_select_op(inst), LinkedOp::JumpIf);
+}
+
+TEST(Linker, OpNames) {
+    EXPECT_STREQ(linked_op_name(LinkedOp::Return), "Return");
+    EXPECT_STREQ(linked_op_name(LinkedOp::BinaryOp_Int_Add_StackRel_StaticData),
+                 "BinaryOp_Int_Add_StackRel_StaticData");
+    EXPECT_STREQ(linked_op_name(LinkedOp::JumpIf_StaticData_False),
+                 "JumpIf_StaticData_False");
+}
+
+static LinkedUnit link_single_function(Slice<Inst> function, Arena* arena,
+                                       bool fuse = true) {
+    Slice<Inst>* functions = arena_alloc<Slice<Inst>>(arena);
+    *functions = function;
+    CodeUnit code = {.static_data = {nullptr, 0},
+                     .functions = Slice<Slice<Inst>>{functions, 1}};
+    return link_code_unit(code, arena, fuse);
+}
+
+TEST(Linker, EncodingRoundTrip) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst insts[] = {
+        inst_binary_op(BinOperand::Int_Sub, mem_ptr_stack_rel(16),
+                       mem_ptr_stack_rel(-32), mem_ptr_static_data(8)),
+        inst_binary_op(BinOperand::Float_Div, {MemPtrType::StackAbs, 24},
+                       mem_ptr_stack_rel(0), mem_ptr_stack_rel(8)),
+        inst_unary_op(UnaryOperand::Bool_Not, mem_ptr_stack_rel(1),
+                      mem_ptr_stack_rel(0)),
+        inst_mov(mem_ptr_stack_rel(0), mem_ptr_static_data(3), 1),
+        inst_mov(mem_ptr_stack_rel(8), mem_ptr_immediate(-268435456), 8),
+        inst_binary_op(BinOperand::Int_Mul, {MemPtrType::StackAbs, 0},
+                       mem_ptr_immediate(268435455), mem_ptr_stack_rel(8)),
+        inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(-40), 24),
+        inst_push_stack(40),
+        inst_pop_stack(8),
+        inst_call(7),
+        inst_tail_call(3),
+        inst_call_builtin((void*)&arena),
+        inst_jump_if_not(mem_ptr_stack_rel(1), 0),
+        inst_jump_if(mem_ptr_invalid(), 0),
+        inst_return(),
+        inst_exit(3),
+    };
+    isize count = sizeof(insts) / sizeof(insts[0]);
+    LinkedUnit unit = link_single_function(Slice<Inst>{insts, count}, &arena);
+    ASSERT_EQ(unit.functions.size, 1);
+    Slice<u8> function = unit.functions[0];
+
+    isize offset = 0;
+    for (isize i = 0; i < count; i++) {
+        LinkedDecoded decoded = link_decode(function, offset);
+        EXPECT_EQ(decoded.op, link_select_op(insts[i]));
+        EXPECT_EQ(decoded.size, linked_op_size(decoded.op));
+
+        std::stringstream expected, actual;
+        expected << insts[i];
+        actual << decoded.inst;
+        EXPECT_EQ(actual.str(), expected.str());
+
+        offset += decoded.size;
+    }
+    EXPECT_EQ(offset, function.size);
+}
+
+TEST(Linker, JumpTargetsAreByteOffsets) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst insts[] = {
+        inst_push_stack(8),
+        inst_jump(3),
+        inst_pop_stack(8),
+        inst_jump_if(mem_ptr_stack_rel(0), 1),
+        inst_return(),
+    };
+    LinkedUnit unit = link_single_function(Slice<Inst>{insts, 5}, &arena);
+    Slice<u8> function = unit.functions[0];
+
+    isize push_size = linked_op_size(LinkedOp::PushStack);
+    isize jump_size = linked_op_size(LinkedOp::Jump);
+    isize pop_size = linked_op_size(LinkedOp::PopStack);
+
+    LinkedDecoded jump = link_decode(function, push_size);
+    EXPECT_EQ(jump.inst.jump.new_ip, push_size + jump_size + pop_size);
+
+    LinkedDecoded jump_if = link_decode(function, jump.inst.jump.new_ip);
+    EXPECT_EQ(jump_if.op, LinkedOp::JumpIf_StackRel_True);
+    EXPECT_EQ(jump_if.inst.jump_if.new_ip, push_size);
+}
+
+TEST(Linker, EncodingIsCompact) {
+    // Specialized instructions carry only the opcode and their operands
+    EXPECT_EQ(linked_op_size(LinkedOp::BinaryOp_Int_Add_StackRel_StackRel),
+              14);
+    EXPECT_EQ(linked_op_size(LinkedOp::Mov_StackRel_8), 10);
+    EXPECT_EQ(linked_op_size(LinkedOp::JumpIf_StackRel_False), 10);
+    EXPECT_EQ(linked_op_size(LinkedOp::Return), 2);
+    EXPECT_LT(linked_op_size(LinkedOp::BinaryOp), (isize)sizeof(Inst));
+}
+
+TEST(Linker, Disassemble) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst insts[] = {
+        inst_mov(mem_ptr_stack_rel(0), mem_ptr_static_data(8), 8),
+        inst_jump_if_not(mem_ptr_stack_rel(0), 0),
+        inst_mov(mem_ptr_stack_rel(0), {MemPtrType::StackAbs, 8}, 16),
+        inst_return(),
+    };
+    LinkedUnit unit = link_single_function(Slice<Inst>{insts, 4}, &arena);
+
+    std::stringstream ss;
+    link_disassemble(unit.functions[0], ss);
+    EXPECT_EQ(ss.str(), "0: Mov_StaticData_8 (StackRel 0) (StaticData 8)\n"
+                        "10: JumpIf_StackRel_False (StackRel 0) -> 0\n"
+                        "20: Mov (StackRel 0) (StackAbs 8) 16\n"
+                        "34: Return\n");
+}
+
+TEST(Linker, FusesSuperinstructions) {
+    LinkedOp compare = LinkedOp::BinaryOp_Int_LessThan_StackRel_Immediate;
+    LinkedOp jump_if = LinkedOp::JumpIf_StackRel_False;
+    LinkedOp fused = link_fuse_ops(compare, jump_if);
+    if (fused == LinkedOp::Count) {
+        GTEST_SKIP() << "The pair is not in superinstructions.hpp";
+    }
+
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst insts[] = {
+        inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(0),
+                       mem_ptr_stack_rel(8), mem_ptr_immediate(10)),
+        inst_jump_if_not(mem_ptr_stack_rel(0), 3),
+        inst_return(),
+        inst_return(),
+    };
+    Slice<u8> function =
+        link_single_function(Slice<Inst>{insts, 4}, &arena).functions[0];
+
+    LinkedDecoded decoded = link_decode(function, 0);
+    EXPECT_EQ(decoded.op, fused);
+    EXPECT_EQ(decoded.inst.type, InstType::BinaryOp);
+    // Only the opcode of the superinstruction is skipped, the fused
+    // instructions are decoded one by one
+    EXPECT_EQ(decoded.size, LINK_OPCODE_SIZE + linked_op_size(compare));
+    EXPECT_EQ(linked_op_size(fused), LINK_OPCODE_SIZE +
+                                         linked_op_size(compare) +
+                                         linked_op_size(jump_if));
+
+    decoded = link_decode(function, decoded.size);
+    EXPECT_EQ(decoded.op, jump_if);
+    EXPECT_EQ(decoded.inst.jump_if.new_ip,
+              linked_op_size(fused) + linked_op_size(LinkedOp::Return));
+
+    function = link_single_function(Slice<Inst>{insts, 4}, &arena, false)
+                   .functions[0];
+    EXPECT_EQ(link_decode(function, 0).op, compare);
+}
+
+TEST(Linker, DoesNotFuseJumpTargets) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    // The `JumpIf` is jumped to, it has to stay a separate instruction
+    Inst insts[] = {
+        inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(0),
+                       mem_ptr_stack_rel(8), mem_ptr_immediate(10)),
+        inst_jump_if_not(mem_ptr_stack_rel(0), 1),
+        inst_return(),
+    };
+    Slice<u8> function =
+        link_single_function(Slice<Inst>{insts, 3}, &arena).functions[0];
+
+    EXPECT_EQ(link_decode(function, 0).op,
+              LinkedOp::BinaryOp_Int_LessThan_StackRel_Immediate);
+}
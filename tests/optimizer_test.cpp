@@ -1,8 +1,10 @@
 #include "bytecode.hpp"
+#include "common.hpp"
 #include "core.hpp"
 #include "optimizer.hpp"
-#include "sema.hpp"
+#include "vm.hpp"
 #include <gtest/gtest.h>
+#include <string>
 
 TEST(Optimizer, PopPushStackCombination) {
     Arena arena;
@@ -65,3 +67,433 @@ TEST(Optimizer, PopPushStackCombinationWithJumps) {
     EXPECT_EQ(instructions[5].type, InstType::PopStack);
     EXPECT_EQ(instructions[5].pop_stack.size, 4);
 }
+
+TEST(Optimizer, JumpToRemovedPopPushStack) {
+    Arena arena;
+    arena_init(&arena, 2048);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_jump_if(mem_ptr_invalid(), 2));
+    array_push(&instructions, inst_jump(0));
+    array_push(&instructions, inst_push_stack(8));
+    array_push(&instructions, inst_pop_stack(8));
+    array_push(&instructions, inst_return());
+
+    optimize(&instructions, &arena);
+
+    EXPECT_EQ(instructions.size, 3);
+
+    EXPECT_EQ(instructions[0].type, InstType::JumpIf);
+    EXPECT_EQ(instructions[0].jump_if.new_ip, 2);
+
+    EXPECT_EQ(instructions[2].type, InstType::Return);
+}
+
+TEST(Optimizer, RemovesMovToSelfAndJumpToNext) {
+    Arena arena;
+    arena_init(&arena, 2048);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_jump_if(mem_ptr_stack_rel(0), 4));
+    array_push(&instructions, inst_jump(2));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(0), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_immediate(1), 8));
+    array_push(&instructions, inst_return());
+
+    u64 hits = optimizer_hits("mov_to_self");
+    optimize(&instructions, &arena);
+
+    EXPECT_EQ(optimizer_hits("mov_to_self"), hits + 1);
+    ASSERT_EQ(instructions.size, 3);
+    EXPECT_EQ(instructions[0].type, InstType::JumpIf);
+    EXPECT_EQ(instructions[0].jump_if.new_ip, 2);
+    EXPECT_EQ(instructions[1].type, InstType::Mov);
+    EXPECT_EQ(instructions[2].type, InstType::Return);
+}
+
+// Removing the jump target makes the jump before it a jump to the next
+// instruction, the target must move to where that jump was
+TEST(Optimizer, JumpToRemovedTargetAfterRemovedJump) {
+    Arena arena;
+    arena_init(&arena, 2048);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_jump_if(mem_ptr_stack_rel(0), 3));
+    array_push(&instructions, inst_call(1));
+    array_push(&instructions, inst_jump(4));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(0), 8));
+    array_push(&instructions, inst_return());
+
+    optimize(&instructions, &arena);
+
+    ASSERT_EQ(instructions.size, 3);
+    EXPECT_EQ(instructions[0].type, InstType::JumpIf);
+    EXPECT_EQ(instructions[0].jump_if.new_ip, 2);
+    EXPECT_EQ(instructions[2].type, InstType::Return);
+}
+
+TEST(Optimizer, KeepsMovChainIntoOverlappingRange) {
+    Arena arena;
+    arena_init(&arena, 2048);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_push_stack(8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(-8), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(-9), mem_ptr_stack_rel(0), 8));
+    array_push(&instructions, inst_pop_stack(8));
+    array_push(&instructions, inst_return());
+
+    u64 hits = optimizer_hits("mov_chain");
+    optimize(&instructions, &arena);
+
+    EXPECT_EQ(optimizer_hits("mov_chain"), hits);
+    ASSERT_EQ(instructions.size, 5);
+    EXPECT_EQ(instructions[2].type, InstType::Mov);
+    EXPECT_EQ(instructions[2].mov.src.mem_offset, 0);
+}
+
+TEST(Optimizer, RemovesOverwrittenMov) {
+    Arena arena;
+    arena_init(&arena, 2048);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_immediate(1), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_immediate(2), 8));
+    // Reads what it overwrites, so the first one is still needed
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(8), mem_ptr_immediate(3), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(8), mem_ptr_stack_rel(8), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(8), mem_ptr_stack_rel(12), 8));
+    array_push(&instructions, inst_return());
+
+    optimize(&instructions, &arena);
+
+    ASSERT_EQ(instructions.size, 4);
+    EXPECT_EQ(instructions[0].mov.src.mem_offset, 2);
+    EXPECT_EQ(instructions[1].mov.src.mem_offset, 3);
+    EXPECT_EQ(instructions[2].mov.src.mem_offset, 12);
+    EXPECT_EQ(instructions[3].type, InstType::Return);
+}
+
+TEST(Optimizer, ForwardsMovAndRemovesDeadStore) {
+    Arena arena;
+    arena_init(&arena, 2048);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_push_stack(16));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(8), mem_ptr_immediate(5), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(8), 8));
+    array_push(&instructions, inst_pop_stack(8));
+    array_push(&instructions, inst_return());
+
+    optimize(&instructions, &arena);
+
+    // The temporary at 8 is popped without being read
+    ASSERT_EQ(instructions.size, 4);
+    EXPECT_EQ(instructions[0].type, InstType::PushStack);
+    EXPECT_EQ(instructions[1].type, InstType::Mov);
+    EXPECT_EQ(instructions[1].mov.dest.mem_offset, 0);
+    EXPECT_EQ(instructions[1].mov.src.type, MemPtrType::Immediate);
+    EXPECT_EQ(instructions[1].mov.src.mem_offset, 5);
+    EXPECT_EQ(instructions[2].type, InstType::PopStack);
+    EXPECT_EQ(instructions[3].type, InstType::Return);
+}
+
+TEST(Optimizer, RemovesPushMovPop) {
+    Arena arena;
+    arena_init(&arena, 2048);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_push_stack(8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_immediate(1), 8));
+    array_push(&instructions, inst_push_stack(8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(8), mem_ptr_stack_rel(0), 8));
+    array_push(&instructions, inst_pop_stack(8));
+    array_push(&instructions, inst_return());
+
+    u64 hits = optimizer_hits("push_mov_pop");
+    optimize(&instructions, &arena);
+
+    EXPECT_EQ(optimizer_hits("push_mov_pop"), hits + 1);
+    ASSERT_EQ(instructions.size, 3);
+    EXPECT_EQ(instructions[0].type, InstType::PushStack);
+    EXPECT_EQ(instructions[0].push_stack.size, 8);
+    EXPECT_EQ(instructions[1].type, InstType::Mov);
+    EXPECT_EQ(instructions[2].type, InstType::Return);
+}
+
+TEST(Optimizer, PropagatesCopies) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    // a := arg; b := a + a; return b
+    array_push(&instructions, inst_push_stack(8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(-16), 8));
+    array_push(&instructions, inst_push_stack(8));
+    array_push(&instructions,
+               inst_binary_op(BinOperand::Int_Add, mem_ptr_stack_rel(8),
+                              mem_ptr_stack_rel(0), mem_ptr_stack_rel(0)));
+    array_push(&instructions, inst_push_stack(8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(-24), mem_ptr_stack_rel(8), 8));
+    array_push(&instructions, inst_pop_stack(24));
+    array_push(&instructions, inst_return());
+
+    u64 copies = optimizer_hits("copy_propagation");
+    u64 forwarded = optimizer_hits("result_forwarding");
+    optimize(&instructions, &arena);
+
+    EXPECT_EQ(optimizer_hits("copy_propagation"), copies + 2);
+    EXPECT_EQ(optimizer_hits("result_forwarding"), forwarded + 1);
+    ASSERT_EQ(instructions.size, 4);
+    EXPECT_EQ(instructions[0].type, InstType::PushStack);
+    EXPECT_EQ(instructions[0].push_stack.size, 16);
+    ASSERT_EQ(instructions[1].type, InstType::BinaryOp);
+    EXPECT_EQ(instructions[1].binary.dest.mem_offset, -24);
+    EXPECT_EQ(instructions[1].binary.left.mem_offset, -16);
+    EXPECT_EQ(instructions[1].binary.right.mem_offset, -16);
+    EXPECT_EQ(instructions[2].type, InstType::PopStack);
+    EXPECT_EQ(instructions[2].pop_stack.size, 16);
+    EXPECT_EQ(instructions[3].type, InstType::Return);
+}
+
+// The arguments of a tail call moved over each other, `b` only partly
+// overlaps the slot it goes to, so it is copied out first
+TEST(Optimizer, KeepsCopiesBetweenOverlappingRanges) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_push_stack(9));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(-8), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(8), mem_ptr_stack_rel(-9), 1));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(-9), mem_ptr_stack_rel(0), 8));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(-1), mem_ptr_stack_rel(8), 1));
+    array_push(&instructions, inst_pop_stack(9));
+    array_push(&instructions, inst_return());
+
+    optimize(&instructions, &arena);
+
+    for (isize i = 0; i < instructions.size; i++) {
+        Inst inst = instructions[i];
+        if (inst.type != InstType::Mov) {
+            continue;
+        }
+        isize dest = inst.mov.dest.mem_offset;
+        isize src = inst.mov.src.mem_offset;
+        EXPECT_TRUE(dest + inst.mov.size <= src || src + inst.mov.size <= dest)
+            << "Mov " << dest << " " << src;
+    }
+}
+
+TEST(Optimizer, KeepsCopiesAcrossJumpTargets) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Array<Inst> instructions = {};
+    array_init(&instructions, 16, &arena);
+
+    array_push(&instructions, inst_push_stack(16));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(-8), 8));
+    // Another path reaches the add with a different value at 0
+    array_push(&instructions,
+               inst_binary_op(BinOperand::Int_Add, mem_ptr_stack_rel(8),
+                              mem_ptr_stack_rel(0), mem_ptr_immediate(1)));
+    array_push(&instructions,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_stack_rel(8), 8));
+    array_push(&instructions, inst_jump(2));
+
+    optimize(&instructions, &arena);
+
+    ASSERT_EQ(instructions.size, 5);
+    EXPECT_EQ(instructions[1].type, InstType::Mov);
+    EXPECT_EQ(instructions[2].binary.left.mem_offset, 0);
+    EXPECT_EQ(instructions[3].type, InstType::Mov);
+    EXPECT_EQ(instructions[4].jump.new_ip, 2);
+}
+
+TEST(Optimizer, InlinesSmallFunction) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    // Adds one to the argument in place
+    Array<Inst> callee = {};
+    array_init(&callee, 4, &arena);
+    array_push(&callee,
+               inst_binary_op(BinOperand::Int_Add, mem_ptr_stack_rel(-8),
+                              mem_ptr_stack_rel(-8), mem_ptr_immediate(1)));
+    array_push(&callee, inst_return());
+
+    Array<Inst> caller = {};
+    array_init(&caller, 8, &arena);
+    array_push(&caller, inst_push_stack(8));
+    array_push(&caller,
+               inst_mov(mem_ptr_stack_rel(0), mem_ptr_immediate(41), 8));
+    array_push(&caller, inst_call(1));
+    array_push(&caller,
+               inst_mov(mem_ptr_stack_rel(-16), mem_ptr_stack_rel(0), 8));
+    array_push(&caller, inst_pop_stack(8));
+    array_push(&caller, inst_return());
+
+    Slice<Inst> functions_data[] = {array_to_slice(&caller),
+                                    array_to_slice(&callee)};
+    Slice<Slice<Inst>> functions = {functions_data, 2};
+
+    u64 inlined = optimizer_hits("inlined_calls");
+    EXPECT_EQ(inline_calls(functions, INLINE_BUDGET, &arena), 1);
+    EXPECT_EQ(optimizer_hits("inlined_calls"), inlined + 1);
+
+    // The callee is still there for other calls
+    ASSERT_EQ(functions[1].size, 2);
+    EXPECT_EQ(functions[1][0].binary.dest.mem_offset, -8);
+
+    isize adds = 0;
+    for (isize i = 0; i < functions[0].size; i++) {
+        EXPECT_NE(functions[0][i].type, InstType::Call);
+        if (functions[0][i].type == InstType::BinaryOp) {
+            adds += 1;
+        }
+    }
+    EXPECT_EQ(adds, 1);
+    EXPECT_EQ(functions[0][functions[0].size - 1].type, InstType::Return);
+}
+
+TEST(Optimizer, InliningSkipsCallsAndRespectsBudget) {
+    Arena arena;
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    // Calls itself, so it is never inlined
+    Inst recursive[] = {inst_call(1), inst_return()};
+    Inst leaf[] = {inst_mov(mem_ptr_stack_rel(-8), mem_ptr_immediate(1), 8),
+                   inst_return()};
+    Inst caller[] = {inst_push_stack(8), inst_call(1), inst_call(2),
+                     inst_pop_stack(8), inst_return()};
+
+    Slice<Inst> functions_data[] = {{caller, 5}, {recursive, 2}, {leaf, 2}};
+    Slice<Slice<Inst>> functions = {functions_data, 3};
+
+    EXPECT_EQ(inline_calls(functions, 0, &arena), 0);
+    EXPECT_EQ(functions[0].size, 5);
+
+    EXPECT_EQ(inline_calls(functions, INLINE_BUDGET, &arena), 1);
+    isize calls = 0;
+    for (isize i = 0; i < functions[0].size; i++) {
+        if (functions[0][i].type == InstType::Call) {
+            EXPECT_EQ(functions[0][i].call.fp, 1);
+            calls += 1;
+        }
+    }
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(functions[1].size, 2);
+}
+
+// The passes must not change what a program does, only how fast it does it
+TEST(Optimizer, KeepsProgramOutput) {
+    Arena arena;
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    const char* source = R"SOURCE(
+        square :: fn(n: int) -> int {
+            return n * n
+        }
+
+        step :: fn(a: int, b: int) -> int {
+            c := a
+            c = c + b
+            c = c * 2
+            return c - a
+        }
+
+        fib :: fn(n: int) -> int {
+            if n < 2 {
+                return n
+            }
+            return fib(n - 1) + fib(n - 2)
+        }
+
+        main :: fn() {
+            total := 0
+            last := 1
+            for i := 0; i < 20; i = i + 1 {
+                last = step(last, i) / 3
+                x := last
+                x = x + square(i)
+                if x > total {
+                    total = x
+                } else {
+                    total = total - 1
+                }
+                std_print_int(total)
+                std_print_space()
+            }
+            std_print_newline()
+            std_println_int(fib(12) + last)
+        }
+    )SOURCE";
+
+    CompilerBackend backends[] = {CompilerBackend::Register,
+                                  CompilerBackend::Stack};
+    for (CompilerBackend backend : backends) {
+        u64 inlined = optimizer_hits("inlined_calls");
+        CodeUnit optimized = compile_source(source, &arena, true, backend);
+        EXPECT_GT(optimizer_hits("inlined_calls"), inlined);
+        CodeUnit plain = compile_source(source, &arena, false, backend);
+
+        std::string expected =
+            run_captured(vm_make(plain, 64 * 1024, &arena));
+        EXPECT_EQ(run_captured(vm_make(optimized, 64 * 1024, &arena)),
+                  expected);
+        EXPECT_NE(expected.find('\n'), std::string::npos);
+    }
+}
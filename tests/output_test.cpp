@@ -0,0 +1,105 @@
+#include "core.hpp"
+#include "output.hpp"
+#include <climits>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <string>
+
+static std::string format(i64 value) {
+    char digits[OUTPUT_INT_MAX_SIZE];
+    char* end = digits + OUTPUT_INT_MAX_SIZE;
+    return std::string(output_format_int(value, end), end);
+}
+
+TEST(Output, FormatsIntegers) {
+    i64 values[] = {0,    1,     9,     10,    11,        99,
+                    100,  101,   999,   1000,  123456789, -1,
+                    -10,  -99,   -100,  -1234, LLONG_MAX, LLONG_MIN};
+    for (i64 value : values) {
+        EXPECT_EQ(format(value), std::to_string(value));
+    }
+    for (i64 value = -100000; value <= 100000; value += 7) {
+        ASSERT_EQ(format(value), std::to_string(value));
+    }
+}
+
+static std::string read_all(FILE* file) {
+    fflush(file);
+    rewind(file);
+    std::string result;
+    char buffer[256];
+    while (size_t read = fread(buffer, 1, sizeof(buffer), file)) {
+        result.append(buffer, read);
+    }
+    return result;
+}
+
+// Writes more than fits into the buffer, so it is flushed on the way too
+static void write_numbers(OutputBuffer* output, FILE* file) {
+    for (i64 i = 0; i < 1000; i++) {
+        output_write_int(output, file, i * 1000003);
+        output_write_char(output, file, ' ');
+    }
+    output_write(output, file, "end", 3);
+}
+
+static std::string expected_numbers() {
+    std::string expected;
+    for (i64 i = 0; i < 1000; i++) {
+        expected += std::to_string(i * 1000003) + " ";
+    }
+    return expected + "end";
+}
+
+TEST(Output, FlushesToDescriptor) {
+    Arena arena = {};
+    arena_init(&arena, 1024);
+    defer(arena_free(&arena));
+    OutputBuffer output = {};
+    output_init(&output, 64, &arena);
+
+    FILE* file = tmpfile();
+    defer(fclose(file));
+    ASSERT_GE(fileno(file), 0);
+    // Buffered by stdio, still comes first
+    fprintf(file, "start ");
+    write_numbers(&output, file);
+    EXPECT_TRUE(output_flush(&output, file));
+    EXPECT_EQ(output.size, 0);
+    EXPECT_EQ(read_all(file), "start " + expected_numbers());
+}
+
+TEST(Output, FlushesToMemoryStream) {
+    Arena arena = {};
+    arena_init(&arena, 1024);
+    defer(arena_free(&arena));
+    OutputBuffer output = {};
+    output_init(&output, 64, &arena);
+
+    char* data = nullptr;
+    size_t size = 0;
+    FILE* file = open_memstream(&data, &size);
+    write_numbers(&output, file);
+    EXPECT_TRUE(output_flush(&output, file));
+    fclose(file);
+    EXPECT_EQ(std::string(data, size), expected_numbers());
+    free(data);
+}
+
+TEST(Output, WritesLargerThanBuffer) {
+    Arena arena = {};
+    arena_init(&arena, 1024);
+    defer(arena_free(&arena));
+    OutputBuffer output = {};
+    output_init(&output, 8, &arena);
+
+    FILE* file = tmpfile();
+    defer(fclose(file));
+    output_write(&output, file, "abc", 3);
+    output_write(&output, file, "0123456789", 10);
+    EXPECT_EQ(output.size, 0);
+    output_write(&output, file, "xyz", 3);
+    EXPECT_EQ(output.size, 3);
+    output_flush(&output, file);
+    EXPECT_EQ(read_all(file), "abc0123456789xyz");
+}
@@ -0,0 +1,133 @@
+#include "common.hpp"
+#include "core.hpp"
+#include "profile.hpp"
+#include "vm.hpp"
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+
+// `fib` (1) is called 177 times from `main` (2)
+static const char* source = R"SOURCE(
+    fib :: fn(n: int) -> int {
+        if n < 2 {
+            return n
+        }
+        return fib(n - 1) + fib(n - 2)
+    }
+
+    main :: fn() {
+        std_println_int(fib(10))
+    }
+)SOURCE";
+
+static u64 sum(Slice<u64> counts) {
+    u64 total = 0;
+    for (isize i = 0; i < counts.size; i++) {
+        total += counts[i];
+    }
+    return total;
+}
+
+static Profile* run_profiled(VmImage image, bool timed, Arena* arena) {
+    VM* vm = vm_make(image, 64 * 1024, arena);
+    Profile* profile = profile_make(vm->linked, timed, arena);
+    vm_enable_profiling(vm, profile);
+    vm->stdout = fopen("/dev/null", "w");
+    vm_run(vm);
+    fclose(vm->stdout);
+    EXPECT_EQ(stack_pop<u8>(&vm->stack), 0);
+    return profile;
+}
+
+TEST(Profile, CountsEveryInstruction) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    Profile* profile = run_profiled(image, false, &arena);
+
+    // Stepping executes the same instructions, but the two halves of a
+    // superinstruction as two steps
+    VM* stepped = vm_make(image, 64 * 1024, &arena);
+    stepped->stdout = fopen("/dev/null", "w");
+    Slice<Slice<u64>> steps =
+        profile_make(stepped->linked, false, &arena)->counts;
+    bool running = true;
+    while (running) {
+        steps[stepped->fp][stepped->ip]++;
+        running = vm_execute_inst(stepped);
+    }
+    fclose(stepped->stdout);
+
+    for (isize f = 0; f < steps.size; f++) {
+        for (isize offset = 0; offset < steps[f].size; offset++) {
+            if (profile->counts[f][offset] > 0) {
+                EXPECT_EQ(profile->counts[f][offset], steps[f][offset])
+                    << "fn " << f << " offset " << offset;
+            }
+        }
+    }
+
+    u64 fib_calls = 0;
+    for (isize i = 0; i < profile->nodes.size; i++) {
+        if (profile->nodes[i].function == 1) {
+            fib_calls += profile->nodes[i].calls;
+        }
+    }
+    EXPECT_EQ(fib_calls, 177);
+}
+
+TEST(Profile, FoldedStacksAddUp) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    Profile* profile = run_profiled(image, false, &arena);
+    u64 total = 0;
+    for (isize f = 0; f < profile->counts.size; f++) {
+        total += sum(profile->counts[f]);
+    }
+
+    std::stringstream folded;
+    profile_write_folded(profile, folded);
+    u64 folded_total = 0;
+    std::string line;
+    isize deepest = 0;
+    while (std::getline(folded, line)) {
+        isize space = line.rfind(' ');
+        ASSERT_NE(space, (isize)std::string::npos) << line;
+        EXPECT_EQ(line.rfind("fn0", 0), 0u) << line;
+        folded_total += std::stoull(line.substr(space + 1));
+        deepest = std::max<isize>(
+            deepest, std::count(line.begin(), line.end(), ';'));
+    }
+    EXPECT_EQ(folded_total, total);
+    // The entry function and `main`, then `fib` 10 deep
+    EXPECT_EQ(deepest, 11);
+}
+
+TEST(Profile, TimesFunctions) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    Profile* profile = run_profiled(image, true, &arena);
+    u64 fib_ticks = 0;
+    for (isize i = 0; i < profile->nodes.size; i++) {
+        if (profile->nodes[i].function == 1) {
+            fib_ticks += profile->nodes[i].ticks;
+        }
+    }
+    EXPECT_GT(fib_ticks, 0u);
+
+    std::stringstream report;
+    profile_report(profile, report);
+    EXPECT_NE(report.str().find(PROFILE_TICKS_UNIT), std::string::npos);
+    EXPECT_NE(report.str().find("Int_LessThan"), std::string::npos);
+    EXPECT_NE(report.str().find("Hottest instructions:"), std::string::npos)
+        << report.str();
+}
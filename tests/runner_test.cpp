@@ -0,0 +1,93 @@
+#include "common.hpp"
+#include "core.hpp"
+#include "runner.hpp"
+#include "vm.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <string>
+
+TEST(Runner, SharesImageAcrossThreads) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    const char* source = R"SOURCE(
+        fib :: fn(n: int) -> int {
+            if n < 2 {
+                return n
+            }
+            return fib(n - 1) + fib(n - 2)
+        }
+
+        main :: fn() {
+            for i := 0; i < 15; i = i + 1 {
+                std_print_int(fib(i))
+                std_print_space()
+            }
+            std_print_newline()
+        }
+    )SOURCE";
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    EXPECT_TRUE(image.verified);
+
+    const isize job_count = 64;
+    RunJob jobs[job_count] = {};
+    char* outputs[job_count] = {};
+    size_t output_sizes[job_count] = {};
+    for (isize i = 0; i < job_count; i++) {
+        jobs[i].image = &image;
+        jobs[i].stdout = open_memstream(&outputs[i], &output_sizes[i]);
+        jobs[i].stderr = stderr;
+        jobs[i].exit_code = 0xff;
+    }
+
+    run_jobs(Slice<RunJob>{jobs, job_count}, 8, 64 * 1024);
+
+    for (isize i = 0; i < job_count; i++) {
+        fclose(jobs[i].stdout);
+        EXPECT_EQ(jobs[i].exit_code, 0);
+        EXPECT_EQ(std::string(outputs[i], output_sizes[i]),
+                  "0 1 1 2 3 5 8 13 21 34 55 89 144 233 377 \n");
+        free(outputs[i]);
+    }
+}
+
+TEST(Runner, ResetsVMBetweenJobs) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    const char* first_source = R"SOURCE(
+        main :: fn() {
+            std_println_int(1)
+        }
+    )SOURCE";
+    const char* second_source = R"SOURCE(
+        main :: fn() {
+            std_println_int(2)
+        }
+    )SOURCE";
+    VmImage first = vm_image_make(compile_source(first_source, &arena), &arena);
+    VmImage second = vm_image_make(compile_source(second_source, &arena), &arena);
+
+    // A single worker runs all the jobs on the same VM
+    const isize job_count = 4;
+    RunJob jobs[job_count] = {};
+    char* outputs[job_count] = {};
+    size_t output_sizes[job_count] = {};
+    for (isize i = 0; i < job_count; i++) {
+        jobs[i].image = i % 2 == 0 ? &first : &second;
+        jobs[i].stdout = open_memstream(&outputs[i], &output_sizes[i]);
+        jobs[i].stderr = stderr;
+    }
+
+    run_jobs(Slice<RunJob>{jobs, job_count}, 1, 64 * 1024);
+
+    for (isize i = 0; i < job_count; i++) {
+        fclose(jobs[i].stdout);
+        EXPECT_EQ(std::string(outputs[i], output_sizes[i]),
+                  i % 2 == 0 ? "1\n" : "2\n");
+        free(outputs[i]);
+    }
+}
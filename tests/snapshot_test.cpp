@@ -0,0 +1,243 @@
+#include "common.hpp"
+#include "core.hpp"
+#include "snapshot.hpp"
+#include "vm.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <string>
+
+// The setup is deep in the call stack when the fuel runs out
+static const char* source = R"SOURCE(
+    setup :: fn(depth: int) -> int {
+        if depth == 0 {
+            total := 0
+            for i := 0; i < 100; i = i + 1 {
+                total = total + i
+            }
+            return total
+        }
+        return setup(depth - 1) + 1
+    }
+
+    main :: fn() {
+        base := setup(5)
+        std_println_int(base)
+        for i := 0; i < 3; i = i + 1 {
+            std_println_int(base + i)
+        }
+    }
+)SOURCE";
+
+TEST(Snapshot, RestoredVmContinues) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    VM* vm = vm_make(image, 64 * 1024, &arena);
+    Capture before(vm);
+    ASSERT_EQ(vm_run_for(vm, 30), VmStatus::Yielded);
+    std::string printed = before.finish();
+    EXPECT_EQ(printed, "");
+    ASSERT_GT(vm->calls.size, 2);
+
+    Slice<u8> bytes = snapshot_take(vm, &arena);
+    Snapshot snapshot = {};
+    const char* error = nullptr;
+    ASSERT_TRUE(snapshot_decode(bytes, image, &snapshot, &arena, &error))
+        << error;
+
+    // Any number of VMs start from the same snapshot
+    for (isize i = 0; i < 3; i++) {
+        VM* restored = vm_make(image, 64 * 1024, &arena);
+        ASSERT_TRUE(snapshot_restore(restored, image, &snapshot, &error))
+            << error;
+        EXPECT_EQ(restored->calls.size, vm->calls.size);
+        Capture after(restored);
+        vm_run(restored);
+        EXPECT_EQ(after.finish(), "4955\n4955\n4956\n4957\n");
+        EXPECT_EQ(stack_pop<u8>(&restored->stack), 0);
+    }
+
+    // The original goes on the same way
+    Capture rest(vm);
+    vm_run(vm);
+    EXPECT_EQ(rest.finish(), "4955\n4955\n4956\n4957\n");
+}
+
+TEST(Snapshot, KeepsBufferedOutput) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    VM* vm = vm_make(image, 64 * 1024, &arena);
+    // Stepping does not write the output out until `Exit`
+    Capture before(vm);
+    while (vm->output.size == 0) {
+        ASSERT_TRUE(vm_execute_inst(vm));
+    }
+    Slice<u8> bytes = snapshot_take(vm, &arena);
+    vm->output.size = 0;
+    before.finish();
+
+    Snapshot snapshot = {};
+    const char* error = nullptr;
+    ASSERT_TRUE(snapshot_decode(bytes, image, &snapshot, &arena, &error))
+        << error;
+    VM* restored = vm_make(image, 64 * 1024, &arena);
+    ASSERT_TRUE(snapshot_restore(restored, image, &snapshot, &error));
+    Capture after(restored);
+    vm_run(restored);
+    EXPECT_EQ(after.finish(), "4955\n4955\n4956\n4957\n");
+}
+
+TEST(Snapshot, WritesAndLoadsFile) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    VM* vm = vm_make(image, 64 * 1024, &arena);
+    ASSERT_EQ(vm_run_for(vm, 100), VmStatus::Yielded);
+
+    TempFile temp;
+    const char* path = temp.path;
+    ASSERT_TRUE(snapshot_write(path, vm));
+
+    // A fresh compile of the same source is the same program
+    VmImage same = vm_image_make(compile_source(source, &arena), &arena);
+    Snapshot snapshot = {};
+    const char* error = nullptr;
+    ASSERT_TRUE(snapshot_load(path, same, &snapshot, &arena, &error))
+        << error;
+    VM* restored = vm_make(same, 64 * 1024, &arena);
+    ASSERT_TRUE(snapshot_restore(restored, same, &snapshot, &error));
+    EXPECT_EQ(restored->fp, vm->fp);
+    EXPECT_EQ(restored->ip, vm->ip);
+    EXPECT_EQ(restored->bp, vm->bp);
+    ASSERT_EQ(restored->stack.size, vm->stack.size);
+    EXPECT_EQ(memcmp(restored->stack.data, vm->stack.data, vm->stack.size), 0);
+}
+
+TEST(Snapshot, RejectsInvalidSnapshots) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    VM* vm = vm_make(image, 64 * 1024, &arena);
+    ASSERT_EQ(vm_run_for(vm, 30), VmStatus::Yielded);
+    Slice<u8> bytes = snapshot_take(vm, &arena);
+    Snapshot snapshot = {};
+    const char* error = nullptr;
+
+    const char* other_source = R"SOURCE(
+        main :: fn() {
+            std_println_int(1)
+        }
+    )SOURCE";
+    VmImage other = vm_image_make(compile_source(other_source, &arena), &arena);
+    EXPECT_FALSE(snapshot_decode(bytes, other, &snapshot, &arena, &error));
+    EXPECT_STREQ(error, "The snapshot is of a different program");
+
+    Slice<u8> truncated = {bytes.data, bytes.size - 1};
+    EXPECT_FALSE(snapshot_decode(truncated, image, &snapshot, &arena, &error));
+    EXPECT_STREQ(error, "Truncated snapshot");
+
+    Slice<u8> copy = {arena_alloc<u8>(&arena, bytes.size), bytes.size};
+    memcpy(copy.data, bytes.data, bytes.size);
+    copy[0] = 'X';
+    EXPECT_FALSE(snapshot_decode(copy, image, &snapshot, &arena, &error));
+    EXPECT_STREQ(error, "Not a snapshot");
+
+    // The instruction pointer in the middle of an instruction
+    memcpy(copy.data, bytes.data, bytes.size);
+    SnapshotHeader header;
+    memcpy(&header, copy.data, sizeof(header));
+    header.ip += 1;
+    memcpy(copy.data, &header, sizeof(header));
+    EXPECT_FALSE(snapshot_decode(copy, image, &snapshot, &arena, &error));
+    EXPECT_STREQ(error, "The snapshot points outside of the program");
+
+    // A VM with a smaller stack
+    ASSERT_TRUE(snapshot_decode(bytes, image, &snapshot, &arena, &error));
+    VM* small = vm_make(image, 8, &arena);
+    EXPECT_FALSE(snapshot_restore(small, image, &snapshot, &error));
+    EXPECT_STREQ(error, "The snapshot does not fit into the VM");
+}
+
+// Verified code runs without checks, the frames have to be ones the code
+// could have built
+TEST(Snapshot, RejectsTamperedFrames) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    VmImage image = vm_image_make(compile_source(source, &arena), &arena);
+    ASSERT_TRUE(image.verified);
+    VM* vm = vm_make(image, 64 * 1024, &arena);
+    ASSERT_EQ(vm_run_for(vm, 30), VmStatus::Yielded);
+    Slice<u8> bytes = snapshot_take(vm, &arena);
+    Snapshot snapshot = {};
+    const char* error = nullptr;
+    ASSERT_TRUE(snapshot_decode(bytes, image, &snapshot, &arena, &error))
+        << error;
+    SnapshotHeader valid = snapshot.header;
+    ASSERT_GT(valid.call_count, 1u);
+    // The frames come right before the output
+    isize calls_offset = bytes.size - valid.output_size -
+                         valid.call_count * sizeof(SnapshotFrame);
+
+    Slice<u8> copy = {arena_alloc<u8>(&arena, bytes.size), bytes.size};
+    auto expect_rejected = [&](SnapshotHeader header, isize frame,
+                               SnapshotFrame tampered) {
+        memcpy(copy.data, bytes.data, bytes.size);
+        memcpy(copy.data, &header, sizeof(header));
+        if (frame >= 0) {
+            memcpy(copy.data + calls_offset + frame * sizeof(SnapshotFrame),
+                   &tampered, sizeof(tampered));
+        }
+        EXPECT_FALSE(snapshot_decode(copy, image, &snapshot, &arena, &error));
+        EXPECT_STREQ(error, "The snapshot's frames do not match the program");
+    };
+
+    // Wherever the VM pauses, its own frames are accepted
+    VM* paused = vm_make(image, 64 * 1024, &arena);
+    paused->stdout = fopen("/dev/null", "w");
+    while (vm_run_for(paused, 7) == VmStatus::Yielded) {
+        Slice<u8> taken = snapshot_take(paused, &arena);
+        EXPECT_TRUE(snapshot_decode(taken, image, &snapshot, &arena, &error))
+            << error;
+    }
+    fclose(paused->stdout);
+
+    // A function other than the entry without the frame that called it
+    VM* fresh = vm_make(image, 64 * 1024, &arena);
+    Slice<u8> start = snapshot_take(fresh, &arena);
+    SnapshotHeader header;
+    memcpy(&header, start.data, sizeof(header));
+    header.fp = 1;
+    memcpy(start.data, &header, sizeof(header));
+    EXPECT_FALSE(snapshot_decode(start, image, &snapshot, &arena, &error));
+    EXPECT_STREQ(error, "The snapshot's frames do not match the program");
+
+    // The current frame lower than the code has it
+    header = valid;
+    header.bp -= 8;
+    expect_rejected(header, -1, {});
+
+    // A callee's BP not at the top of its caller's frame
+    SnapshotFrame frame;
+    memcpy(&frame, bytes.data + calls_offset + sizeof(SnapshotFrame),
+           sizeof(frame));
+    SnapshotFrame moved = frame;
+    moved.bp += 8;
+    expect_rejected(valid, 1, moved);
+
+    // A return address that does not follow a call
+    SnapshotFrame returned = frame;
+    returned.return_offset = 0;
+    expect_rejected(valid, 1, returned);
+}
@@ -0,0 +1,158 @@
+#include "common.hpp"
+#include "core.hpp"
+#include "tiering.hpp"
+#include "vm.hpp"
+#include <gtest/gtest.h>
+#include <sstream>
+
+// Most tests count calls, so they compile without optimizing, inlining would
+// remove them
+//
+// `main` runs once, `fib` is called 177 times and `square` once per loop
+// iteration
+static const char* source = R"SOURCE(
+    fib :: fn(n: int) -> int {
+        if n < 2 {
+            return n
+        }
+        return fib(n - 1) + fib(n - 2)
+    }
+
+    square :: fn(n: int) -> int {
+        return n * n
+    }
+
+    main :: fn() {
+        std_println_int(fib(10))
+        total := 0
+        for i := 0; i < 3; i = i + 1 {
+            total = total + square(i)
+        }
+        std_println_int(total)
+    }
+)SOURCE";
+
+static std::string run_tiered(CodeUnit code, Tiering* tiering, Arena* arena) {
+    VM* vm = vm_make(code, 1024 * 1024, arena);
+    vm_enable_tiering(vm, tiering);
+    return run_captured(vm);
+}
+
+TEST(Tiering, PromotesHotFunction) {
+    if (!jit_supported()) {
+        GTEST_SKIP();
+    }
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena, false);
+    Tiering* tiering = tiering_make(code, 10, &arena);
+    defer(tiering_free(tiering));
+
+    EXPECT_EQ(run_tiered(code, tiering, &arena), "55\n5\n");
+
+    // `fib` (1) tiers up on its 10th call. The interpreted frames of `fib`
+    // still call it, but from then on they enter the native code.
+    EXPECT_EQ(tiering->functions[1].tier, Tier::Native);
+    EXPECT_GT(tiering->functions[1].invocations, 10);
+    EXPECT_LT(tiering->functions[1].invocations, 177);
+    EXPECT_EQ(tiering->functions[2].tier, Tier::Interpreted);
+    EXPECT_EQ(tiering->functions[2].invocations, 3);
+    EXPECT_EQ(tiering->functions[3].tier, Tier::Interpreted);
+    EXPECT_EQ(tiering->functions[3].invocations, 1);
+    EXPECT_EQ(tiering->functions[3].back_edges, 3);
+
+    ASSERT_EQ(tiering->transitions.size, 1);
+    EXPECT_EQ(tiering->transitions[0].function, 1);
+    EXPECT_EQ(tiering->transitions[0].tier, Tier::Native);
+    EXPECT_EQ(tiering->transitions[0].invocations, 10);
+
+    std::stringstream dump;
+    tiering_dump(tiering, dump);
+    EXPECT_NE(dump.str().find("fn 1 -> native after 10 invocations"),
+              std::string::npos)
+        << dump.str();
+}
+
+TEST(Tiering, BackEdgesCountTowardsThreshold) {
+    if (!jit_supported()) {
+        GTEST_SKIP();
+    }
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    // The loop of the first call makes `count` hot on its second call
+    const char* loop_source = R"SOURCE(
+        count :: fn(n: int) -> int {
+            total := 0
+            for i := 0; i < n; i = i + 1 {
+                total = total + i
+            }
+            return total
+        }
+
+        main :: fn() {
+            std_println_int(count(10))
+            std_println_int(count(10))
+            std_println_int(count(10))
+        }
+    )SOURCE";
+    CodeUnit code = compile_source(loop_source, &arena, false);
+    Tiering* tiering = tiering_make(code, 5, &arena);
+    defer(tiering_free(tiering));
+
+    EXPECT_EQ(run_tiered(code, tiering, &arena), "45\n45\n45\n");
+    EXPECT_EQ(tiering->functions[1].tier, Tier::Native);
+    EXPECT_EQ(tiering->functions[1].invocations, 3);
+    EXPECT_EQ(tiering->functions[1].back_edges, 10);
+
+    ASSERT_EQ(tiering->transitions.size, 1);
+    EXPECT_EQ(tiering->transitions[0].invocations, 2);
+    EXPECT_EQ(tiering->transitions[0].back_edges, 10);
+}
+
+// What runs by default: `square` is inlined into `main`, `fib` calls itself
+// and is not
+TEST(Tiering, PromotesHotFunctionWhenOptimized) {
+    if (!jit_supported()) {
+        GTEST_SKIP();
+    }
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena);
+    Tiering* tiering = tiering_make(code, 10, &arena);
+    defer(tiering_free(tiering));
+
+    EXPECT_EQ(run_tiered(code, tiering, &arena), "55\n5\n");
+
+    EXPECT_EQ(tiering->functions[1].tier, Tier::Native);
+    EXPECT_GT(tiering->functions[1].invocations, 10);
+    EXPECT_LT(tiering->functions[1].invocations, 177);
+    EXPECT_EQ(tiering->functions[2].tier, Tier::Interpreted);
+    EXPECT_EQ(tiering->functions[2].invocations, 0);
+    EXPECT_EQ(tiering->functions[3].tier, Tier::Interpreted);
+    EXPECT_EQ(tiering->functions[3].back_edges, 3);
+
+    ASSERT_EQ(tiering->transitions.size, 1);
+    EXPECT_EQ(tiering->transitions[0].function, 1);
+    EXPECT_EQ(tiering->transitions[0].invocations, 10);
+}
+
+TEST(Tiering, ColdCodeStaysInterpreted) {
+    Arena arena = {};
+    arena_init(&arena, 64 * 1024);
+    defer(arena_free(&arena));
+
+    CodeUnit code = compile_source(source, &arena, false);
+    Tiering* tiering = tiering_make(code, 1000, &arena);
+    defer(tiering_free(tiering));
+
+    EXPECT_EQ(run_tiered(code, tiering, &arena), "55\n5\n");
+    EXPECT_EQ(tiering->jit, nullptr);
+    EXPECT_EQ(tiering->transitions.size, 0);
+    EXPECT_EQ(tiering->functions[1].invocations, 177);
+}
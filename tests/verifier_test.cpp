@@ -0,0 +1,249 @@
+#include "bytecode.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include "verifier.hpp"
+#include "vm.hpp"
+#include <gtest/gtest.h>
+
+static CodeUnit make_code_unit(Slice<Inst> entry, Slice<Inst> callee,
+                               Arena* arena) {
+    Array<Slice<Inst>> functions = {};
+    array_init(&functions, 2, arena);
+    array_push(&functions, entry);
+    if (callee.size > 0) {
+        array_push(&functions, callee);
+    }
+
+    i64* constants = arena_alloc<i64>(arena, 2);
+    constants[0] = 1;
+    constants[1] = 5;
+    return CodeUnit{
+        .static_data = Slice<u8>{(u8*)constants, 2 * sizeof(i64)},
+        .functions = array_to_slice(&functions),
+    };
+}
+
+static bool verify(CodeUnit code, Arena* arena, VerifyError* error) {
+    LinkedUnit linked = link_code_unit(code, arena);
+    return verify_linked_unit(linked, code.static_data, arena, error);
+}
+
+TEST(Verifier, AcceptsCall) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(sizeof(i64)),
+        inst_call(1),
+        inst_exit(0),
+    };
+    // Increments the return value until it reaches 5
+    MemPtr return_ptr = mem_ptr_stack_rel(-8);
+    Inst counter[] = {
+        inst_push_stack(sizeof(bool)),
+        inst_binary_op(BinOperand::Int_Add, return_ptr, return_ptr,
+                       mem_ptr_immediate(1)),
+        inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(0),
+                       return_ptr, mem_ptr_static_data(8)),
+        inst_jump_if(mem_ptr_stack_rel(0), 1),
+        inst_pop_stack(sizeof(bool)),
+        inst_return(),
+    };
+    CodeUnit code = make_code_unit(Slice<Inst>{entry, 3},
+                                   Slice<Inst>{counter, 6}, &arena);
+
+    VerifyError error = {};
+    EXPECT_TRUE(verify(code, &arena, &error)) << error.message;
+
+    VM* vm = vm_make(code, 1024, &arena);
+    EXPECT_TRUE(vm->verified);
+    vm_run(vm);
+    EXPECT_EQ(stack_pop<u8>(&vm->stack), 0);
+    EXPECT_EQ(*stack_peek<i64>(&vm->stack), 5);
+}
+
+TEST(Verifier, RejectsInconsistentStackHeight) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    // Every iteration pushes 8 more bytes
+    Inst entry[] = {
+        inst_push_stack(8),
+        inst_mov(mem_ptr_stack_rel(0), mem_ptr_immediate(1), 1),
+        inst_jump_if(mem_ptr_stack_rel(0), 0),
+        inst_exit(0),
+    };
+    CodeUnit code =
+        make_code_unit(Slice<Inst>{entry, 4}, Slice<Inst>{}, &arena);
+
+    VerifyError error = {};
+    EXPECT_FALSE(verify(code, &arena, &error));
+    EXPECT_STREQ(error.message, "Inconsistent stack height");
+    EXPECT_EQ(error.function, 0);
+}
+
+TEST(Verifier, RejectsOperandAboveFrame) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(8),
+        inst_mov(mem_ptr_stack_rel(4), mem_ptr_immediate(1), 8),
+        inst_exit(0),
+    };
+    CodeUnit code =
+        make_code_unit(Slice<Inst>{entry, 3}, Slice<Inst>{}, &arena);
+
+    VerifyError error = {};
+    EXPECT_FALSE(verify(code, &arena, &error));
+    EXPECT_STREQ(error.message, "Operand above the top of the stack");
+    EXPECT_EQ(error.offset, linked_op_size(LinkedOp::PushStack));
+}
+
+TEST(Verifier, RejectsStaticDataOutOfBounds) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(8),
+        inst_mov(mem_ptr_stack_rel(0), mem_ptr_static_data(12), 8),
+        inst_exit(0),
+    };
+    CodeUnit code =
+        make_code_unit(Slice<Inst>{entry, 3}, Slice<Inst>{}, &arena);
+
+    VerifyError error = {};
+    EXPECT_FALSE(verify(code, &arena, &error));
+    EXPECT_STREQ(error.message, "Operand outside of the static data");
+}
+
+TEST(Verifier, RejectsFallingOffTheEnd) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(8),
+        inst_pop_stack(8),
+    };
+    CodeUnit code =
+        make_code_unit(Slice<Inst>{entry, 2}, Slice<Inst>{}, &arena);
+
+    VerifyError error = {};
+    EXPECT_FALSE(verify(code, &arena, &error));
+    EXPECT_STREQ(error.message, "Falls off the end of the function");
+}
+
+TEST(Verifier, RejectsCalleeReachingBelowCaller) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    // The callee reads an argument the caller never pushed
+    Inst entry[] = {
+        inst_call(1),
+        inst_exit(0),
+    };
+    Inst callee[] = {
+        inst_push_stack(8),
+        inst_mov(mem_ptr_stack_rel(0),
+                 mem_ptr_stack_rel(-8), 8),
+        inst_pop_stack(8),
+        inst_return(),
+    };
+    CodeUnit code = make_code_unit(Slice<Inst>{entry, 2},
+                                   Slice<Inst>{callee, 4}, &arena);
+
+    VerifyError error = {};
+    EXPECT_FALSE(verify(code, &arena, &error));
+    EXPECT_STREQ(error.message, "Callee reaches below the caller's frame");
+}
+
+TEST(Verifier, AcceptsTailCall) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(sizeof(i64)),
+        inst_call(1),
+        inst_exit(0),
+    };
+    // Counts the return value up to 5, the recursion reuses the frame
+    MemPtr return_ptr = mem_ptr_stack_rel(-8);
+    Inst counter[] = {
+        inst_push_stack(sizeof(bool)),
+        inst_binary_op(BinOperand::Int_Add, return_ptr, return_ptr,
+                       mem_ptr_immediate(1)),
+        inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(0),
+                       return_ptr, mem_ptr_static_data(8)),
+        inst_jump_if_not(mem_ptr_stack_rel(0), 6),
+        inst_pop_stack(sizeof(bool)),
+        inst_tail_call(1),
+        inst_pop_stack(sizeof(bool)),
+        inst_return(),
+    };
+    CodeUnit code = make_code_unit(Slice<Inst>{entry, 3},
+                                   Slice<Inst>{counter, 8}, &arena);
+
+    VerifyError error = {};
+    EXPECT_TRUE(verify(code, &arena, &error)) << error.message;
+
+    VM* vm = vm_make(code, 1024, &arena);
+    EXPECT_TRUE(vm->verified);
+    vm_run(vm);
+    EXPECT_EQ(stack_pop<u8>(&vm->stack), 0);
+    EXPECT_EQ(*stack_peek<i64>(&vm->stack), 5);
+    EXPECT_EQ(vm->calls.size, 0);
+}
+
+TEST(Verifier, RejectsTailCallWithNonEmptyFrame) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_call(1),
+        inst_exit(0),
+    };
+    Inst callee[] = {
+        inst_push_stack(8),
+        inst_tail_call(1),
+    };
+    CodeUnit code = make_code_unit(Slice<Inst>{entry, 2},
+                                   Slice<Inst>{callee, 2}, &arena);
+
+    VerifyError error = {};
+    EXPECT_FALSE(verify(code, &arena, &error));
+    EXPECT_STREQ(error.message, "Tail call with a non-empty frame");
+    EXPECT_EQ(error.function, 1);
+}
+
+TEST(Verifier, UnverifiableCodeRunsChecked) {
+    Arena arena = {};
+    arena_init(&arena, 4096);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(16),
+        inst_binary_op(BinOperand::Int_Add, {MemPtrType::StackAbs, 8},
+                       mem_ptr_static_data(0), mem_ptr_static_data(8)),
+        inst_exit(0),
+    };
+    CodeUnit code =
+        make_code_unit(Slice<Inst>{entry, 3}, Slice<Inst>{}, &arena);
+
+    VerifyError error = {};
+    EXPECT_FALSE(verify(code, &arena, &error));
+    EXPECT_STREQ(error.message, "Operand in an unverifiable mode");
+
+    VM* vm = vm_make(code, 1024, &arena);
+    EXPECT_FALSE(vm->verified);
+    vm_run(vm);
+    EXPECT_EQ(stack_pop<u8>(&vm->stack), 0);
+    EXPECT_EQ(*stack_peek<i64>(&vm->stack), 6);
+}
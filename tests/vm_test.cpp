@@ -41,3 +41,154 @@ TEST(VM, ExecuteInstruction) {
     EXPECT_EQ(*vm_ptr_read<i64>(vm, {MemPtrType::StackAbs, 8}), (isize)20);
     EXPECT_EQ(*vm_ptr_read<i64>(vm, {MemPtrType::StackAbs, 16}), (isize)30);
 }
+
+TEST(VM, RunUntilExit) {
+    Arena arena;
+    arena_init(&arena, 4024);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(sizeof(i64)),
+        inst_call(1),
+        inst_exit(0),
+    };
+
+    // Increments the return value until it reaches 5
+    MemPtr return_ptr = mem_ptr_stack_rel(-8);
+    Inst counter[] = {
+        inst_push_stack(sizeof(bool)),
+        inst_binary_op(BinOperand::Int_Add, return_ptr, return_ptr,
+                       mem_ptr_static_data(0)),
+        inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(0),
+                       return_ptr, mem_ptr_static_data(8)),
+        inst_jump_if(mem_ptr_stack_rel(0), 1),
+        inst_pop_stack(sizeof(bool)),
+        inst_return(),
+    };
+
+    Array<Slice<Inst>> functions = {};
+    array_init(&functions, 2, &arena);
+    array_push(&functions, slice_from_inline_alloc(entry, &arena));
+    array_push(&functions, slice_from_inline_alloc(counter, &arena));
+
+    i64 constants[] = {1, 5};
+    Slice<u8> static_data = {(u8*)constants, sizeof(constants)};
+
+    CodeUnit code = {
+        .static_data = static_data,
+        .functions = array_to_slice(&functions),
+    };
+
+    VM* vm = vm_make(code, 1024, &arena);
+    vm_run(vm);
+
+    EXPECT_EQ(stack_pop<u8>(&vm->stack), 0);
+    EXPECT_EQ(vm->stack.size, (isize)sizeof(i64));
+    EXPECT_EQ(*stack_peek<i64>(&vm->stack), 5);
+}
+
+TEST(VM, RunForYieldsAndResumes) {
+    Arena arena;
+    arena_init(&arena, 4024);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_push_stack(sizeof(i64)),
+        inst_call(1),
+        inst_exit(0),
+    };
+
+    // Increments the return value until it reaches 5, jumps back 4 times
+    MemPtr return_ptr = mem_ptr_stack_rel(-8);
+    Inst counter[] = {
+        inst_push_stack(sizeof(bool)),
+        inst_binary_op(BinOperand::Int_Add, return_ptr, return_ptr,
+                       mem_ptr_immediate(1)),
+        inst_binary_op(BinOperand::Int_LessThan, mem_ptr_stack_rel(0),
+                       return_ptr, mem_ptr_immediate(5)),
+        inst_jump_if(mem_ptr_stack_rel(0), 1),
+        inst_pop_stack(sizeof(bool)),
+        inst_return(),
+    };
+
+    Array<Slice<Inst>> functions = {};
+    array_init(&functions, 2, &arena);
+    array_push(&functions, slice_from_inline_alloc(entry, &arena));
+    array_push(&functions, slice_from_inline_alloc(counter, &arena));
+
+    CodeUnit code = {
+        .static_data = {},
+        .functions = array_to_slice(&functions),
+    };
+
+    VM* vm = vm_make(code, 1024, &arena);
+    // The call and every backward jump spend the whole budget
+    isize yields = 0;
+    while (vm_run_for(vm, 1) == VmStatus::Yielded) {
+        yields++;
+        EXPECT_EQ(*vm_ptr_read<i64>(vm, {MemPtrType::StackAbs, 0}),
+                  yields - 1);
+    }
+    EXPECT_EQ(yields, 5);
+    EXPECT_TRUE(vm->finished);
+    EXPECT_EQ(vm_run_for(vm, 1), VmStatus::Finished);
+
+    EXPECT_EQ(stack_pop<u8>(&vm->stack), 0);
+    EXPECT_EQ(*stack_peek<i64>(&vm->stack), 5);
+}
+
+TEST(VM, RunForStopsInfiniteLoop) {
+    Arena arena;
+    arena_init(&arena, 4024);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_jump(0),
+        inst_exit(0),
+    };
+
+    Array<Slice<Inst>> functions = {};
+    array_init(&functions, 1, &arena);
+    array_push(&functions, slice_from_inline_alloc(entry, &arena));
+
+    CodeUnit code = {
+        .static_data = {},
+        .functions = array_to_slice(&functions),
+    };
+
+    VM* vm = vm_make(code, 1024, &arena);
+    EXPECT_EQ(vm_run_for(vm, 1000), VmStatus::Yielded);
+    EXPECT_EQ(vm_run_for(vm, 1000), VmStatus::Yielded);
+    EXPECT_EQ(vm->ip, 0);
+    EXPECT_FALSE(vm->finished);
+}
+
+TEST(VM, RunForReportsCallStackOverflow) {
+    Arena arena;
+    arena_init(&arena, 4024);
+    defer(arena_free(&arena));
+
+    Inst entry[] = {
+        inst_call(1),
+        inst_exit(0),
+    };
+    Inst recurse[] = {
+        inst_call(1),
+        inst_return(),
+    };
+
+    Array<Slice<Inst>> functions = {};
+    array_init(&functions, 2, &arena);
+    array_push(&functions, slice_from_inline_alloc(entry, &arena));
+    array_push(&functions, slice_from_inline_alloc(recurse, &arena));
+
+    CodeUnit code = {
+        .static_data = {},
+        .functions = array_to_slice(&functions),
+    };
+
+    VM* vm = vm_make(code, 1024, &arena);
+    EXPECT_EQ(vm_run_for(vm, 2 * VM_CALL_STACK_CAPACITY), VmStatus::Error);
+    EXPECT_EQ(vm->calls.size, VM_CALL_STACK_CAPACITY);
+    EXPECT_EQ(vm->ip, 0);
+}
@@ -0,0 +1,299 @@
+// Looks for superinstruction candidates. Runs every program of the corpus
+// instruction by instruction, counts how many times each pair and triple of
+// linked instructions was executed one right after the other and prints the
+// most frequent ones. With `--emit` the top pairs are written out as the
+// `SUPERINSTRUCTIONS` table, which the linker and the VM are generated from.
+//
+// Usage: jazz_superinstructions [--emit <header>] [--top <n>] <file.jazz>...
+
+#include "compiler.hpp"
+#include "core.hpp"
+#include "linker.hpp"
+#include "parser.hpp"
+#include "sema.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+constexpr isize OP_COUNT = (isize)LinkedOp::Count;
+
+struct ExecutedInst {
+    isize fp;
+    isize ip;
+    LinkedOp op;
+};
+
+struct Counts {
+    HashMap<isize, isize> pairs;
+    HashMap<isize, isize> triples;
+    isize executed;
+};
+
+struct Candidate {
+    isize key;
+    isize count;
+};
+
+static String read_file(Arena* arena, const char* file_name) {
+    FILE* file = fopen(file_name, "r");
+    if (!file) {
+        std::cerr << "Error: Could not open file " << file_name << std::endl;
+        return {};
+    }
+    defer(fclose(file));
+
+    fseek(file, 0, SEEK_END);
+    isize file_size = ftell(file);
+    rewind(file);
+
+    char* buffer = arena_alloc<char>(arena, file_size + 1);
+    isize read_size = fread(buffer, 1, file_size, file);
+    if (read_size != file_size) {
+        std::cerr << "Error: Could not read file " << file_name << std::endl;
+        return {};
+    }
+    buffer[file_size] = '\0';
+
+    return String{.data = buffer, .size = file_size};
+}
+
+static void count_add(HashMap<isize, isize>* counts, isize key) {
+    isize* count = hash_map_get_ptr(counts, key);
+    if (count) {
+        (*count)++;
+    } else {
+        hash_map_insert_or_set(counts, key, (isize)1);
+    }
+}
+
+// `next` directly follows `prev` in the code, so the two could be fused
+static bool falls_through(ExecutedInst prev, ExecutedInst next) {
+    return prev.fp == next.fp &&
+           prev.ip + linked_op_size(prev.op) == next.ip;
+}
+
+static bool profile_file(const char* file_name, Counts* counts,
+                         Arena* arena) {
+    String source_code = read_file(arena, file_name);
+    if (!source_code.data) {
+        return false;
+    }
+
+    Tokenizer tokenizer;
+    tokenizer_init(&tokenizer, source_code);
+    AstFile* file = ast_file_make(tokenizer, 16, arena);
+    ast_file_parse(file, arena);
+    if (file->errors.size > 0) {
+        std::cerr << "Error: Could not parse " << file_name << std::endl;
+        return false;
+    }
+
+    semantic_analysis(file, arena);
+    CodeUnit code_unit = ast_compile_to_bytecode(&file->ast, true, arena,
+                                                 CompilerBackend::Register);
+
+    VM* vm = vm_make(code_unit, 8 * 1024 * 1024, arena);
+    // Existing superinstructions would hide the pairs they are made of
+    vm->linked = link_code_unit(code_unit, arena, false);
+    vm->stdout = tmpfile();
+    defer(fclose(vm->stdout));
+
+    // The last three executed instructions, `history[0]` is the newest
+    ExecutedInst history[3] = {};
+    isize history_size = 0;
+    bool running = true;
+    while (running) {
+        Slice<u8> function = vm->linked.functions[vm->fp];
+        ExecutedInst current = {vm->fp, vm->ip,
+                                link_read_op(function.data + vm->ip)};
+        running = vm_execute_inst(vm);
+        counts->executed++;
+
+        history[2] = history[1];
+        history[1] = history[0];
+        history[0] = current;
+        history_size = std::min(history_size + 1, (isize)3);
+
+        if (history_size < 2 || !falls_through(history[1], history[0])) {
+            continue;
+        }
+        isize pair = (isize)history[1].op * OP_COUNT + (isize)history[0].op;
+        count_add(&counts->pairs, pair);
+
+        if (history_size < 3 || !falls_through(history[2], history[1])) {
+            continue;
+        }
+        count_add(&counts->triples,
+                  (isize)history[2].op * OP_COUNT * OP_COUNT + pair);
+    }
+
+    return true;
+}
+
+static Array<Candidate> rank(HashMap<isize, isize>* counts, Arena* arena) {
+    Array<Candidate> ranked = {};
+    array_init(&ranked, 64, arena);
+    for (auto& [key, count] : *counts->backing_map) {
+        array_push(&ranked, Candidate{key, count});
+    }
+    std::sort(ranked.data, ranked.data + ranked.size,
+              [](Candidate a, Candidate b) {
+                  return a.count != b.count ? a.count > b.count
+                                            : a.key < b.key;
+              });
+    return ranked;
+}
+
+static bool pair_is_fusable(isize key) {
+    return linked_op_is_fusable((LinkedOp)(key / OP_COUNT), true) &&
+           linked_op_is_fusable((LinkedOp)(key % OP_COUNT), false);
+}
+
+static void print_ranked(const char* title, Array<Candidate>* ranked,
+                         isize length, isize executed, isize top) {
+    std::cout << title << ":" << std::endl;
+    for (isize i = 0; i < ranked->size && i < top; i++) {
+        Candidate candidate = (*ranked)[i];
+        std::cout << std::fixed << std::setprecision(2) << std::setw(6)
+                  << 100.0 * (f64)candidate.count / (f64)executed << "% "
+                  << std::setw(12) << candidate.count << " ";
+
+        isize key = candidate.key;
+        isize divisor = length == 3 ? OP_COUNT * OP_COUNT : OP_COUNT;
+        for (isize j = 0; j < length; j++) {
+            std::cout << (j > 0 ? " -> " : "")
+                      << linked_op_name((LinkedOp)(key / divisor));
+            key %= divisor;
+            divisor /= OP_COUNT;
+        }
+        if (length == 2 && !pair_is_fusable(candidate.key)) {
+            std::cout << " (not fusable)";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+static bool emit_header(const char* path, Array<Candidate>* pairs, isize top,
+                        int argc, char* argv[]) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Error: Could not open file " << path << std::endl;
+        return false;
+    }
+
+    // The command is wrapped to fit into 80 columns
+    std::string comment = "// Generated by `jazz_superinstructions";
+    isize line_size = comment.size();
+    for (int i = 1; i < argc; i++) {
+        std::string word = argv[i];
+        if (i == argc - 1) {
+            word += "`, do not edit by hand.";
+        }
+        if (line_size + 1 + (isize)word.size() > 80) {
+            comment += "\n//";
+            line_size = 2;
+        }
+        comment += " " + word;
+        line_size += 1 + word.size();
+    }
+
+    out << "#pragma once\n\n";
+    out << comment << "\n";
+    out << "//\n";
+    out << "// Pairs of linked instructions which get fused into a single "
+           "superinstruction,\n";
+    out << "// the most frequently executed pairs first. `X` is called as "
+           "X(first, second).\n";
+
+    std::vector<std::string> rows;
+    for (isize i = 0; i < pairs->size && (isize)rows.size() < top; i++) {
+        isize key = (*pairs)[i].key;
+        if (!pair_is_fusable(key)) {
+            continue;
+        }
+        std::string first = linked_op_name((LinkedOp)(key / OP_COUNT));
+        rows.push_back(first + ", " +
+                       linked_op_name((LinkedOp)(key % OP_COUNT)));
+    }
+
+    std::vector<std::string> lines = {"#define SUPERINSTRUCTIONS(X)"};
+    for (isize i = 0; i < (isize)rows.size(); i++) {
+        std::string row = "    X(" + rows[i] + ")";
+        if (row.size() > 77) {
+            isize comma = rows[i].find(',');
+            lines.push_back("    X(" + rows[i].substr(0, comma + 1));
+            row = "      " + rows[i].substr(comma + 2) + ")";
+        }
+        lines.push_back(row);
+    }
+
+    // Every line but the last one continues the `#define`, the backslash goes
+    // to the 80th column
+    for (isize i = 0; i + 1 < (isize)lines.size(); i++) {
+        out << lines[i]
+            << std::string(std::max<isize>(79 - lines[i].size(), 1), ' ')
+            << "\\\n";
+    }
+    out << lines.back() << "\n";
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    const char* emit_path = nullptr;
+    isize top = 8;
+    Array<const char*> files = {};
+
+    Arena arena = {};
+    arena_init(&arena, 1024 * 1024);
+    defer(arena_free(&arena));
+    array_init(&files, 16, &arena);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+            emit_path = argv[++i];
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atol(argv[++i]);
+        } else {
+            array_push(&files, (const char*)argv[i]);
+        }
+    }
+
+    if (files.size == 0) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--emit <header>] [--top <n>] <file.jazz>..."
+                  << std::endl;
+        return 1;
+    }
+
+    Counts counts = {};
+    hash_map_init(&counts.pairs, 1024, &arena);
+    hash_map_init(&counts.triples, 1024, &arena);
+
+    for (isize i = 0; i < files.size; i++) {
+        if (!profile_file(files[i], &counts, &arena)) {
+            return 1;
+        }
+    }
+
+    Array<Candidate> pairs = rank(&counts.pairs, &arena);
+    Array<Candidate> triples = rank(&counts.triples, &arena);
+    std::cout << "Executed instructions: " << counts.executed << std::endl
+              << std::endl;
+    print_ranked("Pairs", &pairs, 2, counts.executed, 2 * top);
+    print_ranked("Triples", &triples, 3, counts.executed, top);
+
+    if (emit_path && !emit_header(emit_path, &pairs, top, argc, argv)) {
+        return 1;
+    }
+
+    return 0;
+}